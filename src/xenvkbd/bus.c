@@ -37,6 +37,7 @@
 #include "bus.h"
 #include "fdo.h"
 #include "pdo.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -54,7 +55,7 @@ __BusAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, BUS_TAG);
+    return PoolAllocate(BUS_TAG, Length);
 }
 
 static FORCEINLINE VOID
@@ -62,7 +63,7 @@ __BusFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, BUS_TAG);
+    PoolFree(Buffer, BUS_TAG);
 }
 
 static VOID
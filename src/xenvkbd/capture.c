@@ -0,0 +1,247 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifdef _KERNEL_MODE
+
+#include <ntddk.h>
+#include <xen.h>
+#include <debug_interface.h>
+
+#include "capture.h"
+#include "pool.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define XENVKBD_CAPTURE_TAG 'tpaC'
+
+#else   // _KERNEL_MODE
+
+#include <time.h>
+
+#include "capture.h"
+
+#define RtlZeroMemory(_D, _L)   memset((_D), 0, (_L))
+
+static FORCEINLINE ULONG64
+__GetTimeUs(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return ((ULONG64)Now.tv_sec * 1000000ull) +
+           ((ULONG64)Now.tv_nsec / 1000ull);
+}
+
+#endif  // _KERNEL_MODE
+
+static FORCEINLINE ULONG
+__CaptureSize(
+    IN  ULONG   Count
+    )
+{
+    return XENVKBD_CAPTURE_SIZE(Count);
+}
+
+VOID
+CaptureInitialize(
+    IN  PXENVKBD_CAPTURE    Capture,
+    IN  ULONG               Count
+    )
+{
+    Capture->Magic = XENVKBD_CAPTURE_MAGIC;
+    Capture->Version = XENVKBD_CAPTURE_VERSION;
+    Capture->RecordSize = sizeof (XENVKBD_CAPTURE_RECORD);
+    Capture->Count = Count;
+    Capture->StartTimeUs = __GetTimeUs();
+}
+
+ULONG
+CaptureGetFootprint(
+    IN  PXENVKBD_CAPTURE    Capture
+    )
+{
+    return __CaptureSize(Capture->Count);
+}
+
+// Callers serialize recording (the ring lock); readers tolerate a torn
+// record at the write position.
+VOID
+CaptureRecord(
+    IN  PXENVKBD_CAPTURE        Capture,
+    IN  XENVKBD_CAPTURE_TYPE    Type,
+    IN  ULONG                   Index,
+    IN  const VOID              *Data,
+    IN  ULONG                   Length
+    )
+{
+    ULONG                       Sequence = Capture->Sequence;
+    PXENVKBD_CAPTURE_RECORD     Record;
+
+    Record = &Capture->Record[Sequence & (Capture->Count - 1)];
+
+    Length = __min(Length, sizeof (Record->Data));
+
+    Record->TimeUs = __GetTimeUs() - Capture->StartTimeUs;
+    Record->Sequence = Sequence;
+    Record->Index = Index;
+    Record->Type = (USHORT)Type;
+    Record->Length = (USHORT)Length;
+    RtlCopyMemory(Record->Data, Data, Length);
+    RtlZeroMemory(Record->Data + Length, sizeof (Record->Data) - Length);
+
+    Capture->Sequence = Sequence + 1;
+}
+
+#ifdef _KERNEL_MODE
+
+NTSTATUS
+CaptureCreate(
+    IN  ULONG               Count,
+    OUT PXENVKBD_CAPTURE    *Capture
+    )
+{
+    NTSTATUS                status;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Count == 0)
+        goto fail1;
+
+    // Round down to a power of two so the write position is a mask
+    Count = __min(Count, XENVKBD_CAPTURE_MAXIMUM);
+    while ((Count & (Count - 1)) != 0)
+        Count &= Count - 1;
+
+    *Capture = PoolAllocate(XENVKBD_CAPTURE_TAG, __CaptureSize(Count));
+
+    status = STATUS_NO_MEMORY;
+    if (*Capture == NULL)
+        goto fail2;
+
+    CaptureInitialize(*Capture, Count);
+
+    Info("%u records @ 0x%p\n", Count, *Capture);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+CaptureDestroy(
+    IN  PXENVKBD_CAPTURE    Capture
+    )
+{
+    ULONG                   Count = Capture->Count;
+
+    RtlZeroMemory(Capture, __CaptureSize(Count));
+    PoolFree(Capture, XENVKBD_CAPTURE_TAG);
+}
+
+static const CHAR *
+CaptureTypeName(
+    IN  USHORT  Type
+    )
+{
+#define _CAPTURE_TYPE_NAME(_Type)   \
+    case CAPTURE_TYPE_ ## _Type:    \
+        return #_Type;
+
+    switch (Type) {
+    _CAPTURE_TYPE_NAME(PASS);
+    _CAPTURE_TYPE_NAME(EVENT);
+    _CAPTURE_TYPE_NAME(REPORT);
+    _CAPTURE_TYPE_NAME(CONNECT);
+    default:
+        break;
+    }
+
+    return "INVALID";
+
+#undef  _CAPTURE_TYPE_NAME
+}
+
+VOID
+CaptureDebugCallback(
+    IN  PXENVKBD_CAPTURE        Capture,
+    IN  PXENBUS_DEBUG_INTERFACE DebugInterface,
+    IN  ULONG                   Limit
+    )
+{
+    ULONG                       Sequence = Capture->Sequence;
+    ULONG                       Count;
+
+    Count = __min(__min(Sequence, Capture->Count), Limit);
+
+    XENBUS_DEBUG(Printf,
+                 DebugInterface,
+                 "CAPTURE: 0x%p Records = %u/%u Sequence = %u\n",
+                 Capture,
+                 Count,
+                 Capture->Count,
+                 Sequence);
+
+    while (Count != 0) {
+        PXENVKBD_CAPTURE_RECORD Record;
+        PUCHAR                  Data;
+
+        Record = &Capture->Record[(Sequence - Count) & (Capture->Count - 1)];
+        Data = Record->Data;
+        --Count;
+
+        XENBUS_DEBUG(Printf,
+                     DebugInterface,
+                     "%u: %llu.%06llu %s %u: "
+                     "%02x %02x %02x %02x %02x %02x %02x %02x "
+                     "%02x %02x %02x %02x %02x %02x %02x %02x\n",
+                     Record->Sequence,
+                     Record->TimeUs / 1000000ull,
+                     Record->TimeUs % 1000000ull,
+                     CaptureTypeName(Record->Type),
+                     Record->Index,
+                     Data[0], Data[1], Data[2], Data[3],
+                     Data[4], Data[5], Data[6], Data[7],
+                     Data[8], Data[9], Data[10], Data[11],
+                     Data[12], Data[13], Data[14], Data[15]);
+    }
+}
+
+#endif  // _KERNEL_MODE
@@ -0,0 +1,157 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENVKBD_CAPTURE_H
+#define _XENVKBD_CAPTURE_H
+
+// The record layout and CaptureRecord() are shared with the user-space
+// tools (test/replay.c), which build against the translate.h shim.
+#ifdef _KERNEL_MODE
+
+#include <ntddk.h>
+#include <xen.h>
+#include <debug_interface.h>
+
+#endif  // _KERNEL_MODE
+
+#include "translate.h"
+
+// A capture is a single non-paged buffer: a fixed header followed by a
+// power-of-two number of records written circularly. The layout is stable
+// so that the buffer can be lifted out of a crash dump (search for the
+// magic) and replayed through the translation engine.
+
+#define XENVKBD_CAPTURE_MAGIC   0x50414356  // 'VCAP'
+#define XENVKBD_CAPTURE_VERSION 2           // Adds CAPTURE_TYPE_CONNECT
+
+typedef enum _XENVKBD_CAPTURE_TYPE {
+    CAPTURE_TYPE_INVALID = 0,
+    CAPTURE_TYPE_PASS,      // Start of a DPC pass: Index = in_cons, Data = in_prod
+    CAPTURE_TYPE_EVENT,     // A ring slot: Index = slot, Data = the event
+    CAPTURE_TYPE_REPORT,    // A HID report: Index = slot of the last event applied
+    CAPTURE_TYPE_CONNECT    // The ring connected: Index = in ring slots,
+                            // Data = XENVKBD_CAPTURE_CONNECT
+} XENVKBD_CAPTURE_TYPE;
+
+// What a replay needs to translate the ring as the driver did
+#define XENVKBD_CAPTURE_EVENT_IDX       0x00000001
+#define XENVKBD_CAPTURE_KEY_BATCH       0x00000002
+#define XENVKBD_CAPTURE_TIMESTAMP       0x00000004
+#define XENVKBD_CAPTURE_COALESCE        0x00000100
+#define XENVKBD_CAPTURE_DEDUP           0x00000200
+#define XENVKBD_CAPTURE_BACKPRESSURE    0x00000400
+
+#pragma pack(push, 1)
+
+typedef struct _XENVKBD_CAPTURE_RECORD {
+    ULONG64 TimeUs;
+    ULONG   Sequence;
+    ULONG   Index;
+    USHORT  Type;
+    USHORT  Length;
+    ULONG   Reserved;
+    UCHAR   Data[XENKBD_IN_EVENT_SIZE];
+} XENVKBD_CAPTURE_RECORD, *PXENVKBD_CAPTURE_RECORD;
+
+typedef struct _XENVKBD_CAPTURE {
+    ULONG                   Magic;
+    USHORT                  Version;
+    USHORT                  RecordSize;
+    ULONG                   Count;
+    ULONG                   Sequence;   // Next record to be written
+    ULONG64                 StartTimeUs;
+    ULONG64                 Reserved;
+    XENVKBD_CAPTURE_RECORD  Record[1];  // Count entries
+} XENVKBD_CAPTURE, *PXENVKBD_CAPTURE;
+
+typedef struct _XENVKBD_CAPTURE_CONNECT {
+    ULONG   Flags;
+    ULONG   FlushRate;
+    ULONG   DpcBudget;
+} XENVKBD_CAPTURE_CONNECT, *PXENVKBD_CAPTURE_CONNECT;
+
+#pragma pack(pop)
+
+C_ASSERT(sizeof (XENVKBD_CAPTURE_RECORD) == 64);
+C_ASSERT(FIELD_OFFSET(XENVKBD_CAPTURE, Record) == 32);
+
+#define XENVKBD_CAPTURE_MAXIMUM 4096
+
+#define XENVKBD_CAPTURE_SIZE(_Count)                \
+    (FIELD_OFFSET(XENVKBD_CAPTURE, Record) +        \
+     ((_Count) * sizeof (XENVKBD_CAPTURE_RECORD)))
+
+// Fills in the header of a zeroed buffer of XENVKBD_CAPTURE_SIZE(Count)
+// bytes; Count must be a power of two
+extern VOID
+CaptureInitialize(
+    IN  PXENVKBD_CAPTURE    Capture,
+    IN  ULONG               Count
+    );
+
+extern ULONG
+CaptureGetFootprint(
+    IN  PXENVKBD_CAPTURE    Capture
+    );
+
+extern VOID
+CaptureRecord(
+    IN  PXENVKBD_CAPTURE        Capture,
+    IN  XENVKBD_CAPTURE_TYPE    Type,
+    IN  ULONG                   Index,
+    IN  const VOID              *Data,
+    IN  ULONG                   Length
+    );
+
+#ifdef _KERNEL_MODE
+
+extern NTSTATUS
+CaptureCreate(
+    IN  ULONG               Count,
+    OUT PXENVKBD_CAPTURE    *Capture
+    );
+
+extern VOID
+CaptureDestroy(
+    IN  PXENVKBD_CAPTURE    Capture
+    );
+
+extern VOID
+CaptureDebugCallback(
+    IN  PXENVKBD_CAPTURE        Capture,
+    IN  PXENBUS_DEBUG_INTERFACE DebugInterface,
+    IN  ULONG                   Limit
+    );
+
+#endif  // _KERNEL_MODE
+
+#endif  // _XENVKBD_CAPTURE_H
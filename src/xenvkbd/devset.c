@@ -0,0 +1,277 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifdef _KERNEL_MODE
+
+#include <ntddk.h>
+
+#include "devset.h"
+
+#else   // _KERNEL_MODE
+
+#include <strings.h>
+
+#include "devset.h"
+
+#define RtlZeroMemory(_D, _L)   memset((_D), 0, (_L))
+#define _stricmp                strcasecmp
+
+#endif  // _KERNEL_MODE
+
+#define DEVICE_SET_ALIGNMENT    sizeof (PVOID)
+#define DEVICE_SET_SIZE(_Length)                                    \
+    (((ULONG)(_Length) + (ULONG)DEVICE_SET_ALIGNMENT - 1) &         \
+     ~((ULONG)DEVICE_SET_ALIGNMENT - 1))
+
+static FORCEINLINE CHAR
+__DeviceSetToUpper(
+    IN  CHAR    Character
+    )
+{
+    if (Character < 'a' || Character > 'z')
+        return Character;
+
+    return 'A' + Character - 'a';
+}
+
+static FORCEINLINE ULONG
+__DeviceSetHash(
+    IN  PCHAR   Name
+    )
+{
+    ULONG       Hash = 2166136261u;
+
+    while (*Name != '\0') {
+        Hash ^= (UCHAR)__DeviceSetToUpper(*Name++);
+        Hash *= 16777619u;
+    }
+
+    return Hash;
+}
+
+// Count the names in Buffer and the bytes they occupy, including the
+// final NUL
+static ULONG
+__DeviceSetCount(
+    IN  PCHAR   Buffer,
+    OUT PULONG  Size
+    )
+{
+    ULONG       Index;
+    ULONG       Count;
+
+    Index = 0;
+    Count = 0;
+    for (;;) {
+        if (Buffer[Index] == '\0') {
+            Count++;
+            Index++;
+
+            // Check for double NUL
+            if (Buffer[Index] == '\0')
+                break;
+        } else {
+            Index++;
+        }
+    }
+
+    *Size = Index + 1;
+    return Count;
+}
+
+static FORCEINLINE ULONG
+__DeviceSetBuckets(
+    IN  ULONG   Count
+    )
+{
+    ULONG       Buckets;
+
+    Buckets = 16;
+    while (Buckets < Count * 2)
+        Buckets <<= 1;
+
+    return Buckets;
+}
+
+ULONG
+DeviceSetGetFootprint(
+    IN  PCHAR   Buffer
+    )
+{
+    ULONG       Count;
+    ULONG       Size;
+
+    Count = __DeviceSetCount(Buffer, &Size);
+
+    return DEVICE_SET_SIZE(sizeof (XENVKBD_DEVICE_SET)) +
+           DEVICE_SET_SIZE(sizeof (ANSI_STRING) * (Count + 1)) +
+           DEVICE_SET_SIZE(sizeof (ULONG) * Count) * 2 +
+           DEVICE_SET_SIZE(sizeof (ULONG) * __DeviceSetBuckets(Count)) +
+           DEVICE_SET_SIZE(Size);
+}
+
+static FORCEINLINE PVOID
+__DeviceSetCarve(
+    IN OUT  PUCHAR  *Cursor,
+    IN      ULONG   Length
+    )
+{
+    PVOID           Buffer = *Cursor;
+
+    *Cursor += DEVICE_SET_SIZE(Length);
+    return Buffer;
+}
+
+PXENVKBD_DEVICE_SET
+DeviceSetInitialize(
+    IN  PVOID           Memory,
+    IN  PCHAR           Buffer
+    )
+{
+    PXENVKBD_DEVICE_SET Set;
+    PUCHAR              Free;
+    PCHAR               Names;
+    ULONG               Count;
+    ULONG               Buckets;
+    ULONG               Size;
+    ULONG               Index;
+    PCHAR               Cursor;
+
+    Count = __DeviceSetCount(Buffer, &Size);
+    Buckets = __DeviceSetBuckets(Count);
+
+    Free = Memory;
+    Set = __DeviceSetCarve(&Free, sizeof (XENVKBD_DEVICE_SET));
+
+    Set->Count = Count;
+    Set->Mask = Buckets - 1;
+    Set->Device = __DeviceSetCarve(&Free, sizeof (ANSI_STRING) * (Count + 1));
+    Set->Hash = __DeviceSetCarve(&Free, sizeof (ULONG) * Count);
+    Set->Next = __DeviceSetCarve(&Free, sizeof (ULONG) * Count);
+    Set->Bucket = __DeviceSetCarve(&Free, sizeof (ULONG) * Buckets);
+    Names = __DeviceSetCarve(&Free, Size);
+
+    RtlZeroMemory(&Set->Device[Count], sizeof (ANSI_STRING));
+    RtlZeroMemory(Set->Bucket, sizeof (ULONG) * Buckets);
+
+    for (Index = 0; Index < Size; Index++)
+        Names[Index] = __DeviceSetToUpper(Buffer[Index]);
+
+    Cursor = Names;
+    for (Index = 0; Index < Count; Index++) {
+        PANSI_STRING    Device = &Set->Device[Index];
+        ULONG           Length;
+        ULONG           Slot;
+
+        Length = (ULONG)strlen(Cursor);
+        Device->Buffer = Cursor;
+        Device->Length = (USHORT)Length;
+        Device->MaximumLength = (USHORT)(Length + 1);
+
+        Set->Hash[Index] = __DeviceSetHash(Cursor);
+
+        // Bucket heads and chain links are biased by one so that zero
+        // terminates a chain
+        Slot = Set->Hash[Index] & Set->Mask;
+        Set->Next[Index] = Set->Bucket[Slot];
+        Set->Bucket[Slot] = Index + 1;
+
+        Cursor += Length + 1;
+    }
+
+    return Set;
+}
+
+PANSI_STRING
+DeviceSetFind(
+    IN  PXENVKBD_DEVICE_SET Set,
+    IN  PCHAR               Name
+    )
+{
+    ULONG                   Hash;
+    ULONG                   Index;
+
+    Hash = __DeviceSetHash(Name);
+
+    for (Index = Set->Bucket[Hash & Set->Mask];
+         Index != 0;
+         Index = Set->Next[Index - 1]) {
+        PANSI_STRING    Device = &Set->Device[Index - 1];
+
+        if (Device->Length == 0 ||
+            Set->Hash[Index - 1] != Hash)
+            continue;
+
+        if (_stricmp(Name, Device->Buffer) == 0)
+            return Device;
+    }
+
+    return NULL;
+}
+
+ULONG
+DeviceSetCountMissing(
+    IN  PXENVKBD_DEVICE_SET From,
+    IN  PXENVKBD_DEVICE_SET In OPTIONAL
+    )
+{
+    ULONG                   Index;
+    ULONG                   Count;
+
+    Count = 0;
+    for (Index = 0; Index < From->Count; Index++) {
+        PANSI_STRING    Device = &From->Device[Index];
+
+        if (Device->Length == 0)
+            continue;
+
+        if (In == NULL || DeviceSetFind(In, Device->Buffer) == NULL)
+            Count++;
+    }
+
+    return Count;
+}
+
+VOID
+DeviceSetReset(
+    IN  PXENVKBD_DEVICE_SET Set
+    )
+{
+    ULONG                   Index;
+
+    for (Index = 0; Index < Set->Count; Index++) {
+        PANSI_STRING    Device = &Set->Device[Index];
+
+        Device->Length = Device->MaximumLength - 1;
+    }
+}
@@ -0,0 +1,104 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_DEVSET_H
+#define _XENVKBD_DEVSET_H
+
+// The device set is shared with the user-space benchmark (test/scan.c),
+// which builds against the translate.h shim.
+#ifdef _KERNEL_MODE
+
+#include <ntddk.h>
+
+#else   // _KERNEL_MODE
+
+#include "translate.h"
+
+typedef CHAR            *PCHAR;
+
+typedef struct _STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PCHAR   Buffer;
+} ANSI_STRING, *PANSI_STRING;
+
+#endif  // _KERNEL_MODE
+
+// A set of device names, held in a single allocation and hashed on the
+// upper-cased name so that reconciliation against the PDO list is linear.
+// Device[] is NUL terminated; an entry with zero Length has been claimed
+// (or filtered out) and will no longer be found.
+typedef struct _XENVKBD_DEVICE_SET {
+    ULONG           Count;
+    ULONG           Mask;
+    PULONG          Bucket;
+    PULONG          Next;
+    PULONG          Hash;
+    PANSI_STRING    Device;
+} XENVKBD_DEVICE_SET, *PXENVKBD_DEVICE_SET;
+
+// Bytes needed for a set of the names in Buffer, a double NUL terminated
+// list as returned by XENBUS_STORE(Directory, ...)
+extern ULONG
+DeviceSetGetFootprint(
+    IN  PCHAR   Buffer
+    );
+
+// Builds the set in Memory, which must be DeviceSetGetFootprint(Buffer)
+// bytes and pointer aligned. The set does not refer to Buffer.
+extern PXENVKBD_DEVICE_SET
+DeviceSetInitialize(
+    IN  PVOID   Memory,
+    IN  PCHAR   Buffer
+    );
+
+extern PANSI_STRING
+DeviceSetFind(
+    IN  PXENVKBD_DEVICE_SET Set,
+    IN  PCHAR               Name
+    );
+
+// Count the names in From that are not in In
+extern ULONG
+DeviceSetCountMissing(
+    IN  PXENVKBD_DEVICE_SET From,
+    IN  PXENVKBD_DEVICE_SET In OPTIONAL
+    );
+
+// Undo any claiming or filtering so the set can serve as a snapshot
+extern VOID
+DeviceSetReset(
+    IN  PXENVKBD_DEVICE_SET Set
+    );
+
+#endif  // _XENVKBD_DEVSET_H
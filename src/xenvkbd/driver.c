@@ -39,18 +39,39 @@
 #include "fdo.h"
 #include "pdo.h"
 #include "driver.h"
+#include "thread.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
+typedef struct _XENVKBD_CONFIG_SNAPSHOT {
+    LONG            References; // One is the driver's while it is current
+    XENVKBD_CONFIG  Config;
+} XENVKBD_CONFIG_SNAPSHOT, *PXENVKBD_CONFIG_SNAPSHOT;
+
 typedef struct _XENVKBD_DRIVER {
     PDRIVER_OBJECT      DriverObject;
     HANDLE              ParametersKey;
     BOOLEAN             NeedReboot;
+
+    PXENVKBD_CONFIG     Config;
+    KSPIN_LOCK          ConfigLock;
+    HANDLE              ConfigKey;      // Parameters, for the notification
+    HANDLE              ConfigEventHandle;
+    PKEVENT             ConfigEvent;
+    IO_STATUS_BLOCK     ConfigStatus;
+    PXENVKBD_THREAD     ConfigThread;
 } XENVKBD_DRIVER, *PXENVKBD_DRIVER;
 
 static XENVKBD_DRIVER    Driver;
 
+#define XENVKBD_DRIVER_TAG  'VRD'
+
+#define DRIVER_DEFAULT_ENUMERATE            1
+#define DRIVER_DEFAULT_SCAN_QUIET_PERIOD    50  // ms
+#define DRIVER_DEFAULT_CAPTURE_RECORDS      0   // disabled
+
 extern PULONG   InitSafeBootMode;
 
 static FORCEINLINE BOOLEAN
@@ -117,6 +138,298 @@ DriverGetParametersKey(
     return __DriverGetParametersKey();
 }
 
+static VOID
+__DriverReleaseConfig(
+    IN  PXENVKBD_CONFIG_SNAPSHOT    Snapshot
+    )
+{
+    ASSERT(Snapshot->References > 0);
+    if (InterlockedDecrement(&Snapshot->References) != 0)
+        return;
+
+    if (Snapshot->Config.UnsupportedDevices != NULL)
+        RegistryFreeSzValue(Snapshot->Config.UnsupportedDevices);
+
+    PoolFree(Snapshot, XENVKBD_DRIVER_TAG);
+}
+
+// Each reader holds a reference on the snapshot it is using, so that a
+// snapshot replaced by a Parameters change is freed as soon as the last
+// of them is done with it
+static NTSTATUS
+__DriverLoadConfig(
+    VOID
+    )
+{
+    PXENVKBD_CONFIG_SNAPSHOT    Snapshot;
+    PXENVKBD_CONFIG             Config;
+    PXENVKBD_CONFIG             Old;
+    HANDLE                      ParametersKey;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    Snapshot = PoolAllocate(XENVKBD_DRIVER_TAG,
+                            sizeof (XENVKBD_CONFIG_SNAPSHOT));
+
+    status = STATUS_NO_MEMORY;
+    if (Snapshot == NULL)
+        goto fail1;
+
+    Config = &Snapshot->Config;
+    ParametersKey = __DriverGetParametersKey();
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "Enumerate",
+                                     &Config->Enumerate);
+    if (!NT_SUCCESS(status))
+        Config->Enumerate = DRIVER_DEFAULT_ENUMERATE;
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "ScanQuietPeriod",
+                                     &Config->ScanQuietPeriod);
+    if (!NT_SUCCESS(status))
+        Config->ScanQuietPeriod = DRIVER_DEFAULT_SCAN_QUIET_PERIOD;
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "CaptureRecords",
+                                     &Config->CaptureRecords);
+    if (!NT_SUCCESS(status))
+        Config->CaptureRecords = DRIVER_DEFAULT_CAPTURE_RECORDS;
+
+    status = RegistryQuerySzValue(ParametersKey,
+                                  "UnsupportedDevices",
+                                  NULL,
+                                  &Config->UnsupportedDevices);
+    if (!NT_SUCCESS(status))
+        Config->UnsupportedDevices = NULL;
+
+    Snapshot->References = 1;
+
+    KeAcquireSpinLock(&Driver.ConfigLock, &Irql);
+    Old = Driver.Config;
+    Driver.Config = Config;
+    KeReleaseSpinLock(&Driver.ConfigLock, Irql);
+
+    if (Old != NULL)
+        __DriverReleaseConfig(CONTAINING_RECORD(Old,
+                                                XENVKBD_CONFIG_SNAPSHOT,
+                                                Config));
+
+    Info("Enumerate = %u ScanQuietPeriod = %u CaptureRecords = %u UnsupportedDevices = %s\n",
+         Config->Enumerate,
+         Config->ScanQuietPeriod,
+         Config->CaptureRecords,
+         (Config->UnsupportedDevices != NULL) ? "SET" : "NONE");
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Every reader has finished by now, so this is the last reference
+static VOID
+__DriverFreeConfig(
+    VOID
+    )
+{
+    PXENVKBD_CONFIG_SNAPSHOT    Snapshot;
+
+    if (Driver.Config == NULL)
+        return;
+
+    Snapshot = CONTAINING_RECORD(Driver.Config,
+                                 XENVKBD_CONFIG_SNAPSHOT,
+                                 Config);
+    Driver.Config = NULL;
+
+    ASSERT3U(Snapshot->References, ==, 1);
+    __DriverReleaseConfig(Snapshot);
+}
+
+const XENVKBD_CONFIG *
+DriverGetConfig(
+    VOID
+    )
+{
+    PXENVKBD_CONFIG_SNAPSHOT    Snapshot;
+    KIRQL                       Irql;
+
+    KeAcquireSpinLock(&Driver.ConfigLock, &Irql);
+
+    Snapshot = CONTAINING_RECORD(Driver.Config,
+                                 XENVKBD_CONFIG_SNAPSHOT,
+                                 Config);
+    InterlockedIncrement(&Snapshot->References);
+
+    KeReleaseSpinLock(&Driver.ConfigLock, Irql);
+
+    return &Snapshot->Config;
+}
+
+VOID
+DriverPutConfig(
+    IN  const XENVKBD_CONFIG    *Config
+    )
+{
+    __DriverReleaseConfig(CONTAINING_RECORD(Config,
+                                            XENVKBD_CONFIG_SNAPSHOT,
+                                            Config));
+}
+
+static NTSTATUS
+DriverConfigWatch(
+    IN  PXENVKBD_THREAD Self,
+    IN  PVOID           Context
+    )
+{
+    PVOID               Object[2];
+    NTSTATUS            status;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    Trace("====>\n");
+
+    Object[0] = ThreadGetEvent(Self);
+    Object[1] = Driver.ConfigEvent;
+
+    for (;;) {
+        status = ZwNotifyChangeKey(Driver.ConfigKey,
+                                   Driver.ConfigEventHandle,
+                                   NULL,
+                                   NULL,
+                                   &Driver.ConfigStatus,
+                                   REG_NOTIFY_CHANGE_NAME |
+                                   REG_NOTIFY_CHANGE_LAST_SET,
+                                   FALSE,
+                                   NULL,
+                                   0,
+                                   TRUE);
+        if (!NT_SUCCESS(status)) {
+            Warning("ZwNotifyChangeKey failed (%08x)\n", status);
+            break;
+        }
+
+        (VOID) KeWaitForMultipleObjects(ARRAYSIZE(Object),
+                                        Object,
+                                        WaitAny,
+                                        Executive,
+                                        KernelMode,
+                                        FALSE,
+                                        NULL,
+                                        NULL);
+        KeClearEvent(ThreadGetEvent(Self));
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        KeClearEvent(Driver.ConfigEvent);
+
+        (VOID) __DriverLoadConfig();
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+__DriverWatchConfig(
+    VOID
+    )
+{
+    OBJECT_ATTRIBUTES   Attributes;
+    NTSTATUS            status;
+
+    // A handle of its own, so that closing it cancels the notification
+    // without touching the key everything else reads
+    status = RegistryOpenSubKey(__DriverGetParametersKey(),
+                                "",
+                                KEY_READ,
+                                &Driver.ConfigKey);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    InitializeObjectAttributes(&Attributes,
+                               NULL,
+                               OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwCreateEvent(&Driver.ConfigEventHandle,
+                           EVENT_ALL_ACCESS,
+                           &Attributes,
+                           NotificationEvent,
+                           FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = ObReferenceObjectByHandle(Driver.ConfigEventHandle,
+                                       EVENT_ALL_ACCESS,
+                                       *ExEventObjectType,
+                                       KernelMode,
+                                       &Driver.ConfigEvent,
+                                       NULL);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = ThreadCreate(DriverConfigWatch, NULL, &Driver.ConfigThread);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+    ObDereferenceObject(Driver.ConfigEvent);
+    Driver.ConfigEvent = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    ZwClose(Driver.ConfigEventHandle);
+    Driver.ConfigEventHandle = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    RegistryCloseKey(Driver.ConfigKey);
+    Driver.ConfigKey = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+__DriverUnwatchConfig(
+    VOID
+    )
+{
+    ThreadAlert(Driver.ConfigThread);
+    ThreadJoin(Driver.ConfigThread);
+    Driver.ConfigThread = NULL;
+
+    // The thread leaves a notification pending; closing the handle it was
+    // requested on cancels it, before the event it would signal goes away
+    RegistryCloseKey(Driver.ConfigKey);
+    Driver.ConfigKey = NULL;
+
+    ObDereferenceObject(Driver.ConfigEvent);
+    Driver.ConfigEvent = NULL;
+
+    ZwClose(Driver.ConfigEventHandle);
+    Driver.ConfigEventHandle = NULL;
+
+    RtlZeroMemory(&Driver.ConfigStatus, sizeof (IO_STATUS_BLOCK));
+}
+
 #define MAXNAMELEN  256
 
 static FORCEINLINE VOID
@@ -222,11 +535,17 @@ DriverUnload(
 
     Driver.NeedReboot = FALSE;
 
+    WorkTeardown();
+
+    __DriverUnwatchConfig();
+
     ParametersKey = __DriverGetParametersKey();
     __DriverSetParametersKey(NULL);
 
     RegistryCloseKey(ParametersKey);
 
+    __DriverFreeConfig();
+
     RegistryTeardown();
 
     Info("XENVKBD %d.%d.%d (%d) (%02d.%02d.%04d)\n",
@@ -242,6 +561,8 @@ DriverUnload(
 
     ASSERT(IsZeroMemory(&Driver, sizeof (XENVKBD_DRIVER)));
 
+    PoolTeardown();
+
     Trace("<====\n");
 }
 
@@ -350,6 +671,8 @@ DriverEntry(
 
     Trace("====>\n");
 
+    PoolInitialize();
+
     __DriverSetDriverObject(DriverObject);
 
     Driver.DriverObject->DriverUnload = DriverUnload;
@@ -380,6 +703,20 @@ DriverEntry(
 
     __DriverSetParametersKey(ParametersKey);
 
+    KeInitializeSpinLock(&Driver.ConfigLock);
+
+    status = __DriverLoadConfig();
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    status = __DriverWatchConfig();
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    status = WorkInitialize();
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
     RegistryCloseKey(ServiceKey);
 
     DriverObject->DriverExtension->AddDevice = AddDevice;
@@ -394,6 +731,23 @@ DriverEntry(
 
     return STATUS_SUCCESS;
 
+fail6:
+    Error("fail6\n");
+
+    __DriverUnwatchConfig();
+
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+    __DriverFreeConfig();
+
+    __DriverSetParametersKey(NULL);
+
+    RegistryCloseKey(ParametersKey);
+
 fail3:
     Error("fail3\n");
 
@@ -411,5 +765,7 @@ fail1:
 
     ASSERT(IsZeroMemory(&Driver, sizeof (XENVKBD_DRIVER)));
 
+    PoolTeardown();
+
     return status;
 }
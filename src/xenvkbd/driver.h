@@ -53,6 +53,25 @@ DriverRequestReboot(
     VOID
     );
 
+// Values from the Parameters key. A snapshot is immutable once published
+// and remains valid until it is handed back with DriverPutConfig().
+typedef struct _XENVKBD_CONFIG {
+    ULONG           Enumerate;
+    ULONG           ScanQuietPeriod;
+    ULONG           CaptureRecords;
+    PANSI_STRING    UnsupportedDevices;
+} XENVKBD_CONFIG, *PXENVKBD_CONFIG;
+
+extern const XENVKBD_CONFIG *
+DriverGetConfig(
+    VOID
+    );
+
+extern VOID
+DriverPutConfig(
+    IN  const XENVKBD_CONFIG    *Config
+    );
+
 typedef struct _XENVKBD_PDO  XENVKBD_PDO, *PXENVKBD_PDO;
 typedef struct _XENVKBD_FDO  XENVKBD_FDO, *PXENVKBD_FDO;
 
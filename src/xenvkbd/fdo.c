@@ -51,7 +51,9 @@
 #include "thread.h"
 #include "mutex.h"
 #include "frontend.h"
+#include "devset.h"
 #include "names.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -80,16 +82,21 @@ struct _XENVKBD_FDO {
     ULONG                       Usage[DeviceUsageTypeDumpFile + 1];
     BOOLEAN                     NotDisableable;
 
-    PXENVKBD_THREAD             SystemPowerThread;
+    PXENVKBD_WORK               SystemPowerWork;
     PIRP                        SystemPowerIrp;
-    PXENVKBD_THREAD             DevicePowerThread;
+    PXENVKBD_WORK               DevicePowerWork;
     PIRP                        DevicePowerIrp;
 
     CHAR                        VendorName[MAXNAMELEN];
 
-    PXENVKBD_THREAD             ScanThread;
+    PXENVKBD_WORK               ScanWork;
     KEVENT                      ScanEvent;
     PXENBUS_STORE_WATCH         ScanWatch;
+    PXENVKBD_DEVICE_SET         ScanSnapshot;
+    LONG                        ScanForce;  // Set from any context
+    ULONG                       ScanTriggered;
+    ULONG                       ScanExecuted;
+    ULONG                       Distribution;
     MUTEX                       Mutex;
     ULONG                       References;
 
@@ -104,6 +111,7 @@ struct _XENVKBD_FDO {
     XENBUS_GNTTAB_INTERFACE     GnttabInterface;
 
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackLate;
+    PXENBUS_DEBUG_CALLBACK      DebugCallback;
 };
 
 static FORCEINLINE PVOID
@@ -111,7 +119,7 @@ __FdoAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, FDO_POOL);
+    return PoolAllocate(FDO_POOL, Length);
 }
 
 static FORCEINLINE VOID
@@ -119,7 +127,7 @@ __FdoFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, FDO_POOL);
+    PoolFree(Buffer, FDO_POOL);
 }
 
 static FORCEINLINE VOID
@@ -674,8 +682,11 @@ done:
     ASSERT3U(Fdo->References, !=, 0);
     --Fdo->References;
 
-    if (Fdo->ScanThread)
-        ThreadWake(Fdo->ScanThread);
+    if (Fdo->ScanWork != NULL) {
+        // The device list may not have changed, but the PDOs have
+        (VOID) InterlockedExchange(&Fdo->ScanForce, TRUE);
+        WorkWake(Fdo->ScanWork);
+    }
 }
 
 static FORCEINLINE VOID
@@ -713,30 +724,56 @@ FdoReleaseMutex(
         FdoDestroy(Fdo);
 }
 
+static PXENVKBD_DEVICE_SET
+__FdoCreateDeviceSet(
+    IN  PCHAR       Buffer
+    )
+{
+    PVOID           Memory;
+    NTSTATUS        status;
+
+    Memory = __FdoAllocate(DeviceSetGetFootprint(Buffer));
+
+    status = STATUS_NO_MEMORY;
+    if (Memory == NULL)
+        goto fail1;
+
+    return DeviceSetInitialize(Memory, Buffer);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return NULL;
+}
+
+static FORCEINLINE VOID
+__FdoDestroyDeviceSet(
+    IN  PXENVKBD_DEVICE_SET Set
+    )
+{
+    __FdoFree(Set);
+}
+
 static FORCEINLINE BOOLEAN
 __FdoEnumerate(
-    IN  PXENVKBD_FDO    Fdo,
-    IN  PANSI_STRING    Devices
+    IN  PXENVKBD_FDO        Fdo,
+    IN  PXENVKBD_DEVICE_SET Devices
     )
 {
+    const XENVKBD_CONFIG *Config;
     BOOLEAN             NeedInvalidate; 
-    HANDLE              ParametersKey;
-    ULONG               Enumerate;
     PLIST_ENTRY         ListEntry;
     ULONG               Index;
+    ULONG               Enumerate;
     NTSTATUS            status;
 
     Trace("====>\n");
 
     NeedInvalidate = FALSE;
 
-    ParametersKey = DriverGetParametersKey();
-
-    status = RegistryQueryDwordValue(ParametersKey,
-                                     "Enumerate",
-                                     &Enumerate);
-    if (!NT_SUCCESS(status))
-        Enumerate = 1;
+    Config = DriverGetConfig();
+    Enumerate = Config->Enumerate;
+    DriverPutConfig(Config);
 
     if (Enumerate == 0)
         goto done;
@@ -750,25 +787,17 @@ __FdoEnumerate(
         PXENVKBD_PDO    Pdo = Dx->Pdo;
 
         if (PdoGetDevicePnpState(Pdo) != Deleted) {
-            PCHAR           Name;
+            PANSI_STRING    Device;
             BOOLEAN         Missing;
 
-            Name = PdoGetName(Pdo);
             Missing = TRUE;
 
             // If the PDO already exists and its name is in the device list
             // then we don't want to remove it.
-            for (Index = 0; Devices[Index].Buffer != NULL; Index++) {
-                PANSI_STRING Device = &Devices[Index];
-
-                if (Device->Length == 0)
-                    continue;
-
-                if (strcmp(Name, Device->Buffer) == 0) {
-                    Missing = FALSE;
-                    Device->Length = 0;  // avoid duplication
-                    break;
-                }
+            Device = DeviceSetFind(Devices, PdoGetName(Pdo));
+            if (Device != NULL) {
+                Missing = FALSE;
+                Device->Length = 0;  // avoid duplication
             }
 
             if (!PdoIsMissing(Pdo)) {
@@ -795,8 +824,8 @@ __FdoEnumerate(
     }
 
     // Walk the class list and create PDOs for any new device
-    for (Index = 0; Devices[Index].Buffer != NULL; Index++) {
-        PANSI_STRING Device = &Devices[Index];
+    for (Index = 0; Index < Devices->Count; Index++) {
+        PANSI_STRING Device = &Devices->Device[Index];
 
         if (Device->Length == 0)
             continue;
@@ -814,201 +843,182 @@ done:
     return NeedInvalidate;
 }
 
-static FORCEINLINE PANSI_STRING
-__FdoMultiSzToUpcaseAnsi(
-    IN  PCHAR       Buffer
+#define FDO_SCAN_MAX_DEFER      20  // quiet periods
+
+// Absorb further wake-ups (i.e. watch events) until there has been a
+// quiet period, unless somebody is synchronously waiting on the scan.
+static VOID
+__FdoScanSettle(
+    IN  PXENVKBD_FDO    Fdo,
+    IN  PXENVKBD_WORK   Self
     )
 {
-    PANSI_STRING    Ansi;
-    LONG            Index;
-    LONG            Count;
-    NTSTATUS        status;
-
-    Index = 0;
-    Count = 0;
-    for (;;) {
-        if (Buffer[Index] == '\0') {
-            Count++;
-            Index++;
+    const XENVKBD_CONFIG *Config;
+    PKEVENT             Event;
+    ULONG               QuietPeriod;
+    ULONG               Count;
+    NTSTATUS            status;
 
-            // Check for double NUL
-            if (Buffer[Index] == '\0')
-                break;
-        } else {
-            Buffer[Index] = __toupper(Buffer[Index]);
-            Index++;
-        }
-    }
+    Event = WorkGetEvent(Self);
+    Config = DriverGetConfig();
+    QuietPeriod = Config->ScanQuietPeriod;
+    DriverPutConfig(Config);
 
-    Ansi = __FdoAllocate(sizeof (ANSI_STRING) * (Count + 1));
+    for (Count = 0; Count < FDO_SCAN_MAX_DEFER; Count++) {
+        LARGE_INTEGER   Timeout;
 
-    status = STATUS_NO_MEMORY;
-    if (Ansi == NULL)
-        goto fail1;
-
-    for (Index = 0; Index < Count; Index++) {
-        ULONG   Length;
-
-        Length = (ULONG)strlen(Buffer);
-        Ansi[Index].MaximumLength = (USHORT)(Length + 1);
-        Ansi[Index].Buffer = __FdoAllocate(Ansi[Index].MaximumLength);
+        if (QuietPeriod == 0 ||
+            !KeReadStateEvent(&Fdo->ScanEvent) ||
+            WorkIsAlerted(Self))
+            break;
 
-        status = STATUS_NO_MEMORY;
-        if (Ansi[Index].Buffer == NULL)
-            goto fail2;
+        Timeout.QuadPart = -10000ll * QuietPeriod;
 
-        RtlCopyMemory(Ansi[Index].Buffer, Buffer, Length);
-        Ansi[Index].Length = (USHORT)Length;
+        status = KeWaitForSingleObject(Event,
+                                       Executive,
+                                       KernelMode,
+                                       FALSE,
+                                       &Timeout);
+        if (status == STATUS_TIMEOUT)
+            break;
 
-        Buffer += Length + 1;
+        KeClearEvent(Event);
+        Fdo->ScanTriggered++;
     }
-
-    return Ansi;
-
-fail2:
-    Error("fail2\n");
-
-    while (--Index >= 0)
-        __FdoFree(Ansi[Index].Buffer);
-
-    __FdoFree(Ansi);
-
-fail1:
-    Error("fail1 (%08x)\n", status);
-
-    return NULL;
-}
-
-static FORCEINLINE VOID
-__FdoFreeAnsi(
-    IN  PANSI_STRING    Ansi
-    )
-{
-    ULONG               Index;
-
-    for (Index = 0; Ansi[Index].Buffer != NULL; Index++)
-        __FdoFree(Ansi[Index].Buffer);
-        
-    __FdoFree(Ansi);
 }
 
-static NTSTATUS
+// Invoked on a work queue worker each time the scan event is signalled
+static VOID
 FdoScan(
-    PXENVKBD_THREAD     Self,
-    PVOID               Context
+    IN  PXENVKBD_WORK   Self,
+    IN  PVOID           Context
     )
 {
     PXENVKBD_FDO        Fdo = Context;
-    PKEVENT             Event;
-    HANDLE              ParametersKey;
+    PCHAR               Buffer;
+    PXENVKBD_DEVICE_SET Devices;
+    const XENVKBD_CONFIG *Config;
+    PANSI_STRING        UnsupportedDevices;
+    ULONG               Index;
+    ULONG               Added;
+    ULONG               Removed;
+    BOOLEAN             Urgent;
+    BOOLEAN             NeedInvalidate;
     NTSTATUS            status;
 
     Trace("====>\n");
 
-    Event = ThreadGetEvent(Self);
+    Fdo->ScanTriggered++;
 
-    ParametersKey = DriverGetParametersKey();
+    // It is not safe to use interfaces before this point
+    if (__FdoGetDevicePnpState(Fdo) != Started)
+        goto done;
 
-    for (;;) {
-        PCHAR           Buffer;
-        PANSI_STRING    Devices;
-        PANSI_STRING    UnsupportedDevices;
-        ULONG           Index;
-        BOOLEAN         NeedInvalidate;
+    __FdoScanSettle(Fdo, Self);
 
-        Trace("waiting...\n");
+    if (WorkIsAlerted(Self))
+        goto done;
 
-        (VOID) KeWaitForSingleObject(Event,
-                                     Executive,
-                                     KernelMode,
-                                     FALSE,
-                                     NULL);
-        KeClearEvent(Event);
+    // A cleared ScanEvent means someone is waiting for the result. Take
+    // ScanForce in one go so that a request made meanwhile is not lost.
+    Urgent = (InterlockedExchange(&Fdo->ScanForce, FALSE) != FALSE) ? TRUE : FALSE;
+    if (!KeReadStateEvent(&Fdo->ScanEvent))
+        Urgent = TRUE;
 
-        if (ThreadIsAlerted(Self))
-            break;
+    status = XENBUS_STORE(Directory,
+                          &Fdo->StoreInterface,
+                          NULL,
+                          "device",
+                          "vkbd",
+                          &Buffer);
+    if (NT_SUCCESS(status)) {
+        Devices = __FdoCreateDeviceSet(Buffer);
 
-        // It is not safe to use interfaces before this point
-        if (__FdoGetDevicePnpState(Fdo) != Started) {
-            KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
-            continue;
-        }
+        XENBUS_STORE(Free,
+                     &Fdo->StoreInterface,
+                     Buffer);
+    } else {
+        Devices = NULL;
+    }
 
-        status = XENBUS_STORE(Directory,
-                              &Fdo->StoreInterface,
-                              NULL,
-                              "device",
-                              "vkbd",
-                              &Buffer);
-        if (NT_SUCCESS(status)) {
-            Devices = __FdoMultiSzToUpcaseAnsi(Buffer);
+    if (Devices == NULL)
+        goto done;
 
-            XENBUS_STORE(Free,
-                         &Fdo->StoreInterface,
-                         Buffer);
-        } else {
-            Devices = NULL;
-        }
+    Added = DeviceSetCountMissing(Devices, Fdo->ScanSnapshot);
+    Removed = (Fdo->ScanSnapshot != NULL) ?
+              DeviceSetCountMissing(Fdo->ScanSnapshot, Devices) :
+              0;
 
-        if (Devices == NULL)
-            goto loop;
+    if (Added == 0 && Removed == 0 && !Urgent) {
+        __FdoDestroyDeviceSet(Devices);
+        goto done;
+    }
 
-        if (ParametersKey != NULL) {
-            status = RegistryQuerySzValue(ParametersKey,
-                                          "UnsupportedDevices",
-                                          NULL,
-                                          &UnsupportedDevices);
-            if (!NT_SUCCESS(status))
-                UnsupportedDevices = NULL;
-        } else {
-            UnsupportedDevices = NULL;
-        }
+    Fdo->ScanExecuted++;
 
-        // NULL out anything in the Devices list that is in the
-        // UnsupportedDevices list    
-        for (Index = 0; Devices[Index].Buffer != NULL; Index++) {
-            PANSI_STRING    Device = &Devices[Index];
-            ULONG           Entry;
-            BOOLEAN         Supported;
-
-            Supported = TRUE;
-
-            for (Entry = 0;
-                 UnsupportedDevices != NULL && UnsupportedDevices[Entry].Buffer != NULL;
-                 Entry++) {
-                if (strncmp(Device->Buffer,
-                            UnsupportedDevices[Entry].Buffer,
-                            Device->Length) == 0) {
-                    Supported = FALSE;
-                    break;
-                }
-            }
+    Config = DriverGetConfig();
+    UnsupportedDevices = Config->UnsupportedDevices;
 
-            if (!Supported)
-                Device->Length = 0;
-        }
+    // Remove anything in the Devices set that is in the
+    // UnsupportedDevices list
+    for (Index = 0;
+         UnsupportedDevices != NULL && UnsupportedDevices[Index].Buffer != NULL;
+         Index++) {
+        PANSI_STRING    Device;
 
-        if (UnsupportedDevices != NULL)
-            RegistryFreeSzValue(UnsupportedDevices);
+        Device = DeviceSetFind(Devices, UnsupportedDevices[Index].Buffer);
+        if (Device != NULL)
+            Device->Length = 0;
+    }
 
-        NeedInvalidate = __FdoEnumerate(Fdo, Devices);
+    DriverPutConfig(Config);
 
-        __FdoFreeAnsi(Devices);
+    NeedInvalidate = __FdoEnumerate(Fdo, Devices);
 
-        if (NeedInvalidate) {
-            NeedInvalidate = FALSE;
-            IoInvalidateDeviceRelations(__FdoGetPhysicalDeviceObject(Fdo), 
-                                        BusRelations);
-        }
+    DeviceSetReset(Devices);
 
-loop:
-        KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
-    }
+    if (Fdo->ScanSnapshot != NULL)
+        __FdoDestroyDeviceSet(Fdo->ScanSnapshot);
+    Fdo->ScanSnapshot = Devices;
+
+    Info("%s: +%u -%u%s (scans: triggered %u executed %u)\n",
+         __FdoGetName(Fdo),
+         Added,
+         Removed,
+         (Urgent) ? " (urgent)" : "",
+         Fdo->ScanTriggered,
+         Fdo->ScanExecuted);
+
+    if (NeedInvalidate)
+        IoInvalidateDeviceRelations(__FdoGetPhysicalDeviceObject(Fdo), 
+                                    BusRelations);
 
+done:
     KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
 
     Trace("<====\n");
-    return STATUS_SUCCESS;
+}
+
+static VOID
+FdoScanStop(
+    IN  PXENVKBD_FDO    Fdo
+    )
+{
+    WorkAlert(Fdo->ScanWork);
+    WorkJoin(Fdo->ScanWork);
+    Fdo->ScanWork = NULL;
+
+    if (Fdo->ScanSnapshot != NULL) {
+        __FdoDestroyDeviceSet(Fdo->ScanSnapshot);
+        Fdo->ScanSnapshot = NULL;
+    }
+
+    Fdo->ScanForce = FALSE;
+    Fdo->ScanTriggered = 0;
+    Fdo->ScanExecuted = 0;
+
+    // Release anyone still waiting on a synchronous scan
+    KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
 }
 
 static DECLSPEC_NOINLINE VOID
@@ -1118,125 +1128,163 @@ fail1:
     return FALSE;
 }
 
+#define MAXIMUM_INDEX   255
+
+// Entries that match us were left by an earlier instance (e.g. one that
+// crashed or was migrated) and are removed; the rest mark their index as
+// used. Entry names are decimal indices; other names never occupy one.
+static NTSTATUS
+__FdoScanDistributions(
+    IN  PXENVKBD_FDO                Fdo,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction,
+    IN  PCHAR                       Buffer,
+    OUT PULONG                      Used
+    )
+{
+    NTSTATUS                        status;
+
+    for (; *Buffer != '\0'; Buffer += strlen(Buffer) + 1) {
+        PCHAR   Value;
+        PCHAR   End;
+        ULONG   Index;
+        BOOLEAN Match;
+
+        status = XENBUS_STORE(Read,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              "drivers",
+                              Buffer,
+                              &Value);
+        if (NT_SUCCESS(status)) {
+            Match = __FdoMatchDistribution(Fdo, Value);
+
+            XENBUS_STORE(Free,
+                         &Fdo->StoreInterface,
+                         Value);
+        } else {
+            Match = FALSE;
+        }
+
+        if (Match) {
+            status = XENBUS_STORE(Remove,
+                                  &Fdo->StoreInterface,
+                                  Transaction,
+                                  "drivers",
+                                  Buffer);
+            if (!NT_SUCCESS(status))
+                goto fail1;
+
+            continue;
+        }
+
+        Index = strtoul(Buffer, &End, 10);
+        if (*End == '\0' && End != Buffer && Index <= MAXIMUM_INDEX)
+            Used[Index / 32] |= 1u << (Index % 32);
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static FORCEINLINE LONG
+__FdoFindFreeDistribution(
+    IN  PULONG  Used
+    )
+{
+    ULONG       Word;
+
+    for (Word = 0; Word < (MAXIMUM_INDEX + 1) / 32; Word++) {
+        ULONG   Bit;
+
+        if (!_BitScanForward(&Bit, ~Used[Word]))
+            continue;
+
+        return (LONG)(Word * 32 + Bit);
+    }
+
+    return -1;
+}
+
 static VOID
 FdoClearDistribution(
     IN  PXENVKBD_FDO    Fdo
     )
 {
+    CHAR                Distribution[MAXNAMELEN];
     PCHAR               Buffer;
-    PANSI_STRING        Distributions;
-    ULONG               Index;
     NTSTATUS            status;
 
     Trace("====>\n");
 
-    status = XENBUS_STORE(Directory,
+    // Only the entry claimed by FdoSetDistribution() can be ours by now:
+    // it swept any others when it claimed it
+    if (Fdo->Distribution == 0)
+        goto done;
+
+    status = RtlStringCbPrintfA(Distribution,
+                                MAXNAMELEN,
+                                "%u",
+                                Fdo->Distribution - 1);
+    ASSERT(NT_SUCCESS(status));
+
+    Fdo->Distribution = 0;
+
+    status = XENBUS_STORE(Read,
                           &Fdo->StoreInterface,
                           NULL,
-                          NULL,
                           "drivers",
+                          Distribution,
                           &Buffer);
-    if (NT_SUCCESS(status)) {
-        Distributions = __FdoMultiSzToUpcaseAnsi(Buffer);
-
-        XENBUS_STORE(Free,
-                     &Fdo->StoreInterface,
-                     Buffer);
-    } else {
-        Distributions = NULL;
-    }
-
-    if (Distributions == NULL)
+    if (!NT_SUCCESS(status))
         goto done;
 
-    for (Index = 0; Distributions[Index].Buffer != NULL; Index++) {
-        PANSI_STRING    Distribution = &Distributions[Index];
-
-        status = XENBUS_STORE(Read,
-                              &Fdo->StoreInterface,
-                              NULL,
-                              "drivers",
-                              Distribution->Buffer,
-                              &Buffer);
-        if (!NT_SUCCESS(status))
-            continue;
-
-        if (__FdoMatchDistribution(Fdo, Buffer))
-            (VOID) XENBUS_STORE(Remove,
-                                &Fdo->StoreInterface,
-                                NULL,
-                                "drivers",
-                                Distribution->Buffer);
-
-        XENBUS_STORE(Free,
-                     &Fdo->StoreInterface,
-                     Buffer);
-    }
+    // The index may have been re-used if the store was re-populated
+    // across a migration
+    if (__FdoMatchDistribution(Fdo, Buffer))
+        (VOID) XENBUS_STORE(Remove,
+                            &Fdo->StoreInterface,
+                            NULL,
+                            "drivers",
+                            Distribution);
 
-    __FdoFreeAnsi(Distributions);
+    XENBUS_STORE(Free,
+                 &Fdo->StoreInterface,
+                 Buffer);
 
 done:
     Trace("<====\n");
 }
 
-#define MAXIMUM_INDEX   255
-
 static NTSTATUS
 FdoSetDistribution(
     IN  PXENVKBD_FDO    Fdo
     )
 {
-    ULONG               Index;
+    ULONG               Used[(MAXIMUM_INDEX + 1) / 32];
+    LONG                Index;
     CHAR                Distribution[MAXNAMELEN];
     CHAR                Vendor[MAXNAMELEN];
     const CHAR          *Product;
+    ULONG               Offset;
     NTSTATUS            status;
 
     Trace("====>\n");
 
-    Index = 0;
-    while (Index <= MAXIMUM_INDEX) {
-        PCHAR   Buffer;
-
-        status = RtlStringCbPrintfA(Distribution,
-                                    MAXNAMELEN,
-                                    "%u",
-                                    Index);
-        ASSERT(NT_SUCCESS(status));
-
-        status = XENBUS_STORE(Read,
-                              &Fdo->StoreInterface,
-                              NULL,
-                              "drivers",
-                              Distribution,
-                              &Buffer);
-        if (!NT_SUCCESS(status)) {
-            if (status == STATUS_OBJECT_NAME_NOT_FOUND)
-                goto update;
-
-            goto fail1;
-        }
-
-        XENBUS_STORE(Free,
-                     &Fdo->StoreInterface,
-                     Buffer);
-
-        Index++;
-    }
-
-    status = STATUS_UNSUCCESSFUL;
-    goto fail2;
+    ASSERT3U(Fdo->Distribution, ==, 0);
 
-update:
     status = RtlStringCbPrintfA(Vendor,
                                 MAXNAMELEN,
                                 "%s",
                                 VENDOR_NAME_STR);
     ASSERT(NT_SUCCESS(status));
 
-    for (Index  = 0; Vendor[Index] != '\0'; Index++)
-        if (!isalnum((UCHAR)Vendor[Index]))
-            Vendor[Index] = '_';
+    for (Offset = 0; Vendor[Offset] != '\0'; Offset++)
+        if (!isalnum((UCHAR)Vendor[Offset]))
+            Vendor[Offset] = '_';
 
     Product = "XENVKBD";
 
@@ -1246,29 +1294,97 @@ update:
 #define ATTRIBUTES   ""
 #endif
 
-    (VOID) XENBUS_STORE(Printf,
-                        &Fdo->StoreInterface,
-                        NULL,
-                        "drivers",
-                        Distribution,
-                        "%s %s %u.%u.%u.%u %s",
-                        Vendor,
-                        Product,
-                        MAJOR_VERSION,
-                        MINOR_VERSION,
-                        MICRO_VERSION,
-                        BUILD_NUMBER,
-                        ATTRIBUTES
-                        );
+    Index = -1;
+
+    // Read the directory once, sweep stale entries of ours and claim the
+    // first free index in the same transaction, rather than probing each
+    // index in turn
+    for (;;) {
+        PXENBUS_STORE_TRANSACTION   Transaction;
+        PCHAR                       Buffer;
+
+        status = XENBUS_STORE(TransactionStart,
+                              &Fdo->StoreInterface,
+                              &Transaction);
+        if (!NT_SUCCESS(status))
+            break;
+
+        RtlZeroMemory(Used, sizeof (Used));
+
+        status = XENBUS_STORE(Directory,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              NULL,
+                              "drivers",
+                              &Buffer);
+        if (NT_SUCCESS(status)) {
+            status = __FdoScanDistributions(Fdo, Transaction, Buffer, Used);
+
+            XENBUS_STORE(Free,
+                         &Fdo->StoreInterface,
+                         Buffer);
+
+            if (!NT_SUCCESS(status))
+                goto abort;
+        } else if (status != STATUS_OBJECT_NAME_NOT_FOUND) {
+            goto abort;
+        }
+
+        status = STATUS_UNSUCCESSFUL;
+        Index = __FdoFindFreeDistribution(Used);
+        if (Index < 0)
+            goto abort;
+
+        status = RtlStringCbPrintfA(Distribution,
+                                    MAXNAMELEN,
+                                    "%u",
+                                    Index);
+        ASSERT(NT_SUCCESS(status));
+
+        status = XENBUS_STORE(Printf,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              "drivers",
+                              Distribution,
+                              "%s %s %u.%u.%u.%u %s",
+                              Vendor,
+                              Product,
+                              MAJOR_VERSION,
+                              MINOR_VERSION,
+                              MICRO_VERSION,
+                              BUILD_NUMBER,
+                              ATTRIBUTES
+                              );
+        if (!NT_SUCCESS(status))
+            goto abort;
+
+        status = XENBUS_STORE(TransactionEnd,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              TRUE);
+        if (status == STATUS_RETRY)
+            continue;
+
+        break;
+
+abort:
+        (VOID) XENBUS_STORE(TransactionEnd,
+                            &Fdo->StoreInterface,
+                            Transaction,
+                            FALSE);
+        break;
+    }
 
 #undef  ATTRIBUTES
 
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Fdo->Distribution = Index + 1;
+
     Trace("<====\n");
     return STATUS_SUCCESS;
 
-fail2:
-    Error("fail2\n");
-
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -1288,11 +1404,14 @@ __FdoD3ToD0(
 
     (VOID) FdoSetDistribution(Fdo);
 
+    // Nothing can be assumed about what changed while we were away
+    (VOID) InterlockedExchange(&Fdo->ScanForce, TRUE);
+
     status = XENBUS_STORE(WatchAdd,
                           &Fdo->StoreInterface,
                           "device",
                           "vkbd",
-                          ThreadGetEvent(Fdo->ScanThread),
+                          WorkGetEvent(Fdo->ScanWork),
                           &Fdo->ScanWatch);
     if (!NT_SUCCESS(status))
         goto fail1;
@@ -1340,6 +1459,25 @@ __FdoD0ToD3(
     Trace("<====\n");
 }
 
+static VOID
+FdoDebugCallback(
+    IN  PVOID       Argument,
+    IN  BOOLEAN     Crashing
+    )
+{
+    PXENVKBD_FDO    Fdo = Argument;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    XENBUS_DEBUG(Printf,
+                 &Fdo->DebugInterface,
+                 "SCANS: triggered %u executed %u\n",
+                 Fdo->ScanTriggered,
+                 Fdo->ScanExecuted);
+
+    PoolDebugCallback(&Fdo->DebugInterface);
+}
+
 static DECLSPEC_NOINLINE VOID
 FdoSuspendCallbackLate(
     IN  PVOID       Argument
@@ -1393,6 +1531,19 @@ FdoD3ToD0(
     if (!NT_SUCCESS(status))
         goto fail4;
 
+    status = XENBUS_DEBUG(Acquire, &Fdo->DebugInterface);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    status = XENBUS_DEBUG(Register,
+                          &Fdo->DebugInterface,
+                          __MODULE__ "|FDO",
+                          FdoDebugCallback,
+                          Fdo,
+                          &Fdo->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
     KeLowerIrql(Irql);
 
     __FdoSetDevicePowerState(Fdo, PowerDeviceD0);
@@ -1422,6 +1573,19 @@ FdoD3ToD0(
 
     return STATUS_SUCCESS;
 
+fail6:
+    Error("fail6\n");
+
+    XENBUS_DEBUG(Release, &Fdo->DebugInterface);
+
+fail5:
+    Error("fail5\n");
+
+    XENBUS_SUSPEND(Deregister,
+                   &Fdo->SuspendInterface,
+                   Fdo->SuspendCallbackLate);
+    Fdo->SuspendCallbackLate = NULL;
+
 fail4:
     Error("fail4\n");
 
@@ -1490,6 +1654,13 @@ FdoD0ToD3(
 
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
+    XENBUS_DEBUG(Deregister,
+                 &Fdo->DebugInterface,
+                 Fdo->DebugCallback);
+    Fdo->DebugCallback = NULL;
+
+    XENBUS_DEBUG(Release, &Fdo->DebugInterface);
+
     XENBUS_SUSPEND(Deregister,
                    &Fdo->SuspendInterface,
                    Fdo->SuspendCallbackLate);
@@ -1551,7 +1722,10 @@ FdoStartDevice(
 
     KeInitializeEvent(&Fdo->ScanEvent, NotificationEvent, FALSE);
 
-    status = ThreadCreate(FdoScan, Fdo, &Fdo->ScanThread);
+    status = WorkCreate(FdoScan,
+                        Fdo,
+                        WORK_CLASS_WAITING,
+                        &Fdo->ScanWork);
     if (!NT_SUCCESS(status))
         goto fail2;
 
@@ -1560,7 +1734,7 @@ FdoStartDevice(
         goto fail3;
 
     __FdoSetDevicePnpState(Fdo, Started);
-    ThreadWake(Fdo->ScanThread);
+    WorkWake(Fdo->ScanWork);
 
     status = Irp->IoStatus.Status;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -1570,9 +1744,7 @@ FdoStartDevice(
 fail3:
     Error("fail3\n");
 
-    ThreadAlert(Fdo->ScanThread);
-    ThreadJoin(Fdo->ScanThread);
-    Fdo->ScanThread = NULL;
+    FdoScanStop(Fdo);
 
 fail2:
     Error("fail2\n");
@@ -1636,9 +1808,7 @@ FdoStopDevice(
     if (__FdoGetDevicePowerState(Fdo) == PowerDeviceD0)
         FdoD0ToD3(Fdo);
 
-    ThreadAlert(Fdo->ScanThread);
-    ThreadJoin(Fdo->ScanThread);
-    Fdo->ScanThread = NULL;
+    FdoScanStop(Fdo);
 
     RtlZeroMemory(&Fdo->ScanEvent, sizeof (KEVENT));
 
@@ -1738,9 +1908,9 @@ FdoRemoveDevice(
         goto done;
 
     KeClearEvent(&Fdo->ScanEvent);
-    ThreadWake(Fdo->ScanThread);
+    WorkWake(Fdo->ScanWork);
 
-    Trace("waiting for scan thread\n");
+    Trace("waiting for scan\n");
 
     (VOID) KeWaitForSingleObject(&Fdo->ScanEvent,
                                  Executive,
@@ -1775,9 +1945,7 @@ FdoRemoveDevice(
     if (__FdoGetDevicePowerState(Fdo) == PowerDeviceD0)
         FdoD0ToD3(Fdo);
 
-    ThreadAlert(Fdo->ScanThread);
-    ThreadJoin(Fdo->ScanThread);
-    Fdo->ScanThread = NULL;
+    FdoScanStop(Fdo);
 
     RtlZeroMemory(&Fdo->ScanEvent, sizeof (KEVENT));
 
@@ -1832,9 +2000,9 @@ FdoQueryDeviceRelations(
     }
 
     KeClearEvent(&Fdo->ScanEvent);
-    ThreadWake(Fdo->ScanThread);
+    WorkWake(Fdo->ScanWork);
 
-    Trace("waiting for scan thread\n");
+    Trace("waiting for scan\n");
 
     (VOID) KeWaitForSingleObject(&Fdo->ScanEvent,
                                  Executive,
@@ -2665,118 +2833,78 @@ done:
     return status;
 }
 
-static NTSTATUS
+static VOID
 FdoDevicePower(
-    IN  PXENVKBD_THREAD Self,
+    IN  PXENVKBD_WORK   Self,
     IN  PVOID           Context
     )
 {
     PXENVKBD_FDO        Fdo = Context;
-    PKEVENT             Event;
-
-    Event = ThreadGetEvent(Self);
-
-    for (;;) {
-        PIRP                Irp;
-        PIO_STACK_LOCATION  StackLocation;
-        UCHAR               MinorFunction;
-
-        if (Fdo->DevicePowerIrp == NULL) {
-            (VOID) KeWaitForSingleObject(Event,
-                                         Executive,
-                                         KernelMode,
-                                         FALSE,
-                                         NULL);
-            KeClearEvent(Event);
-        }
+    PIRP                Irp;
+    PIO_STACK_LOCATION  StackLocation;
 
-        if (ThreadIsAlerted(Self))
-            break;
+    UNREFERENCED_PARAMETER(Self);
 
-        Irp = Fdo->DevicePowerIrp;
+    Irp = Fdo->DevicePowerIrp;
 
-        if (Irp == NULL)
-            continue;
+    if (Irp == NULL)
+        return;
 
-        Fdo->DevicePowerIrp = NULL;
-        KeMemoryBarrier();
+    Fdo->DevicePowerIrp = NULL;
+    KeMemoryBarrier();
 
-        StackLocation = IoGetCurrentIrpStackLocation(Irp);
-        MinorFunction = StackLocation->MinorFunction;
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
 
-        switch (StackLocation->MinorFunction) {
-        case IRP_MN_SET_POWER:
-            (VOID) __FdoSetDevicePower(Fdo, Irp);
-            break;
+    switch (StackLocation->MinorFunction) {
+    case IRP_MN_SET_POWER:
+        (VOID) __FdoSetDevicePower(Fdo, Irp);
+        break;
 
-        case IRP_MN_QUERY_POWER:
-            (VOID) __FdoQueryDevicePower(Fdo, Irp);
-            break;
+    case IRP_MN_QUERY_POWER:
+        (VOID) __FdoQueryDevicePower(Fdo, Irp);
+        break;
 
-        default:
-            ASSERT(FALSE);
-            break;
-        }
+    default:
+        ASSERT(FALSE);
+        break;
     }
-
-    return STATUS_SUCCESS;
 }
 
-static NTSTATUS
+static VOID
 FdoSystemPower(
-    IN  PXENVKBD_THREAD Self,
+    IN  PXENVKBD_WORK   Self,
     IN  PVOID           Context
     )
 {
     PXENVKBD_FDO        Fdo = Context;
-    PKEVENT             Event;
-
-    Event = ThreadGetEvent(Self);
-
-    for (;;) {
-        PIRP                Irp;
-        PIO_STACK_LOCATION  StackLocation;
-        UCHAR               MinorFunction;
-
-        if (Fdo->SystemPowerIrp == NULL) {
-            (VOID) KeWaitForSingleObject(Event,
-                                         Executive,
-                                         KernelMode,
-                                         FALSE,
-                                         NULL);
-            KeClearEvent(Event);
-        }
+    PIRP                Irp;
+    PIO_STACK_LOCATION  StackLocation;
 
-        if (ThreadIsAlerted(Self))
-            break;
+    UNREFERENCED_PARAMETER(Self);
 
-        Irp = Fdo->SystemPowerIrp;
+    Irp = Fdo->SystemPowerIrp;
 
-        if (Irp == NULL)
-            continue;
+    if (Irp == NULL)
+        return;
 
-        Fdo->SystemPowerIrp = NULL;
-        KeMemoryBarrier();
+    Fdo->SystemPowerIrp = NULL;
+    KeMemoryBarrier();
 
-        StackLocation = IoGetCurrentIrpStackLocation(Irp);
-        MinorFunction = StackLocation->MinorFunction;
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
 
-        switch (StackLocation->MinorFunction) {
-        case IRP_MN_SET_POWER:
-            (VOID) __FdoSetSystemPower(Fdo, Irp);
-            break;
+    switch (StackLocation->MinorFunction) {
+    case IRP_MN_SET_POWER:
+        (VOID) __FdoSetSystemPower(Fdo, Irp);
+        break;
 
-        case IRP_MN_QUERY_POWER:
-            (VOID) __FdoQuerySystemPower(Fdo, Irp);
-            break;
+    case IRP_MN_QUERY_POWER:
+        (VOID) __FdoQuerySystemPower(Fdo, Irp);
+        break;
 
-        default:
-            ASSERT(FALSE);
-            break;
-        }
+    default:
+        ASSERT(FALSE);
+        break;
     }
-
-    return STATUS_SUCCESS;
 }
 
 static DECLSPEC_NOINLINE NTSTATUS
@@ -2820,7 +2948,7 @@ FdoDispatchPower(
         Fdo->DevicePowerIrp = Irp;
         KeMemoryBarrier();
 
-        ThreadWake(Fdo->DevicePowerThread);
+        WorkWake(Fdo->DevicePowerWork);
 
         status = STATUS_PENDING;
         break;
@@ -2832,7 +2960,7 @@ FdoDispatchPower(
         Fdo->SystemPowerIrp = Irp;
         KeMemoryBarrier();
 
-        ThreadWake(Fdo->SystemPowerThread);
+        WorkWake(Fdo->SystemPowerWork);
 
         status = STATUS_PENDING;
         break;
@@ -3036,11 +3164,17 @@ FdoCreate(
     Fdo->LowerDeviceObject = IoAttachDeviceToDeviceStack(FunctionDeviceObject,
                                                          PhysicalDeviceObject);
 
-    status = ThreadCreate(FdoSystemPower, Fdo, &Fdo->SystemPowerThread);
+    status = WorkCreate(FdoSystemPower,
+                        Fdo,
+                        WORK_CLASS_WAITING,
+                        &Fdo->SystemPowerWork);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    status = ThreadCreate(FdoDevicePower, Fdo, &Fdo->DevicePowerThread);
+    status = WorkCreate(FdoDevicePower,
+                        Fdo,
+                        WORK_CLASS_WAITING,
+                        &Fdo->DevicePowerWork);
     if (!NT_SUCCESS(status))
         goto fail4;
 
@@ -3184,16 +3318,16 @@ fail6:
 fail5:
     Error("fail5\n");
 
-    ThreadAlert(Fdo->DevicePowerThread);
-    ThreadJoin(Fdo->DevicePowerThread);
-    Fdo->DevicePowerThread = NULL;
+    WorkAlert(Fdo->DevicePowerWork);
+    WorkJoin(Fdo->DevicePowerWork);
+    Fdo->DevicePowerWork = NULL;
     
 fail4:
     Error("fail4\n");
 
-    ThreadAlert(Fdo->SystemPowerThread);
-    ThreadJoin(Fdo->SystemPowerThread);
-    Fdo->SystemPowerThread = NULL;
+    WorkAlert(Fdo->SystemPowerWork);
+    WorkJoin(Fdo->SystemPowerWork);
+    Fdo->SystemPowerWork = NULL;
     
 fail3:
     Error("fail3\n");
@@ -3266,13 +3400,13 @@ FdoDestroy(
 
     __FdoReleaseLowerBusInterface(Fdo);
 
-    ThreadAlert(Fdo->DevicePowerThread);
-    ThreadJoin(Fdo->DevicePowerThread);
-    Fdo->DevicePowerThread = NULL;
+    WorkAlert(Fdo->DevicePowerWork);
+    WorkJoin(Fdo->DevicePowerWork);
+    Fdo->DevicePowerWork = NULL;
 
-    ThreadAlert(Fdo->SystemPowerThread);
-    ThreadJoin(Fdo->SystemPowerThread);
-    Fdo->SystemPowerThread = NULL;
+    WorkAlert(Fdo->SystemPowerWork);
+    WorkJoin(Fdo->SystemPowerWork);
+    Fdo->SystemPowerWork = NULL;
 
     IoDetachDevice(Fdo->LowerDeviceObject);
 
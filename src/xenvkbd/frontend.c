@@ -44,32 +44,69 @@
 #include "frontend.h"
 #include "names.h"
 #include "ring.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
 #define DOMID_INVALID   (0x7FF4U)
 
+typedef enum _XENVKBD_FRONTEND_OPERATION {
+    FRONTEND_OPERATION_NONE = 0,
+    FRONTEND_OPERATION_CLOSE,
+    FRONTEND_OPERATION_PREPARE,
+    FRONTEND_OPERATION_CONNECT
+} XENVKBD_FRONTEND_OPERATION, *PXENVKBD_FRONTEND_OPERATION;
+
 struct _XENVKBD_FRONTEND {
     PXENVKBD_PDO                Pdo;
     PCHAR                       Path;
     XENVKBD_FRONTEND_STATE      State;
     BOOLEAN                     Online;
+    BOOLEAN                     Preserve;
     KSPIN_LOCK                  Lock;
-    PXENVKBD_THREAD             EjectThread;
+    PXENVKBD_WORK               EjectWork;
     KEVENT                      EjectEvent;
 
+    XENVKBD_FRONTEND_STATE      Target;
+    XENVKBD_FRONTEND_OPERATION  Operation;
+    ULONG                       Phase;
+    ULONG                       Mask;
+    XenbusState                 BackendState;
+    LARGE_INTEGER               WaitStart;
+    NTSTATUS                    Failure;
+    PXENVKBD_WORK               StateWork;
+    KTIMER                      PollTimer;
+    KDPC                        PollDpc;
+    KEVENT                      StateEvent;
+    NTSTATUS                    Result;
+    PXENBUS_STORE_WATCH         StateWatch;
+
     PCHAR                       BackendPath;
     USHORT                      BackendDomain;
 
     PXENVKBD_RING               Ring;
 
+    XENBUS_DEBUG_INTERFACE      DebugInterface;
     XENBUS_SUSPEND_INTERFACE    SuspendInterface;
     XENBUS_STORE_INTERFACE      StoreInterface;
 
+    PXENBUS_DEBUG_CALLBACK      DebugCallback;
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackEarly;
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackLate;
     PXENBUS_STORE_WATCH         Watch;
+
+    ULONGLONG                   Timing[FRONTEND_TIMING_COUNT];
+    ULONGLONG                   OperationStart;
+    ULONGLONG                   ConnectStart;
+    ULONGLONG                   ConnectTime;
+    ULONGLONG                   RunStart;
+    ULONGLONG                   CpuTime;
+    ULONGLONG                   ConnectCpu;
+    ULONG                       Connects;
+    ULONG                       StoreCount;
+    ULONGLONG                   StoreTime;
+    ULONGLONG                   StoreMax;
 };
 
 static const PCHAR
@@ -103,7 +140,7 @@ __FrontendAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, FRONTEND_POOL);
+    return PoolAllocate(FRONTEND_POOL, Length);
 }
 
 static FORCEINLINE VOID
@@ -111,7 +148,7 @@ __FrontendFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, FRONTEND_POOL);
+    PoolFree(Buffer, FRONTEND_POOL);
 }
 
 static FORCEINLINE PXENVKBD_PDO
@@ -184,7 +221,7 @@ __FrontendGet ## _Function(                             \
     IN  PXENVKBD_FRONTEND   Frontend                    \
     )                                                   \
 {                                                       \
-    return Frontend-> ## _Function;                     \
+    return Frontend->_Function;                         \
 }                                                       \
                                                         \
 _Type                                                   \
@@ -192,11 +229,45 @@ FrontendGet ## _Function(                               \
     IN  PXENVKBD_FRONTEND   Frontend                    \
     )                                                   \
 {                                                       \
-    return __FrontendGet ## _Function ## (Frontend);    \
+    return __FrontendGet ## _Function(Frontend);        \
 }
 
 DEFINE_FRONTEND_GET_FUNCTION(Ring, PXENVKBD_RING)
 
+ULONG
+FrontendGetSuspendCount(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    return XENBUS_SUSPEND(GetCount, &Frontend->SuspendInterface);
+}
+
+VOID
+FrontendAccountTime(
+    IN  PXENVKBD_FRONTEND       Frontend,
+    IN  XENVKBD_FRONTEND_TIMING Timing,
+    IN  ULONGLONG               Start
+    )
+{
+    ASSERT3U(Timing, <, FRONTEND_TIMING_COUNT);
+    Frontend->Timing[Timing] = __GetTimeUs() - Start;
+}
+
+VOID
+FrontendAccountStore(
+    IN  PXENVKBD_FRONTEND   Frontend,
+    IN  ULONGLONG           Start
+    )
+{
+    ULONGLONG               Delta = __GetTimeUs() - Start;
+
+    Frontend->StoreCount++;
+    Frontend->StoreTime += Delta;
+
+    if (Delta > Frontend->StoreMax)
+        Frontend->StoreMax = Delta;
+}
+
 static BOOLEAN
 FrontendIsOnline(
     IN  PXENVKBD_FRONTEND   Frontend
@@ -212,14 +283,17 @@ FrontendIsBackendOnline(
 {
     PCHAR                   Buffer;
     BOOLEAN                 Online;
+    ULONGLONG               Start;
     NTSTATUS                status;
 
+    Start = __GetTimeUs();
     status = XENBUS_STORE(Read,
                           &Frontend->StoreInterface,
                           NULL,
                           __FrontendGetBackendPath(Frontend),
                           "online",
                           &Buffer);
+    FrontendAccountStore(Frontend, Start);
     if (!NT_SUCCESS(status)) {
         Online = FALSE;
     } else {
@@ -233,56 +307,34 @@ FrontendIsBackendOnline(
     return Online;
 }
 
-static DECLSPEC_NOINLINE NTSTATUS
+static DECLSPEC_NOINLINE VOID
 FrontendEject(
-    IN  PXENVKBD_THREAD Self,
+    IN  PXENVKBD_WORK   Self,
     IN  PVOID           Context
     )
 {
-    PXENVKBD_FRONTEND    Frontend = Context;
-    PKEVENT             Event;
-
-    Trace("%s: ====>\n", __FrontendGetPath(Frontend));
+    PXENVKBD_FRONTEND   Frontend = Context;
+    KIRQL               Irql;
 
-    Event = ThreadGetEvent(Self);
+    UNREFERENCED_PARAMETER(Self);
 
-    for (;;) {
-        KIRQL       Irql;
-
-        KeWaitForSingleObject(Event,
-                              Executive,
-                              KernelMode,
-                              FALSE,
-                              NULL);
-        KeClearEvent(Event);
-
-        if (ThreadIsAlerted(Self))
-            break;
-
-        KeAcquireSpinLock(&Frontend->Lock, &Irql);
-
-        // It is not safe to use interfaces before this point
-        if (Frontend->State == FRONTEND_UNKNOWN ||
-            Frontend->State == FRONTEND_CLOSED)
-            goto loop;
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
 
-        if (!FrontendIsOnline(Frontend))
-            goto loop;
+    // It is not safe to use interfaces before this point
+    if (Frontend->State == FRONTEND_UNKNOWN ||
+        Frontend->State == FRONTEND_CLOSED)
+        goto done;
 
-        if (!FrontendIsBackendOnline(Frontend))
-            PdoRequestEject(__FrontendGetPdo(Frontend));
+    if (!FrontendIsOnline(Frontend))
+        goto done;
 
-loop:
-        KeReleaseSpinLock(&Frontend->Lock, Irql);
+    if (!FrontendIsBackendOnline(Frontend))
+        PdoRequestEject(__FrontendGetPdo(Frontend));
 
-        KeSetEvent(&Frontend->EjectEvent, IO_NO_INCREMENT, FALSE);
-    }
+done:
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
 
     KeSetEvent(&Frontend->EjectEvent, IO_NO_INCREMENT, FALSE);
-
-    Trace("%s: <====\n", __FrontendGetPath(Frontend));
-
-    return STATUS_SUCCESS;
 }
 
 VOID
@@ -368,6 +420,7 @@ FrontendSetXenbusState(
     )
 {
     BOOLEAN                 Online;
+    ULONGLONG               Start;
 
     Trace("%s: ====> %s\n",
           __FrontendGetPath(Frontend),
@@ -377,6 +430,7 @@ FrontendSetXenbusState(
 
     Online = FrontendIsBackendOnline(Frontend);
 
+    Start = __GetTimeUs();
     (VOID) XENBUS_STORE(Printf,
                         &Frontend->StoreInterface,
                         NULL,
@@ -384,6 +438,7 @@ FrontendSetXenbusState(
                         "state",
                         "%u",
                         State);
+    FrontendAccountStore(Frontend, Start);
 
     if (State == XenbusStateClosed && !Online)
         FrontendSetOffline(Frontend);
@@ -393,6 +448,39 @@ FrontendSetXenbusState(
           XenbusStateName(State));
 }
 
+static VOID
+FrontendReadBackendXenbusState(
+    IN  PXENVKBD_FRONTEND   Frontend,
+    OUT XenbusState         *State
+    )
+{
+    PCHAR                   Buffer;
+    ULONGLONG               Start;
+    NTSTATUS                status;
+
+    Start = __GetTimeUs();
+    status = XENBUS_STORE(Read,
+                          &Frontend->StoreInterface,
+                          NULL,
+                          __FrontendGetBackendPath(Frontend),
+                          "state",
+                          &Buffer);
+    FrontendAccountStore(Frontend, Start);
+    if (!NT_SUCCESS(status)) {
+        *State = XenbusStateUnknown;
+    } else {
+        *State = (XenbusState)strtol(Buffer, NULL, 10);
+
+        XENBUS_STORE(Free,
+                     &Frontend->StoreInterface,
+                     Buffer);
+    }
+}
+
+#define FRONTEND_BACKEND_TIMEOUT    120000  // ms
+
+// Only used where DISPATCH_LEVEL is mandatory (i.e. from the suspend
+// callbacks). Everything else waits in FrontendWorker.
 static VOID
 FrontendWaitForBackendXenbusStateChange(
     IN      PXENVKBD_FRONTEND   Frontend,
@@ -429,8 +517,7 @@ FrontendWaitForBackendXenbusStateChange(
 
     Timeout.QuadPart = 0;
 
-    while (*State == Old && TimeDelta < 120000) {
-        PCHAR           Buffer;
+    while (*State == Old && TimeDelta < FRONTEND_BACKEND_TIMEOUT) {
         LARGE_INTEGER   Now;
 
         if (Watch != NULL) {
@@ -456,21 +543,7 @@ FrontendWaitForBackendXenbusStateChange(
             KeClearEvent(&Event);
         }
 
-        status = XENBUS_STORE(Read,
-                              &Frontend->StoreInterface,
-                              NULL,
-                              __FrontendGetBackendPath(Frontend),
-                              "state",
-                              &Buffer);
-        if (!NT_SUCCESS(status)) {
-            *State = XenbusStateUnknown;
-        } else {
-            *State = (XenbusState)strtol(Buffer, NULL, 10);
-
-            XENBUS_STORE(Free,
-                         &Frontend->StoreInterface,
-                         Buffer);
-        }
+        FrontendReadBackendXenbusState(Frontend, State);
 
         KeQuerySystemTime(&Now);
 
@@ -494,14 +567,17 @@ FrontendUpdatePath(
 {
     ULONG                   Length;
     PCHAR                   Buffer;
+    ULONGLONG               Start;
     NTSTATUS                status;
 
+    Start = __GetTimeUs();
     status = XENBUS_STORE(Read,
                           &Frontend->StoreInterface,
                           NULL,
                           Frontend->Path,
                           "backend-id",
                           &Buffer);
+    FrontendAccountStore(Frontend, Start);
     if (NT_SUCCESS(status)) {
         Frontend->BackendDomain = (USHORT)strtoul(Buffer, NULL, 10);
 
@@ -512,12 +588,14 @@ FrontendUpdatePath(
         Frontend->BackendDomain = 0;
     }
 
+    Start = __GetTimeUs();
     status = XENBUS_STORE(Read,
                           &Frontend->StoreInterface,
                           NULL,
                           Frontend->Path,
                           "backend",
                           &Buffer);
+    FrontendAccountStore(Frontend, Start);
     if (!NT_SUCCESS(status))
         goto fail1;
 
@@ -553,66 +631,167 @@ fail1:
     return status;
 }
 
+#define XENBUS_STATE_MASK(_State)   (1ul << (_State))
+
 static NTSTATUS
-FrontendClose(
+__FrontendWaitForBackend(
+    IN  PXENVKBD_FRONTEND   Frontend,
+    IN  ULONG               Phase,
+    IN  ULONG               Mask
+    )
+{
+    ULONGLONG               Start;
+    NTSTATUS                status;
+
+    ASSERT3P(Frontend->StateWatch, ==, NULL);
+
+    Frontend->Phase = Phase;
+    Frontend->Mask = Mask;
+    KeQuerySystemTime(&Frontend->WaitStart);
+
+    // If the watch cannot be added FrontendWorker falls back to
+    // periodically re-reading the backend state
+    Start = __GetTimeUs();
+    status = XENBUS_STORE(WatchAdd,
+                          &Frontend->StoreInterface,
+                          __FrontendGetBackendPath(Frontend),
+                          "state",
+                          WorkGetEvent(Frontend->StateWork),
+                          &Frontend->StateWatch);
+    FrontendAccountStore(Frontend, Start);
+    if (!NT_SUCCESS(status))
+        Frontend->StateWatch = NULL;
+
+    return STATUS_PENDING;
+}
+
+static VOID
+__FrontendStopWaiting(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    if (Frontend->StateWatch != NULL) {
+        ULONGLONG   Start = __GetTimeUs();
+
+        (VOID) XENBUS_STORE(WatchRemove,
+                            &Frontend->StoreInterface,
+                            Frontend->StateWatch);
+        FrontendAccountStore(Frontend, Start);
+    }
+    Frontend->StateWatch = NULL;
+
+    Frontend->Mask = 0;
+    RtlZeroMemory(&Frontend->WaitStart, sizeof (LARGE_INTEGER));
+}
+
+static NTSTATUS
+__FrontendCheckBackend(
     IN  PXENVKBD_FRONTEND   Frontend
     )
 {
+    XenbusState             Old = Frontend->BackendState;
     XenbusState             State;
     NTSTATUS                status;
 
-    Trace("=====>\n");
-    if (Frontend->Watch)
-        XENBUS_STORE(WatchRemove,
-                     &Frontend->StoreInterface,
-                     Frontend->Watch);
-    Frontend->Watch = NULL;
+    FrontendReadBackendXenbusState(Frontend, &State);
+    Frontend->BackendState = State;
 
-    status = FrontendUpdatePath(Frontend);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+    if (State == XenbusStateUnknown) {
+        LARGE_INTEGER   Now;
+        ULONGLONG       TimeDelta;
 
-    State = XenbusStateUnknown;
-    do {
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-        if (State == XenbusStateUnknown)
-            goto fail2;
-    } while (State == XenbusStateInitialising);
+        KeQuerySystemTime(&Now);
+        TimeDelta = (Now.QuadPart - Frontend->WaitStart.QuadPart) / 10000ull;
 
-    FrontendSetXenbusState(Frontend, XenbusStateClosing);
+        // An unknown state is only tolerated while the backend has yet
+        // to show up, and only for so long
+        status = STATUS_UNSUCCESSFUL;
+        if (Old != XenbusStateUnknown ||
+            TimeDelta >= FRONTEND_BACKEND_TIMEOUT)
+            goto fail1;
 
-    status = STATUS_UNSUCCESSFUL;
-    do {
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-        if (State == XenbusStateUnknown)
-            goto fail3;
-    } while (State != XenbusStateClosing &&
-             State != XenbusStateClosed);
+        return STATUS_PENDING;
+    }
 
-    FrontendSetXenbusState(Frontend, XenbusStateClosed);
+    if (!(Frontend->Mask & XENBUS_STATE_MASK(State)))
+        return STATUS_PENDING;
 
-    do {
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-        if (State == XenbusStateUnknown)
-            goto fail4;
-    } while (State != XenbusStateClosed);
+    Trace("%s: %s\n",
+          __FrontendGetBackendPath(Frontend),
+          XenbusStateName(State));
+
+    __FrontendStopWaiting(Frontend);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 %08x\n", status);
+
+    __FrontendStopWaiting(Frontend);
+
+    return status;
+}
+
+static NTSTATUS
+FrontendClose(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    ULONGLONG               Start;
+    NTSTATUS                status;
+
+    Trace("=====> %u\n", Frontend->Phase);
+
+    switch (Frontend->Phase) {
+    case 0:
+        if (Frontend->Watch) {
+            Start = __GetTimeUs();
+            XENBUS_STORE(WatchRemove,
+                         &Frontend->StoreInterface,
+                         Frontend->Watch);
+            FrontendAccountStore(Frontend, Start);
+        }
+        Frontend->Watch = NULL;
 
-    __FrontendFree(Frontend->BackendPath);
-    Frontend->BackendPath = NULL;
-    Frontend->BackendDomain = DOMID_INVALID;
+        status = FrontendUpdatePath(Frontend);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        Frontend->BackendState = XenbusStateUnknown;
+
+        return __FrontendWaitForBackend(Frontend,
+                                        1,
+                                        ~XENBUS_STATE_MASK(XenbusStateInitialising));
+
+    case 1:
+        FrontendSetXenbusState(Frontend, XenbusStateClosing);
+
+        return __FrontendWaitForBackend(Frontend,
+                                        2,
+                                        XENBUS_STATE_MASK(XenbusStateClosing) |
+                                        XENBUS_STATE_MASK(XenbusStateClosed));
+
+    case 2:
+        FrontendSetXenbusState(Frontend, XenbusStateClosed);
+
+        return __FrontendWaitForBackend(Frontend,
+                                        3,
+                                        XENBUS_STATE_MASK(XenbusStateClosed));
+
+    case 3:
+        __FrontendFree(Frontend->BackendPath);
+        Frontend->BackendPath = NULL;
+        Frontend->BackendDomain = DOMID_INVALID;
+        break;
+
+    default:
+        ASSERT(FALSE);
+        break;
+    }
 
     Trace("<=====\n");
     return STATUS_SUCCESS;
 
-fail4:
-    Error("fail4\n");
-fail3:
-    Error("fail3\n");
-fail2:
-    Error("fail2\n");
 fail1:
     Error("fail1 %08x\n", status);
     return status;
@@ -623,43 +802,45 @@ FrontendPrepare(
     IN  PXENVKBD_FRONTEND   Frontend
     )
 {
-    XenbusState             State;
+    ULONGLONG               Start;
     NTSTATUS                status;
 
-    Trace("=====>\n");
+    Trace("=====> %u\n", Frontend->Phase);
 
-    status = FrontendUpdatePath(Frontend);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+    switch (Frontend->Phase) {
+    case 0:
+        status = FrontendUpdatePath(Frontend);
+        if (!NT_SUCCESS(status))
+            goto fail1;
 
-    status = XENBUS_STORE(WatchAdd,
-                          &Frontend->StoreInterface,
-                          NULL,
-                          Frontend->BackendPath,
-                          ThreadGetEvent(Frontend->EjectThread),
-                          &Frontend->Watch);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+        Start = __GetTimeUs();
+        status = XENBUS_STORE(WatchAdd,
+                              &Frontend->StoreInterface,
+                              NULL,
+                              Frontend->BackendPath,
+                              WorkGetEvent(Frontend->EjectWork),
+                              &Frontend->Watch);
+        FrontendAccountStore(Frontend, Start);
+        if (!NT_SUCCESS(status))
+            goto fail2;
 
-    FrontendSetXenbusState(Frontend, XenbusStateInitialising);
+        FrontendSetXenbusState(Frontend, XenbusStateInitialising);
 
-    status = STATUS_UNSUCCESSFUL;
-    do {
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-        if (State == XenbusStateUnknown)
-            goto fail3;
-    } while (State != XenbusStateInitWait);
+        return __FrontendWaitForBackend(Frontend,
+                                        1,
+                                        XENBUS_STATE_MASK(XenbusStateInitWait));
+
+    case 1:
+        break;
+
+    default:
+        ASSERT(FALSE);
+        break;
+    }
 
     Trace("<=====\n");
     return STATUS_SUCCESS;
 
-fail3:
-    Error("fail3\n");
-    XENBUS_STORE(WatchRemove,
-                 &Frontend->StoreInterface,
-                 Frontend->Watch);
-    Frontend->Watch = NULL;
 fail2:
     Error("fail2\n");
 fail1:
@@ -672,73 +853,92 @@ FrontendConnect(
     IN  PXENVKBD_FRONTEND   Frontend
     )
 {
-    XenbusState             State;
+    ULONGLONG               Start;
     NTSTATUS                status;
 
-    Trace("=====>\n");
+    Trace("=====> %u\n", Frontend->Phase);
 
-    status = RingConnect(Frontend->Ring);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+    switch (Frontend->Phase) {
+    case 0:
+        status = RingConnect(Frontend->Ring);
+        if (!NT_SUCCESS(status))
+            goto fail1;
 
-    for (;;) {
-        PXENBUS_STORE_TRANSACTION   Transaction;
+        for (;;) {
+            PXENBUS_STORE_TRANSACTION   Transaction;
 
-        status = XENBUS_STORE(TransactionStart,
-                              &Frontend->StoreInterface,
-                              &Transaction);
-        if (!NT_SUCCESS(status))
+            Start = __GetTimeUs();
+            status = XENBUS_STORE(TransactionStart,
+                                  &Frontend->StoreInterface,
+                                  &Transaction);
+            FrontendAccountStore(Frontend, Start);
+            if (!NT_SUCCESS(status))
+                break;
+
+            status = RingStoreWrite(Frontend->Ring,
+                                    Transaction);
+            if (!NT_SUCCESS(status))
+                goto abort;
+
+            Start = __GetTimeUs();
+            status = XENBUS_STORE(TransactionEnd,
+                                  &Frontend->StoreInterface,
+                                  Transaction,
+                                  TRUE);
+            FrontendAccountStore(Frontend, Start);
+            if (status == STATUS_RETRY)
+                continue;
+
+            if (NT_SUCCESS(status))
+                RingStoreCommit(Frontend->Ring);
             break;
 
-        status = RingStoreWrite(Frontend->Ring,
-                                Transaction);
+abort:
+            Start = __GetTimeUs();
+            (VOID) XENBUS_STORE(TransactionEnd,
+                                &Frontend->StoreInterface,
+                                Transaction,
+                                FALSE);
+            FrontendAccountStore(Frontend, Start);
+            break;
+        }
         if (!NT_SUCCESS(status))
-            goto abort;
-
-        status = XENBUS_STORE(TransactionEnd,
-                              &Frontend->StoreInterface,
-                              Transaction,
-                              TRUE);
-        if (status == STATUS_RETRY)
-            continue;
-        break;
+            goto fail2;
 
-abort:
-        (VOID) XENBUS_STORE(TransactionEnd,
-                            &Frontend->StoreInterface,
-                            Transaction,
-                            FALSE);
-        break;
-    }
-    if (!NT_SUCCESS(status))
-        goto fail2;
+        FrontendSetXenbusState(Frontend, XenbusStateInitialised);
 
-    FrontendSetXenbusState(Frontend, XenbusStateInitialised);
+        return __FrontendWaitForBackend(Frontend,
+                                        1,
+                                        ~(XENBUS_STATE_MASK(XenbusStateInitWait) |
+                                          XENBUS_STATE_MASK(XenbusStateInitialising) |
+                                          XENBUS_STATE_MASK(XenbusStateInitialised)));
 
-    status = STATUS_UNSUCCESSFUL;
-    do {
-        FrontendWaitForBackendXenbusStateChange(Frontend,
-                                                &State);
-        if (State == XenbusStateUnknown)
+    case 1:
+        // The ring is torn down by __FrontendComplete()
+        status = STATUS_UNSUCCESSFUL;
+        if (Frontend->BackendState != XenbusStateConnected)
             goto fail3;
-    } while (State == XenbusStateInitWait ||
-             State == XenbusStateInitialising ||
-             State == XenbusStateInitialised);
 
-    if (State != XenbusStateConnected)
-        goto fail4;
+        FrontendSetXenbusState(Frontend, XenbusStateConnected);
+        break;
 
-    FrontendSetXenbusState(Frontend, XenbusStateConnected);
+    default:
+        ASSERT(FALSE);
+        break;
+    }
 
     Trace("<=====\n");
     return STATUS_SUCCESS;
 
-fail4:
-    Error("fail4\n");
 fail3:
     Error("fail3\n");
+    return status;
+
 fail2:
     Error("fail2\n");
+
+    RingDisconnect(Frontend->Ring);
+
 fail1:
     Error("fail1 %08x\n", status);
     return status;
@@ -751,7 +951,10 @@ FrontendDisconnect(
 {
     Trace("====>\n");
 
-    RingDisconnect(__FrontendGetRing(Frontend));
+    if (Frontend->Preserve)
+        RingPark(__FrontendGetRing(Frontend));
+    else
+        RingDisconnect(__FrontendGetRing(Frontend));
 
     Trace("<====\n");
 }
@@ -790,154 +993,524 @@ FrontendDisable(
     Trace("<====\n");
 }
 
-NTSTATUS
-FrontendSetState(
-    IN  PXENVKBD_FRONTEND       Frontend,
-    IN  XENVKBD_FRONTEND_STATE  State
+static NTSTATUS
+__FrontendContinue(
+    IN  PXENVKBD_FRONTEND   Frontend
     )
 {
-    NTSTATUS                    status;
-    KIRQL                       Irql;
-
-    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    switch (Frontend->Operation) {
+    case FRONTEND_OPERATION_CLOSE:
+        return FrontendClose(Frontend);
+    case FRONTEND_OPERATION_PREPARE:
+        return FrontendPrepare(Frontend);
+    case FRONTEND_OPERATION_CONNECT:
+        return FrontendConnect(Frontend);
+    default:
+        ASSERT(FALSE);
+        return STATUS_UNSUCCESSFUL;
+    }
+}
 
-    Info("%s: ====> '%s' -> '%s'\n",
-         __FrontendGetPath(Frontend),
-         FrontendStateName(Frontend->State),
-         FrontendStateName(State));
+static NTSTATUS
+__FrontendStart(
+    IN  PXENVKBD_FRONTEND           Frontend,
+    IN  XENVKBD_FRONTEND_OPERATION  Operation
+    );
 
-    status = STATUS_SUCCESS;
-    while (Frontend->State != State && NT_SUCCESS(status)) {
-        switch (Frontend->State) {
-        case FRONTEND_UNKNOWN:
-            switch (State) {
-            case FRONTEND_CLOSING:
-            case FRONTEND_CLOSED:
-            case FRONTEND_PREPARED:
-            case FRONTEND_CONNECTED:
-            case FRONTEND_ENABLED:
-                status = FrontendClose(Frontend);
-                if (NT_SUCCESS(status)) {
-                    Frontend->State = FRONTEND_CLOSED;
-                }
-                break;
+static NTSTATUS
+__FrontendComplete(
+    IN  PXENVKBD_FRONTEND   Frontend,
+    IN  NTSTATUS            status
+    )
+{
+    XENVKBD_FRONTEND_OPERATION  Operation;
+    ULONG                       Phase;
+
+    if (status == STATUS_PENDING)
+        return status;
+
+    Operation = Frontend->Operation;
+    Phase = Frontend->Phase;
+
+    Frontend->Operation = FRONTEND_OPERATION_NONE;
+    Frontend->Phase = 0;
+
+    FrontendAccountTime(Frontend,
+                        (Operation == FRONTEND_OPERATION_CLOSE) ? FRONTEND_TIMING_CLOSE :
+                        (Operation == FRONTEND_OPERATION_PREPARE) ? FRONTEND_TIMING_PREPARE :
+                        FRONTEND_TIMING_CONNECT,
+                        Frontend->OperationStart);
+    Frontend->OperationStart = 0;
+
+    switch (Operation) {
+    case FRONTEND_OPERATION_CLOSE:
+        if (!NT_SUCCESS(Frontend->Failure)) {
+            // Clean-up after a failed prepare or connect
+            status = Frontend->Failure;
+            Frontend->Failure = STATUS_SUCCESS;
+
+            Frontend->State = FRONTEND_CLOSED;
+        } else if (Frontend->State == FRONTEND_CONNECTED) {
+            status = STATUS_SUCCESS;
+
+            Frontend->State = FRONTEND_CLOSING;
+        } else if (NT_SUCCESS(status)) {
+            Frontend->State = FRONTEND_CLOSED;
+        }
+        break;
 
-            default:
-                ASSERT(FALSE);
-                break;
-            }
+    case FRONTEND_OPERATION_PREPARE:
+        if (NT_SUCCESS(status)) {
+            Frontend->State = FRONTEND_PREPARED;
             break;
+        }
 
-        case FRONTEND_CLOSING:
-            switch (State) {
-            case FRONTEND_UNKNOWN:
-            case FRONTEND_CLOSED:
-            case FRONTEND_PREPARED:
-            case FRONTEND_CONNECTED:
-            case FRONTEND_ENABLED:
-                FrontendDisconnect(Frontend);
-                Frontend->State = FRONTEND_CLOSED;
-                break;
-            default:
-                ASSERT(FALSE);
-                break;
-            }
+        Frontend->Failure = status;
+        return __FrontendStart(Frontend, FRONTEND_OPERATION_CLOSE);
+
+    case FRONTEND_OPERATION_CONNECT:
+        if (NT_SUCCESS(status)) {
+            Frontend->State = FRONTEND_CONNECTED;
+
+            Frontend->ConnectTime = __GetTimeUs() - Frontend->ConnectStart;
+            Frontend->ConnectStart = 0;
+            Frontend->ConnectCpu = Frontend->CpuTime +
+                                   __GetTimeUs() - Frontend->RunStart;
+            Frontend->Connects++;
+
+            Info("%s: connected in %lluus (CPU %lluus) (PREPARE %llu CONNECT %llu STORE_WRITE %llu) STORE %u ops %lluus (max %lluus)\n",
+                 __FrontendGetPath(Frontend),
+                 Frontend->ConnectTime,
+                 Frontend->ConnectCpu,
+                 Frontend->Timing[FRONTEND_TIMING_PREPARE],
+                 Frontend->Timing[FRONTEND_TIMING_CONNECT],
+                 Frontend->Timing[FRONTEND_TIMING_STORE_WRITE],
+                 Frontend->StoreCount,
+                 Frontend->StoreTime,
+                 Frontend->StoreMax);
             break;
+        }
 
-        case FRONTEND_CLOSED:
-            switch (State) {
-            case FRONTEND_PREPARED:
-            case FRONTEND_CONNECTED:
-            case FRONTEND_ENABLED:
-                status = FrontendPrepare(Frontend);
-                if (NT_SUCCESS(status)) {
-                    Frontend->State = FRONTEND_PREPARED;
-                } else {
-                    FrontendClose(Frontend);
-                    Frontend->State = FRONTEND_CLOSED;
-                }
-                break;
-            case FRONTEND_UNKNOWN:
-                Frontend->State = FRONTEND_UNKNOWN;
-                break;
-            default:
-                ASSERT(FALSE);
-                break;
-            }
-            break;
+        if (Phase != 0)
+            FrontendDisconnect(Frontend);
 
-        case FRONTEND_PREPARED:
-            switch (State) {
-            case FRONTEND_CLOSING:
-            case FRONTEND_CLOSED:
-                status = FrontendClose(Frontend);
-                if (NT_SUCCESS(status))
-                    Frontend->State = FRONTEND_CLOSED;
-                break;
-            case FRONTEND_CONNECTED:
-            case FRONTEND_ENABLED:
-                status = FrontendConnect(Frontend);
-                if (NT_SUCCESS(status)) {
-                    Frontend->State = FRONTEND_CONNECTED;
-                } else {
-                    FrontendClose(Frontend);
-                    Frontend->State = FRONTEND_CLOSED;
-                }
-                break;
-            default:
-                ASSERT(FALSE);
-                break;
-            }
-            break;
+        Frontend->Failure = status;
+        return __FrontendStart(Frontend, FRONTEND_OPERATION_CLOSE);
 
-        case FRONTEND_CONNECTED:
-            switch (State) {
-            case FRONTEND_ENABLED:
-                FrontendEnable(Frontend);
-                Frontend->State = FRONTEND_ENABLED;
-                break;
-            case FRONTEND_CLOSING:
-            case FRONTEND_CLOSED:
-                FrontendClose(Frontend);
-                Frontend->State = FRONTEND_CLOSING;
-                break;
-            default:
-                ASSERT(FALSE);
-                break;
-            }
+    default:
+        ASSERT(FALSE);
+        break;
+    }
+
+    Info("%s in state '%s'\n",
+         __FrontendGetPath(Frontend),
+         FrontendStateName(Frontend->State));
+
+    return status;
+}
+
+static NTSTATUS
+__FrontendStart(
+    IN  PXENVKBD_FRONTEND           Frontend,
+    IN  XENVKBD_FRONTEND_OPERATION  Operation
+    )
+{
+    ASSERT3U(Frontend->Operation, ==, FRONTEND_OPERATION_NONE);
+
+    Frontend->Operation = Operation;
+    Frontend->Phase = 0;
+
+    Frontend->OperationStart = __GetTimeUs();
+
+    // Store accounting covers everything from here to CONNECTED
+    if (Operation == FRONTEND_OPERATION_PREPARE) {
+        Frontend->ConnectStart = Frontend->OperationStart;
+        Frontend->RunStart = Frontend->OperationStart;
+        Frontend->CpuTime = 0;
+        Frontend->StoreCount = 0;
+        Frontend->StoreTime = 0;
+        Frontend->StoreMax = 0;
+    }
+
+    return __FrontendComplete(Frontend, __FrontendContinue(Frontend));
+}
+
+static NTSTATUS
+__FrontendStep(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    XENVKBD_FRONTEND_STATE  State = Frontend->Target;
+    NTSTATUS                status;
+
+    if (Frontend->Operation != FRONTEND_OPERATION_NONE) {
+        status = __FrontendCheckBackend(Frontend);
+        if (status == STATUS_PENDING)
+            return status;
+
+        if (NT_SUCCESS(status))
+            status = __FrontendContinue(Frontend);
+
+        return __FrontendComplete(Frontend, status);
+    }
+
+    status = STATUS_SUCCESS;
+    switch (Frontend->State) {
+    case FRONTEND_UNKNOWN:
+        switch (State) {
+        case FRONTEND_CLOSING:
+        case FRONTEND_CLOSED:
+        case FRONTEND_PREPARED:
+        case FRONTEND_CONNECTED:
+        case FRONTEND_ENABLED:
+            status = __FrontendStart(Frontend, FRONTEND_OPERATION_CLOSE);
             break;
 
+        default:
+            ASSERT(FALSE);
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        break;
+
+    case FRONTEND_CLOSING:
+        switch (State) {
+        case FRONTEND_UNKNOWN:
+        case FRONTEND_CLOSED:
+        case FRONTEND_PREPARED:
+        case FRONTEND_CONNECTED:
         case FRONTEND_ENABLED:
-            switch (State) {
-            case FRONTEND_CLOSING:
-            case FRONTEND_CLOSED:
-            case FRONTEND_CONNECTED:
-                FrontendDisable(Frontend);
-                Frontend->State = FRONTEND_CONNECTED;
-                break;
-            default:
-                ASSERT(FALSE);
-                break;
-            }
+            FrontendDisconnect(Frontend);
+            Frontend->State = FRONTEND_CLOSED;
             break;
+        default:
+            ASSERT(FALSE);
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        break;
 
+    case FRONTEND_CLOSED:
+        switch (State) {
+        case FRONTEND_PREPARED:
+        case FRONTEND_CONNECTED:
+        case FRONTEND_ENABLED:
+            status = __FrontendStart(Frontend, FRONTEND_OPERATION_PREPARE);
+            break;
+        case FRONTEND_UNKNOWN:
+            // Drop anything left parked by a fast resume
+            if (!Frontend->Preserve)
+                RingDisconnect(__FrontendGetRing(Frontend));
+
+            Frontend->State = FRONTEND_UNKNOWN;
+            break;
         default:
             ASSERT(FALSE);
+            status = STATUS_INVALID_PARAMETER;
             break;
         }
+        break;
 
+    case FRONTEND_PREPARED:
+        switch (State) {
+        case FRONTEND_UNKNOWN:
+        case FRONTEND_CLOSING:
+        case FRONTEND_CLOSED:
+            status = __FrontendStart(Frontend, FRONTEND_OPERATION_CLOSE);
+            break;
+        case FRONTEND_CONNECTED:
+        case FRONTEND_ENABLED:
+            status = __FrontendStart(Frontend, FRONTEND_OPERATION_CONNECT);
+            break;
+        default:
+            ASSERT(FALSE);
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        break;
+
+    case FRONTEND_CONNECTED:
+        switch (State) {
+        case FRONTEND_ENABLED:
+            status = FrontendEnable(Frontend);
+            if (NT_SUCCESS(status))
+                Frontend->State = FRONTEND_ENABLED;
+            break;
+        case FRONTEND_UNKNOWN:
+        case FRONTEND_CLOSING:
+        case FRONTEND_CLOSED:
+            status = __FrontendStart(Frontend, FRONTEND_OPERATION_CLOSE);
+            break;
+        default:
+            ASSERT(FALSE);
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        break;
+
+    case FRONTEND_ENABLED:
+        switch (State) {
+        case FRONTEND_UNKNOWN:
+        case FRONTEND_CLOSING:
+        case FRONTEND_CLOSED:
+        case FRONTEND_CONNECTED:
+            FrontendDisable(Frontend);
+            Frontend->State = FRONTEND_CONNECTED;
+            break;
+        default:
+            ASSERT(FALSE);
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        break;
+
+    default:
+        ASSERT(FALSE);
+        status = STATUS_INVALID_PARAMETER;
+        break;
+    }
+
+    if (status != STATUS_PENDING)
         Info("%s in state '%s'\n",
              __FrontendGetPath(Frontend),
              FrontendStateName(Frontend->State));
+
+    return status;
+}
+
+static FORCEINLINE VOID
+__FrontendSetResult(
+    IN  PXENVKBD_FRONTEND   Frontend,
+    IN  NTSTATUS            status
+    )
+{
+    Frontend->Result = status;
+    KeSetEvent(&Frontend->StateEvent, IO_NO_INCREMENT, FALSE);
+}
+
+// Drive the state machine towards Target until it either gets there,
+// fails, or has to wait for the backend. Called with Lock held.
+//
+// Since this runs at DISPATCH_LEVEL and cannot be pre-empted, the time
+// spent in here is the CPU time that the state machine costs. (Store
+// requests spin on the store ring, so that is included too).
+static NTSTATUS
+__FrontendRun(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    Frontend->RunStart = __GetTimeUs();
+
+    status = STATUS_SUCCESS;
+    while (Frontend->Operation != FRONTEND_OPERATION_NONE ||
+           Frontend->State != Frontend->Target) {
+        status = __FrontendStep(Frontend);
+        if (status == STATUS_PENDING)
+            goto done;
+
+        if (!NT_SUCCESS(status)) {
+            Error("%s: giving up on '%s' in state '%s' (%08x)\n",
+                  __FrontendGetPath(Frontend),
+                  FrontendStateName(Frontend->Target),
+                  FrontendStateName(Frontend->State),
+                  status);
+
+            Frontend->Target = Frontend->State;
+            break;
+        }
+    }
+
+    __FrontendSetResult(Frontend, status);
+
+done:
+    Frontend->CpuTime += __GetTimeUs() - Frontend->RunStart;
+    Frontend->RunStart = 0;
+
+    return status;
+}
+
+static VOID
+__FrontendAbort(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    if (Frontend->Operation == FRONTEND_OPERATION_NONE)
+        return;
+
+    Warning("%s: aborting operation %u in state '%s'\n",
+            __FrontendGetPath(Frontend),
+            Frontend->Operation,
+            FrontendStateName(Frontend->State));
+
+    __FrontendStopWaiting(Frontend);
+
+    if (Frontend->Operation == FRONTEND_OPERATION_CONNECT &&
+        Frontend->Phase != 0)
+        FrontendDisconnect(Frontend);
+
+    Frontend->Operation = FRONTEND_OPERATION_NONE;
+    Frontend->Phase = 0;
+    Frontend->Failure = STATUS_SUCCESS;
+    Frontend->OperationStart = 0;
+    Frontend->ConnectStart = 0;
+}
+
+static FORCEINLINE VOID
+__FrontendSetTarget(
+    IN  PXENVKBD_FRONTEND       Frontend,
+    IN  XENVKBD_FRONTEND_STATE  State
+    )
+{
+    Frontend->Target = State;
+    Frontend->Result = STATUS_PENDING;
+    KeClearEvent(&Frontend->StateEvent);
+}
+
+// Run the state machine in-line, stall-polling for the backend. This is
+// only for contexts where DISPATCH_LEVEL is mandatory. Called with Lock held.
+static NTSTATUS
+__FrontendSetStateSynchronous(
+    IN  PXENVKBD_FRONTEND       Frontend,
+    IN  XENVKBD_FRONTEND_STATE  State
+    )
+{
+    XENVKBD_FRONTEND_STATE      Target = Frontend->Target;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    Info("%s: ====> '%s' -> '%s' (synchronous)\n",
+         __FrontendGetPath(Frontend),
+         FrontendStateName(Frontend->State),
+         FrontendStateName(State));
+
+    __FrontendAbort(Frontend);
+
+    Frontend->Target = State;
+
+    for (;;) {
+        XenbusState BackendState;
+
+        status = __FrontendRun(Frontend);
+        if (status != STATUS_PENDING)
+            break;
+
+        BackendState = Frontend->BackendState;
+        FrontendWaitForBackendXenbusStateChange(Frontend,
+                                                &BackendState);
+    }
+
+    // Leave anything further to the worker
+    __FrontendSetTarget(Frontend, Target);
+
+    Info("%s: <===== (%08x)\n", __FrontendGetPath(Frontend), status);
+
+    return status;
+}
+
+#define FRONTEND_WORKER_PERIOD  1000    // ms
+
+KDEFERRED_ROUTINE   FrontendPoll;
+
+VOID
+FrontendPoll(
+    IN  PKDPC       Dpc,
+    IN  PVOID       Context,
+    IN  PVOID       Argument1,
+    IN  PVOID       Argument2
+    )
+{
+    PXENVKBD_FRONTEND   Frontend = Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    WorkWake(Frontend->StateWork);
+}
+
+static DECLSPEC_NOINLINE VOID
+FrontendWorker(
+    IN  PXENVKBD_WORK   Self,
+    IN  PVOID           Context
+    )
+{
+    PXENVKBD_FRONTEND   Frontend = Context;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    UNREFERENCED_PARAMETER(Self);
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+
+    status = __FrontendRun(Frontend);
+
+    // Waiting on the backend is driven by the state watch, but
+    // re-check every so often in case the watch could not be added
+    // (or the backend never turns up)
+    if (status == STATUS_PENDING) {
+        LARGE_INTEGER   Timeout;
+
+        Timeout.QuadPart = -10000ll * FRONTEND_WORKER_PERIOD;
+        (VOID) KeSetTimer(&Frontend->PollTimer, Timeout, &Frontend->PollDpc);
     }
 
     KeReleaseSpinLock(&Frontend->Lock, Irql);
+}
 
-    Info("%s: <=====\n", __FrontendGetPath(Frontend));
+NTSTATUS
+FrontendWaitForState(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    Trace("waiting for worker\n");
+
+    (VOID) KeWaitForSingleObject(&Frontend->StateEvent,
+                                 Executive,
+                                 KernelMode,
+                                 FALSE,
+                                 NULL);
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+    status = Frontend->Result;
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
 
     return status;
 }
 
+VOID
+FrontendSetState(
+    IN  PXENVKBD_FRONTEND       Frontend,
+    IN  XENVKBD_FRONTEND_STATE  State
+    )
+{
+    KIRQL                       Irql;
+
+    KeAcquireSpinLock(&Frontend->Lock, &Irql);
+
+    Info("%s: ====> '%s' -> '%s'\n",
+         __FrontendGetPath(Frontend),
+         FrontendStateName(Frontend->State),
+         FrontendStateName(State));
+
+    __FrontendSetTarget(Frontend, State);
+
+    KeReleaseSpinLock(&Frontend->Lock, Irql);
+
+    WorkWake(Frontend->StateWork);
+
+    Info("%s: <=====\n", __FrontendGetPath(Frontend));
+}
+
 static FORCEINLINE VOID
 __FrontendResume(
     IN  PXENVKBD_FRONTEND   Frontend
@@ -945,8 +1518,14 @@ __FrontendResume(
 {
     ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
 
+    KeAcquireSpinLockAtDpcLevel(&Frontend->Lock);
+
     ASSERT3U(Frontend->State, ==, FRONTEND_UNKNOWN);
-    (VOID) FrontendSetState(Frontend, FRONTEND_CLOSED);
+    __FrontendSetTarget(Frontend, FRONTEND_CLOSED);
+
+    KeReleaseSpinLockFromDpcLevel(&Frontend->Lock);
+
+    WorkWake(Frontend->StateWork);
 }
 
 static FORCEINLINE VOID
@@ -954,9 +1533,17 @@ __FrontendSuspend(
     IN  PXENVKBD_FRONTEND   Frontend
     )
 {
+    NTSTATUS                status;
+
     ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
 
-    (VOID) FrontendSetState(Frontend, FRONTEND_UNKNOWN);
+    KeAcquireSpinLockAtDpcLevel(&Frontend->Lock);
+
+    status = __FrontendSetStateSynchronous(Frontend, FRONTEND_UNKNOWN);
+    __FrontendSetTarget(Frontend, FRONTEND_UNKNOWN);
+    __FrontendSetResult(Frontend, status);
+
+    KeReleaseSpinLockFromDpcLevel(&Frontend->Lock);
 }
 
 static DECLSPEC_NOINLINE VOID
@@ -975,9 +1562,108 @@ FrontendSuspendCallbackLate(
     )
 {
     PXENVKBD_FRONTEND   Frontend = Argument;
+    BOOLEAN             Pending;
+    NTSTATUS            status;
 
-    __FrontendSuspend(Frontend);
-    __FrontendResume(Frontend);
+    KeAcquireSpinLockAtDpcLevel(&Frontend->Lock);
+
+    // Only the grant and event channel belong to the old host, so park
+    // the ring rather than freeing it and let the worker reconnect it.
+    Frontend->Preserve = TRUE;
+
+    (VOID) __FrontendSetStateSynchronous(Frontend, FRONTEND_UNKNOWN);
+    status = __FrontendSetStateSynchronous(Frontend, FRONTEND_CLOSED);
+
+    Frontend->Preserve = FALSE;
+
+    Pending = (Frontend->State != Frontend->Target) ? TRUE : FALSE;
+    if (!Pending)
+        __FrontendSetResult(Frontend, status);
+
+    KeReleaseSpinLockFromDpcLevel(&Frontend->Lock);
+
+    if (Pending)
+        WorkWake(Frontend->StateWork);
+}
+
+// Non-paged bytes held on behalf of this device
+static VOID
+FrontendDebugFootprint(
+    IN  PXENVKBD_FRONTEND   Frontend
+    )
+{
+    PXENVKBD_PDO            Pdo = __FrontendGetPdo(Frontend);
+    ULONG                   Self;
+    ULONG                   Ring;
+    ULONG                   Hid;
+    ULONG                   Device;
+
+    Self = sizeof (XENVKBD_FRONTEND) +
+           (ULONG)strlen(Frontend->Path) + 1;
+    if (Frontend->BackendPath != NULL)
+        Self += (ULONG)strlen(Frontend->BackendPath) + 1;
+
+    Ring = RingGetFootprint(__FrontendGetRing(Frontend));
+    Hid = HidGetFootprint(PdoGetHidContext(Pdo));
+    Device = PdoGetFootprint(Pdo);
+
+    XENBUS_DEBUG(Printf,
+                 &Frontend->DebugInterface,
+                 "NON-PAGED: FRONTEND %u RING %u HID %u PDO %u (TOTAL %u BYTES)\n",
+                 Self,
+                 Ring,
+                 Hid,
+                 Device,
+                 Self + Ring + Hid + Device);
+}
+
+static VOID
+FrontendDebugCallback(
+    IN  PVOID           Argument,
+    IN  BOOLEAN         Crashing
+    )
+{
+    PXENVKBD_FRONTEND   Frontend = Argument;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    XENBUS_DEBUG(Printf,
+                 &Frontend->DebugInterface,
+                 "%s: %s -> %s (OPERATION %u PHASE %u BACKEND %s)\n",
+                 __FrontendGetPath(Frontend),
+                 FrontendStateName(Frontend->State),
+                 FrontendStateName(Frontend->Target),
+                 Frontend->Operation,
+                 Frontend->Phase,
+                 XenbusStateName(Frontend->BackendState));
+
+    XENBUS_DEBUG(Printf,
+                 &Frontend->DebugInterface,
+                 "CLOSE: %lluus PREPARE: %lluus CONNECT: %lluus\n",
+                 Frontend->Timing[FRONTEND_TIMING_CLOSE],
+                 Frontend->Timing[FRONTEND_TIMING_PREPARE],
+                 Frontend->Timing[FRONTEND_TIMING_CONNECT]);
+
+    XENBUS_DEBUG(Printf,
+                 &Frontend->DebugInterface,
+                 "GNTTAB_CACHE: %lluus GRANT: %lluus EVTCHN: %lluus FEATURES: %lluus STORE_WRITE: %lluus\n",
+                 Frontend->Timing[FRONTEND_TIMING_GNTTAB_CACHE],
+                 Frontend->Timing[FRONTEND_TIMING_GRANT],
+                 Frontend->Timing[FRONTEND_TIMING_EVTCHN],
+                 Frontend->Timing[FRONTEND_TIMING_FEATURES],
+                 Frontend->Timing[FRONTEND_TIMING_STORE_WRITE]);
+
+    XENBUS_DEBUG(Printf,
+                 &Frontend->DebugInterface,
+                 "CONNECTS: %u (LAST %lluus CPU %lluus) STORE: %u ops %lluus (max %lluus)\n",
+                 Frontend->Connects,
+                 Frontend->ConnectTime,
+                 Frontend->ConnectCpu,
+                 Frontend->StoreCount,
+                 Frontend->StoreTime,
+                 Frontend->StoreMax);
+
+    FrontendDebugFootprint(Frontend);
 }
 
 NTSTATUS
@@ -992,10 +1678,23 @@ FrontendResume(
 
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
-    status = XENBUS_SUSPEND(Acquire, &Frontend->SuspendInterface);
+    status = XENBUS_DEBUG(Acquire, &Frontend->DebugInterface);
     if (!NT_SUCCESS(status))
         goto fail1;
 
+    status = XENBUS_DEBUG(Register,
+                          &Frontend->DebugInterface,
+                          __MODULE__ "|FRONTEND",
+                          FrontendDebugCallback,
+                          Frontend,
+                          &Frontend->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_SUSPEND(Acquire, &Frontend->SuspendInterface);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
     __FrontendResume(Frontend);
 
     status = XENBUS_SUSPEND(Register,
@@ -1005,7 +1704,7 @@ FrontendResume(
                             Frontend,
                             &Frontend->SuspendCallbackEarly);
     if (!NT_SUCCESS(status))
-        goto fail2;
+        goto fail4;
 
     status = XENBUS_SUSPEND(Register,
                             &Frontend->SuspendInterface,
@@ -1014,14 +1713,16 @@ FrontendResume(
                             Frontend,
                             &Frontend->SuspendCallbackLate);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail5;
 
     KeLowerIrql(Irql);
 
+    (VOID) FrontendWaitForState(Frontend);
+
     KeClearEvent(&Frontend->EjectEvent);
-    ThreadWake(Frontend->EjectThread);
+    WorkWake(Frontend->EjectWork);
 
-    Trace("waiting for eject thread\n");
+    Trace("waiting for eject check\n");
 
     (VOID) KeWaitForSingleObject(&Frontend->EjectEvent,
                                  Executive,
@@ -1033,21 +1734,34 @@ FrontendResume(
 
     return STATUS_SUCCESS;
     
-fail3:
-    Error("fail3\n");
+fail5:
+    Error("fail5\n");
 
     XENBUS_SUSPEND(Deregister,
                    &Frontend->SuspendInterface,
                    Frontend->SuspendCallbackEarly);
     Frontend->SuspendCallbackEarly = NULL;
 
-fail2:
-    Error("fail2\n");
+fail4:
+    Error("fail4\n");
 
     __FrontendSuspend(Frontend);
 
     XENBUS_SUSPEND(Release, &Frontend->SuspendInterface);
 
+fail3:
+    Error("fail3\n");
+
+    XENBUS_DEBUG(Deregister,
+                 &Frontend->DebugInterface,
+                 Frontend->DebugCallback);
+    Frontend->DebugCallback = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    XENBUS_DEBUG(Release, &Frontend->DebugInterface);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -1065,6 +1779,11 @@ FrontendSuspend(
 
     Trace("====>\n");
 
+    // Do the heavy lifting at PASSIVE_LEVEL while the suspend callbacks
+    // are still in place to cover a concurrent suspend
+    FrontendSetState(Frontend, FRONTEND_UNKNOWN);
+    (VOID) FrontendWaitForState(Frontend);
+
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
     XENBUS_SUSPEND(Deregister,
@@ -1077,16 +1796,24 @@ FrontendSuspend(
                    Frontend->SuspendCallbackEarly);
     Frontend->SuspendCallbackEarly = NULL;
 
+    // Normally a no-op, unless a suspend raced with the above
     __FrontendSuspend(Frontend);
 
     XENBUS_SUSPEND(Release, &Frontend->SuspendInterface);
 
+    XENBUS_DEBUG(Deregister,
+                 &Frontend->DebugInterface,
+                 Frontend->DebugCallback);
+    Frontend->DebugCallback = NULL;
+
+    XENBUS_DEBUG(Release, &Frontend->DebugInterface);
+
     KeLowerIrql(Irql);
 
     KeClearEvent(&Frontend->EjectEvent);
-    ThreadWake(Frontend->EjectThread);
+    WorkWake(Frontend->EjectWork);
 
-    Trace("waiting for eject thread\n");
+    Trace("waiting for eject check\n");
 
     (VOID) KeWaitForSingleObject(&Frontend->EjectEvent,
                                  Executive,
@@ -1143,6 +1870,7 @@ FrontendInitialize(
 
     (*Frontend)->Online = TRUE;
 
+    FdoGetDebugInterface(PdoGetFdo(Pdo), &(*Frontend)->DebugInterface);
     FdoGetSuspendInterface(PdoGetFdo(Pdo), &(*Frontend)->SuspendInterface);
     FdoGetStoreInterface(PdoGetFdo(Pdo), &(*Frontend)->StoreInterface);
 
@@ -1152,14 +1880,39 @@ FrontendInitialize(
 
     KeInitializeEvent(&(*Frontend)->EjectEvent, NotificationEvent, FALSE);
 
-    status = ThreadCreate(FrontendEject, *Frontend, &(*Frontend)->EjectThread);
+    status = WorkCreate(FrontendEject,
+                        *Frontend,
+                        WORK_CLASS_LEAF,
+                        &(*Frontend)->EjectWork);
     if (!NT_SUCCESS(status))
         goto fail5;
 
+    KeInitializeEvent(&(*Frontend)->StateEvent, NotificationEvent, TRUE);
+    KeInitializeTimer(&(*Frontend)->PollTimer);
+    KeInitializeDpc(&(*Frontend)->PollDpc, FrontendPoll, *Frontend);
+
+    status = WorkCreate(FrontendWorker,
+                        *Frontend,
+                        WORK_CLASS_LEAF,
+                        &(*Frontend)->StateWork);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
+fail6:
+    Error("fail6\n");
+
+    RtlZeroMemory(&(*Frontend)->PollDpc, sizeof (KDPC));
+    RtlZeroMemory(&(*Frontend)->PollTimer, sizeof (KTIMER));
+    RtlZeroMemory(&(*Frontend)->StateEvent, sizeof (KEVENT));
+
+    WorkAlert((*Frontend)->EjectWork);
+    WorkJoin((*Frontend)->EjectWork);
+    (*Frontend)->EjectWork = NULL;
+
 fail5:
     Error("fail5\n");
 
@@ -1177,6 +1930,9 @@ fail4:
     RtlZeroMemory(&(*Frontend)->SuspendInterface,
                   sizeof (XENBUS_SUSPEND_INTERFACE));
 
+    RtlZeroMemory(&(*Frontend)->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
     (*Frontend)->Online = FALSE;
 
     RtlZeroMemory(&(*Frontend)->Lock, sizeof (KSPIN_LOCK));
@@ -1214,10 +1970,29 @@ FrontendTeardown(
     ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
 
     ASSERT(Frontend->State == FRONTEND_UNKNOWN);
+    ASSERT3U(Frontend->Target, ==, FRONTEND_UNKNOWN);
+    ASSERT3U(Frontend->Operation, ==, FRONTEND_OPERATION_NONE);
+    ASSERT3P(Frontend->StateWatch, ==, NULL);
+
+    // Nothing is pending any more so the timer cannot be re-armed
+    (VOID) KeCancelTimer(&Frontend->PollTimer);
+    KeFlushQueuedDpcs();
 
-    ThreadAlert(Frontend->EjectThread);
-    ThreadJoin(Frontend->EjectThread);
-    Frontend->EjectThread = NULL;
+    WorkAlert(Frontend->StateWork);
+    WorkJoin(Frontend->StateWork);
+    Frontend->StateWork = NULL;
+
+    RtlZeroMemory(&Frontend->PollDpc, sizeof (KDPC));
+    RtlZeroMemory(&Frontend->PollTimer, sizeof (KTIMER));
+    RtlZeroMemory(&Frontend->StateEvent, sizeof (KEVENT));
+    Frontend->Result = STATUS_SUCCESS;
+
+    Frontend->BackendState = XenbusStateUnknown;
+    Frontend->Failure = STATUS_SUCCESS;
+
+    WorkAlert(Frontend->EjectWork);
+    WorkJoin(Frontend->EjectWork);
+    Frontend->EjectWork = NULL;
 
     RtlZeroMemory(&Frontend->EjectEvent, sizeof (KEVENT));
 
@@ -1230,6 +2005,18 @@ FrontendTeardown(
     RtlZeroMemory(&Frontend->SuspendInterface,
                   sizeof (XENBUS_SUSPEND_INTERFACE));
 
+    RtlZeroMemory(&Frontend->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    RtlZeroMemory(Frontend->Timing, sizeof (Frontend->Timing));
+    Frontend->ConnectTime = 0;
+    Frontend->CpuTime = 0;
+    Frontend->ConnectCpu = 0;
+    Frontend->Connects = 0;
+    Frontend->StoreCount = 0;
+    Frontend->StoreTime = 0;
+    Frontend->StoreMax = 0;
+
     Frontend->Online = FALSE;
 
     RtlZeroMemory(&Frontend->Lock, sizeof (KSPIN_LOCK));
@@ -56,6 +56,18 @@ typedef enum _XENVKBD_FRONTEND_STATE {
     FRONTEND_ENABLED
 } XENVKBD_FRONTEND_STATE, *PXENVKBD_FRONTEND_STATE;
 
+typedef enum _XENVKBD_FRONTEND_TIMING {
+    FRONTEND_TIMING_CLOSE,
+    FRONTEND_TIMING_PREPARE,
+    FRONTEND_TIMING_CONNECT,
+    FRONTEND_TIMING_GNTTAB_CACHE,
+    FRONTEND_TIMING_GRANT,
+    FRONTEND_TIMING_EVTCHN,
+    FRONTEND_TIMING_FEATURES,
+    FRONTEND_TIMING_STORE_WRITE,
+    FRONTEND_TIMING_COUNT
+} XENVKBD_FRONTEND_TIMING, *PXENVKBD_FRONTEND_TIMING;
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 extern NTSTATUS
 FrontendInitialize(
@@ -73,12 +85,20 @@ FrontendEjectFailed(
     IN PXENVKBD_FRONTEND    Frontend
     );
 
-extern NTSTATUS
+// Asynchronous: the transition is made by the frontend's worker and
+// FrontendWaitForState() collects its outcome
+extern VOID
 FrontendSetState(
     IN  PXENVKBD_FRONTEND       Frontend,
     IN  XENVKBD_FRONTEND_STATE  State
     );
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+extern NTSTATUS
+FrontendWaitForState(
+    IN  PXENVKBD_FRONTEND   Frontend
+    );
+
 extern NTSTATUS
 FrontendResume(
     IN  PXENVKBD_FRONTEND   Frontend
@@ -109,6 +129,24 @@ FrontendGetBackendDomain(
     IN  PXENVKBD_FRONTEND   Frontend
     );
 
+extern ULONG
+FrontendGetSuspendCount(
+    IN  PXENVKBD_FRONTEND   Frontend
+    );
+
+extern VOID
+FrontendAccountTime(
+    IN  PXENVKBD_FRONTEND       Frontend,
+    IN  XENVKBD_FRONTEND_TIMING Timing,
+    IN  ULONGLONG               Start
+    );
+
+extern VOID
+FrontendAccountStore(
+    IN  PXENVKBD_FRONTEND   Frontend,
+    IN  ULONGLONG           Start
+    );
+
 #include "ring.h"
 
 extern PXENVKBD_RING
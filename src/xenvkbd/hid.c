@@ -45,6 +45,7 @@
 #include "mrsw.h"
 #include "thread.h"
 #include "vkbd.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -90,7 +91,7 @@ __HidAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, XENVKBD_VKBD_TAG);
+    return PoolAllocateObject(XENVKBD_VKBD_TAG, Length);
 }
 
 static FORCEINLINE VOID
@@ -98,7 +99,7 @@ __HidFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, XENVKBD_VKBD_TAG);
+    PoolFree(Buffer, XENVKBD_VKBD_TAG);
 }
 
 static NTSTATUS
@@ -114,27 +115,41 @@ HidEnable(
 
     Trace("====>\n");
 
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
     AcquireMrswLockExclusive(&Context->Lock, &Irql);
 
-    if (Context->Enabled)
+    if (Context->Enabled) {
+        ReleaseMrswLockExclusive(&Context->Lock, Irql, FALSE);
         goto done;
+    }
 
     Context->Callback = Callback;
     Context->Argument = Argument;
 
-    Context->Enabled = TRUE;
-
     KeMemoryBarrier();
 
-    status = FrontendSetState(Context->Frontend, FRONTEND_ENABLED);
+    FrontendSetState(Context->Frontend, FRONTEND_ENABLED);
+
+    ReleaseMrswLockExclusive(&Context->Lock, Irql, FALSE);
+
+    // The connection is made by the frontend's worker; wait for it
+    // outside the lock so that reads are not held off meanwhile
+    status = FrontendWaitForState(Context->Frontend);
     if (!NT_SUCCESS(status)) {
         if (status != STATUS_DEVICE_NOT_READY)
             goto fail1;
     }
 
-done:
+    // Reports made before this are left pending in the ring, and the
+    // first read sends them
+    AcquireMrswLockExclusive(&Context->Lock, &Irql);
+
+    Context->Enabled = TRUE;
+
     ReleaseMrswLockExclusive(&Context->Lock, Irql, FALSE);
 
+done:
     Trace("<====\n");
 
     return STATUS_SUCCESS;
@@ -142,9 +157,7 @@ done:
 fail1:
     Error("fail1 (%08x)\n", status);
 
-    Context->Enabled = FALSE;
-
-    KeMemoryBarrier();
+    AcquireMrswLockExclusive(&Context->Lock, &Irql);
 
     Context->Argument = NULL;
     Context->Callback = NULL;
@@ -164,6 +177,8 @@ HidDisable(
 
     Trace("====>\n");
 
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
     AcquireMrswLockExclusive(&Context->Lock, &Irql);
 
     if (!Context->Enabled) {
@@ -175,14 +190,22 @@ HidDisable(
 
     KeMemoryBarrier();
 
-    (VOID) FrontendSetState(Context->Frontend, FRONTEND_CONNECTED);
+    FrontendSetState(Context->Frontend, FRONTEND_CONNECTED);
 
-    ReleaseMrswLockExclusive(&Context->Lock, Irql, TRUE);
+    ReleaseMrswLockExclusive(&Context->Lock, Irql, FALSE);
+
+    // The ring DPC may still be on its way into HidSendReadReport(), so
+    // let the worker disable the ring and flush the DPC before the
+    // callback goes away
+    (VOID) FrontendWaitForState(Context->Frontend);
+    KeFlushQueuedDpcs();
+
+    AcquireMrswLockExclusive(&Context->Lock, &Irql);
 
     Context->Argument = NULL;
     Context->Callback = NULL;
 
-    ReleaseMrswLockShared(&Context->Lock);
+    ReleaseMrswLockExclusive(&Context->Lock, Irql, FALSE);
 
 done:
     Trace("<====\n");
@@ -365,16 +388,16 @@ HidGetFeature(
     if (!Context->Enabled)
         goto done;
 
-    status = STATUS_NOT_SUPPORTED;
+    status = RingGetFeature(Context->Ring,
+                            ReportId,
+                            Buffer,
+                            Length,
+                            Returned);
 
 done:
     ReleaseMrswLockShared(&Context->Lock);
     Trace("<=====\n");
 
-    UNREFERENCED_PARAMETER(ReportId);
-    UNREFERENCED_PARAMETER(Buffer);
-    UNREFERENCED_PARAMETER(Length);
-    UNREFERENCED_PARAMETER(Returned);
     return status;
 }
 
@@ -396,15 +419,15 @@ HidSetFeature(
     if (!Context->Enabled)
         goto done;
 
-    status = STATUS_NOT_SUPPORTED;
+    status = RingSetFeature(Context->Ring,
+                            ReportId,
+                            Buffer,
+                            Length);
 
 done:
     ReleaseMrswLockShared(&Context->Lock);
     Trace("<=====\n");
 
-    UNREFERENCED_PARAMETER(ReportId);
-    UNREFERENCED_PARAMETER(Buffer);
-    UNREFERENCED_PARAMETER(Length);
     return status;
 }
 
@@ -654,6 +677,16 @@ HidGetInterface(
     return status;
 }   
 
+ULONG
+HidGetFootprint(
+    IN  PXENVKBD_HID_CONTEXT    Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return sizeof (XENVKBD_HID_CONTEXT);
+}
+
 VOID
 HidTeardown(
     IN  PXENVKBD_HID_CONTEXT    Context
@@ -56,6 +56,11 @@ HidGetInterface(
     IN      ULONG                   Size
     );
 
+extern ULONG
+HidGetFootprint(
+    IN  PXENVKBD_HID_CONTEXT    Context
+    );
+
 extern VOID
 HidTeardown(
     IN  PXENVKBD_HID_CONTEXT    Context
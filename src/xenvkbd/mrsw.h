@@ -45,13 +45,21 @@ typedef struct _XENVKBD_MRSW_HOLDER {
     LONG        Level;
 } XENVKBD_MRSW_HOLDER, *PXENVKBD_MRSW_HOLDER;
 
+// Each holder needs a slot. Only a handful of threads ever call into a HID
+// context at once, so a quarter of the mask is plenty and keeps the lock
+// small. If every slot is in use a claim below DISPATCH_LEVEL waits for a
+// release rather than spinning.
+#define XENVKBD_MRSW_SLOTS  16
+
+#define XENVKBD_MRSW_UNAVAILABLE_MASK   (~((1ll << XENVKBD_MRSW_SLOTS) - 1))
+
 typedef struct _XENVKBD_MRSW_LOCK {
     volatile LONG64 Mask;
-    XENVKBD_MRSW_HOLDER     Holder[64];
+    XENVKBD_MRSW_HOLDER     Holder[XENVKBD_MRSW_SLOTS];
     KEVENT          Event;
 } XENVKBD_MRSW_LOCK, *PXENVKBD_MRSW_LOCK;
 
-C_ASSERT(RTL_FIELD_SIZE(XENVKBD_MRSW_LOCK, Holder) == RTL_FIELD_SIZE(XENVKBD_MRSW_LOCK, Mask) * 8 * sizeof (XENVKBD_MRSW_HOLDER));
+C_ASSERT(XENVKBD_MRSW_SLOTS < RTL_FIELD_SIZE(XENVKBD_MRSW_LOCK, Mask) * 8);
 
 #define XENVKBD_MRSW_EXCLUSIVE_SLOT  0
 
@@ -64,7 +72,7 @@ InitializeMrswLock(
 
     RtlZeroMemory(Lock, sizeof (XENVKBD_MRSW_LOCK));
 
-    for (Slot = 0; Slot < sizeof (Lock->Mask) * 8; Slot++)
+    for (Slot = 0; Slot < XENVKBD_MRSW_SLOTS; Slot++)
         Lock->Holder[Slot].Level = -1;
 
     KeInitializeEvent(&Lock->Event, NotificationEvent, FALSE);
@@ -103,7 +111,7 @@ __AcquireMrswLockExclusive(
     Self = KeGetCurrentThread();
 
     // Make sure we do not already hold the lock
-    for (Slot = 0; Slot < sizeof (Lock->Mask) * 8; Slot++)
+    for (Slot = 0; Slot < XENVKBD_MRSW_SLOTS; Slot++)
         ASSERT(Lock->Holder[Slot].Thread != Self);
 
     for (;;) {
@@ -178,6 +186,20 @@ ReleaseMrswLockExclusive(
     KeLowerIrql(Irql);
 }
 
+static FORCEINLINE BOOLEAN
+__SharedSlotsFull(
+    IN  PXENVKBD_MRSW_LOCK  Lock
+    )
+{
+    LONG64                  Mask;
+
+    Mask = Lock->Mask |
+           (1ll << XENVKBD_MRSW_EXCLUSIVE_SLOT) |
+           XENVKBD_MRSW_UNAVAILABLE_MASK;
+
+    return (Mask == -1ll) ? TRUE : FALSE;
+}
+
 static FORCEINLINE LONG
 __ClaimShared(
     IN  PXENVKBD_MRSW_LOCK  Lock
@@ -187,14 +209,20 @@ __ClaimShared(
     LONG64                  Old;
     LONG64                  New;
 
-    // Make sure the exclusive bit is set so that we don't find it
-    Old = Lock->Mask | (1ll << XENVKBD_MRSW_EXCLUSIVE_SLOT);
+    // Make sure the exclusive bit and the bits beyond the holder table are
+    // set so that we don't find them
+    Old = Lock->Mask |
+          (1ll << XENVKBD_MRSW_EXCLUSIVE_SLOT) |
+          XENVKBD_MRSW_UNAVAILABLE_MASK;
 
     Slot = __ffu((ULONG64)Old);
-    ASSERT(Slot >= 0);
+    if (Slot < 0)
+        return -1;  // All slots are in use
+
     ASSERT3U(Slot, != , XENVKBD_MRSW_EXCLUSIVE_SLOT);
 
-    Old &= ~(1ll << XENVKBD_MRSW_EXCLUSIVE_SLOT);
+    Old &= ~((1ll << XENVKBD_MRSW_EXCLUSIVE_SLOT) |
+             XENVKBD_MRSW_UNAVAILABLE_MASK);
     New = Old | (1ll << Slot);
 
     return (InterlockedCompareExchange64(&Lock->Mask, New, Old) == Old) ? Slot : -1;
@@ -218,7 +246,7 @@ AcquireMrswLockShared(
 
     // Do we already hold the lock? If so, get the nesting level
     Level = -1;
-    for (Slot = 0; Slot < sizeof (Lock->Mask) * 8; Slot++) {
+    for (Slot = 0; Slot < XENVKBD_MRSW_SLOTS; Slot++) {
         if (Lock->Holder[Slot].Thread == Self && Lock->Holder[Slot].Level > Level)
             Level = Lock->Holder[Slot].Level;
     }
@@ -229,7 +257,23 @@ AcquireMrswLockShared(
         if (Slot >= 0)
             break;
 
-        _mm_pause();
+        // A lost race is retried straight away, as is a full table if we
+        // were called at DISPATCH_LEVEL and so cannot block
+        if (!__SharedSlotsFull(Lock) || Irql == DISPATCH_LEVEL) {
+            _mm_pause();
+            continue;
+        }
+
+        KeLowerIrql(Irql);
+
+        (VOID) KeWaitForSingleObject(&Lock->Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(&Lock->Event);
+
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
     }
 
     Holder = &Lock->Holder[Slot];
@@ -261,7 +305,7 @@ ReleaseMrswLockShared(
 
     Level = -1;
     Deepest = -1;
-    for (Slot = 0; Slot < sizeof (Lock->Mask) * 8; Slot++) {
+    for (Slot = 0; Slot < XENVKBD_MRSW_SLOTS; Slot++) {
         if (Lock->Holder[Slot].Thread == Self && Lock->Holder[Slot].Level > Level) {
             Level = Lock->Holder[Slot].Level;
             Deepest = Slot;
@@ -51,6 +51,7 @@
 #include "driver.h"
 #include "registry.h"
 #include "thread.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -64,9 +65,9 @@
 struct _XENVKBD_PDO {
     PXENVKBD_DX                 Dx;
 
-    PXENVKBD_THREAD             SystemPowerThread;
+    PXENVKBD_WORK               SystemPowerWork;
     PIRP                        SystemPowerIrp;
-    PXENVKBD_THREAD             DevicePowerThread;
+    PXENVKBD_WORK               DevicePowerWork;
     PIRP                        DevicePowerIrp;
 
     PXENVKBD_FDO                Fdo;
@@ -90,7 +91,7 @@ __PdoAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, PDO_POOL);
+    return PoolAllocateObject(PDO_POOL, Length);
 }
 
 static FORCEINLINE VOID
@@ -98,7 +99,7 @@ __PdoFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, PDO_POOL);
+    PoolFree(Buffer, PDO_POOL);
 }
 
 static FORCEINLINE VOID
@@ -453,6 +454,16 @@ PdoGetHidContext(
     return __PdoGetHidContext(Pdo);
 }
 
+ULONG
+PdoGetFootprint(
+    IN  PXENVKBD_PDO    Pdo
+    )
+{
+    UNREFERENCED_PARAMETER(Pdo);
+
+    return sizeof (XENVKBD_PDO) + sizeof (XENVKBD_DX);
+}
+
 PDMA_ADAPTER
 PdoGetDmaAdapter(
     IN  PXENVKBD_PDO        Pdo,
@@ -521,13 +532,12 @@ PdoGetBusData(
                          Length);
 }
 
-static FORCEINLINE NTSTATUS
+static FORCEINLINE VOID
 __PdoD3ToD0(
     IN  PXENVKBD_PDO            Pdo
     )
 {
     POWER_STATE                 PowerState;
-    NTSTATUS                    status;
 
     Trace("(%s) ====>\n", __PdoGetName(Pdo));
 
@@ -536,9 +546,8 @@ __PdoD3ToD0(
 
     // Dont take over keyboard/mouse until XenHid starts
     // XenHid calling XENHID_HID(Enable...) sets state to ENABLED
-    status = FrontendSetState(__PdoGetFrontend(Pdo), FRONTEND_CLOSED);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+    // The outcome is collected by PdoD3ToD0() once back at PASSIVE_LEVEL
+    FrontendSetState(__PdoGetFrontend(Pdo), FRONTEND_CLOSED);
 
     __PdoSetDevicePowerState(Pdo, PowerDeviceD0);
 
@@ -548,13 +557,6 @@ __PdoD3ToD0(
                     PowerState);
 
     Trace("(%s) <====\n", __PdoGetName(Pdo));
-
-    return STATUS_SUCCESS;
-
-fail1:
-    Error("fail1 (%08x)\n", status);
-
-    return status;
 }
 
 static FORCEINLINE VOID
@@ -576,7 +578,7 @@ __PdoD0ToD3(
 
     __PdoSetDevicePowerState(Pdo, PowerDeviceD3);
 
-    (VOID) FrontendSetState(__PdoGetFrontend(Pdo), FRONTEND_CLOSED);
+    FrontendSetState(__PdoGetFrontend(Pdo), FRONTEND_CLOSED);
 
     Trace("(%s) <====\n", __PdoGetName(Pdo));
 }
@@ -587,12 +589,13 @@ PdoSuspendCallbackLate(
     )
 {
     PXENVKBD_PDO        Pdo = Argument;
-    NTSTATUS            status;
 
-    __PdoD0ToD3(Pdo);
+    // The frontend's own late callback parks the ring and its worker
+    // then reconnects it to whatever state XenHid last asked for.
+    // Cycling through D3 here would close it and leave input dead.
+    ASSERT3U(__PdoGetDevicePowerState(Pdo), ==, PowerDeviceD0);
 
-    status = __PdoD3ToD0(Pdo);
-    ASSERT(NT_SUCCESS(status));
+    Info("(%s) fast resume\n", __PdoGetName(Pdo));
 }
 
 // This function must not touch pageable code or data
@@ -612,9 +615,7 @@ PdoD3ToD0(
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    status = __PdoD3ToD0(Pdo);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    __PdoD3ToD0(Pdo);
 
     status = XENBUS_SUSPEND(Register,
                             &Pdo->SuspendInterface,
@@ -623,20 +624,31 @@ PdoD3ToD0(
                             Pdo,
                             &Pdo->SuspendCallbackLate);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail2;
 
     KeLowerIrql(Irql);
 
+    status = FrontendWaitForState(__PdoGetFrontend(Pdo));
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
     return STATUS_SUCCESS;
 
 fail3:
     Error("fail3\n");
 
-    __PdoD0ToD3(Pdo);
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    XENBUS_SUSPEND(Deregister,
+                   &Pdo->SuspendInterface,
+                   Pdo->SuspendCallbackLate);
+    Pdo->SuspendCallbackLate = NULL;
 
 fail2:
     Error("fail2\n");
 
+    __PdoD0ToD3(Pdo);
+
     XENBUS_SUSPEND(Release, &Pdo->SuspendInterface);
 
 fail1:
@@ -1641,44 +1653,26 @@ __PdoSetDevicePower(
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS
+static VOID
 PdoDevicePower(
-    IN  PXENVKBD_THREAD Self,
+    IN  PXENVKBD_WORK   Self,
     IN  PVOID           Context
     )
 {
     PXENVKBD_PDO        Pdo = Context;
-    PKEVENT             Event;
+    PIRP                Irp;
 
-    Event = ThreadGetEvent(Self);
+    UNREFERENCED_PARAMETER(Self);
 
-    for (;;) {
-        PIRP    Irp;
+    Irp = Pdo->DevicePowerIrp;
 
-        if (Pdo->DevicePowerIrp == NULL) {
-            (VOID) KeWaitForSingleObject(Event,
-                                         Executive,
-                                         KernelMode,
-                                         FALSE,
-                                         NULL);
-            KeClearEvent(Event);
-        }
-
-        if (ThreadIsAlerted(Self))
-            break;
-
-        Irp = Pdo->DevicePowerIrp;
-
-        if (Irp == NULL)
-            continue;
-
-        Pdo->DevicePowerIrp = NULL;
-        KeMemoryBarrier();
+    if (Irp == NULL)
+        return;
 
-        (VOID) __PdoSetDevicePower(Pdo, Irp);
-    }
+    Pdo->DevicePowerIrp = NULL;
+    KeMemoryBarrier();
 
-    return STATUS_SUCCESS;
+    (VOID) __PdoSetDevicePower(Pdo, Irp);
 }
 
 static FORCEINLINE NTSTATUS
@@ -1738,44 +1732,26 @@ __PdoSetSystemPower(
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS
+static VOID
 PdoSystemPower(
-    IN  PXENVKBD_THREAD Self,
+    IN  PXENVKBD_WORK   Self,
     IN  PVOID           Context
     )
 {
     PXENVKBD_PDO        Pdo = Context;
-    PKEVENT             Event;
-
-    Event = ThreadGetEvent(Self);
-
-    for (;;) {
-        PIRP    Irp;
-
-        if (Pdo->SystemPowerIrp == NULL) {
-            (VOID) KeWaitForSingleObject(Event,
-                                         Executive,
-                                         KernelMode,
-                                         FALSE,
-                                         NULL);
-            KeClearEvent(Event);
-        }
-
-        if (ThreadIsAlerted(Self))
-            break;
+    PIRP                Irp;
 
-        Irp = Pdo->SystemPowerIrp;
+    UNREFERENCED_PARAMETER(Self);
 
-        if (Irp == NULL)
-            continue;
+    Irp = Pdo->SystemPowerIrp;
 
-        Pdo->SystemPowerIrp = NULL;
-        KeMemoryBarrier();
+    if (Irp == NULL)
+        return;
 
-        (VOID) __PdoSetSystemPower(Pdo, Irp);
-    }
+    Pdo->SystemPowerIrp = NULL;
+    KeMemoryBarrier();
 
-    return STATUS_SUCCESS;
+    (VOID) __PdoSetSystemPower(Pdo, Irp);
 }
 
 static DECLSPEC_NOINLINE NTSTATUS
@@ -1810,7 +1786,7 @@ PdoSetPower(
         Pdo->DevicePowerIrp = Irp;
         KeMemoryBarrier();
 
-        ThreadWake(Pdo->DevicePowerThread);
+        WorkWake(Pdo->DevicePowerWork);
 
         status = STATUS_PENDING;
         break;
@@ -1822,7 +1798,7 @@ PdoSetPower(
         Pdo->SystemPowerIrp = Irp;
         KeMemoryBarrier();
 
-        ThreadWake(Pdo->SystemPowerThread);
+        WorkWake(Pdo->SystemPowerWork);
 
         status = STATUS_PENDING;
         break;
@@ -1986,11 +1962,17 @@ PdoCreate(
     Pdo->Dx = Dx;
     Pdo->Fdo = Fdo;
 
-    status = ThreadCreate(PdoSystemPower, Pdo, &Pdo->SystemPowerThread);
+    status = WorkCreate(PdoSystemPower,
+                        Pdo,
+                        WORK_CLASS_WAITING,
+                        &Pdo->SystemPowerWork);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    status = ThreadCreate(PdoDevicePower, Pdo, &Pdo->DevicePowerThread);
+    status = WorkCreate(PdoDevicePower,
+                        Pdo,
+                        WORK_CLASS_WAITING,
+                        &Pdo->DevicePowerWork);
     if (!NT_SUCCESS(status))
         goto fail4;
 
@@ -2061,16 +2043,16 @@ fail6:
 fail5:
     Error("fail5\n");
 
-    ThreadAlert(Pdo->DevicePowerThread);
-    ThreadJoin(Pdo->DevicePowerThread);
-    Pdo->DevicePowerThread = NULL;
+    WorkAlert(Pdo->DevicePowerWork);
+    WorkJoin(Pdo->DevicePowerWork);
+    Pdo->DevicePowerWork = NULL;
 
 fail4:
     Error("fail4\n");
 
-    ThreadAlert(Pdo->SystemPowerThread);
-    ThreadJoin(Pdo->SystemPowerThread);
-    Pdo->SystemPowerThread = NULL;
+    WorkAlert(Pdo->SystemPowerWork);
+    WorkJoin(Pdo->SystemPowerWork);
+    Pdo->SystemPowerWork = NULL;
 
 fail3:
     Error("fail3\n");
@@ -2130,13 +2112,13 @@ PdoDestroy(
 
     BusTeardown(&Pdo->BusInterface);
 
-    ThreadAlert(Pdo->DevicePowerThread);
-    ThreadJoin(Pdo->DevicePowerThread);
-    Pdo->DevicePowerThread = NULL;
+    WorkAlert(Pdo->DevicePowerWork);
+    WorkJoin(Pdo->DevicePowerWork);
+    Pdo->DevicePowerWork = NULL;
 
-    ThreadAlert(Pdo->SystemPowerThread);
-    ThreadJoin(Pdo->SystemPowerThread);
-    Pdo->SystemPowerThread = NULL;
+    WorkAlert(Pdo->SystemPowerWork);
+    WorkJoin(Pdo->SystemPowerWork);
+    Pdo->SystemPowerWork = NULL;
 
     Pdo->Fdo = NULL;
     Pdo->Dx = NULL;
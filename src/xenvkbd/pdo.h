@@ -86,6 +86,11 @@ PdoGetDeviceObject(
     IN  PXENVKBD_PDO    Pdo
     );
 
+extern ULONG
+PdoGetFootprint(
+    IN  PXENVKBD_PDO    Pdo
+    );
+
 extern PDMA_ADAPTER
 PdoGetDmaAdapter(
     IN  PXENVKBD_PDO        Pdo,
@@ -0,0 +1,405 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <debug_interface.h>
+
+#include "pool.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+// Every allocation made through this layer carries a small header so that
+// the live byte count of its tag can be maintained when it is freed.
+// Buffers that are handed to (and freed by) the rest of the system must
+// not come from here; use __AllocatePoolWithTag() for those.
+
+#define XENVKBD_POOL_MAGIC  'rdHP'
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _XENVKBD_POOL_HEADER {
+    ULONG   Magic;  // Catches buffers that did not come from here
+    ULONG   Length;
+    ULONG   Class;  // Lookaside list index + 1, or 0 for plain pool
+} XENVKBD_POOL_HEADER, *PXENVKBD_POOL_HEADER;
+
+typedef struct _XENVKBD_POOL_TAG {
+    ULONG   Tag;
+    LONG    Allocations;
+    LONG    Frees;
+    LONG    Failures;
+    LONG    Bytes;
+    LONG    Peak;
+} XENVKBD_POOL_TAG, *PXENVKBD_POOL_TAG;
+
+// Objects of a fixed size that are repeatedly created and destroyed (e.g.
+// on hot-plug or reconnect) are recycled through a lookaside list, one per
+// tag and size.
+typedef struct _XENVKBD_POOL_CLASS {
+    NPAGED_LOOKASIDE_LIST   Lookaside;
+    ULONG                   Tag;
+    ULONG                   Size;
+} XENVKBD_POOL_CLASS, *PXENVKBD_POOL_CLASS;
+
+#define POOL_TAG_COUNT      16
+#define POOL_CLASS_COUNT    8
+
+typedef struct _XENVKBD_POOL {
+    XENVKBD_POOL_CLASS  Class[POOL_CLASS_COUNT];
+    XENVKBD_POOL_TAG    Tag[POOL_TAG_COUNT];
+    KSPIN_LOCK          Lock;
+    volatile ULONG      TagCount;
+    volatile ULONG      ClassCount;
+} XENVKBD_POOL, *PXENVKBD_POOL;
+
+static XENVKBD_POOL Pool;
+
+static FORCEINLINE CHAR
+__PoolTagChar(
+    IN  ULONG   Tag,
+    IN  ULONG   Index
+    )
+{
+    CHAR        Char = (CHAR)((Tag >> (Index * 8)) & 0xFF);
+
+    return (Char != '\0') ? Char : ' ';
+}
+
+#define POOL_TAG_CHARS(_Tag)        \
+        __PoolTagChar((_Tag), 0),   \
+        __PoolTagChar((_Tag), 1),   \
+        __PoolTagChar((_Tag), 2),   \
+        __PoolTagChar((_Tag), 3)
+
+static FORCEINLINE PXENVKBD_POOL_TAG
+__PoolFindTag(
+    IN  ULONG   Tag
+    )
+{
+    ULONG       Count = Pool.TagCount;
+    ULONG       Index;
+
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Count; Index++) {
+        if (Pool.Tag[Index].Tag == Tag)
+            return &Pool.Tag[Index];
+    }
+
+    return NULL;
+}
+
+static PXENVKBD_POOL_TAG
+__PoolGetTag(
+    IN  ULONG           Tag
+    )
+{
+    PXENVKBD_POOL_TAG   Entry;
+    KIRQL               Irql;
+
+    Entry = __PoolFindTag(Tag);
+    if (Entry != NULL)
+        return Entry;
+
+    KeAcquireSpinLock(&Pool.Lock, &Irql);
+
+    Entry = __PoolFindTag(Tag);
+    if (Entry == NULL && Pool.TagCount < POOL_TAG_COUNT) {
+        Entry = &Pool.Tag[Pool.TagCount];
+        Entry->Tag = Tag;
+
+        KeMemoryBarrier();
+        Pool.TagCount++;
+    }
+
+    KeReleaseSpinLock(&Pool.Lock, Irql);
+
+    // Accounting is lost for this tag, which checked builds should not
+    // tolerate: POOL_TAG_COUNT needs raising
+    if (Entry == NULL) {
+        Error("%c%c%c%c: no room to account\n",
+              POOL_TAG_CHARS(Tag));
+        ASSERT(Entry != NULL);
+    }
+
+    return Entry;
+}
+
+static FORCEINLINE LONG
+__PoolFindClass(
+    IN  ULONG   Tag,
+    IN  ULONG   Size
+    )
+{
+    ULONG       Count = Pool.ClassCount;
+    ULONG       Index;
+
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Count; Index++) {
+        PXENVKBD_POOL_CLASS Class = &Pool.Class[Index];
+
+        if (Class->Tag == Tag && Class->Size == Size)
+            return (LONG)Index;
+    }
+
+    return -1;
+}
+
+static LONG
+__PoolGetClass(
+    IN  ULONG   Tag,
+    IN  ULONG   Size
+    )
+{
+    KIRQL       Irql;
+    LONG        Index;
+
+    Index = __PoolFindClass(Tag, Size);
+    if (Index >= 0)
+        return Index;
+
+    KeAcquireSpinLock(&Pool.Lock, &Irql);
+
+    Index = __PoolFindClass(Tag, Size);
+    if (Index < 0 && Pool.ClassCount < POOL_CLASS_COUNT) {
+        PXENVKBD_POOL_CLASS Class = &Pool.Class[Pool.ClassCount];
+
+        ExInitializeNPagedLookasideList(&Class->Lookaside,
+                                        NULL,
+                                        NULL,
+                                        POOL_NX_ALLOCATION,
+                                        sizeof (XENVKBD_POOL_HEADER) + Size,
+                                        Tag,
+                                        0);
+        Class->Tag = Tag;
+        Class->Size = Size;
+
+        Index = (LONG)Pool.ClassCount;
+
+        KeMemoryBarrier();
+        Pool.ClassCount++;
+    }
+
+    KeReleaseSpinLock(&Pool.Lock, Irql);
+
+    // The allocation falls back to plain pool, which checked builds should
+    // not tolerate: POOL_CLASS_COUNT needs raising
+    if (Index < 0) {
+        Error("%c%c%c%c[%u]: no room for a lookaside list\n",
+              POOL_TAG_CHARS(Tag),
+              Size);
+        ASSERT(Index >= 0);
+    }
+
+    return Index;
+}
+
+static PVOID
+__PoolAllocate(
+    IN  ULONG               Tag,
+    IN  ULONG               Length,
+    IN  BOOLEAN             Object
+    )
+{
+    PXENVKBD_POOL_TAG       Entry;
+    LONG                    Index;
+    PXENVKBD_POOL_HEADER    Header;
+    LONG                    Bytes;
+    LONG                    Peak;
+
+    if (Length == 0)
+        return NULL;
+
+    Entry = __PoolGetTag(Tag);
+    Index = (Object) ? __PoolGetClass(Tag, Length) : -1;
+
+    if (Index >= 0) {
+        Header = ExAllocateFromNPagedLookasideList(&Pool.Class[Index].Lookaside);
+    } else {
+#if (_MSC_VER >= 1928) // VS 16.9 (EWDK 20344 or later)
+        Header = ExAllocatePoolUninitialized(NonPagedPool,
+                                             sizeof (XENVKBD_POOL_HEADER) + Length,
+                                             Tag);
+#else
+#pragma warning(suppress:28160) // annotation error
+        Header = ExAllocatePoolWithTag(NonPagedPool,
+                                       sizeof (XENVKBD_POOL_HEADER) + Length,
+                                       Tag);
+#endif
+    }
+
+    if (Header == NULL) {
+        if (Entry != NULL)
+            InterlockedIncrement(&Entry->Failures);
+
+        return NULL;
+    }
+
+    RtlZeroMemory(Header, sizeof (XENVKBD_POOL_HEADER) + Length);
+
+    Header->Magic = XENVKBD_POOL_MAGIC;
+    Header->Length = Length;
+    Header->Class = (ULONG)(Index + 1);
+
+    if (Entry != NULL) {
+        InterlockedIncrement(&Entry->Allocations);
+        Bytes = InterlockedExchangeAdd(&Entry->Bytes, (LONG)Length) + (LONG)Length;
+
+        do {
+            Peak = Entry->Peak;
+            if (Bytes <= Peak)
+                break;
+        } while (InterlockedCompareExchange(&Entry->Peak, Bytes, Peak) != Peak);
+    }
+
+    return Header + 1;
+}
+
+PVOID
+PoolAllocate(
+    IN  ULONG   Tag,
+    IN  ULONG   Length
+    )
+{
+    return __PoolAllocate(Tag, Length, FALSE);
+}
+
+PVOID
+PoolAllocateObject(
+    IN  ULONG   Tag,
+    IN  ULONG   Length
+    )
+{
+    return __PoolAllocate(Tag, Length, TRUE);
+}
+
+VOID
+PoolFree(
+    IN  PVOID               Buffer,
+    IN  ULONG               Tag
+    )
+{
+    PXENVKBD_POOL_HEADER    Header = (PXENVKBD_POOL_HEADER)Buffer - 1;
+    PXENVKBD_POOL_TAG       Entry;
+
+    ASSERT3U(Header->Magic, ==, XENVKBD_POOL_MAGIC);
+    Header->Magic = 0;  // So that a double free is caught too
+
+    Entry = __PoolFindTag(Tag);
+    if (Entry != NULL) {
+        InterlockedIncrement(&Entry->Frees);
+        InterlockedExchangeAdd(&Entry->Bytes, -(LONG)Header->Length);
+    }
+
+    if (Header->Class != 0) {
+        PXENVKBD_POOL_CLASS Class = &Pool.Class[Header->Class - 1];
+
+        ASSERT3U(Class->Tag, ==, Tag);
+        ASSERT3U(Class->Size, ==, Header->Length);
+
+        ExFreeToNPagedLookasideList(&Class->Lookaside, Header);
+    } else {
+        ExFreePoolWithTag(Header, Tag);
+    }
+}
+
+VOID
+PoolDebugCallback(
+    IN  PXENBUS_DEBUG_INTERFACE DebugInterface
+    )
+{
+    ULONG                       Index;
+
+    for (Index = 0; Index < Pool.TagCount; Index++) {
+        PXENVKBD_POOL_TAG   Entry = &Pool.Tag[Index];
+
+        XENBUS_DEBUG(Printf,
+                     DebugInterface,
+                     "%c%c%c%c: %d bytes (peak %d) allocations %d frees %d failures %d\n",
+                     POOL_TAG_CHARS(Entry->Tag),
+                     Entry->Bytes,
+                     Entry->Peak,
+                     Entry->Allocations,
+                     Entry->Frees,
+                     Entry->Failures);
+    }
+
+    for (Index = 0; Index < Pool.ClassCount; Index++) {
+        PXENVKBD_POOL_CLASS Class = &Pool.Class[Index];
+
+        XENBUS_DEBUG(Printf,
+                     DebugInterface,
+                     "%c%c%c%c[%u]: lookaside depth %u allocates %u misses %u\n",
+                     POOL_TAG_CHARS(Class->Tag),
+                     Class->Size,
+                     ExQueryDepthSList(&Class->Lookaside.L.ListHead),
+                     Class->Lookaside.L.TotalAllocates,
+                     Class->Lookaside.L.AllocateMisses);
+    }
+}
+
+VOID
+PoolInitialize(
+    VOID
+    )
+{
+    ASSERT(IsZeroMemory(&Pool, sizeof (XENVKBD_POOL)));
+
+    KeInitializeSpinLock(&Pool.Lock);
+}
+
+VOID
+PoolTeardown(
+    VOID
+    )
+{
+    ULONG   Index;
+
+    for (Index = 0; Index < Pool.ClassCount; Index++) {
+        PXENVKBD_POOL_CLASS Class = &Pool.Class[Index];
+
+        ExDeleteNPagedLookasideList(&Class->Lookaside);
+    }
+
+    for (Index = 0; Index < Pool.TagCount; Index++) {
+        PXENVKBD_POOL_TAG   Entry = &Pool.Tag[Index];
+
+        if (Entry->Bytes != 0)
+            Warning("%c%c%c%c: LEAKED %d bytes (allocations %d frees %d)\n",
+                    POOL_TAG_CHARS(Entry->Tag),
+                    Entry->Bytes,
+                    Entry->Allocations,
+                    Entry->Frees);
+    }
+
+    RtlZeroMemory(&Pool, sizeof (XENVKBD_POOL));
+}
@@ -33,6 +33,7 @@
 #include <ntddk.h>
 
 #include "registry.h"
+#include "pool.h"
 #include "assert.h"
 #include "util.h"
 
@@ -45,7 +46,7 @@ __RegistryAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, REGISTRY_TAG);
+    return PoolAllocate(REGISTRY_TAG, Length);
 }
 
 static FORCEINLINE VOID
@@ -53,7 +54,7 @@ __RegistryFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, REGISTRY_TAG);
+    PoolFree(Buffer, REGISTRY_TAG);
 }
 
 NTSTATUS
@@ -831,29 +832,31 @@ fail1:
     return status;
 }
 
+// The ANSI_STRING array and the string bodies share a single arena, so
+// RegistryFreeSzValue() only has to free the array.
 static PANSI_STRING
 RegistrySzToAnsi(
     IN  PWCHAR      Buffer
     )
 {
+    ARENA           Arena;
     PANSI_STRING    Ansi;
     ULONG           Length;
     UNICODE_STRING  Unicode;
     NTSTATUS        status;
 
-    Ansi = __RegistryAllocate(sizeof (ANSI_STRING) * 2);
+    Length = (ULONG)wcslen(Buffer);
 
-    status = STATUS_NO_MEMORY;
-    if (Ansi == NULL)
+    if (!__ArenaCreate(&Arena,
+                       ARENA_SIZE(sizeof (ANSI_STRING) * 2) +
+                       ARENA_SIZE((Length + 1) * sizeof (CHAR)),
+                       REGISTRY_TAG))
         goto fail1;
 
-    Length = (ULONG)wcslen(Buffer);
-    Ansi[0].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
-    Ansi[0].Buffer = __RegistryAllocate(Ansi[0].MaximumLength);
+    Ansi = __ArenaAllocate(&Arena, sizeof (ANSI_STRING) * 2);
 
-    status = STATUS_NO_MEMORY;
-    if (Ansi[0].Buffer == NULL)
-        goto fail2;
+    Ansi[0].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
+    Ansi[0].Buffer = __ArenaAllocate(&Arena, Ansi[0].MaximumLength);
 
     RtlInitUnicodeString(&Unicode, Buffer);
     status = RtlUnicodeStringToAnsiString(&Ansi[0], &Unicode, FALSE);
@@ -863,9 +866,6 @@ RegistrySzToAnsi(
 
     return Ansi;
 
-fail2:
-    __RegistryFree(Ansi);
-
 fail1:
     return NULL;
 }
@@ -875,13 +875,16 @@ RegistryMultiSzToAnsi(
     IN  PWCHAR      Buffer
     )
 {
+    ARENA           Arena;
     PANSI_STRING    Ansi;
+    ULONG           Size;
     LONG            Index;
     LONG            Count;
     NTSTATUS        status;
 
     Index = 0;
     Count = 0;
+    Size = 0;
     for (;;) {
         ULONG   Length;
 
@@ -889,27 +892,25 @@ RegistryMultiSzToAnsi(
         if (Length == 0)
             break;
 
+        Size += ARENA_SIZE((Length + 1) * sizeof (CHAR));
         Index += Length + 1;
         Count++;
     }
 
-    Ansi = __RegistryAllocate(sizeof (ANSI_STRING) * (Count + 1));
-
-    status = STATUS_NO_MEMORY;
-    if (Ansi == NULL)
+    if (!__ArenaCreate(&Arena,
+                       ARENA_SIZE(sizeof (ANSI_STRING) * (Count + 1)) + Size,
+                       REGISTRY_TAG))
         goto fail1;
 
+    Ansi = __ArenaAllocate(&Arena, sizeof (ANSI_STRING) * (Count + 1));
+
     for (Index = 0; Index < Count; Index++) {
         ULONG           Length;
         UNICODE_STRING  Unicode;
 
         Length = (ULONG)wcslen(Buffer);
         Ansi[Index].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
-        Ansi[Index].Buffer = __RegistryAllocate(Ansi[Index].MaximumLength);
-
-        status = STATUS_NO_MEMORY;
-        if (Ansi[Index].Buffer == NULL)
-            goto fail2;
+        Ansi[Index].Buffer = __ArenaAllocate(&Arena, Ansi[Index].MaximumLength);
 
         RtlInitUnicodeString(&Unicode, Buffer);
 
@@ -922,12 +923,6 @@ RegistryMultiSzToAnsi(
 
     return Ansi;
 
-fail2:
-    while (--Index >= 0)
-        __RegistryFree(Ansi[Index].Buffer);
-
-    __RegistryFree(Ansi);
-
 fail1:
     return NULL;
 }
@@ -1225,6 +1220,7 @@ RegistryQuerySystemStartOption(
     UNICODE_STRING                  Unicode;
     HANDLE                          Key;
     PANSI_STRING                    Ansi;
+    ARENA                           Arena;
     ULONG                           Length;
     PCHAR                           Option;
     PCHAR                           Context;
@@ -1256,19 +1252,19 @@ RegistryQuerySystemStartOption(
     goto fail3;
 
 found:
-    *Value = __RegistryAllocate(sizeof (ANSI_STRING) * 2);
+    Length = (ULONG)strlen(Option);
 
     status = STATUS_NO_MEMORY;
-    if (*Value == NULL)
+    if (!__ArenaCreate(&Arena,
+                       ARENA_SIZE(sizeof (ANSI_STRING) * 2) +
+                       ARENA_SIZE((Length + 1) * sizeof (CHAR)),
+                       REGISTRY_TAG))
         goto fail4;
 
-    Length = (ULONG)strlen(Option);
-    (*Value)[0].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
-    (*Value)[0].Buffer = __RegistryAllocate((*Value)[0].MaximumLength);
+    *Value = __ArenaAllocate(&Arena, sizeof (ANSI_STRING) * 2);
 
-    status = STATUS_NO_MEMORY;
-    if ((*Value)[0].Buffer == NULL)
-        goto fail5;
+    (*Value)[0].MaximumLength = (USHORT)(Length + 1) * sizeof (CHAR);
+    (*Value)[0].Buffer = __ArenaAllocate(&Arena, (*Value)[0].MaximumLength);
 
     RtlCopyMemory((*Value)[0].Buffer, Option, Length * sizeof (CHAR));
 
@@ -1280,9 +1276,6 @@ found:
 
     return STATUS_SUCCESS;
 
-fail5:
-    __RegistryFree(*Value);
-
 fail4:
 fail3:
     RegistryFreeSzValue(Ansi);
@@ -1455,14 +1448,10 @@ RegistryFreeSzValue(
     IN  PANSI_STRING    Array
     )
 {
-    ULONG               Index;
-
     if (Array == NULL)
         return;
 
-    for (Index = 0; Array[Index].Buffer != NULL; Index++)
-        __RegistryFree(Array[Index].Buffer);
-
+    // The strings live in the same allocation as the array
     __RegistryFree(Array);
 }
 
@@ -48,17 +48,142 @@
 #include "ring.h"
 #include "hid.h"
 #include "vkbd.h"
+#include "translate.h"
+#include "capture.h"
 #include "thread.h"
 #include "registry.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
 #define MAXNAMELEN  128
 
+typedef enum _XENVKBD_RING_STORE_KEY {
+    RING_STORE_PAGE_GREF = 0,
+    RING_STORE_PAGE_REF,
+    RING_STORE_EVENT_CHANNEL,
+    RING_STORE_REQUEST_ABS_POINTER,
+    RING_STORE_REQUEST_RAW_POINTER,
+    RING_STORE_REQUEST_EVENT_IDX,
+    RING_STORE_REQUEST_KEY_BATCH,
+    RING_STORE_REQUEST_TIMESTAMP,
+    RING_STORE_RING_PAGE_ORDER,
+    RING_STORE_IN_RING_REF0,
+    RING_STORE_IN_RING_REF1,
+    RING_STORE_IN_RING_REF2,
+    RING_STORE_KEY_COUNT
+} XENVKBD_RING_STORE_KEY;
+
+static const PCHAR RingStoreKeyName[] = {
+    "page-gref",
+    // this should not be required - QEMU should use grant references
+    "page-ref",
+    "event-channel",
+    "request-abs-pointer",
+    "request-raw-pointer",
+    "request-event-idx",
+    "request-key-batch",
+    "request-timestamp",
+    "ring-page-order",
+    "in-ring-ref0",
+    "in-ring-ref1",
+    "in-ring-ref2",
+};
+
+C_ASSERT(ARRAYSIZE(RingStoreKeyName) == RING_STORE_KEY_COUNT);
+
+// Large enough for a decimal ULONG64
+#define RING_STORE_VALUE_LENGTH 24
+
+// Optional multi-page in ring. A backend advertising max-ring-page-order
+// may be given ring-page-order = N > 0, in which case the indices (and
+// in_event) stay in page 0 but the in ring moves to 2^N - 1 further pages,
+// granted as in-ring-ref0 onwards. It holds the largest power of two number
+// of slots that fits. Order 0 is the classic single page layout.
+#define RING_MAX_PAGE_ORDER 2
+#define RING_MAX_IN_PAGES   ((1u << RING_MAX_PAGE_ORDER) - 1)
+
+C_ASSERT(RING_STORE_IN_RING_REF2 - RING_STORE_IN_RING_REF0 + 1 == RING_MAX_IN_PAGES);
+
+// Latency histograms (feature-timestamp). Bucket 0 counts delays below
+// 1us and bucket N those in [2^(N-1), 2^N)us; the last is open ended.
+#define RING_LATENCY_BUCKETS    20
+
+// Slots copied out of the shared ring at a time
+#define RING_SNAPSHOT_LENGTH    XENKBD_IN_RING_LEN
+
+// Most recent capture records printed by the debug callback
+#define RING_CAPTURE_DUMP_LIMIT 32
+
+// Fields used on every event are kept together at the front; everything
+// that is only used to connect, disconnect or dump state starts on its own
+// cache line.
 struct _XENVKBD_RING {
-    PXENVKBD_FRONTEND       Frontend;
+    KSPIN_LOCK              Lock;
+    struct xenkbd_page      *Shared;
+    union xenkbd_in_event   *InRing;
+    ULONG                   InRingLength;
     PXENVKBD_HID_CONTEXT    Hid;
+    PXENBUS_EVTCHN_CHANNEL  Channel;
+    BOOLEAN                 Connected;
+    BOOLEAN                 Enabled;
+    BOOLEAN                 AbsPointer;
+    BOOLEAN                 RawPointer;
+    BOOLEAN                 EventIdx;
+    BOOLEAN                 KeyBatch;
+    BOOLEAN                 Timestamp;
+    BOOLEAN                 Coalesce;
+    BOOLEAN                 Dedup;
+    BOOLEAN                 Backpressure;
+    BOOLEAN                 KeyboardPending;
+    BOOLEAN                 AbsMousePending;
+    BOOLEAN                 AbsMouseDirty;
+    ULONG                   FlushRate;
+    ULONG                   DpcBudget;
+
+    XENVKBD_TRANSLATE       Translate;
+    XENVKBD_HID_KEYBOARD    KeyboardLast;
+    XENVKBD_HID_ABSMOUSE    AbsMouseLast;
+    ULONG                   AbsMouseMerged;
+    PXENVKBD_CAPTURE        Capture;
+
+    // Bumped from outside the lock (the ISR, RingNotify(), RingReadReport())
+    LONG                    Dpcs;
+    LONG                    Events;
+
+    // Everything else is only written under Lock, i.e. from the DPC
+    ULONG                   Processed;
+    ULONG                   Slot;
+    ULONG                   Reports;
+    ULONG                   Pending;
+    ULONG                   Coalesced;
+    ULONG                   Deduplicated;
+    ULONG                   Deferred;
+    ULONG                   Full;
+    ULONG                   Occupancy;
+    ULONG                   Overruns;
+    ULONG                   Rechecks;
+    BOOLEAN                 Holding;
+    ULONG                   Holds;
+
+    BOOLEAN                 SkewValid;
+    LONG64                  Skew;
+    ULONG64                 EventStamp;
+    ULONG64                 KeyboardStamp;
+    ULONG64                 AbsMouseStamp;
+    ULONG                   DpcLatency[RING_LATENCY_BUCKETS];
+    ULONG                   DeliveryLatency[RING_LATENCY_BUCKETS];
+
+    KDPC                    Dpc;
+
+    // Private copy of the slots being decoded, so that each one is read
+    // from the shared ring exactly once
+    DECLSPEC_CACHEALIGN
+    union xenkbd_in_event   Snapshot[RING_SNAPSHOT_LENGTH];
+
+    DECLSPEC_CACHEALIGN
+    PXENVKBD_FRONTEND       Frontend;
 
     XENBUS_DEBUG_INTERFACE  DebugInterface;
     XENBUS_STORE_INTERFACE  StoreInterface;
@@ -69,34 +194,38 @@ struct _XENVKBD_RING {
 
     PXENBUS_GNTTAB_CACHE    GnttabCache;
     PMDL                    Mdl;
-    struct xenkbd_page      *Shared;
     PXENBUS_GNTTAB_ENTRY    Entry;
-    PXENBUS_EVTCHN_CHANNEL  Channel;
-    KSPIN_LOCK              Lock;
-    KDPC                    Dpc;
-    ULONG                   Dpcs;
-    ULONG                   Events;
-    BOOLEAN                 Connected;
-    BOOLEAN                 Enabled;
-    BOOLEAN                 AbsPointer;
-    BOOLEAN                 RawPointer;
-
-    XENVKBD_HID_KEYBOARD    KeyboardReport;
-    XENVKBD_HID_ABSMOUSE    AbsMouseReport;
-    BOOLEAN                 KeyboardPending;
-    BOOLEAN                 AbsMousePending;
-
-    USHORT                  KeyCodeToUsageMapping[1 << (sizeof(UCHAR) * 8)];
+    ULONG                   PageOrder;
+    PMDL                    InMdl;
+    ULONG                   InPages;
+    PXENBUS_GNTTAB_ENTRY    InEntry[RING_MAX_IN_PAGES];
+    BOOLEAN                 Parked;
+    BOOLEAN                 FeaturesValid;
+    USHORT                  FeatureDomain;
+    ULONG                   FeaturePageOrder;
+    ULONG                   FeatureSuspendCount;
+
+    CHAR                    StoreValue[RING_STORE_KEY_COUNT][RING_STORE_VALUE_LENGTH];
+    CHAR                    StorePublished[RING_STORE_KEY_COUNT][RING_STORE_VALUE_LENGTH];
+    ULONG                   StorePending;
+    BOOLEAN                 StoreValid;
+    ULONG                   StoreSuspendCount;
+    USHORT                  StoreDomain;
+    ULONG                   StoreWrites;
+    ULONG                   StoreSkipped;
 };
 
 #define XENVKBD_RING_TAG    'gniR'
 
+C_ASSERT(sizeof (XENVKBD_HID_TUNING) == 12);
+C_ASSERT(sizeof (XENVKBD_HID_COUNTERS) == 36);
+
 static FORCEINLINE PVOID
 __RingAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, XENVKBD_RING_TAG);
+    return PoolAllocateObject(XENVKBD_RING_TAG, Length);
 }
 
 static FORCEINLINE VOID
@@ -104,7 +233,7 @@ __RingFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, XENVKBD_RING_TAG);
+    PoolFree(Buffer, XENVKBD_RING_TAG);
 }
 
 static FORCEINLINE NTSTATUS
@@ -129,194 +258,296 @@ __RingCopyBuffer(
     return STATUS_SUCCESS;
 }
 
-#define CONSTRAIN(_Value, _Min, _Max) \
-    (__min(__max((_Value), (_Min)), (_Max)))
-
-static FORCEINLINE UCHAR
-SetBit(
-    IN  UCHAR   Value,
-    IN  UCHAR   BitIdx,
-    IN  BOOLEAN Pressed
+// The backend's clock is not the guest's, so the delay is measured against
+// the smallest (guest - backend) offset seen since connecting. That makes
+// it the time spent beyond the quickest observed path, which is what
+// separates queueing from a constant clock offset.
+static FORCEINLINE VOID
+__RingAccountLatency(
+    IN  PXENVKBD_RING   Ring,
+    IN  PULONG          Histogram,
+    IN  ULONG64         Stamp
     )
 {
-    if (Pressed) {
-        return Value | (1 << BitIdx);
-    } else {
-        return Value & ~(1 << BitIdx);
-    }
-}
+    LONG64              Offset;
+    ULONG64             Delay;
+    ULONG               Bucket;
 
-static FORCEINLINE VOID
-SetArray(
-    IN  PUCHAR  Array,
-    IN  ULONG   Size,
-    IN  UCHAR   Value,
-    IN  BOOLEAN Pressed
-    )
-{
-    ULONG       Idx;
-    if (Pressed) {
-        for (Idx = 0; Idx < Size; ++Idx) {
-            if (Array[Idx] == Value)
-                break;
-            if (Array[Idx] != 0)
-                continue;
-            Array[Idx] = Value;
-            break;
-        }
-    } else {
-        for (Idx = 0; Idx < Size; ++Idx) {
-            if (Array[Idx] == 0)
-                break;
-            if (Array[Idx] != Value)
-                continue;
-            for (; Idx < Size - 1; ++Idx)
-                Array[Idx] = Array[Idx + 1];
-            Array[Size - 1] = 0;
-            break;
-        }
-    }
-}
+    Offset = (LONG64)__GetTimeUs() - (LONG64)(Stamp / 1000);
 
-struct _KEY_CODE_TO_USAGE {
-    const CHAR  *KeyName;
-    UCHAR       KeyCode;
-    USHORT      Usage;
-};
+    if (!Ring->SkewValid || Offset < Ring->Skew) {
+        Ring->Skew = Offset;
+        Ring->SkewValid = TRUE;
+    }
 
-#define DEFINE_USAGE(_KeyCode, _Usage) \
-    { #_KeyCode, _KeyCode, _Usage }
+    Delay = (ULONG64)(Offset - Ring->Skew);
 
-static struct _KEY_CODE_TO_USAGE KeyCodeToUsageTable[] = {
-    DEFINE_USAGE_TABLE
-};
+    if (Delay == 0) {
+        Bucket = 0;
+    } else if (Delay > MAXULONG) {
+        Bucket = RING_LATENCY_BUCKETS - 1;
+    } else {
+        (VOID) _BitScanReverse(&Bucket, (ULONG)Delay);
+        Bucket = __min(Bucket + 1, RING_LATENCY_BUCKETS - 1);
+    }
 
-#undef DEFINE_USAGE
+    Histogram[Bucket]++;
+}
 
-static VOID RingBuildKeyCodeToUsageMapping(
+static FORCEINLINE VOID
+__RingSendKeyboardReport(
     IN  PXENVKBD_RING   Ring
     )
 {
-    ULONG               Index;
-
-    for (Index = 0; Index < ARRAYSIZE(KeyCodeToUsageTable); Index++) {
-        struct _KEY_CODE_TO_USAGE   *Entry = &KeyCodeToUsageTable[Index];
-        ULONG                       Code = Entry->KeyCode;
+    if (Ring->Dedup &&
+        !Ring->KeyboardPending &&
+        RtlEqualMemory(&Ring->Translate.Keyboard,
+                       &Ring->KeyboardLast,
+                       sizeof(XENVKBD_HID_KEYBOARD))) {
+        Ring->Deduplicated++;
+        return;
+    }
 
-        ASSERT3U(Code, <, ARRAYSIZE(Ring->KeyCodeToUsageMapping));
-        ASSERT3U(Ring->KeyCodeToUsageMapping[Code], ==, 0);
-        Ring->KeyCodeToUsageMapping[Code] = Entry->Usage;
+    Ring->Reports++;
+    if (Ring->Capture != NULL)
+        CaptureRecord(Ring->Capture,
+                      CAPTURE_TYPE_REPORT,
+                      Ring->Slot,
+                      &Ring->Translate.Keyboard,
+                      sizeof (XENVKBD_HID_KEYBOARD));
+
+    Ring->KeyboardPending = HidSendReadReport(Ring->Hid,
+                                              &Ring->Translate.Keyboard,
+                                              sizeof(XENVKBD_HID_KEYBOARD));
+    if (Ring->KeyboardPending) {
+        Ring->Pending++;
+        return;
     }
+
+    if (Ring->Timestamp && Ring->KeyboardStamp != 0)
+        __RingAccountLatency(Ring, Ring->DeliveryLatency, Ring->KeyboardStamp);
+
+    Ring->KeyboardLast = Ring->Translate.Keyboard;
 }
 
-static FORCEINLINE const CHAR *
-__KeyCodeToKeyName(
-    ULONG   KeyCode
+static FORCEINLINE VOID
+__RingSendAbsMouseReport(
+    IN  PXENVKBD_RING   Ring
     )
 {
-    ULONG   Index;
+    Ring->AbsMouseDirty = FALSE;
+    Ring->AbsMouseMerged = 0;
+
+    // dZ is relative so a repeated wheel report is never a duplicate
+    if (Ring->Dedup &&
+        !Ring->AbsMousePending &&
+        Ring->Translate.AbsMouse.dZ == 0 &&
+        RtlEqualMemory(&Ring->Translate.AbsMouse,
+                       &Ring->AbsMouseLast,
+                       sizeof(XENVKBD_HID_ABSMOUSE))) {
+        Ring->Deduplicated++;
+        return;
+    }
 
-    for (Index = 0; Index < ARRAYSIZE(KeyCodeToUsageTable); Index++) {
-        struct _KEY_CODE_TO_USAGE   *Entry = &KeyCodeToUsageTable[Index];
+    Ring->Reports++;
+    if (Ring->Capture != NULL)
+        CaptureRecord(Ring->Capture,
+                      CAPTURE_TYPE_REPORT,
+                      Ring->Slot,
+                      &Ring->Translate.AbsMouse,
+                      sizeof (XENVKBD_HID_ABSMOUSE));
 
-        if (Entry->KeyCode == KeyCode)
-            return Entry->KeyName;
+    Ring->AbsMousePending = HidSendReadReport(Ring->Hid,
+                                              &Ring->Translate.AbsMouse,
+                                              sizeof(XENVKBD_HID_ABSMOUSE));
+    if (Ring->AbsMousePending) {
+        Ring->Pending++;
+        return;
     }
 
-    return "UNKNOWN";
-}
-
-static FORCEINLINE USHORT
-__RingKeyCodeToUsage(
-    IN  PXENVKBD_RING   Ring,
-    IN  ULONG           KeyCode
-    )
-{
-    if (KeyCode < ARRAYSIZE(Ring->KeyCodeToUsageMapping))
-        return Ring->KeyCodeToUsageMapping[KeyCode];
+    if (Ring->Timestamp && Ring->AbsMouseStamp != 0)
+        __RingAccountLatency(Ring, Ring->DeliveryLatency, Ring->AbsMouseStamp);
 
-    return 0;
+    Ring->AbsMouseLast = Ring->Translate.AbsMouse;
 }
 
 static FORCEINLINE VOID
-__RingEventMotion(
-    IN  PXENVKBD_RING   Ring,
-    IN  LONG            dX,
-    IN  LONG            dY,
-    IN  LONG            dZ
+__RingFlushAbsMouseReport(
+    IN  PXENVKBD_RING   Ring
     )
 {
-    Ring->AbsMouseReport.X = (USHORT)CONSTRAIN(Ring->AbsMouseReport.X + dX, 0, 32767);
-    Ring->AbsMouseReport.Y = (USHORT)CONSTRAIN(Ring->AbsMouseReport.Y + dY, 0, 32767);
-    Ring->AbsMouseReport.dZ = -(CHAR)CONSTRAIN(dZ, -127, 127);
-
-    Ring->AbsMousePending = HidSendReadReport(Ring->Hid,
-                                              &Ring->AbsMouseReport,
-                                              sizeof(XENVKBD_HID_ABSMOUSE));
+    if (Ring->AbsMouseDirty)
+        __RingSendAbsMouseReport(Ring);
 }
 
 static FORCEINLINE VOID
-__RingEventKeypress(
-    IN  PXENVKBD_RING   Ring,
-    IN  ULONG           KeyCode,
-    IN  BOOLEAN         Pressed
+__RingUpdateAbsMouseReport(
+    IN  PXENVKBD_RING   Ring
     )
 {
-    if (KeyCode >= 0x110 && KeyCode <= 0x114) {
-        // Mouse Buttons
-        Ring->AbsMouseReport.Buttons = SetBit(Ring->AbsMouseReport.Buttons,
-                                              (UCHAR)(KeyCode - 0x110),
-                                              Pressed);
+    // Wheel movement is relative, so it must not be merged away
+    if (!Ring->Coalesce || Ring->Translate.AbsMouse.dZ != 0) {
+        __RingSendAbsMouseReport(Ring);
+        return;
+    }
 
-        Ring->AbsMousePending = HidSendReadReport(Ring->Hid,
-                                                  &Ring->AbsMouseReport,
-                                                  sizeof(XENVKBD_HID_ABSMOUSE));
+    if (Ring->AbsMouseDirty)
+        Ring->Coalesced++;
 
-    } else {
-        // map KeyCode to Usage
-        USHORT  Usage = __RingKeyCodeToUsage(Ring, KeyCode);
+    Ring->AbsMouseDirty = TRUE;
 
-        Trace("%s (%02x) -> %04x (%s)\n",
-              __KeyCodeToKeyName(KeyCode), KeyCode,
-              Usage, Pressed ? "PRESSED" : "RELEASED");
+    if (Ring->FlushRate != 0 &&
+        ++Ring->AbsMouseMerged >= Ring->FlushRate)
+        __RingSendAbsMouseReport(Ring);
+}
 
-        if (Usage == 0)
-            return; // non-standard key
+static VOID
+RingTranslateCallback(
+    IN  PVOID                       Context,
+    IN  ULONG                       Index,
+    IN  const union xenkbd_in_event *Event,
+    IN  XENVKBD_TRANSLATE_RESULT    Result
+    )
+{
+    PXENVKBD_RING                   Ring = Context;
+
+    Ring->Slot = Index;
+
+    // Only the first result of a batched slot carries the event
+    if (Ring->Capture != NULL && Event != NULL)
+        CaptureRecord(Ring->Capture,
+                      CAPTURE_TYPE_EVENT,
+                      Index,
+                      Event,
+                      sizeof (union xenkbd_in_event));
+
+    if (Ring->Timestamp && Event != NULL) {
+        Ring->EventStamp = TranslateGetTimestamp(Event);
+        if (Ring->EventStamp != 0)
+            __RingAccountLatency(Ring, Ring->DpcLatency, Ring->EventStamp);
+    }
 
-        if (Usage >= 0xE0 && Usage <= 0xE7) {
-            // Modifier
-            Ring->KeyboardReport.Modifiers = SetBit(Ring->KeyboardReport.Modifiers,
-                                                    (UCHAR)(Usage - 0xE0),
-                                                    Pressed);
-        } else {
-            // Standard Key
-            SetArray(Ring->KeyboardReport.Keys,
-                     6,
-                     (UCHAR)Usage,
-                     Pressed);
-        }
-        Ring->KeyboardPending = HidSendReadReport(Ring->Hid,
-                                                  &Ring->KeyboardReport,
-                                                  sizeof(XENVKBD_HID_KEYBOARD));
+    // Remember the newest event behind each report for delivery latency
+    if (Result == TRANSLATE_RESULT_KEYBOARD)
+        Ring->KeyboardStamp = Ring->EventStamp;
+    else if (Result != TRANSLATE_RESULT_NONE)
+        Ring->AbsMouseStamp = Ring->EventStamp;
+
+    switch (Result) {
+    case TRANSLATE_RESULT_NONE:
+        break;
+    case TRANSLATE_RESULT_KEYBOARD:
+        // Keep pointer and keyboard reports in ring order
+        __RingFlushAbsMouseReport(Ring);
+        __RingSendKeyboardReport(Ring);
+        break;
+    case TRANSLATE_RESULT_BUTTONS:
+        __RingSendAbsMouseReport(Ring);
+        break;
+    case TRANSLATE_RESULT_POINTER:
+        __RingUpdateAbsMouseReport(Ring);
+        break;
+    default:
+        ASSERT(FALSE);
+        break;
+    }
+}
 
+// In backpressure mode nothing is applied over a report that the class
+// driver has not yet read. Pointer events stay in the ring, where a
+// coalescing backend can merge them, and key transitions are neither
+// overwritten nor lost.
+static BOOLEAN
+RingHoldEvent(
+    IN  PVOID                       Context,
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    PXENVKBD_RING                   Ring = Context;
+
+    switch (Event->type) {
+    case XENKBD_TYPE_MOTION:
+    case XENKBD_TYPE_POS:
+        return Ring->AbsMousePending;
+    case XENKBD_TYPE_KEY:
+    case XENKBD_TYPE_KEY_BATCH:
+        // Keys may also be pointer buttons
+        return Ring->KeyboardPending || Ring->AbsMousePending;
+    default:
+        return FALSE;
     }
 }
 
-static FORCEINLINE VOID
-__RingEventPosition(
-    IN  PXENVKBD_RING   Ring,
-    IN  ULONG           X,
-    IN  ULONG           Y,
-    IN  LONG            dZ
+// Start a replay with the translation state just reset
+static VOID
+__RingCaptureConnect(
+    IN  PXENVKBD_RING       Ring
     )
 {
-    Ring->AbsMouseReport.X = (USHORT)CONSTRAIN(X, 0, 32767);
-    Ring->AbsMouseReport.Y = (USHORT)CONSTRAIN(Y, 0, 32767);
-    Ring->AbsMouseReport.dZ = -(CHAR)CONSTRAIN(dZ, -127, 127);
+    XENVKBD_CAPTURE_CONNECT Connect;
+
+    RtlZeroMemory(&Connect, sizeof (Connect));
+
+    if (Ring->EventIdx)
+        Connect.Flags |= XENVKBD_CAPTURE_EVENT_IDX;
+    if (Ring->KeyBatch)
+        Connect.Flags |= XENVKBD_CAPTURE_KEY_BATCH;
+    if (Ring->Timestamp)
+        Connect.Flags |= XENVKBD_CAPTURE_TIMESTAMP;
+    if (Ring->Coalesce)
+        Connect.Flags |= XENVKBD_CAPTURE_COALESCE;
+    if (Ring->Dedup)
+        Connect.Flags |= XENVKBD_CAPTURE_DEDUP;
+    if (Ring->Backpressure)
+        Connect.Flags |= XENVKBD_CAPTURE_BACKPRESSURE;
+
+    Connect.FlushRate = Ring->FlushRate;
+    Connect.DpcBudget = Ring->DpcBudget;
+
+    CaptureRecord(Ring->Capture,
+                  CAPTURE_TYPE_CONNECT,
+                  Ring->InRingLength,
+                  &Connect,
+                  sizeof (Connect));
+}
 
-    Ring->AbsMousePending = HidSendReadReport(Ring->Hid,
-                                              &Ring->AbsMouseReport,
-                                              sizeof(XENVKBD_HID_ABSMOUSE));
+static VOID
+RingTranslatePass(
+    IN  PVOID       Context,
+    IN  ULONG       Cons,
+    IN  ULONG       Prod,
+    IN  BOOLEAN     Overrun
+    )
+{
+    PXENVKBD_RING   Ring = Context;
+    ULONG           Count;
+
+    // The engine has released every key and button; report that first
+    if (Overrun) {
+        if (Ring->Overruns++ == 0)
+            Warning("%s: in_cons = %u in_prod = %u\n",
+                    FrontendGetPath(Ring->Frontend),
+                    Cons,
+                    Prod);
+
+        __RingFlushAbsMouseReport(Ring);
+        __RingSendKeyboardReport(Ring);
+        __RingSendAbsMouseReport(Ring);
+    }
+
+    // A full ring means the backend has had to stall or drop input
+    Count = Prod - Cons;
+    if (Count > Ring->Occupancy)
+        Ring->Occupancy = Count;
+    if (Count >= Ring->InRingLength)
+        Ring->Full++;
+
+    if (Ring->Capture != NULL)
+        CaptureRecord(Ring->Capture,
+                      CAPTURE_TYPE_PASS,
+                      Cons,
+                      &Prod,
+                      sizeof (ULONG));
 }
 
 static VOID
@@ -351,7 +582,9 @@ RingDpc(
     IN  PVOID       Argument2
     )
 {
-    PXENVKBD_RING   Ring = Context;
+    PXENVKBD_RING           Ring = Context;
+    XENVKBD_TRANSLATE_RING  InRing;
+    XENVKBD_TRANSLATE_STOP  Stop;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Argument1);
@@ -364,62 +597,53 @@ RingDpc(
     if (!Ring->Enabled)
         goto done;
 
-    for (;;) {
-        ULONG   in_cons;
-        ULONG   in_prod;
-
-        KeMemoryBarrier();
-
-        in_cons = Ring->Shared->in_cons;
-        in_prod = Ring->Shared->in_prod;
-
-        KeMemoryBarrier();
-
-        if (in_cons == in_prod)
-            break;
-
-        while (in_cons != in_prod) {
-            union xenkbd_in_event *in_evt;
-
-            in_evt = &XENKBD_IN_RING_REF(Ring->Shared, in_cons);
-            ++in_cons;
-
-            switch (in_evt->type) {
-            case XENKBD_TYPE_MOTION:
-                __RingEventMotion(Ring,
-                                  in_evt->motion.rel_x,
-                                  in_evt->motion.rel_y,
-                                  in_evt->motion.rel_z);
-                break;
-            case XENKBD_TYPE_KEY:
-                __RingEventKeypress(Ring,
-                                    in_evt->key.keycode,
-                                    in_evt->key.pressed);
-                break;
-            case XENKBD_TYPE_POS:
-                __RingEventPosition(Ring,
-                                    in_evt->pos.abs_x,
-                                    in_evt->pos.abs_y,
-                                    in_evt->pos.rel_z);
-                break;
-            case XENKBD_TYPE_MTOUCH:
-                Trace("MTOUCH: %u %u %u %u\n",
-                     in_evt->mtouch.event_type,
-                     in_evt->mtouch.contact_id,
-                     in_evt->mtouch.u.pos.abs_x,
-                     in_evt->mtouch.u.pos.abs_y);
-                // call Frontend
-                break;
-            default:
-                Trace("UNKNOWN: %u\n",
-                      in_evt->type);
-                break;
-            }
-        }
+    // A read may have been posted since a report could not be delivered;
+    // push out 1 pending report
+    if (Ring->KeyboardPending)
+        __RingSendKeyboardReport(Ring);
+    else if (Ring->AbsMousePending)
+        __RingSendAbsMouseReport(Ring);
+
+    InRing.Shared = Ring->Shared;
+    InRing.Slots = Ring->InRing;
+    InRing.Length = Ring->InRingLength;
+    InRing.EventIdx = Ring->EventIdx;
+    InRing.Backpressure = Ring->Backpressure;
+    InRing.Snapshot = Ring->Snapshot;
+    InRing.SnapshotLength = RING_SNAPSHOT_LENGTH;
+    InRing.Applied = 0;
+    InRing.Rechecks = 0;
+
+    Stop = TranslateRing(&Ring->Translate,
+                         &InRing,
+                         (Ring->DpcBudget != 0) ? Ring->DpcBudget : MAXULONG,
+                         RingTranslatePass,
+                         RingTranslateCallback,
+                         RingHoldEvent,
+                         Ring);
+
+    Ring->Processed += InRing.Applied;
+    Ring->Rechecks += InRing.Rechecks;
+
+    __RingFlushAbsMouseReport(Ring);
+
+    Ring->Holding = (Stop == TRANSLATE_STOP_HELD) ? TRUE : FALSE;
+
+    if (Ring->Holding) {
+        // Leave the channel masked; the next read re-queues the DPC, which
+        // delivers the pending report and resumes consumption
+        Ring->Holds++;
+        goto done;
+    }
 
-        KeMemoryBarrier();
+    if (Stop == TRANSLATE_STOP_BUDGET) {
+        // Leave the channel masked and pick up the remainder later
+        Ring->Deferred++;
 
-        Ring->Shared->in_cons = in_cons;
+        if (KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
+            InterlockedIncrement(&Ring->Dpcs);
+
+        goto done;
     }
 
     XENBUS_EVTCHN(Unmask,
@@ -445,14 +669,43 @@ RingEvtchnCallback(
     UNREFERENCED_PARAMETER(InterruptObject);
 
     ASSERT(Ring != NULL);
-    Ring->Events++;
+    InterlockedIncrement(&Ring->Events);
 
     if (KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
-        Ring->Dpcs++;
+        InterlockedIncrement(&Ring->Dpcs);
 
     return TRUE;
 }
 
+static VOID
+RingDebugLatency(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONG               Bucket;
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "LATENCY: Skew = %lldus\n",
+                 Ring->Skew);
+
+    for (Bucket = 0; Bucket < RING_LATENCY_BUCKETS; Bucket++) {
+        if (Ring->DpcLatency[Bucket] == 0 &&
+            Ring->DeliveryLatency[Bucket] == 0)
+            continue;
+
+        XENBUS_DEBUG(Printf,
+                     &Ring->DebugInterface,
+                     "%s%8uus: DPC = %u DELIVERY = %u\n",
+                     (Bucket == RING_LATENCY_BUCKETS - 1) ? ">=" : "< ",
+                     (Bucket == RING_LATENCY_BUCKETS - 1) ?
+                     1u << (Bucket - 1) :
+                     1u << Bucket,
+                     Ring->DpcLatency[Bucket],
+                     Ring->DeliveryLatency[Bucket]);
+    }
+}
+
 static VOID
 RingDebugCallback(
     IN  PVOID           Argument,
@@ -465,32 +718,90 @@ RingDebugCallback(
 
     XENBUS_DEBUG(Printf,
                  &Ring->DebugInterface,
-                 "0x%p [%s]\n",
+                 "0x%p [%s]%s%s%s%s ORDER %u (%u slots)\n",
                  Ring,
-                 (Ring->Enabled) ? "ENABLED" : "DISABLED");
+                 (Ring->Enabled) ? "ENABLED" : "DISABLED",
+                 (Ring->Parked) ? " PARKED" : "",
+                 (Ring->EventIdx) ? " EVENT_IDX" : "",
+                 (Ring->KeyBatch) ? " KEY_BATCH" : "",
+                 (Ring->Timestamp) ? " TIMESTAMP" : "",
+                 Ring->PageOrder,
+                 Ring->InRingLength);
 
     XENBUS_DEBUG(Printf,
                  &Ring->DebugInterface,
                  "KBD: %02x %02x %02x %02x %02x %02x %02x %02x%s\n",
-                 Ring->KeyboardReport.ReportId,
-                 Ring->KeyboardReport.Modifiers,
-                 Ring->KeyboardReport.Keys[0],
-                 Ring->KeyboardReport.Keys[1],
-                 Ring->KeyboardReport.Keys[2],
-                 Ring->KeyboardReport.Keys[3],
-                 Ring->KeyboardReport.Keys[4],
-                 Ring->KeyboardReport.Keys[5],
+                 Ring->Translate.Keyboard.ReportId,
+                 Ring->Translate.Keyboard.Modifiers,
+                 Ring->Translate.Keyboard.Keys[0],
+                 Ring->Translate.Keyboard.Keys[1],
+                 Ring->Translate.Keyboard.Keys[2],
+                 Ring->Translate.Keyboard.Keys[3],
+                 Ring->Translate.Keyboard.Keys[4],
+                 Ring->Translate.Keyboard.Keys[5],
                  Ring->KeyboardPending ? " PENDING" : "");
 
     XENBUS_DEBUG(Printf,
                  &Ring->DebugInterface,
                  "MOU: %02x %02x %04x %04x %02x%s\n",
-                 Ring->AbsMouseReport.ReportId,
-                 Ring->AbsMouseReport.Buttons,
-                 Ring->AbsMouseReport.X,
-                 Ring->AbsMouseReport.Y,
-                 Ring->AbsMouseReport.dZ,
+                 Ring->Translate.AbsMouse.ReportId,
+                 Ring->Translate.AbsMouse.Buttons,
+                 Ring->Translate.AbsMouse.X,
+                 Ring->Translate.AbsMouse.Y,
+                 Ring->Translate.AbsMouse.dZ,
                  Ring->AbsMousePending ? " PENDING" : "");
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "TUNING: %s%s%sFlushRate = %u DpcBudget = %u\n",
+                 Ring->Coalesce ? "COALESCE " : "",
+                 Ring->Dedup ? "DEDUP " : "",
+                 Ring->Backpressure ? "BACKPRESSURE " : "",
+                 Ring->FlushRate,
+                 Ring->DpcBudget);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "Events = %u Dpcs = %u Processed = %u Reports = %u Pending = %u\n",
+                 Ring->Events,
+                 Ring->Dpcs,
+                 Ring->Processed,
+                 Ring->Reports,
+                 Ring->Pending);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "Coalesced = %u Deduplicated = %u Deferred = %u\n",
+                 Ring->Coalesced,
+                 Ring->Deduplicated,
+                 Ring->Deferred);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "Full = %u Occupancy = %u/%u Overruns = %u Rechecks = %u Holds = %u%s\n",
+                 Ring->Full,
+                 Ring->Occupancy,
+                 Ring->InRingLength,
+                 Ring->Overruns,
+                 Ring->Rechecks,
+                 Ring->Holds,
+                 (Ring->Holding) ? " HOLDING" : "");
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "STORE: Writes = %u Skipped = %u%s%s\n",
+                 Ring->StoreWrites,
+                 Ring->StoreSkipped,
+                 Ring->StoreValid ? " PUBLISHED" : "",
+                 Ring->FeaturesValid ? " FEATURES" : "");
+
+    if (Ring->Timestamp)
+        RingDebugLatency(Ring);
+
+    if (Ring->Capture != NULL)
+        CaptureDebugCallback(Ring->Capture,
+                             &Ring->DebugInterface,
+                             RING_CAPTURE_DUMP_LIMIT);
 }
 
 NTSTATUS
@@ -499,6 +810,8 @@ RingInitialize(
     OUT PXENVKBD_RING       *Ring
     )
 {
+    const XENVKBD_CONFIG    *Config;
+    ULONG                   Records;
     NTSTATUS                status;
 
     Trace("=====>\n");
@@ -524,7 +837,14 @@ RingInitialize(
     FdoGetEvtchnInterface(PdoGetFdo(FrontendGetPdo(Frontend)),
                           &(*Ring)->EvtchnInterface);
 
-    RingBuildKeyCodeToUsageMapping(*Ring);
+    // Capture is diagnostic only, so failing to set it up is not fatal
+    Config = DriverGetConfig();
+    Records = Config->CaptureRecords;
+    DriverPutConfig(Config);
+
+    if (Records != 0 &&
+        !NT_SUCCESS(CaptureCreate(Records, &(*Ring)->Capture)))
+        (*Ring)->Capture = NULL;
 
     return STATUS_SUCCESS;
 
@@ -533,58 +853,157 @@ fail1:
     return status;
 }
 
-static FORCEINLINE VOID
-RingReadFeatures(
-    IN  PXENVKBD_RING   Ring
+static ULONG
+__RingReadFeature(
+    IN  PXENVKBD_RING   Ring,
+    IN  PCHAR           Name
     )
 {
     PCHAR               Buffer;
+    ULONGLONG           Start;
+    ULONG               Value;
     NTSTATUS            status;
 
+    Start = __GetTimeUs();
     status = XENBUS_STORE(Read,
                           &Ring->StoreInterface,
                           NULL,
                           FrontendGetBackendPath(Ring->Frontend),
-                          "feature-abs-pointer",
+                          Name,
                           &Buffer);
-    if (NT_SUCCESS(status)) {
-        Ring->AbsPointer = (BOOLEAN)strtoul(Buffer, NULL, 2);
+    FrontendAccountStore(Ring->Frontend, Start);
+    if (!NT_SUCCESS(status))
+        return 0;
 
-        XENBUS_STORE(Free,
-                     &Ring->StoreInterface,
-                     Buffer);
-    } else {
-        Ring->AbsPointer = FALSE;
-    }
+    Value = strtoul(Buffer, NULL, 10);
 
-    status = XENBUS_STORE(Read,
-                          &Ring->StoreInterface,
-                          NULL,
-                          FrontendGetBackendPath(Ring->Frontend),
-                          "feature-raw-pointer",
-                          &Buffer);
-    if (NT_SUCCESS(status)) {
-        Ring->RawPointer = (BOOLEAN)strtoul(Buffer, NULL, 2);
+    XENBUS_STORE(Free,
+                 &Ring->StoreInterface,
+                 Buffer);
 
-        XENBUS_STORE(Free,
-                     &Ring->StoreInterface,
-                     Buffer);
-    } else {
-        Ring->RawPointer = FALSE;
-    }
+    return Value;
 }
 
-NTSTATUS
-RingConnect(
+static FORCEINLINE VOID
+RingReadFeatures(
     IN  PXENVKBD_RING   Ring
     )
 {
-    PFN_NUMBER          Pfn;
-    PXENVKBD_FRONTEND   Frontend;
+    ULONG               SuspendCount;
+    USHORT              Domain;
+
+    SuspendCount = FrontendGetSuspendCount(Ring->Frontend);
+    Domain = FrontendGetBackendDomain(Ring->Frontend);
+
+    // A backend's features cannot change without it being replaced,
+    // which means a different domain or a migration
+    if (Ring->FeaturesValid &&
+        Ring->FeatureSuspendCount == SuspendCount &&
+        Ring->FeatureDomain == Domain)
+        return;
+
+    Ring->AbsPointer = (__RingReadFeature(Ring, "feature-abs-pointer") != 0);
+    Ring->RawPointer = (__RingReadFeature(Ring, "feature-raw-pointer") != 0);
+    Ring->EventIdx = (__RingReadFeature(Ring, "feature-event-idx") != 0);
+    Ring->KeyBatch = (__RingReadFeature(Ring, "feature-key-batch") != 0);
+    Ring->Timestamp = (__RingReadFeature(Ring, "feature-timestamp") != 0);
+    Ring->FeaturePageOrder = __RingReadFeature(Ring, "max-ring-page-order");
+
+    // Don't cache a backend that is not ready for us
+    Ring->FeaturesValid = Ring->RawPointer;
+    Ring->FeatureSuspendCount = SuspendCount;
+    Ring->FeatureDomain = Domain;
+}
+
+static VOID
+RingStoreFormat(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONG               Index;
     NTSTATUS            status;
 
-    Trace("=====>\n");
-    Frontend = Ring->Frontend;
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_PAGE_GREF],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                XENBUS_GNTTAB(GetReference,
+                                              &Ring->GnttabInterface,
+                                              Ring->Entry));
+    ASSERT(NT_SUCCESS(status));
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_PAGE_REF],
+                                RING_STORE_VALUE_LENGTH,
+                                "%llu",
+                                (ULONG64)MmGetMdlPfnArray(Ring->Mdl)[0]);
+    ASSERT(NT_SUCCESS(status));
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_EVENT_CHANNEL],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                XENBUS_EVTCHN(GetPort,
+                                              &Ring->EvtchnInterface,
+                                              Ring->Channel));
+    ASSERT(NT_SUCCESS(status));
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_REQUEST_ABS_POINTER],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                Ring->AbsPointer);
+    ASSERT(NT_SUCCESS(status));
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_REQUEST_RAW_POINTER],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                Ring->RawPointer);
+    ASSERT(NT_SUCCESS(status));
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_REQUEST_EVENT_IDX],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                Ring->EventIdx);
+    ASSERT(NT_SUCCESS(status));
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_REQUEST_KEY_BATCH],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                Ring->KeyBatch);
+    ASSERT(NT_SUCCESS(status));
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_REQUEST_TIMESTAMP],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                Ring->Timestamp);
+    ASSERT(NT_SUCCESS(status));
+
+    // Keys left empty are not written (and are removed if they were before),
+    // so a single page ring looks exactly as it always has
+    if (Ring->PageOrder == 0)
+        return;
+
+    status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_RING_PAGE_ORDER],
+                                RING_STORE_VALUE_LENGTH,
+                                "%u",
+                                Ring->PageOrder);
+    ASSERT(NT_SUCCESS(status));
+
+    for (Index = 0; Index < Ring->InPages; Index++) {
+        status = RtlStringCbPrintfA(Ring->StoreValue[RING_STORE_IN_RING_REF0 + Index],
+                                    RING_STORE_VALUE_LENGTH,
+                                    "%u",
+                                    XENBUS_GNTTAB(GetReference,
+                                                  &Ring->GnttabInterface,
+                                                  Ring->InEntry[Index]));
+        ASSERT(NT_SUCCESS(status));
+    }
+}
+
+static NTSTATUS
+__RingAcquire(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONGLONG           Start;
+    NTSTATUS            status;
 
     status = XENBUS_DEBUG(Acquire, &Ring->DebugInterface);
     if (!NT_SUCCESS(status))
@@ -602,6 +1021,7 @@ RingConnect(
     if (!NT_SUCCESS(status))
         goto fail4;
 
+    Start = __GetTimeUs();
     status = XENBUS_GNTTAB(CreateCache,
                            &Ring->GnttabInterface,
                            "VKBD_Ring_Gnttab",
@@ -614,29 +1034,219 @@ RingConnect(
     if (!NT_SUCCESS(status))
         goto fail5;
 
-    Ring->KeyboardReport.ReportId = 1;
-    Ring->AbsMouseReport.ReportId = 2;
-    RingReadFeatures(Ring);
-
-    status = STATUS_DEVICE_NOT_READY;
-    if (!Ring->RawPointer)
-        goto fail6;
+    FrontendAccountTime(Ring->Frontend, FRONTEND_TIMING_GNTTAB_CACHE, Start);
 
     Ring->Mdl = __AllocatePage();
-    
+
     status = STATUS_NO_MEMORY;
     if (Ring->Mdl == NULL)
-        goto fail7;
+        goto fail6;
 
     ASSERT(Ring->Mdl->MdlFlags & MDL_MAPPED_TO_SYSTEM_VA);
     Ring->Shared = Ring->Mdl->MappedSystemVa;
     ASSERT(Ring->Shared != NULL);
 
-    ASSERT(Ring->Mdl->MdlFlags & MDL_MAPPED_TO_SYSTEM_VA);
-    RtlZeroMemory(Ring->Mdl->MappedSystemVa, PAGE_SIZE);
+    return STATUS_SUCCESS;
+
+fail6:
+    Error("fail6\n");
+
+    XENBUS_GNTTAB(DestroyCache,
+                  &Ring->GnttabInterface,
+                  Ring->GnttabCache);
+    Ring->GnttabCache = NULL;
+
+fail5:
+    Error("fail5\n");
+
+    XENBUS_GNTTAB(Release, &Ring->GnttabInterface);
+
+fail4:
+    Error("fail4\n");
+
+    XENBUS_EVTCHN(Release, &Ring->EvtchnInterface);
+
+fail3:
+    Error("fail3\n");
+
+    XENBUS_STORE(Release, &Ring->StoreInterface);
+
+fail2:
+    Error("fail2\n");
+
+    XENBUS_DEBUG(Release, &Ring->DebugInterface);
+
+fail1:
+    Error("fail1 %08x\n", status);
+
+    return status;
+}
+
+static VOID
+__RingRelease(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    if (Ring->InMdl != NULL) {
+        __FreePages(Ring->InMdl);
+        Ring->InMdl = NULL;
+        Ring->InPages = 0;
+    }
+
+    Ring->Shared = NULL;
+    __FreePage(Ring->Mdl);
+    Ring->Mdl = NULL;
+
+    XENBUS_GNTTAB(DestroyCache,
+                  &Ring->GnttabInterface,
+                  Ring->GnttabCache);
+    Ring->GnttabCache = NULL;
+
+    XENBUS_GNTTAB(Release, &Ring->GnttabInterface);
+    XENBUS_EVTCHN(Release, &Ring->EvtchnInterface);
+    XENBUS_STORE(Release, &Ring->StoreInterface);
+    XENBUS_DEBUG(Release, &Ring->DebugInterface);
+}
+
+static VOID
+__RingSetupInRing(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONG               Order;
+    ULONG               Pages;
+    ULONG               Length;
+
+    Order = __min(Ring->FeaturePageOrder, RING_MAX_PAGE_ORDER);
+    Pages = (1u << Order) - 1;
+
+    // A parked ring may still hold pages sized for a different backend
+    if (Ring->InMdl != NULL && Ring->InPages != Pages) {
+        __FreePages(Ring->InMdl);
+        Ring->InMdl = NULL;
+        Ring->InPages = 0;
+    }
+
+    if (Pages != 0 && Ring->InMdl == NULL) {
+        Ring->InMdl = __AllocatePages(Pages);
+        if (Ring->InMdl != NULL) {
+            Ring->InPages = Pages;
+        } else {
+            Warning("%s: falling back to a single page\n",
+                    FrontendGetPath(Ring->Frontend));
+            Order = 0;
+        }
+    }
+
+    Ring->PageOrder = Order;
+
+    if (Order == 0) {
+        Ring->InRing = XENKBD_IN_RING(Ring->Shared);
+        Ring->InRingLength = XENKBD_IN_RING_LEN;
+        return;
+    }
+
+    ASSERT(Ring->InMdl->MdlFlags & MDL_MAPPED_TO_SYSTEM_VA);
+    Ring->InRing = Ring->InMdl->MappedSystemVa;
+    RtlZeroMemory(Ring->InRing, Ring->InPages * PAGE_SIZE);
+
+    Length = (Ring->InPages * PAGE_SIZE) / XENKBD_IN_EVENT_SIZE;
+    while ((Length & (Length - 1)) != 0)
+        Length &= Length - 1;
+
+    Ring->InRingLength = Length;
+}
+
+static NTSTATUS
+__RingGrantInRing(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONG               Index;
+    NTSTATUS            status;
+
+    for (Index = 0; Index < Ring->InPages && Ring->PageOrder != 0; Index++) {
+        status = XENBUS_GNTTAB(PermitForeignAccess,
+                               &Ring->GnttabInterface,
+                               Ring->GnttabCache,
+                               TRUE,
+                               FrontendGetBackendDomain(Ring->Frontend),
+                               MmGetMdlPfnArray(Ring->InMdl)[Index],
+                               FALSE,
+                               &Ring->InEntry[Index]);
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+__RingRevokeInRing(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < RING_MAX_IN_PAGES; Index++) {
+        if (Ring->InEntry[Index] == NULL)
+            continue;
+
+        (VOID) XENBUS_GNTTAB(RevokeForeignAccess,
+                             &Ring->GnttabInterface,
+                             Ring->GnttabCache,
+                             TRUE,
+                             Ring->InEntry[Index]);
+        Ring->InEntry[Index] = NULL;
+    }
+}
+
+NTSTATUS
+RingConnect(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    PFN_NUMBER          Pfn;
+    PXENVKBD_FRONTEND   Frontend;
+    ULONGLONG           Start;
+    NTSTATUS            status;
+
+    Trace("=====>%s\n", (Ring->Parked) ? " (parked)" : "");
+    Frontend = Ring->Frontend;
+
+    // A parked ring still holds its page, grant cache and interfaces
+    if (!Ring->Parked) {
+        status = __RingAcquire(Ring);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+    }
+
+    Ring->Parked = FALSE;
+
+    TranslateReset(&Ring->Translate);
+
+    Start = __GetTimeUs();
+    RingReadFeatures(Ring);
+    FrontendAccountTime(Frontend, FRONTEND_TIMING_FEATURES, Start);
+
+    status = STATUS_DEVICE_NOT_READY;
+    if (!Ring->RawPointer)
+        goto fail2;
+
+    Ring->Translate.KeyBatch = Ring->KeyBatch;
+    Ring->Translate.Timestamp = Ring->Timestamp;
+
+    RtlZeroMemory(Ring->Shared, PAGE_SIZE);
+    XENKBD_IN_EVENT_IDX(Ring->Shared) = 1;
+
+    __RingSetupInRing(Ring);
+
+    if (Ring->Capture != NULL)
+        __RingCaptureConnect(Ring);
 
     Pfn = MmGetMdlPfnArray(Ring->Mdl)[0];
 
+    Start = __GetTimeUs();
     status = XENBUS_GNTTAB(PermitForeignAccess,
                            &Ring->GnttabInterface,
                            Ring->GnttabCache,
@@ -646,8 +1256,15 @@ RingConnect(
                            FALSE,
                            &Ring->Entry);
     if (!NT_SUCCESS(status))
-        goto fail8;
+        goto fail3;
+
+    status = __RingGrantInRing(Ring);
+    if (!NT_SUCCESS(status))
+        goto fail4;
 
+    FrontendAccountTime(Frontend, FRONTEND_TIMING_GRANT, Start);
+
+    Start = __GetTimeUs();
     Ring->Channel = XENBUS_EVTCHN(Open,
                                   &Ring->EvtchnInterface,
                                   XENBUS_EVTCHN_TYPE_UNBOUND,
@@ -658,7 +1275,7 @@ RingConnect(
 
     status = STATUS_UNSUCCESSFUL;
     if (Ring->Channel == NULL)
-        goto fail9;
+        goto fail5;
 
     XENBUS_EVTCHN(Unmask,
                   &Ring->EvtchnInterface,
@@ -666,6 +1283,8 @@ RingConnect(
                   FALSE,
                   TRUE);
 
+    FrontendAccountTime(Frontend, FRONTEND_TIMING_EVTCHN, Start);
+
     status = XENBUS_DEBUG(Register,
                           &Ring->DebugInterface,
                           __MODULE__ "|RING",
@@ -673,13 +1292,15 @@ RingConnect(
                           Ring,
                           &Ring->DebugCallback);
     if (!NT_SUCCESS(status))
-        goto fail10;
+        goto fail6;
+
+    RingStoreFormat(Ring);
 
     Ring->Connected = TRUE;
     return STATUS_SUCCESS;
 
-fail10:
-    Error("fail10\n");
+fail6:
+    Error("fail6\n");
 
     XENBUS_EVTCHN(Close,
                   &Ring->EvtchnInterface,
@@ -688,8 +1309,13 @@ fail10:
 
     Ring->Events = 0;
 
-fail9:
-    Error("fail9\n");
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+    __RingRevokeInRing(Ring);
 
     (VOID) XENBUS_GNTTAB(RevokeForeignAccess,
                          &Ring->GnttabInterface,
@@ -698,43 +1324,17 @@ fail9:
                          Ring->Entry);
     Ring->Entry = NULL;
 
-fail8:
-    Error("fail8\n");
-
-    Ring->Shared = NULL;
-    __FreePage(Ring->Mdl);
-    Ring->Mdl = NULL;
-
-fail7:
-    Error("fail7\n");
-
-fail6:
-    Error("fail6\n");
-
-    XENBUS_GNTTAB(DestroyCache,
-                  &Ring->GnttabInterface,
-                  Ring->GnttabCache);
-    Ring->GnttabCache = NULL;
-
-fail5:
-    Error("fail5\n");
-
-    XENBUS_GNTTAB(Release, &Ring->GnttabInterface);
-
-fail4:
-    Error("fail4\n");
-
-    XENBUS_EVTCHN(Release, &Ring->EvtchnInterface);
-
 fail3:
     Error("fail3\n");
 
-    XENBUS_STORE(Release, &Ring->StoreInterface);
-
 fail2:
     Error("fail2\n");
 
-    XENBUS_DEBUG(Release, &Ring->DebugInterface);
+    Ring->InRing = NULL;
+    Ring->InRingLength = 0;
+    Ring->PageOrder = 0;
+
+    __RingRelease(Ring);
 
 fail1:
     Error("fail1 %08x\n", status);
@@ -748,83 +1348,103 @@ RingStoreWrite(
     IN  PXENBUS_STORE_TRANSACTION   Transaction
     )
 {
-    ULONG                           Port;
+    ULONG                           Index;
+    ULONGLONG                       Begin;
+    ULONGLONG                       Start;
     NTSTATUS                        status;
 
     Trace("=====>\n");
-    status = XENBUS_STORE(Printf,
-                          &Ring->StoreInterface,
-                          Transaction,
-                          FrontendGetPath(Ring->Frontend),
-                          "page-gref",
-                          "%u",
-                          XENBUS_GNTTAB(GetReference,
-                                        &Ring->GnttabInterface,
-                                        Ring->Entry));
-    if (!NT_SUCCESS(status))
-        goto fail1;
-
-    // this should not be required - QEMU should use grant references
-    status = XENBUS_STORE(Printf,
-                          &Ring->StoreInterface,
-                          Transaction,
-                          FrontendGetPath(Ring->Frontend),
-                          "page-ref",
-                          "%llu",
-                          (ULONG64)MmGetMdlPfnArray(Ring->Mdl)[0]);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    Begin = __GetTimeUs();
+
+    // Keys are never removed by the backend, so anything already
+    // committed with the same value need not be written again. The
+    // toolstack re-creates the frontend area across a migration, and
+    // a different backend domain may have been attached meanwhile.
+    if (Ring->StoreValid &&
+        (Ring->StoreSuspendCount != FrontendGetSuspendCount(Ring->Frontend) ||
+         Ring->StoreDomain != FrontendGetBackendDomain(Ring->Frontend)))
+        Ring->StoreValid = FALSE;
+
+    Ring->StorePending = 0;
+
+    for (Index = 0; Index < RING_STORE_KEY_COUNT; Index++) {
+        if (Ring->StoreValue[Index][0] == '\0') {
+            // A key that is no longer wanted (e.g. ring-page-order and
+            // the upper in-ring-ref<N> after a smaller ring is negotiated)
+            // must not be left for the backend to pick up
+            if (Ring->StorePublished[Index][0] == '\0')
+                continue;
 
-    Port = XENBUS_EVTCHN(GetPort,
-                         &Ring->EvtchnInterface,
-                         Ring->Channel);
+            Start = __GetTimeUs();
+            (VOID) XENBUS_STORE(Remove,
+                                &Ring->StoreInterface,
+                                Transaction,
+                                FrontendGetPath(Ring->Frontend),
+                                RingStoreKeyName[Index]);
+            FrontendAccountStore(Ring->Frontend, Start);
+
+            Ring->StorePending |= 1u << Index;
+            Ring->StoreWrites++;
+            continue;
+        }
 
-    status = XENBUS_STORE(Printf,
-                          &Ring->StoreInterface,
-                          Transaction,
-                          FrontendGetPath(Ring->Frontend),
-                          "event-channel",
-                          "%u",
-                          Port);
-    if (!NT_SUCCESS(status))
-        goto fail3;
+        if (Ring->StoreValid &&
+            strcmp(Ring->StorePublished[Index], Ring->StoreValue[Index]) == 0) {
+            Ring->StoreSkipped++;
+            continue;
+        }
 
-    status = XENBUS_STORE(Printf,
-                          &Ring->StoreInterface,
-                          Transaction,
-                          FrontendGetPath(Ring->Frontend),
-                          "request-abs-pointer",
-                          "%u",
-                          Ring->AbsPointer);
-    if (!NT_SUCCESS(status))
-        goto fail4;
+        Start = __GetTimeUs();
+        status = XENBUS_STORE(Printf,
+                              &Ring->StoreInterface,
+                              Transaction,
+                              FrontendGetPath(Ring->Frontend),
+                              RingStoreKeyName[Index],
+                              "%s",
+                              Ring->StoreValue[Index]);
+        FrontendAccountStore(Ring->Frontend, Start);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        Ring->StorePending |= 1u << Index;
+        Ring->StoreWrites++;
+    }
 
-    status = XENBUS_STORE(Printf,
-                          &Ring->StoreInterface,
-                          Transaction,
-                          FrontendGetPath(Ring->Frontend),
-                          "request-raw-pointer",
-                          "%u",
-                          Ring->RawPointer);
-    if (!NT_SUCCESS(status))
-        goto fail5;
+    FrontendAccountTime(Ring->Frontend, FRONTEND_TIMING_STORE_WRITE, Begin);
 
     Trace("<=====\n");
     return STATUS_SUCCESS;
 
-fail5:
-    Error("fail5\n");
-fail4:
-    Error("fail4\n");
-fail3:
-    Error("fail3\n");
-fail2:
-    Error("fail2\n");
 fail1:
-    Error("fail1 %08x\n", status);
+    Error("fail1 %08x (%s)\n", status, RingStoreKeyName[Index]);
+
+    Ring->StorePending = 0;
+
     return status;
 }
 
+VOID
+RingStoreCommit(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < RING_STORE_KEY_COUNT; Index++) {
+        if ((Ring->StorePending & (1u << Index)) == 0)
+            continue;
+
+        RtlCopyMemory(Ring->StorePublished[Index],
+                      Ring->StoreValue[Index],
+                      RING_STORE_VALUE_LENGTH);
+    }
+
+    Ring->StorePending = 0;
+    Ring->StoreSuspendCount = FrontendGetSuspendCount(Ring->Frontend);
+    Ring->StoreDomain = FrontendGetBackendDomain(Ring->Frontend);
+    Ring->StoreValid = TRUE;
+}
+
 NTSTATUS
 RingEnable(
     IN  PXENVKBD_RING   Ring
@@ -854,13 +1474,12 @@ RingDisable(
     Trace("<=====\n");
 }
 
-VOID
-RingDisconnect(
+static VOID
+__RingDisconnect(
     IN  PXENVKBD_RING   Ring
     )
 {
-    Trace("=====>\n");
-
+    ASSERT(Ring->Connected);
     Ring->Connected = FALSE;
 
     XENBUS_DEBUG(Deregister,
@@ -882,30 +1501,95 @@ RingDisconnect(
                          Ring->Entry);
     Ring->Entry = NULL;
 
-    Ring->Shared = NULL;
-    __FreePage(Ring->Mdl);
-    Ring->Mdl = NULL;
+    __RingRevokeInRing(Ring);
 
-    RtlZeroMemory(&Ring->KeyboardReport,
-                  sizeof(XENVKBD_HID_KEYBOARD));
-    RtlZeroMemory(&Ring->AbsMouseReport,
-                  sizeof(XENVKBD_HID_ABSMOUSE));
+    Ring->InRing = NULL;
+    Ring->InRingLength = 0;
+    Ring->PageOrder = 0;
+
+    RtlZeroMemory(&Ring->Translate,
+                  sizeof(XENVKBD_TRANSLATE));
     Ring->KeyboardPending = FALSE;
     Ring->AbsMousePending = FALSE;
+    RtlZeroMemory(&Ring->KeyboardLast,
+                  sizeof(XENVKBD_HID_KEYBOARD));
+    RtlZeroMemory(&Ring->AbsMouseLast,
+                  sizeof(XENVKBD_HID_ABSMOUSE));
+    Ring->AbsMouseDirty = FALSE;
+    Ring->AbsMouseMerged = 0;
+    Ring->Holding = FALSE;
+
+    // A new backend (or host) means a new clock
+    Ring->SkewValid = FALSE;
+    Ring->Skew = 0;
+    Ring->EventStamp = 0;
+    Ring->KeyboardStamp = 0;
+    Ring->AbsMouseStamp = 0;
+
+    RtlZeroMemory(Ring->StoreValue, sizeof (Ring->StoreValue));
+    Ring->StorePending = 0;
+}
 
-    XENBUS_GNTTAB(DestroyCache,
-                  &Ring->GnttabInterface,
-                  Ring->GnttabCache);
-    Ring->GnttabCache = NULL;
+VOID
+RingDisconnect(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    Trace("=====>\n");
 
-    XENBUS_GNTTAB(Release, &Ring->GnttabInterface);
-    XENBUS_EVTCHN(Release, &Ring->EvtchnInterface);
-    XENBUS_STORE(Release, &Ring->StoreInterface);
-    XENBUS_DEBUG(Release, &Ring->DebugInterface);
+    if (Ring->Connected)
+        __RingDisconnect(Ring);
+    else if (!Ring->Parked)
+        goto done;
+
+    Ring->Parked = FALSE;
+
+    __RingRelease(Ring);
+
+done:
+    Trace("<=====\n");
+}
+
+// Disconnect from the backend but hang on to the page, grant cache and
+// interfaces so that a subsequent RingConnect() only has to re-grant the
+// page and re-bind the event channel.
+VOID
+RingPark(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    Trace("=====>\n");
+
+    __RingDisconnect(Ring);
+
+    Ring->Parked = TRUE;
 
     Trace("<=====\n");
 }
 
+ULONG
+RingGetFootprint(
+    IN  PXENVKBD_RING   Ring
+    )
+{
+    ULONG               Size;
+
+    Size = sizeof (XENVKBD_RING);
+
+    // The shared page is held while connected or parked
+    if (Ring->Mdl != NULL)
+        Size += PAGE_SIZE + (ULONG)MmSizeOfMdl(NULL, PAGE_SIZE);
+
+    if (Ring->InMdl != NULL)
+        Size += (Ring->InPages * PAGE_SIZE) +
+                (ULONG)MmSizeOfMdl(NULL, Ring->InPages * PAGE_SIZE);
+
+    if (Ring->Capture != NULL)
+        Size += CaptureGetFootprint(Ring->Capture);
+
+    return Size;
+}
+
 VOID
 RingTeardown(
     IN  PXENVKBD_RING   Ring
@@ -913,14 +1597,56 @@ RingTeardown(
 {
     Trace("=====>\n");
 
+    ASSERT(!Ring->Connected);
+    ASSERT(!Ring->Parked);
+
     KeFlushQueuedDpcs();
     Ring->Dpcs = 0;
 
-    RtlZeroMemory(&Ring->KeyCodeToUsageMapping,
-                  sizeof (Ring->KeyCodeToUsageMapping));
+    if (Ring->Capture != NULL) {
+        CaptureDestroy(Ring->Capture);
+        Ring->Capture = NULL;
+    }
+
+    Ring->Processed = 0;
+    Ring->Slot = 0;
+    Ring->Reports = 0;
+    Ring->Pending = 0;
+    Ring->Coalesced = 0;
+    Ring->Deduplicated = 0;
+    Ring->Deferred = 0;
+    Ring->Full = 0;
+    Ring->Occupancy = 0;
+    Ring->Overruns = 0;
+    Ring->Rechecks = 0;
+    Ring->Holds = 0;
+    RtlZeroMemory(Ring->DpcLatency, sizeof (Ring->DpcLatency));
+    RtlZeroMemory(Ring->DeliveryLatency, sizeof (Ring->DeliveryLatency));
+
+    Ring->Coalesce = FALSE;
+    Ring->Dedup = FALSE;
+    Ring->Backpressure = FALSE;
+    Ring->FlushRate = 0;
+    Ring->DpcBudget = 0;
 
     Ring->AbsPointer = FALSE;
     Ring->RawPointer = FALSE;
+    Ring->EventIdx = FALSE;
+    Ring->KeyBatch = FALSE;
+    Ring->Timestamp = FALSE;
+    Ring->FeaturesValid = FALSE;
+    Ring->FeatureDomain = 0;
+    Ring->FeatureSuspendCount = 0;
+    Ring->FeaturePageOrder = 0;
+
+    RtlZeroMemory(Ring->StorePublished, sizeof (Ring->StorePublished));
+    Ring->StoreValid = FALSE;
+    Ring->StoreSuspendCount = 0;
+    Ring->StoreDomain = 0;
+    Ring->StoreWrites = 0;
+    Ring->StoreSkipped = 0;
+
+    RtlZeroMemory(Ring->Snapshot, sizeof (Ring->Snapshot));
 
     RtlZeroMemory(&Ring->Dpc, sizeof (KDPC));
 
@@ -954,7 +1680,7 @@ RingNotify(
     )
 {
     if (KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
-        Ring->Dpcs++;
+        InterlockedIncrement(&Ring->Dpcs);
 }
 
 NTSTATUS
@@ -970,13 +1696,13 @@ RingGetInputReport(
     case 1:
         return __RingCopyBuffer(Buffer,
                                 Length,
-                                &Ring->KeyboardReport,
+                                &Ring->Translate.Keyboard,
                                 sizeof(XENVKBD_HID_KEYBOARD),
                                 Returned);
     case 2:
         return __RingCopyBuffer(Buffer,
                                 Length,
-                                &Ring->AbsMouseReport,
+                                &Ring->Translate.AbsMouse,
                                 sizeof(XENVKBD_HID_ABSMOUSE),
                                 Returned);
     default:
@@ -984,18 +1710,129 @@ RingGetInputReport(
     }
 }
 
+// The report state belongs to the DPC, so a pending report is sent from
+// there rather than here. Ring->Lock cannot be taken instead, since a read
+// may be posted from within the completion of the previous one, i.e. from
+// HidSendReadReport() with the lock already held.
 VOID
 RingReadReport(
     IN  PXENVKBD_RING   Ring
     )
 {
-    // Check for pending reports, push 1 pending report to subscriber
-    if (Ring->KeyboardPending)
-        Ring->KeyboardPending = HidSendReadReport(Ring->Hid,
-                                                  &Ring->KeyboardReport,
-                                                  sizeof(XENVKBD_HID_KEYBOARD));
-    else if (Ring->AbsMousePending)
-        Ring->AbsMousePending = HidSendReadReport(Ring->Hid,
-                                                  &Ring->AbsMouseReport,
-                                                  sizeof(XENVKBD_HID_ABSMOUSE));
+    if (KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
+        InterlockedIncrement(&Ring->Dpcs);
+}
+
+NTSTATUS
+RingGetFeature(
+    IN  PXENVKBD_RING   Ring,
+    IN  ULONG           ReportId,
+    IN  PVOID           Buffer,
+    IN  ULONG           Length,
+    OUT PULONG          Returned
+    )
+{
+    KIRQL               Irql;
+
+    switch (ReportId) {
+    case 3: {
+        XENVKBD_HID_TUNING  Tuning;
+
+        RtlZeroMemory(&Tuning, sizeof (Tuning));
+        Tuning.ReportId = 3;
+
+        KeAcquireSpinLock(&Ring->Lock, &Irql);
+        if (Ring->Coalesce)
+            Tuning.Flags |= XENVKBD_HID_TUNING_COALESCE;
+        if (Ring->Dedup)
+            Tuning.Flags |= XENVKBD_HID_TUNING_DEDUP;
+        if (Ring->Backpressure)
+            Tuning.Flags |= XENVKBD_HID_TUNING_BACKPRESSURE;
+        Tuning.FlushRate = Ring->FlushRate;
+        Tuning.DpcBudget = Ring->DpcBudget;
+        KeReleaseSpinLock(&Ring->Lock, Irql);
+
+        return __RingCopyBuffer(Buffer,
+                                Length,
+                                &Tuning,
+                                sizeof(XENVKBD_HID_TUNING),
+                                Returned);
+    }
+    case 4: {
+        XENVKBD_HID_COUNTERS    Counters;
+
+        RtlZeroMemory(&Counters, sizeof (Counters));
+        Counters.ReportId = 4;
+
+        KeAcquireSpinLock(&Ring->Lock, &Irql);
+        Counters.Events = (ULONG)Ring->Events;
+        Counters.Dpcs = (ULONG)Ring->Dpcs;
+        Counters.Processed = Ring->Processed;
+        Counters.Reports = Ring->Reports;
+        Counters.Pending = Ring->Pending;
+        Counters.Coalesced = Ring->Coalesced;
+        Counters.Deduplicated = Ring->Deduplicated;
+        Counters.Deferred = Ring->Deferred;
+        KeReleaseSpinLock(&Ring->Lock, Irql);
+
+        return __RingCopyBuffer(Buffer,
+                                Length,
+                                &Counters,
+                                sizeof(XENVKBD_HID_COUNTERS),
+                                Returned);
+    }
+    default:
+        return STATUS_NOT_SUPPORTED;
+    }
+}
+
+NTSTATUS
+RingSetFeature(
+    IN  PXENVKBD_RING   Ring,
+    IN  ULONG           ReportId,
+    IN  PVOID           Buffer,
+    IN  ULONG           Length
+    )
+{
+    XENVKBD_HID_TUNING  Tuning;
+    BOOLEAN             Held;
+    KIRQL               Irql;
+
+    // The counters report is read-only
+    if (ReportId != 3)
+        return STATUS_NOT_SUPPORTED;
+
+    if (Buffer == NULL || Length < sizeof(XENVKBD_HID_TUNING))
+        return STATUS_INVALID_PARAMETER;
+
+    RtlCopyMemory(&Tuning, Buffer, sizeof(XENVKBD_HID_TUNING));
+
+    if (Tuning.ReportId != 3 ||
+        (Tuning.Flags & ~(XENVKBD_HID_TUNING_COALESCE |
+                          XENVKBD_HID_TUNING_DEDUP |
+                          XENVKBD_HID_TUNING_BACKPRESSURE)) != 0)
+        return STATUS_INVALID_PARAMETER;
+
+    KeAcquireSpinLock(&Ring->Lock, &Irql);
+    Ring->Coalesce = (Tuning.Flags & XENVKBD_HID_TUNING_COALESCE) ? TRUE : FALSE;
+    Ring->Dedup = (Tuning.Flags & XENVKBD_HID_TUNING_DEDUP) ? TRUE : FALSE;
+    Ring->Backpressure = (Tuning.Flags & XENVKBD_HID_TUNING_BACKPRESSURE) ? TRUE : FALSE;
+    Ring->FlushRate = Tuning.FlushRate;
+    Ring->DpcBudget = Tuning.DpcBudget;
+    Held = Ring->Holding;
+    KeReleaseSpinLock(&Ring->Lock, Irql);
+
+    // Re-evaluate a held ring under the new settings
+    if (Held && KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
+        InterlockedIncrement(&Ring->Dpcs);
+
+    Info("%s: COALESCE=%u DEDUP=%u BACKPRESSURE=%u FlushRate=%u DpcBudget=%u\n",
+         FrontendGetPath(Ring->Frontend),
+         (Tuning.Flags & XENVKBD_HID_TUNING_COALESCE) ? 1 : 0,
+         (Tuning.Flags & XENVKBD_HID_TUNING_DEDUP) ? 1 : 0,
+         (Tuning.Flags & XENVKBD_HID_TUNING_BACKPRESSURE) ? 1 : 0,
+         Tuning.FlushRate,
+         Tuning.DpcBudget);
+
+    return STATUS_SUCCESS;
 }
@@ -58,6 +58,11 @@ RingStoreWrite(
     IN  PXENBUS_STORE_TRANSACTION   Transaction
     );
 
+extern VOID
+RingStoreCommit(
+    IN  PXENVKBD_RING   Ring
+    );
+
 extern NTSTATUS
 RingEnable(
     IN  PXENVKBD_RING   Ring
@@ -73,6 +78,11 @@ RingDisconnect(
     IN  PXENVKBD_RING   Ring
     );
 
+extern VOID
+RingPark(
+    IN  PXENVKBD_RING   Ring
+    );
+
 extern VOID
 RingTeardown(
     IN  PXENVKBD_RING   Ring
@@ -97,4 +107,26 @@ RingReadReport(
     IN  PXENVKBD_RING   Ring
     );
 
+extern NTSTATUS
+RingGetFeature(
+    IN  PXENVKBD_RING   Ring,
+    IN  ULONG           ReportId,
+    IN  PVOID           Buffer,
+    IN  ULONG           Length,
+    OUT PULONG          Returned
+    );
+
+extern NTSTATUS
+RingSetFeature(
+    IN  PXENVKBD_RING   Ring,
+    IN  ULONG           ReportId,
+    IN  PVOID           Buffer,
+    IN  ULONG           Length
+    );
+
+extern ULONG
+RingGetFootprint(
+    IN  PXENVKBD_RING   Ring
+    );
+
 #endif  // _XENVKBD_RING_H
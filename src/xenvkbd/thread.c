@@ -33,6 +33,7 @@
 #include <ntddk.h>
 
 #include "thread.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -53,7 +54,7 @@ __ThreadAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, THREAD_POOL);
+    return PoolAllocateObject(THREAD_POOL, Length);
 }
 
 static FORCEINLINE VOID
@@ -61,7 +62,7 @@ __ThreadFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, THREAD_POOL);
+    PoolFree(Buffer, THREAD_POOL);
 }
 
 static FORCEINLINE VOID
@@ -224,3 +225,517 @@ ThreadJoin(
 
     __ThreadFree(Thread);
 }
+
+// A small driver-wide pool of worker threads services all work items, so
+// that FDOs, PDOs and frontends need not own a system thread per activity.
+// Each item has its own event (which may be handed to a store watch) and
+// its function is invoked on a worker whenever that event is signalled.
+// Invocations of any one item are serialized.
+//
+// A worker can only wait on MAXIMUM_WAIT_OBJECTS objects, so items are
+// spread over wait sets of up to WORK_SET_SIZE items, each with its own
+// workers; a set is added whenever the existing ones are full. Items that
+// never wait for another item (WORK_CLASS_LEAF) are kept in sets of their
+// own so that they always make progress, however many of the items waiting
+// for them (e.g. PDO device power items) are holding workers.
+//
+// Two workers per set are then sufficient: the only other nested wait is
+// a system power item waiting for a device power item, and the scan item's
+// settle wait is bounded.
+
+#define WORK_WORKER_COUNT   2
+
+#define WORK_SET_SIZE       (MAXIMUM_WAIT_OBJECTS - 1)
+
+typedef struct _WORK_SET    WORK_SET, *PWORK_SET;
+
+struct _XENVKBD_WORK {
+    LIST_ENTRY              ListEntry;
+    PWORK_SET               Set;
+    XENVKBD_WORK_FUNCTION   Function;
+    PVOID                   Context;
+    KEVENT                  Event;
+    BOOLEAN                 Alerted;
+    BOOLEAN                 Busy;
+    BOOLEAN                 Removing;
+    ULONG                   Waiters;
+    KEVENT                  Done;
+};
+
+typedef struct _WORK_WORKER {
+    PWORK_SET       Set;
+    PXENVKBD_THREAD Thread;
+    PVOID           Object[WORK_SET_SIZE + 1];
+    PXENVKBD_WORK   Work[WORK_SET_SIZE + 1];
+    KWAIT_BLOCK     WaitBlock[WORK_SET_SIZE + 1];
+} WORK_WORKER, *PWORK_WORKER;
+
+struct _WORK_SET {
+    LIST_ENTRY          ListEntry;
+    XENVKBD_WORK_CLASS  Class;
+    LIST_ENTRY          List;
+    ULONG               Count;
+    PWORK_WORKER        Worker[WORK_WORKER_COUNT];
+};
+
+typedef struct _WORK_QUEUE {
+    KSPIN_LOCK      Lock;
+    LIST_ENTRY      List[WORK_CLASS_COUNT];
+    ULONG           Sets;
+    ULONG           Count;
+} WORK_QUEUE, *PWORK_QUEUE;
+
+static WORK_QUEUE   WorkQueue;
+
+// Make the workers of a set rebuild their wait sets
+static FORCEINLINE VOID
+__WorkWakeSet(
+    IN  PWORK_SET       Set,
+    IN  PWORK_WORKER    Self OPTIONAL
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < WORK_WORKER_COUNT; Index++) {
+        PWORK_WORKER    Worker = Set->Worker[Index];
+
+        if (Worker != Self)
+            ThreadWake(Worker->Thread);
+    }
+}
+
+// Called with the queue lock held. An item can only be unlinked once it is
+// neither running nor present in any worker's wait set.
+static FORCEINLINE BOOLEAN
+__WorkTryRemove(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    PWORK_SET           Set = Work->Set;
+
+    if (!Work->Removing || Work->Busy || Work->Waiters != 0)
+        return FALSE;
+
+    RemoveEntryList(&Work->ListEntry);
+    ASSERT(Set->Count != 0);
+    --Set->Count;
+    ASSERT(WorkQueue.Count != 0);
+    --WorkQueue.Count;
+
+    Work->Removing = FALSE;
+    return TRUE;
+}
+
+static NTSTATUS
+WorkWorker(
+    IN  PXENVKBD_THREAD Self,
+    IN  PVOID           Context
+    )
+{
+    PWORK_WORKER        Worker = Context;
+    PWORK_SET           Set = Worker->Set;
+    PKEVENT             Event;
+
+    Event = ThreadGetEvent(Self);
+
+    for (;;) {
+        PXENVKBD_WORK   Work;
+        PLIST_ENTRY     ListEntry;
+        KIRQL           Irql;
+        ULONG           Count;
+        ULONG           Index;
+        BOOLEAN         Removed;
+        BOOLEAN         Orphaned;
+        NTSTATUS        status;
+
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        Worker->Object[0] = Event;
+        Count = 1;
+
+        KeAcquireSpinLock(&WorkQueue.Lock, &Irql);
+
+        for (ListEntry = Set->List.Flink;
+             ListEntry != &Set->List;
+             ListEntry = ListEntry->Flink) {
+            Work = CONTAINING_RECORD(ListEntry, XENVKBD_WORK, ListEntry);
+
+            if (Work->Busy || Work->Removing)
+                continue;
+
+            Work->Waiters++;
+
+            Worker->Work[Count] = Work;
+            Worker->Object[Count] = &Work->Event;
+            Count++;
+        }
+
+        KeReleaseSpinLock(&WorkQueue.Lock, Irql);
+
+        status = KeWaitForMultipleObjects(Count,
+                                          Worker->Object,
+                                          WaitAny,
+                                          Executive,
+                                          KernelMode,
+                                          FALSE,
+                                          NULL,
+                                          Worker->WaitBlock);
+        ASSERT3U(status - STATUS_WAIT_0, <, Count);
+
+        Work = NULL;
+
+        KeAcquireSpinLock(&WorkQueue.Lock, &Irql);
+
+        for (Index = 1; Index < Count; Index++) {
+            PXENVKBD_WORK   Candidate = Worker->Work[Index];
+
+            ASSERT(Candidate->Waiters != 0);
+            --Candidate->Waiters;
+
+            // Another worker may have claimed it in the meantime
+            if (Index == (ULONG)(status - STATUS_WAIT_0) &&
+                !Candidate->Busy &&
+                !Candidate->Removing) {
+                Candidate->Busy = TRUE;
+                Work = Candidate;
+            } else if (__WorkTryRemove(Candidate)) {
+                KeSetEvent(&Candidate->Done, IO_NO_INCREMENT, FALSE);
+            }
+        }
+
+        KeReleaseSpinLock(&WorkQueue.Lock, Irql);
+
+        if (Work == NULL)
+            continue;
+
+        // Clear before the call so that a wake during the call is not lost
+        KeClearEvent(&Work->Event);
+
+        if (!Work->Alerted)
+            Work->Function(Work, Work->Context);
+
+        KeAcquireSpinLock(&WorkQueue.Lock, &Irql);
+        Work->Busy = FALSE;
+        Removed = __WorkTryRemove(Work);
+        // This worker puts the item back in its own wait set next time
+        // round, but may be held up by another item before then. Only if
+        // no other worker of the set is waiting on it already does one of
+        // them need to pick it up.
+        Orphaned = (!Removed && Work->Waiters == 0) ? TRUE : FALSE;
+        KeReleaseSpinLock(&WorkQueue.Lock, Irql);
+
+        if (Removed)
+            KeSetEvent(&Work->Done, IO_NO_INCREMENT, FALSE);
+        else if (Orphaned)
+            __WorkWakeSet(Set, Worker);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+__WorkDestroySet(
+    IN  PWORK_SET   Set
+    )
+{
+    ULONG           Index;
+
+    ASSERT(IsListEmpty(&Set->List));
+    ASSERT3U(Set->Count, ==, 0);
+
+    for (Index = 0; Index < WORK_WORKER_COUNT; Index++) {
+        PWORK_WORKER    Worker = Set->Worker[Index];
+
+        if (Worker == NULL)
+            continue;
+
+        ThreadAlert(Worker->Thread);
+        ThreadJoin(Worker->Thread);
+
+        Worker->Set = NULL;
+        __ThreadFree(Worker);
+        Set->Worker[Index] = NULL;
+    }
+
+    RtlZeroMemory(&Set->List, sizeof (LIST_ENTRY));
+    Set->Class = 0;
+
+    ASSERT(IsZeroMemory(Set, sizeof (WORK_SET)));
+    __ThreadFree(Set);
+}
+
+static NTSTATUS
+__WorkCreateSet(
+    IN  XENVKBD_WORK_CLASS  Class,
+    OUT PWORK_SET           *Set
+    )
+{
+    ULONG                   Index;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    *Set = __ThreadAllocate(sizeof (WORK_SET));
+
+    status = STATUS_NO_MEMORY;
+    if (*Set == NULL)
+        goto fail1;
+
+    (*Set)->Class = Class;
+    InitializeListHead(&(*Set)->List);
+
+    for (Index = 0; Index < WORK_WORKER_COUNT; Index++) {
+        PWORK_WORKER    Worker;
+
+        Worker = __ThreadAllocate(sizeof (WORK_WORKER));
+
+        status = STATUS_NO_MEMORY;
+        if (Worker == NULL)
+            goto fail2;
+
+        Worker->Set = *Set;
+
+        status = ThreadCreate(WorkWorker, Worker, &Worker->Thread);
+        if (!NT_SUCCESS(status)) {
+            __ThreadFree(Worker);
+            goto fail3;
+        }
+
+        (*Set)->Worker[Index] = Worker;
+    }
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+    __WorkDestroySet(*Set);
+    *Set = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Called with the queue lock held
+static FORCEINLINE PWORK_SET
+__WorkFindSet(
+    IN  XENVKBD_WORK_CLASS  Class
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    for (ListEntry = WorkQueue.List[Class].Flink;
+         ListEntry != &WorkQueue.List[Class];
+         ListEntry = ListEntry->Flink) {
+        PWORK_SET   Set = CONTAINING_RECORD(ListEntry, WORK_SET, ListEntry);
+
+        if (Set->Count < WORK_SET_SIZE)
+            return Set;
+    }
+
+    return NULL;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+WorkCreate(
+    IN  XENVKBD_WORK_FUNCTION   Function,
+    IN  PVOID                   Context,
+    IN  XENVKBD_WORK_CLASS      Class,
+    OUT PXENVKBD_WORK           *Work
+    )
+{
+    PWORK_SET                   Set;
+    PWORK_SET                   New;
+    KIRQL                       Irql;
+    ULONG                       Sets;
+    ULONG                       Count;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    ASSERT3U(Class, <, WORK_CLASS_COUNT);
+
+    (*Work) = __ThreadAllocate(sizeof (XENVKBD_WORK));
+
+    status = STATUS_NO_MEMORY;
+    if (*Work == NULL)
+        goto fail1;
+
+    (*Work)->Function = Function;
+    (*Work)->Context = Context;
+
+    KeInitializeEvent(&(*Work)->Event, NotificationEvent, FALSE);
+    KeInitializeEvent(&(*Work)->Done, NotificationEvent, FALSE);
+
+    New = NULL;
+
+    KeAcquireSpinLock(&WorkQueue.Lock, &Irql);
+
+    Set = __WorkFindSet(Class);
+    if (Set == NULL) {
+        KeReleaseSpinLock(&WorkQueue.Lock, Irql);
+
+        // Threads cannot be created under the lock, so a racing
+        // caller may add a set too; that merely leaves spare room
+        status = __WorkCreateSet(Class, &New);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        KeAcquireSpinLock(&WorkQueue.Lock, &Irql);
+
+        InsertTailList(&WorkQueue.List[Class], &New->ListEntry);
+        WorkQueue.Sets++;
+
+        Set = New;
+    }
+
+    (*Work)->Set = Set;
+    InsertTailList(&Set->List, &(*Work)->ListEntry);
+    Set->Count++;
+    WorkQueue.Count++;
+
+    Sets = WorkQueue.Sets;
+    Count = WorkQueue.Count;
+
+    KeReleaseSpinLock(&WorkQueue.Lock, Irql);
+
+    if (New != NULL)
+        Info("%s set added (%u sets, %u items)\n",
+             (Class == WORK_CLASS_LEAF) ? "LEAF" : "WAITING",
+             Sets,
+             Count);
+
+    __WorkWakeSet(Set, NULL);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    __ThreadFree(*Work);
+    *Work = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+PKEVENT
+WorkGetEvent(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    return &Work->Event;
+}
+
+BOOLEAN
+WorkIsAlerted(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    return Work->Alerted;
+}
+
+VOID
+WorkWake(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    KeSetEvent(&Work->Event, IO_NO_INCREMENT, FALSE);
+}
+
+VOID
+WorkAlert(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    Work->Alerted = TRUE;
+    KeSetEvent(&Work->Event, IO_NO_INCREMENT, FALSE);
+}
+
+VOID
+WorkJoin(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    PWORK_SET           Set = Work->Set;
+    KIRQL               Irql;
+    BOOLEAN             Removed;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    ASSERT(Work->Alerted);
+
+    KeAcquireSpinLock(&WorkQueue.Lock, &Irql);
+    Work->Removing = TRUE;
+    Removed = __WorkTryRemove(Work);
+    KeReleaseSpinLock(&WorkQueue.Lock, Irql);
+
+    if (!Removed) {
+        // Make any worker holding the item in its wait set let go of it
+        __WorkWakeSet(Set, NULL);
+
+        (VOID) KeWaitForSingleObject(&Work->Done,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+    }
+
+    __ThreadFree(Work);
+}
+
+NTSTATUS
+WorkInitialize(
+    VOID
+    )
+{
+    ULONG   Class;
+
+    KeInitializeSpinLock(&WorkQueue.Lock);
+
+    // Sets (and hence workers) are only created once there are items
+    for (Class = 0; Class < WORK_CLASS_COUNT; Class++)
+        InitializeListHead(&WorkQueue.List[Class]);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WorkTeardown(
+    VOID
+    )
+{
+    ULONG   Class;
+
+    ASSERT3U(WorkQueue.Count, ==, 0);
+
+    // Sets are kept until now: a set cannot be destroyed from one of
+    // its own workers, which is where items are usually joined from
+    for (Class = 0; Class < WORK_CLASS_COUNT; Class++) {
+        while (!IsListEmpty(&WorkQueue.List[Class])) {
+            PLIST_ENTRY ListEntry = RemoveHeadList(&WorkQueue.List[Class]);
+            PWORK_SET   Set = CONTAINING_RECORD(ListEntry, WORK_SET, ListEntry);
+
+            RtlZeroMemory(&Set->ListEntry, sizeof (LIST_ENTRY));
+            __WorkDestroySet(Set);
+
+            ASSERT(WorkQueue.Sets != 0);
+            --WorkQueue.Sets;
+        }
+
+        RtlZeroMemory(&WorkQueue.List[Class], sizeof (LIST_ENTRY));
+    }
+
+    RtlZeroMemory(&WorkQueue.Lock, sizeof (KSPIN_LOCK));
+
+    ASSERT(IsZeroMemory(&WorkQueue, sizeof (WORK_QUEUE)));
+}
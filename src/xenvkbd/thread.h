@@ -72,4 +72,61 @@ ThreadJoin(
     IN  PXENVKBD_THREAD Thread
     );
 
+typedef struct _XENVKBD_WORK XENVKBD_WORK, *PXENVKBD_WORK;
+
+typedef VOID (*XENVKBD_WORK_FUNCTION)(PXENVKBD_WORK, PVOID);
+
+typedef enum _XENVKBD_WORK_CLASS {
+    WORK_CLASS_WAITING = 0, // May wait for a leaf item
+    WORK_CLASS_LEAF,        // Never waits for another item
+    WORK_CLASS_COUNT
+} XENVKBD_WORK_CLASS, *PXENVKBD_WORK_CLASS;
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+extern NTSTATUS
+WorkInitialize(
+    VOID
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+extern VOID
+WorkTeardown(
+    VOID
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+extern NTSTATUS
+WorkCreate(
+    IN  XENVKBD_WORK_FUNCTION   Function,
+    IN  PVOID                   Context,
+    IN  XENVKBD_WORK_CLASS      Class,
+    OUT PXENVKBD_WORK           *Work
+    );
+
+extern PKEVENT
+WorkGetEvent(
+    IN  PXENVKBD_WORK   Work
+    );
+
+extern BOOLEAN
+WorkIsAlerted(
+    IN  PXENVKBD_WORK   Work
+    );
+
+extern VOID
+WorkWake(
+    IN  PXENVKBD_WORK   Work
+    );
+
+extern VOID
+WorkAlert(
+    IN  PXENVKBD_WORK   Work
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+extern VOID
+WorkJoin(
+    IN  PXENVKBD_WORK   Work
+    );
+
 #endif  // _XENVKBD_THREAD_H
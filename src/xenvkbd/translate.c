@@ -0,0 +1,653 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include "translate.h"
+
+#ifdef _KERNEL_MODE
+#include "dbg_print.h"
+#else
+#define Trace(...)  ((void)0)
+#endif
+
+// Linux keycode definitions
+#include <linux-keycodes.h>
+
+#define DEFINE_USAGE_TABLE                      \
+    DEFINE_USAGE(KEY_RESERVED, 0x00),           \
+    DEFINE_USAGE(KEY_ESC, 0x29),                \
+    DEFINE_USAGE(KEY_1, 0x1E),                  \
+    DEFINE_USAGE(KEY_2, 0x1F),                  \
+    DEFINE_USAGE(KEY_3, 0x20),                  \
+    DEFINE_USAGE(KEY_4, 0x21),                  \
+    DEFINE_USAGE(KEY_5, 0x22),                  \
+    DEFINE_USAGE(KEY_6, 0x23),                  \
+    DEFINE_USAGE(KEY_7, 0x24),                  \
+    DEFINE_USAGE(KEY_8, 0x25),                  \
+    DEFINE_USAGE(KEY_9, 0x26),                  \
+    DEFINE_USAGE(KEY_0, 0x27),                  \
+    DEFINE_USAGE(KEY_MINUS, 0x2D),              \
+    DEFINE_USAGE(KEY_EQUAL, 0x2E),              \
+    DEFINE_USAGE(KEY_BACKSPACE, 0x2A),          \
+    DEFINE_USAGE(KEY_TAB, 0x2B),                \
+    DEFINE_USAGE(KEY_Q, 0x14),                  \
+    DEFINE_USAGE(KEY_W, 0x1A),                  \
+    DEFINE_USAGE(KEY_E, 0x08),                  \
+    DEFINE_USAGE(KEY_R, 0x15),                  \
+    DEFINE_USAGE(KEY_T, 0x17),                  \
+    DEFINE_USAGE(KEY_Y, 0x1C),                  \
+    DEFINE_USAGE(KEY_U, 0x18),                  \
+    DEFINE_USAGE(KEY_I, 0x0C),                  \
+    DEFINE_USAGE(KEY_O, 0x12),                  \
+    DEFINE_USAGE(KEY_P, 0x13),                  \
+    DEFINE_USAGE(KEY_LEFTBRACE, 0x2F),          \
+    DEFINE_USAGE(KEY_RIGHTBRACE, 0x30),         \
+    DEFINE_USAGE(KEY_ENTER, 0x28),              \
+    DEFINE_USAGE(KEY_LEFTCTRL, 0xE0),           \
+    DEFINE_USAGE(KEY_A, 0x04),                  \
+    DEFINE_USAGE(KEY_S, 0x16),                  \
+    DEFINE_USAGE(KEY_D, 0x07),                  \
+    DEFINE_USAGE(KEY_F, 0x09),                  \
+    DEFINE_USAGE(KEY_G, 0x0A),                  \
+    DEFINE_USAGE(KEY_H, 0x0B),                  \
+    DEFINE_USAGE(KEY_J, 0x0D),                  \
+    DEFINE_USAGE(KEY_K, 0x0E),                  \
+    DEFINE_USAGE(KEY_L, 0x0F),                  \
+    DEFINE_USAGE(KEY_SEMICOLON, 0x33),          \
+    DEFINE_USAGE(KEY_APOSTROPHE, 0x34),         \
+    DEFINE_USAGE(KEY_GRAVE, 0x35),              \
+    DEFINE_USAGE(KEY_LEFTSHIFT, 0xE1),          \
+    DEFINE_USAGE(KEY_BACKSLASH, 0x31),          \
+    DEFINE_USAGE(KEY_Z, 0x1D),                  \
+    DEFINE_USAGE(KEY_X, 0x1B),                  \
+    DEFINE_USAGE(KEY_C, 0x06),                  \
+    DEFINE_USAGE(KEY_V, 0x19),                  \
+    DEFINE_USAGE(KEY_B, 0x05),                  \
+    DEFINE_USAGE(KEY_N, 0x11),                  \
+    DEFINE_USAGE(KEY_M, 0x10),                  \
+    DEFINE_USAGE(KEY_COMMA, 0x36),              \
+    DEFINE_USAGE(KEY_DOT, 0x37),                \
+    DEFINE_USAGE(KEY_SLASH, 0x38),              \
+    DEFINE_USAGE(KEY_RIGHTSHIFT, 0xE5),         \
+    DEFINE_USAGE(KEY_KPASTERISK, 0x55),         \
+    DEFINE_USAGE(KEY_LEFTALT, 0xE2),            \
+    DEFINE_USAGE(KEY_SPACE, 0x2C),              \
+    DEFINE_USAGE(KEY_CAPSLOCK, 0x39),           \
+    DEFINE_USAGE(KEY_F1, 0x3A),                 \
+    DEFINE_USAGE(KEY_F2, 0x3B),                 \
+    DEFINE_USAGE(KEY_F3, 0x3C),                 \
+    DEFINE_USAGE(KEY_F4, 0x3D),                 \
+    DEFINE_USAGE(KEY_F5, 0x3E),                 \
+    DEFINE_USAGE(KEY_F6, 0x3F),                 \
+    DEFINE_USAGE(KEY_F7, 0x40),                 \
+    DEFINE_USAGE(KEY_F8, 0x41),                 \
+    DEFINE_USAGE(KEY_F9, 0x42),                 \
+    DEFINE_USAGE(KEY_F10, 0x43),                \
+    DEFINE_USAGE(KEY_NUMLOCK, 0x53),            \
+    DEFINE_USAGE(KEY_SCROLLLOCK, 0x47),         \
+    DEFINE_USAGE(KEY_KP7, 0x5F),                \
+    DEFINE_USAGE(KEY_KP8, 0x60),                \
+    DEFINE_USAGE(KEY_KP9, 0x61),                \
+    DEFINE_USAGE(KEY_KPMINUS, 0x56),            \
+    DEFINE_USAGE(KEY_KP4, 0x5C),                \
+    DEFINE_USAGE(KEY_KP5, 0x5D),                \
+    DEFINE_USAGE(KEY_KP6, 0x5E),                \
+    DEFINE_USAGE(KEY_KPPLUS, 0x57),             \
+    DEFINE_USAGE(KEY_KP1, 0x59),                \
+    DEFINE_USAGE(KEY_KP2, 0x5A),                \
+    DEFINE_USAGE(KEY_KP3, 0x5B),                \
+    DEFINE_USAGE(KEY_KP0, 0x62),                \
+    DEFINE_USAGE(KEY_KPDOT, 0x63),              \
+    DEFINE_USAGE(KEY_ZENKAKUHANKAKU, 0x8F),     \
+    DEFINE_USAGE(KEY_102ND, 0x64),              \
+    DEFINE_USAGE(KEY_F11, 0x44),                \
+    DEFINE_USAGE(KEY_F12, 0x45),                \
+    DEFINE_USAGE(KEY_RO, 0x87),                 \
+    DEFINE_USAGE(KEY_KATAKANA, 0x88),           \
+    DEFINE_USAGE(KEY_HIRAGANA, 0x8A),           \
+    DEFINE_USAGE(KEY_HENKAN, 0x8B),             \
+    DEFINE_USAGE(KEY_KATAKANAHIRAGANA, 0x8C),   \
+    DEFINE_USAGE(KEY_MUHENKAN, 0x8D),           \
+    DEFINE_USAGE(KEY_KPJPCOMMA, 0x8E),          \
+    DEFINE_USAGE(KEY_KPENTER, 0x58),            \
+    DEFINE_USAGE(KEY_RIGHTCTRL, 0xE4),          \
+    DEFINE_USAGE(KEY_KPSLASH, 0x54),            \
+    DEFINE_USAGE(KEY_SYSRQ, 0x46),              \
+    DEFINE_USAGE(KEY_PAUSE, 0x48),              \
+    DEFINE_USAGE(KEY_RIGHTALT, 0xE6),           \
+    DEFINE_USAGE(KEY_HOME, 0x4A),               \
+    DEFINE_USAGE(KEY_UP, 0x52),                 \
+    DEFINE_USAGE(KEY_PAGEUP, 0x4B),             \
+    DEFINE_USAGE(KEY_LEFT, 0x50),               \
+    DEFINE_USAGE(KEY_RIGHT, 0x4F),              \
+    DEFINE_USAGE(KEY_END, 0x4D),                \
+    DEFINE_USAGE(KEY_DOWN, 0x51),               \
+    DEFINE_USAGE(KEY_PAGEDOWN, 0x4E),           \
+    DEFINE_USAGE(KEY_INSERT, 0x49),             \
+    DEFINE_USAGE(KEY_DELETE, 0x4C),             \
+    DEFINE_USAGE(KEY_MUTE, 0x7F),               \
+    DEFINE_USAGE(KEY_VOLUMEDOWN, 0x81),         \
+    DEFINE_USAGE(KEY_VOLUMEUP, 0x80),           \
+    DEFINE_USAGE(KEY_POWER, 0x66),              \
+    DEFINE_USAGE(KEY_KPEQUAL, 0x67),            \
+    DEFINE_USAGE(KEY_KPPLUSMINUS, 0x00),        \
+    DEFINE_USAGE(KEY_KPCOMMA, 0x85),            \
+    DEFINE_USAGE(KEY_HANGEUL, 0x90),            \
+    DEFINE_USAGE(KEY_HANJA, 0x91),              \
+    DEFINE_USAGE(KEY_YEN, 0x89),                \
+    DEFINE_USAGE(KEY_LEFTMETA, 0xE3),           \
+    DEFINE_USAGE(KEY_RIGHTMETA, 0xE7)
+
+struct _KEY_CODE_TO_USAGE {
+    const CHAR  *KeyName;
+    UCHAR       KeyCode;
+    USHORT      Usage;
+};
+
+#define DEFINE_USAGE(_KeyCode, _Usage) \
+    { #_KeyCode, _KeyCode, _Usage }
+
+static const struct _KEY_CODE_TO_USAGE KeyCodeToUsageTable[] = {
+    DEFINE_USAGE_TABLE
+};
+
+#undef DEFINE_USAGE
+
+#define DEFINE_USAGE(_KeyCode, _Usage) \
+    [_KeyCode] = _Usage
+
+// Immutable, so a single copy serves every ring
+static const USHORT KeyCodeToUsageMapping[1 << (sizeof (UCHAR) * 8)] = {
+    DEFINE_USAGE_TABLE
+};
+
+#undef DEFINE_USAGE
+
+#define CONSTRAIN(_Value, _Min, _Max) \
+    (__min(__max((_Value), (_Min)), (_Max)))
+
+static FORCEINLINE UCHAR
+SetBit(
+    IN  UCHAR   Value,
+    IN  UCHAR   BitIdx,
+    IN  BOOLEAN Pressed
+    )
+{
+    if (Pressed) {
+        return Value | (1 << BitIdx);
+    } else {
+        return Value & ~(1 << BitIdx);
+    }
+}
+
+static FORCEINLINE VOID
+SetArray(
+    IN  PUCHAR  Array,
+    IN  ULONG   Size,
+    IN  UCHAR   Value,
+    IN  BOOLEAN Pressed
+    )
+{
+    ULONG       Idx;
+    if (Pressed) {
+        for (Idx = 0; Idx < Size; ++Idx) {
+            if (Array[Idx] == Value)
+                break;
+            if (Array[Idx] != 0)
+                continue;
+            Array[Idx] = Value;
+            break;
+        }
+    } else {
+        for (Idx = 0; Idx < Size; ++Idx) {
+            if (Array[Idx] == 0)
+                break;
+            if (Array[Idx] != Value)
+                continue;
+            for (; Idx < Size - 1; ++Idx)
+                Array[Idx] = Array[Idx + 1];
+            Array[Size - 1] = 0;
+            break;
+        }
+    }
+}
+
+static FORCEINLINE USHORT
+__TranslateKeyCodeToUsage(
+    IN  ULONG   KeyCode
+    )
+{
+    if (KeyCode < ARRAYSIZE(KeyCodeToUsageMapping))
+        return KeyCodeToUsageMapping[KeyCode];
+
+    return 0;
+}
+
+const CHAR *
+TranslateKeyName(
+    IN  ULONG   KeyCode
+    )
+{
+    ULONG   Index;
+
+    for (Index = 0; Index < ARRAYSIZE(KeyCodeToUsageTable); Index++) {
+        const struct _KEY_CODE_TO_USAGE *Entry = &KeyCodeToUsageTable[Index];
+
+        if (Entry->KeyCode == KeyCode)
+            return Entry->KeyName;
+    }
+
+    return "UNKNOWN";
+}
+
+ULONG64
+TranslateGetTimestamp(
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    ULONG64                         Timestamp;
+
+    RtlCopyMemory(&Timestamp,
+                  (const UCHAR *)Event + XENKBD_IN_EVENT_TIMESTAMP_OFFSET,
+                  sizeof (ULONG64));
+
+    return Timestamp;
+}
+
+VOID
+TranslateReset(
+    IN  PXENVKBD_TRANSLATE  Translate
+    )
+{
+    ULONG                   Idx;
+
+    Translate->Keyboard.ReportId = 1;
+    Translate->Keyboard.Modifiers = 0;
+    for (Idx = 0; Idx < ARRAYSIZE(Translate->Keyboard.Keys); Idx++)
+        Translate->Keyboard.Keys[Idx] = 0;
+
+    Translate->AbsMouse.ReportId = 2;
+    Translate->AbsMouse.Buttons = 0;
+    Translate->AbsMouse.X = 0;
+    Translate->AbsMouse.Y = 0;
+    Translate->AbsMouse.dZ = 0;
+
+    Translate->BatchIndex = 0;
+}
+
+VOID
+TranslateRelease(
+    IN  PXENVKBD_TRANSLATE  Translate
+    )
+{
+    ULONG                   Idx;
+
+    Translate->Keyboard.Modifiers = 0;
+    for (Idx = 0; Idx < ARRAYSIZE(Translate->Keyboard.Keys); Idx++)
+        Translate->Keyboard.Keys[Idx] = 0;
+
+    Translate->AbsMouse.Buttons = 0;
+    Translate->AbsMouse.dZ = 0;
+
+    // The rest of a held batch is being skipped along with it
+    Translate->BatchIndex = 0;
+}
+
+static FORCEINLINE XENVKBD_TRANSLATE_RESULT
+__TranslateMotion(
+    IN  PXENVKBD_TRANSLATE  Translate,
+    IN  LONG                dX,
+    IN  LONG                dY,
+    IN  LONG                dZ
+    )
+{
+    // The backend controls dX and dY, so do the sum wide enough that it
+    // cannot overflow
+    Translate->AbsMouse.X = (USHORT)CONSTRAIN((LONG64)Translate->AbsMouse.X + dX, 0, 32767);
+    Translate->AbsMouse.Y = (USHORT)CONSTRAIN((LONG64)Translate->AbsMouse.Y + dY, 0, 32767);
+    Translate->AbsMouse.dZ = -(CHAR)CONSTRAIN(dZ, -127, 127);
+
+    return TRANSLATE_RESULT_POINTER;
+}
+
+static FORCEINLINE XENVKBD_TRANSLATE_RESULT
+__TranslateKeypress(
+    IN  PXENVKBD_TRANSLATE  Translate,
+    IN  ULONG               KeyCode,
+    IN  BOOLEAN             Pressed
+    )
+{
+    USHORT                  Usage;
+
+    if (KeyCode >= 0x110 && KeyCode <= 0x114) {
+        // Mouse Buttons
+        Translate->AbsMouse.Buttons = SetBit(Translate->AbsMouse.Buttons,
+                                             (UCHAR)(KeyCode - 0x110),
+                                             Pressed);
+
+        return TRANSLATE_RESULT_BUTTONS;
+    }
+
+    // map KeyCode to Usage
+    Usage = __TranslateKeyCodeToUsage(KeyCode);
+
+    Trace("%s (%02x) -> %04x (%s)\n",
+          TranslateKeyName(KeyCode), KeyCode,
+          Usage, Pressed ? "PRESSED" : "RELEASED");
+
+    if (Usage == 0)
+        return TRANSLATE_RESULT_NONE; // non-standard key
+
+    if (Usage >= 0xE0 && Usage <= 0xE7) {
+        // Modifier
+        Translate->Keyboard.Modifiers = SetBit(Translate->Keyboard.Modifiers,
+                                               (UCHAR)(Usage - 0xE0),
+                                               Pressed);
+    } else {
+        // Standard Key
+        SetArray(Translate->Keyboard.Keys,
+                 ARRAYSIZE(Translate->Keyboard.Keys),
+                 (UCHAR)Usage,
+                 Pressed);
+    }
+
+    return TRANSLATE_RESULT_KEYBOARD;
+}
+
+static FORCEINLINE XENVKBD_TRANSLATE_RESULT
+__TranslatePosition(
+    IN  PXENVKBD_TRANSLATE  Translate,
+    IN  LONG                X,
+    IN  LONG                Y,
+    IN  LONG                dZ
+    )
+{
+    // Positions are signed on the wire; anything off the left or top edge
+    // must clamp to 0 rather than wrap to the opposite edge
+    Translate->AbsMouse.X = (USHORT)CONSTRAIN(X, 0, 32767);
+    Translate->AbsMouse.Y = (USHORT)CONSTRAIN(Y, 0, 32767);
+    Translate->AbsMouse.dZ = -(CHAR)CONSTRAIN(dZ, -127, 127);
+
+    return TRANSLATE_RESULT_POINTER;
+}
+
+// Returns FALSE if Hold stopped it part way through the batch, in which
+// case BatchIndex records where to resume
+static FORCEINLINE BOOLEAN
+__TranslateKeyBatch(
+    IN  PXENVKBD_TRANSLATE          Translate,
+    IN  const union xenkbd_in_event *Event,
+    IN  ULONG                       Cons,
+    IN  XENVKBD_TRANSLATE_CALLBACK  Callback,
+    IN  XENVKBD_TRANSLATE_HOLD      Hold OPTIONAL,
+    IN  PVOID                       Context
+    )
+{
+    const struct xenkbd_key_batch   *Batch;
+    ULONG                           Count;
+    ULONG                           Idx;
+
+    Batch = (const struct xenkbd_key_batch *)Event;
+    Count = __min(Batch->count,
+                  (Translate->Timestamp) ?
+                  XENKBD_KEY_BATCH_MAX_STAMPED :
+                  XENKBD_KEY_BATCH_MAX);
+
+    if (Count == 0) {
+        if (Hold != NULL && Hold(Context, Event))
+            return FALSE;
+
+        Callback(Context, Cons, Event, TRANSLATE_RESULT_NONE);
+        return TRUE;
+    }
+
+    // Every transition is reported, so that a press and release of the
+    // same key within one slot are not lost, and each may be held until
+    // the report before it has been read
+    for (Idx = Translate->BatchIndex; Idx < Count; Idx++) {
+        USHORT                      Key = Batch->key[Idx];
+        XENVKBD_TRANSLATE_RESULT    Result;
+
+        if (Hold != NULL && Hold(Context, Event)) {
+            Translate->BatchIndex = Idx;
+            return FALSE;
+        }
+
+        Result = __TranslateKeypress(Translate,
+                                     Key & ~XENKBD_KEY_BATCH_PRESSED,
+                                     (Key & XENKBD_KEY_BATCH_PRESSED) ? TRUE : FALSE);
+        Callback(Context, Cons, (Idx == 0) ? Event : NULL, Result);
+    }
+
+    Translate->BatchIndex = 0;
+    return TRUE;
+}
+
+XENVKBD_TRANSLATE_RESULT
+TranslateEvent(
+    IN  PXENVKBD_TRANSLATE          Translate,
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    switch (Event->type) {
+    case XENKBD_TYPE_MOTION:
+        return __TranslateMotion(Translate,
+                                 Event->motion.rel_x,
+                                 Event->motion.rel_y,
+                                 Event->motion.rel_z);
+    case XENKBD_TYPE_KEY:
+        return __TranslateKeypress(Translate,
+                                   Event->key.keycode,
+                                   Event->key.pressed);
+    case XENKBD_TYPE_POS:
+        return __TranslatePosition(Translate,
+                                   Event->pos.abs_x,
+                                   Event->pos.abs_y,
+                                   Event->pos.rel_z);
+    case XENKBD_TYPE_MTOUCH:
+        Trace("MTOUCH: %u %u %u %u\n",
+              Event->mtouch.event_type,
+              Event->mtouch.contact_id,
+              Event->mtouch.u.pos.abs_x,
+              Event->mtouch.u.pos.abs_y);
+        // call Frontend
+        break;
+    default:
+        Trace("UNKNOWN: %u\n",
+              Event->type);
+        break;
+    }
+
+    return TRANSLATE_RESULT_NONE;
+}
+
+VOID
+TranslateSnapshot(
+    IN  const union xenkbd_in_event *Slots,
+    IN  ULONG                       Length,
+    IN  ULONG                       Cons,
+    IN  ULONG                       Count,
+    OUT union xenkbd_in_event       *Events
+    )
+{
+    ULONG                           Start;
+    ULONG                           First;
+
+    Count = __min(Count, Length);
+
+    // At most two contiguous runs: up to the end of the ring, then from
+    // its start
+    Start = Cons % Length;
+    First = __min(Count, Length - Start);
+
+    RtlCopyMemory(&Events[0],
+                  &Slots[Start],
+                  First * XENKBD_IN_EVENT_SIZE);
+    RtlCopyMemory(&Events[First],
+                  &Slots[0],
+                  (Count - First) * XENKBD_IN_EVENT_SIZE);
+}
+
+ULONG
+TranslateEvents(
+    IN  PXENVKBD_TRANSLATE          Translate,
+    IN  const union xenkbd_in_event *Events,
+    IN  ULONG                       Cons,
+    IN  ULONG                       Count,
+    IN  XENVKBD_TRANSLATE_CALLBACK  Callback,
+    IN  XENVKBD_TRANSLATE_HOLD      Hold OPTIONAL,
+    IN  PVOID                       Context
+    )
+{
+    ULONG                           Idx;
+
+    for (Idx = 0; Idx < Count; Idx++) {
+        XENVKBD_TRANSLATE_RESULT    Result;
+
+        if (Events[Idx].type == XENKBD_TYPE_KEY_BATCH && Translate->KeyBatch) {
+            if (!__TranslateKeyBatch(Translate,
+                                     &Events[Idx],
+                                     Cons + Idx,
+                                     Callback,
+                                     Hold,
+                                     Context))
+                break;
+
+            continue;
+        }
+
+        if (Hold != NULL && Hold(Context, &Events[Idx]))
+            break;
+
+        Result = TranslateEvent(Translate, &Events[Idx]);
+        Callback(Context, Cons + Idx, &Events[Idx], Result);
+    }
+
+    return Idx;
+}
+
+XENVKBD_TRANSLATE_STOP
+TranslateRing(
+    IN      PXENVKBD_TRANSLATE          Translate,
+    IN OUT  PXENVKBD_TRANSLATE_RING     Ring,
+    IN      ULONG                       Budget,
+    IN      XENVKBD_TRANSLATE_PASS      Pass OPTIONAL,
+    IN      XENVKBD_TRANSLATE_CALLBACK  Callback,
+    IN      XENVKBD_TRANSLATE_HOLD      Hold OPTIONAL,
+    IN      PVOID                       Context
+    )
+{
+    struct xenkbd_page                  *Shared = Ring->Shared;
+
+    for (;;) {
+        ULONG   in_cons;
+        ULONG   in_prod;
+        ULONG   Count;
+        ULONG   Applied;
+        BOOLEAN Overrun;
+
+        KeMemoryBarrier();
+
+        in_cons = Shared->in_cons;
+        in_prod = Shared->in_prod;
+
+        KeMemoryBarrier();
+
+        if (in_cons == in_prod) {
+            if (!Ring->EventIdx)
+                return TRANSLATE_STOP_EMPTY;
+
+            // Ask to be notified when the next slot is produced, then check
+            // that nothing slipped in before the request became visible
+            XENKBD_IN_EVENT_IDX(Shared) = in_cons + 1;
+
+            KeMemoryBarrier();
+
+            if (Shared->in_prod == in_prod)
+                return TRANSLATE_STOP_EMPTY;
+
+            Ring->Rechecks++;
+            continue;
+        }
+
+        // The producer is more than a ring ahead, so the slots in between
+        // have been overwritten and whatever key releases they held are
+        // lost. Skip to the newest events and release everything so that
+        // nothing is left stuck down.
+        Overrun = (in_prod - in_cons > Ring->Length) ? TRUE : FALSE;
+        if (Overrun) {
+            in_cons = in_prod - Ring->Length;
+            TranslateRelease(Translate);
+        }
+
+        if (Pass != NULL)
+            Pass(Context, in_cons, in_prod, Overrun);
+
+        Count = __min(in_prod - in_cons, Budget);
+        Count = __min(Count, Ring->SnapshotLength);
+
+        TranslateSnapshot(Ring->Slots,
+                          Ring->Length,
+                          in_cons,
+                          Count,
+                          Ring->Snapshot);
+
+        KeMemoryBarrier();
+
+        // The slots are copied, so hand them back before decoding unless
+        // some of them may have to stay
+        if (!Ring->Backpressure)
+            Shared->in_cons = in_cons + Count;
+
+        Applied = TranslateEvents(Translate,
+                                  Ring->Snapshot,
+                                  in_cons,
+                                  Count,
+                                  Callback,
+                                  (Ring->Backpressure) ? Hold : NULL,
+                                  Context);
+
+        if (Ring->Backpressure)
+            Shared->in_cons = in_cons + Applied;
+
+        in_cons += Applied;
+        Budget -= Applied;
+        Ring->Applied += Applied;
+
+        if (Applied != Count)
+            return TRANSLATE_STOP_HELD;
+
+        // Go round again until the budget runs out; a multi-page ring may
+        // need several snapshots
+        if (in_cons != in_prod && Budget == 0)
+            return TRANSLATE_STOP_BUDGET;
+    }
+}
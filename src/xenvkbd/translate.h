@@ -0,0 +1,277 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENVKBD_TRANSLATE_H
+#define _XENVKBD_TRANSLATE_H
+
+// The translation engine only touches the shared ring layout and the HID
+// report buffers, so it can be built outside the kernel against the minimal
+// set of definitions below.
+#ifdef _KERNEL_MODE
+
+#include <ntddk.h>
+#include <xen.h>
+
+#else   // _KERNEL_MODE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef void            VOID, *PVOID;
+typedef char            CHAR;
+typedef uint8_t         UCHAR, *PUCHAR;
+typedef uint16_t        USHORT;
+typedef int32_t         LONG;
+typedef int64_t         LONG64;
+typedef uint64_t        ULONG64;
+typedef uint32_t        ULONG, *PULONG;
+typedef uint8_t         BOOLEAN;
+
+#define TRUE            1
+#define FALSE           0
+
+#define IN
+#define OUT
+#define OPTIONAL
+
+#define FORCEINLINE     inline
+
+#define ARRAYSIZE(_A)   (sizeof (_A) / sizeof ((_A)[0]))
+
+#define FIELD_OFFSET(_T, _F)    offsetof(_T, _F)
+
+#define C_ASSERT(_E)    _Static_assert((_E), #_E)
+
+#define RtlCopyMemory   memcpy
+
+#define KeMemoryBarrier()   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define __min(_A, _B)   (((_A) < (_B)) ? (_A) : (_B))
+#define __max(_A, _B)   (((_A) > (_B)) ? (_A) : (_B))
+
+#include <public/io/kbdif.h>
+
+#endif  // _KERNEL_MODE
+
+// Extension (feature-event-idx / request-event-idx): the backend only
+// notifies once in_prod passes in_event, which lives in the otherwise unused
+// space following the indices of struct xenkbd_page (in the style of the
+// netif/blkif rings).
+#define XENKBD_IN_EVENT_IDX_OFFSET  16
+
+C_ASSERT(sizeof (struct xenkbd_page) <= XENKBD_IN_EVENT_IDX_OFFSET);
+C_ASSERT(XENKBD_IN_EVENT_IDX_OFFSET + sizeof (ULONG) <= XENKBD_IN_RING_OFFS);
+
+#define XENKBD_IN_EVENT_IDX(_Shared) \
+    (*(volatile ULONG *)((PUCHAR)(_Shared) + XENKBD_IN_EVENT_IDX_OFFSET))
+
+// Extension (feature-key-batch / request-key-batch): a single slot carrying
+// up to XENKBD_KEY_BATCH_MAX key transitions, to be applied in order. Each
+// entry is a keycode with XENKBD_KEY_BATCH_PRESSED set for a press. The type
+// is outside the range used by the public protocol.
+#define XENKBD_TYPE_KEY_BATCH       0x80
+
+#define XENKBD_KEY_BATCH_MAX        19
+#define XENKBD_KEY_BATCH_PRESSED    0x8000
+
+struct xenkbd_key_batch {
+    uint8_t     type;       // XENKBD_TYPE_KEY_BATCH
+    uint8_t     count;
+    uint16_t    key[XENKBD_KEY_BATCH_MAX];
+};
+
+C_ASSERT(sizeof (struct xenkbd_key_batch) == XENKBD_IN_EVENT_SIZE);
+
+// Extension (feature-timestamp / request-timestamp): the last 8 bytes of
+// every slot, which are reserved in all public event types, carry the
+// backend's monotonic clock in nanoseconds when the event was queued. A
+// batch then holds at most XENKBD_KEY_BATCH_MAX_STAMPED keys.
+#define XENKBD_IN_EVENT_TIMESTAMP_OFFSET    32
+
+#define XENKBD_KEY_BATCH_MAX_STAMPED        15
+
+C_ASSERT(FIELD_OFFSET(struct xenkbd_key_batch, key[XENKBD_KEY_BATCH_MAX_STAMPED]) ==
+         XENKBD_IN_EVENT_TIMESTAMP_OFFSET);
+
+typedef struct _XENVKBD_HID_KEYBOARD {
+    UCHAR   ReportId; // = 1
+    UCHAR   Modifiers;
+    UCHAR   Keys[6];
+} XENVKBD_HID_KEYBOARD;
+
+typedef struct _XENVKBD_HID_ABSMOUSE {
+    UCHAR   ReportId; // = 2
+    UCHAR   Buttons;
+    USHORT  X;
+    USHORT  Y;
+    CHAR    dZ;
+} XENVKBD_HID_ABSMOUSE;
+
+typedef struct _XENVKBD_TRANSLATE {
+    XENVKBD_HID_KEYBOARD    Keyboard;
+    XENVKBD_HID_ABSMOUSE    AbsMouse;
+    BOOLEAN                 KeyBatch;   // XENKBD_TYPE_KEY_BATCH negotiated
+    BOOLEAN                 Timestamp;  // Slots carry a backend timestamp
+    ULONG                   BatchIndex; // Keys of a held batch already applied
+} XENVKBD_TRANSLATE, *PXENVKBD_TRANSLATE;
+
+typedef enum _XENVKBD_TRANSLATE_RESULT {
+    TRANSLATE_RESULT_NONE = 0,
+    // The keyboard report changed
+    TRANSLATE_RESULT_KEYBOARD,
+    // The pointer buttons changed; this must not be merged away
+    TRANSLATE_RESULT_BUTTONS,
+    // The pointer moved; this may be merged with later movement
+    TRANSLATE_RESULT_POINTER
+} XENVKBD_TRANSLATE_RESULT;
+
+typedef VOID
+(*XENVKBD_TRANSLATE_CALLBACK)(
+    IN  PVOID                       Context,
+    IN  ULONG                       Index,
+    IN  const union xenkbd_in_event *Event,
+    IN  XENVKBD_TRANSLATE_RESULT    Result
+    );
+
+// Returns TRUE if Event must be left in the ring for now
+typedef BOOLEAN
+(*XENVKBD_TRANSLATE_HOLD)(
+    IN  PVOID                       Context,
+    IN  const union xenkbd_in_event *Event
+    );
+
+// Called at the start of each pass over the ring, with Cons already moved
+// on if the producer had overrun it (in which case every key and button has
+// been released)
+typedef VOID
+(*XENVKBD_TRANSLATE_PASS)(
+    IN  PVOID   Context,
+    IN  ULONG   Cons,
+    IN  ULONG   Prod,
+    IN  BOOLEAN Overrun
+    );
+
+// The consumer's view of a shared in ring
+typedef struct _XENVKBD_TRANSLATE_RING {
+    struct xenkbd_page      *Shared;
+    union xenkbd_in_event   *Slots;
+    ULONG                   Length;
+    BOOLEAN                 EventIdx;       // Re-arm in_event when empty
+    BOOLEAN                 Backpressure;   // Only consume applied slots
+    union xenkbd_in_event   *Snapshot;
+    ULONG                   SnapshotLength;
+    ULONG                   Applied;
+    ULONG                   Rechecks;
+} XENVKBD_TRANSLATE_RING, *PXENVKBD_TRANSLATE_RING;
+
+typedef enum _XENVKBD_TRANSLATE_STOP {
+    TRANSLATE_STOP_EMPTY = 0,
+    TRANSLATE_STOP_HELD,
+    TRANSLATE_STOP_BUDGET
+} XENVKBD_TRANSLATE_STOP;
+
+// Clears the reports; the negotiated settings are preserved
+extern VOID
+TranslateReset(
+    IN  PXENVKBD_TRANSLATE  Translate
+    );
+
+// Releases every key and button that is currently held
+extern VOID
+TranslateRelease(
+    IN  PXENVKBD_TRANSLATE  Translate
+    );
+
+extern ULONG64
+TranslateGetTimestamp(
+    IN  const union xenkbd_in_event *Event
+    );
+
+extern const CHAR *
+TranslateKeyName(
+    IN  ULONG   KeyCode
+    );
+
+extern XENVKBD_TRANSLATE_RESULT
+TranslateEvent(
+    IN  PXENVKBD_TRANSLATE          Translate,
+    IN  const union xenkbd_in_event *Event
+    );
+
+// Copies Count (at most Length) slots starting at Cons out of the shared
+// ring of Length slots, so that each slot is fetched exactly once. The
+// caller is responsible for ordering against the producer and for
+// publishing the new consumer index.
+extern VOID
+TranslateSnapshot(
+    IN  const union xenkbd_in_event *Slots,
+    IN  ULONG                       Length,
+    IN  ULONG                       Cons,
+    IN  ULONG                       Count,
+    OUT union xenkbd_in_event       *Events
+    );
+
+// Applies Count events taken from ring index Cons onwards, invoking
+// Callback for each event after it has been applied. A batched slot
+// produces one callback per key; Event is NULL for all but the first.
+// If Hold is given it is consulted before each event, and before each key
+// of a batch, and translation stops at the first it holds. A batch held
+// part way through is not counted as applied; the next call resumes it
+// from the key it stopped at. Returns the number of events applied.
+extern ULONG
+TranslateEvents(
+    IN  PXENVKBD_TRANSLATE          Translate,
+    IN  const union xenkbd_in_event *Events,
+    IN  ULONG                       Cons,
+    IN  ULONG                       Count,
+    IN  XENVKBD_TRANSLATE_CALLBACK  Callback,
+    IN  XENVKBD_TRANSLATE_HOLD      Hold OPTIONAL,
+    IN  PVOID                       Context
+    );
+
+// Consumes up to Budget slots from the shared ring, snapshotting and
+// applying them as TranslateEvents() does and publishing in_cons as it
+// goes. Hold is only consulted if Ring->Backpressure is set. Applied and
+// Rechecks are added to. Returns why consumption stopped.
+extern XENVKBD_TRANSLATE_STOP
+TranslateRing(
+    IN      PXENVKBD_TRANSLATE          Translate,
+    IN OUT  PXENVKBD_TRANSLATE_RING     Ring,
+    IN      ULONG                       Budget,
+    IN      XENVKBD_TRANSLATE_PASS      Pass OPTIONAL,
+    IN      XENVKBD_TRANSLATE_CALLBACK  Callback,
+    IN      XENVKBD_TRANSLATE_HOLD      Hold OPTIONAL,
+    IN      PVOID                       Context
+    );
+
+#endif  // _XENVKBD_TRANSLATE_H
@@ -37,6 +37,7 @@
 #include <intrin.h>
 
 #include "assert.h"
+#include "pool.h"
 
 #define	P2ROUNDUP(_x, _a)   \
         (-(-(_x) & -(_a)))
@@ -140,6 +141,21 @@ __InterlockedSubtract(
     return New;
 }
 
+static FORCEINLINE ULONGLONG
+__GetTimeUs(
+    VOID
+    )
+{
+    LARGE_INTEGER   Counter;
+    LARGE_INTEGER   Frequency;
+
+    Counter = KeQueryPerformanceCounter(&Frequency);
+
+    return ((Counter.QuadPart / Frequency.QuadPart) * 1000000ull) +
+           (((Counter.QuadPart % Frequency.QuadPart) * 1000000ull) /
+            Frequency.QuadPart);
+}
+
 __checkReturn
 static FORCEINLINE PVOID
 __AllocatePoolWithTag(
@@ -178,6 +194,53 @@ __FreePoolWithTag(
     ExFreePoolWithTag(Buffer, Tag);
 }
 
+// A bump allocator over a single pool allocation. Nothing is freed
+// individually; the caller frees the whole block by freeing the first
+// thing allocated from it (which is at the base).
+typedef struct _ARENA {
+    PUCHAR  Base;
+    ULONG   Size;
+    ULONG   Offset;
+} ARENA, *PARENA;
+
+#define ARENA_ALIGNMENT         sizeof (PVOID)
+#define ARENA_SIZE(_Length)     P2ROUNDUP((ULONG)(_Length), (ULONG)ARENA_ALIGNMENT)
+
+__checkReturn
+static FORCEINLINE BOOLEAN
+__ArenaCreate(
+    OUT PARENA  Arena,
+    IN  ULONG   Size,
+    IN  ULONG   Tag
+    )
+{
+    Arena->Base = PoolAllocate(Tag, Size);
+    Arena->Size = (Arena->Base != NULL) ? Size : 0;
+    Arena->Offset = 0;
+
+    return (Arena->Base != NULL) ? TRUE : FALSE;
+}
+
+static FORCEINLINE PVOID
+__ArenaAllocate(
+    IN  PARENA  Arena,
+    IN  ULONG   Length
+    )
+{
+    PVOID       Buffer;
+
+    Length = ARENA_SIZE(Length);
+
+    ASSERT3U(Length, <=, Arena->Size - Arena->Offset);
+    if (Length > Arena->Size - Arena->Offset)
+        return NULL;
+
+    Buffer = Arena->Base + Arena->Offset;
+    Arena->Offset += Length;
+
+    return Buffer;
+}
+
 static FORCEINLINE PMDL
 __AllocatePages(
     IN  ULONG           Count
@@ -0,0 +1,264 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#include <time.h>
+
+#include "backend.h"
+
+static ULONG64
+__BackendGetTimeNs(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return (ULONG64)Now.tv_sec * 1000000000ull + (ULONG64)Now.tv_nsec;
+}
+
+static FORCEINLINE struct xenkbd_key_batch *
+__BackendBatch(
+    IN  PBACKEND    Backend
+    )
+{
+    return (struct xenkbd_key_batch *)&Backend->Slots[(Backend->Prod - 1) % Backend->Length];
+}
+
+static FORCEINLINE ULONG
+__BackendBatchMaximum(
+    IN  PBACKEND    Backend
+    )
+{
+    return (Backend->Timestamp) ?
+           XENKBD_KEY_BATCH_MAX_STAMPED :
+           XENKBD_KEY_BATCH_MAX;
+}
+
+VOID
+BackendInitialize(
+    IN  PBACKEND                Backend,
+    IN  struct xenkbd_page      *Shared,
+    IN  union xenkbd_in_event   *Slots,
+    IN  ULONG                   Length
+    )
+{
+    memset(Backend, 0, sizeof (BACKEND));
+
+    Backend->Shared = Shared;
+    Backend->Slots = Slots;
+    Backend->Length = Length;
+    Backend->Prod = Shared->in_prod;
+    Backend->Pushed = Backend->Prod;
+}
+
+ULONG
+BackendSpace(
+    IN  PBACKEND    Backend
+    )
+{
+    ULONG           in_cons;
+
+    in_cons = __atomic_load_n(&Backend->Shared->in_cons, __ATOMIC_ACQUIRE);
+
+    return Backend->Length - (Backend->Prod - in_cons);
+}
+
+BOOLEAN
+BackendPut(
+    IN  PBACKEND                    Backend,
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    if (BackendSpace(Backend) == 0) {
+        Backend->Full++;
+        return FALSE;
+    }
+
+    memcpy(&Backend->Slots[Backend->Prod % Backend->Length],
+           Event,
+           sizeof (union xenkbd_in_event));
+
+    if (Backend->Timestamp) {
+        ULONG64 Now = __BackendGetTimeNs();
+
+        memcpy((PUCHAR)&Backend->Slots[Backend->Prod % Backend->Length] +
+               XENKBD_IN_EVENT_TIMESTAMP_OFFSET,
+               &Now,
+               sizeof (ULONG64));
+    }
+
+    Backend->Prod++;
+    Backend->Produced++;
+    Backend->BatchOpen = FALSE;
+
+    return TRUE;
+}
+
+BOOLEAN
+BackendBatching(
+    IN  PBACKEND    Backend
+    )
+{
+    return Backend->BatchOpen &&
+           __BackendBatch(Backend)->count < __BackendBatchMaximum(Backend);
+}
+
+BOOLEAN
+BackendPutKey(
+    IN  PBACKEND            Backend,
+    IN  ULONG               KeyCode,
+    IN  BOOLEAN             Pressed
+    )
+{
+    union xenkbd_in_event   Event;
+    struct xenkbd_key_batch *Batch;
+    USHORT                  Key;
+
+    if (!Backend->KeyBatch) {
+        BackendKey(&Event, KeyCode, Pressed);
+        if (!BackendPut(Backend, &Event))
+            return FALSE;
+
+        Backend->Keys++;
+        return TRUE;
+    }
+
+    Key = (USHORT)KeyCode;
+    if (Pressed)
+        Key |= XENKBD_KEY_BATCH_PRESSED;
+
+    if (BackendBatching(Backend)) {
+        Batch = __BackendBatch(Backend);
+        Batch->key[Batch->count++] = Key;
+
+        Backend->Keys++;
+        return TRUE;
+    }
+
+    memset(&Event, 0, sizeof (Event));
+    Batch = (struct xenkbd_key_batch *)&Event;
+    Batch->type = XENKBD_TYPE_KEY_BATCH;
+    Batch->count = 1;
+    Batch->key[0] = Key;
+
+    if (!BackendPut(Backend, &Event))
+        return FALSE;
+
+    Backend->BatchOpen = TRUE;
+    Backend->Keys++;
+    return TRUE;
+}
+
+BOOLEAN
+BackendPush(
+    IN  PBACKEND    Backend
+    )
+{
+    ULONG           Old = Backend->Pushed;
+    ULONG           New = Backend->Prod;
+    ULONG           Event;
+
+    if (New == Old)
+        return FALSE;
+
+    __atomic_store_n(&Backend->Shared->in_prod, New, __ATOMIC_RELEASE);
+    Backend->Pushed = New;
+
+    // The frontend may be reading it now
+    Backend->BatchOpen = FALSE;
+
+    if (Backend->EventIdx) {
+        // Order the in_prod store before the in_event load, against the
+        // frontend's store of in_event and reload of in_prod
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        Event = XENKBD_IN_EVENT_IDX(Backend->Shared);
+
+        // As RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(): notify only if in_event
+        // lies in (Old, New]
+        if ((ULONG)(New - Event) >= (ULONG)(New - Old)) {
+            Backend->Suppressed++;
+            return FALSE;
+        }
+    }
+
+    Backend->Notifications++;
+    return TRUE;
+}
+
+VOID
+BackendKey(
+    OUT union xenkbd_in_event   *Event,
+    IN  ULONG                   KeyCode,
+    IN  BOOLEAN                 Pressed
+    )
+{
+    memset(Event, 0, sizeof (union xenkbd_in_event));
+
+    Event->key.type = XENKBD_TYPE_KEY;
+    Event->key.pressed = Pressed;
+    Event->key.keycode = KeyCode;
+}
+
+VOID
+BackendMotion(
+    OUT union xenkbd_in_event   *Event,
+    IN  LONG                    dX,
+    IN  LONG                    dY,
+    IN  LONG                    dZ
+    )
+{
+    memset(Event, 0, sizeof (union xenkbd_in_event));
+
+    Event->motion.type = XENKBD_TYPE_MOTION;
+    Event->motion.rel_x = dX;
+    Event->motion.rel_y = dY;
+    Event->motion.rel_z = dZ;
+}
+
+VOID
+BackendPosition(
+    OUT union xenkbd_in_event   *Event,
+    IN  LONG                    X,
+    IN  LONG                    Y,
+    IN  LONG                    dZ
+    )
+{
+    memset(Event, 0, sizeof (union xenkbd_in_event));
+
+    Event->pos.type = XENKBD_TYPE_POS;
+    Event->pos.abs_x = X;
+    Event->pos.abs_y = Y;
+    Event->pos.rel_z = dZ;
+}
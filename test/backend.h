@@ -0,0 +1,127 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_BACKEND_H
+#define _XENVKBD_TEST_BACKEND_H
+
+#include "translate.h"
+
+// A reference producer for the in ring, written from the protocol rather
+// than from the driver so that the two can be checked against each other.
+typedef struct _BACKEND {
+    struct xenkbd_page      *Shared;
+    union xenkbd_in_event   *Slots;
+    ULONG                   Length;
+    ULONG                   Prod;       // Private; published by BackendPush()
+    ULONG                   Pushed;     // Last value published
+    BOOLEAN                 EventIdx;   // request-event-idx was written
+    BOOLEAN                 KeyBatch;   // request-key-batch was written
+    BOOLEAN                 Timestamp;  // request-timestamp was written
+    BOOLEAN                 BatchOpen;  // The last slot queued is a batch
+
+    ULONG64                 Produced;   // Slots
+    ULONG64                 Keys;       // Key transitions
+    ULONG64                 Full;
+    ULONG64                 Notifications;
+    ULONG64                 Suppressed; // Not needed thanks to in_event
+} BACKEND, *PBACKEND;
+
+extern VOID
+BackendInitialize(
+    IN  PBACKEND                Backend,
+    IN  struct xenkbd_page      *Shared,
+    IN  union xenkbd_in_event   *Slots,
+    IN  ULONG                   Length
+    );
+
+extern ULONG
+BackendSpace(
+    IN  PBACKEND    Backend
+    );
+
+// Queues Event without publishing it, stamped if Timestamp is set. Returns
+// FALSE if the ring is full.
+extern BOOLEAN
+BackendPut(
+    IN  PBACKEND                    Backend,
+    IN  const union xenkbd_in_event *Event
+    );
+
+// Queues a key transition, with KeyBatch appended to the batch in the last
+// slot queued if it is still unpublished and has room. Returns FALSE if
+// the ring is full.
+extern BOOLEAN
+BackendPutKey(
+    IN  PBACKEND    Backend,
+    IN  ULONG       KeyCode,
+    IN  BOOLEAN     Pressed
+    );
+
+// Returns TRUE if another key transition would go into an unpublished
+// batch, so a backend that can wait a little may as well
+extern BOOLEAN
+BackendBatching(
+    IN  PBACKEND    Backend
+    );
+
+// Publishes everything queued. Returns TRUE if the frontend must be
+// notified, which with EventIdx is only once in_prod passes in_event.
+extern BOOLEAN
+BackendPush(
+    IN  PBACKEND    Backend
+    );
+
+extern VOID
+BackendKey(
+    OUT union xenkbd_in_event   *Event,
+    IN  ULONG                   KeyCode,
+    IN  BOOLEAN                 Pressed
+    );
+
+extern VOID
+BackendMotion(
+    OUT union xenkbd_in_event   *Event,
+    IN  LONG                    dX,
+    IN  LONG                    dY,
+    IN  LONG                    dZ
+    );
+
+extern VOID
+BackendPosition(
+    OUT union xenkbd_in_event   *Event,
+    IN  LONG                    X,
+    IN  LONG                    Y,
+    IN  LONG                    dZ
+    );
+
+#endif  // _XENVKBD_TEST_BACKEND_H
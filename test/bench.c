@@ -0,0 +1,222 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+// Single core throughput of the ring consumer: the backend keeps the ring
+// full with a mix of key, motion and position events and TranslateRing()
+// drains it, exactly as RingDpc() does, into a callback that only counts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <linux-keycodes.h>
+
+#include "translate.h"
+#include "backend.h"
+
+#define PAGE_SIZE   4096
+
+typedef struct _BENCH {
+    ULONG64 Results[TRANSLATE_RESULT_POINTER + 1];
+} BENCH, *PBENCH;
+
+static ULONG64
+BenchGetTimeNs(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return (ULONG64)Now.tv_sec * 1000000000ull + (ULONG64)Now.tv_nsec;
+}
+
+static VOID
+BenchCallback(
+    IN  PVOID                       Context,
+    IN  ULONG                       Index,
+    IN  const union xenkbd_in_event *Event,
+    IN  XENVKBD_TRANSLATE_RESULT    Result
+    )
+{
+    PBENCH                          Bench = Context;
+
+    (void)Index;
+    (void)Event;
+
+    Bench->Results[Result]++;
+}
+
+// A repeating pattern of typing, relative and absolute pointer movement
+// and the odd wheel click
+static VOID
+BenchEvent(
+    IN  ULONG64                 Sequence,
+    OUT union xenkbd_in_event   *Event
+    )
+{
+    static const ULONG  Keys[] = { KEY_H, KEY_E, KEY_L, KEY_L, KEY_O, KEY_SPACE };
+    ULONG               Step = (ULONG)(Sequence % 16);
+
+    if (Step < 4) {
+        BackendKey(Event,
+                   Keys[(Sequence / 16) % ARRAYSIZE(Keys)],
+                   (Step & 1) ? FALSE : TRUE);
+    } else if (Step < 10) {
+        BackendMotion(Event, 3, -2, (Step == 9) ? 1 : 0);
+    } else {
+        BackendPosition(Event,
+                        (LONG)(Sequence % 32768),
+                        (LONG)((Sequence * 7) % 32768),
+                        0);
+    }
+}
+
+static VOID
+BenchUsage(
+    IN  const CHAR  *Name
+    )
+{
+    fprintf(stderr, "usage: %s [--events N] [--budget N]\n", Name);
+    exit(2);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static const struct option  Options[] = {
+        { "events", required_argument, NULL, 'e' },
+        { "budget", required_argument, NULL, 'b' },
+        { NULL, 0, NULL, 0 }
+    };
+    ULONG64                     Events = 10000000;
+    ULONG                       Budget = 0;
+    struct xenkbd_page          *Shared;
+    union xenkbd_in_event       Snapshot[XENKBD_IN_RING_LEN];
+    XENVKBD_TRANSLATE           Translate;
+    XENVKBD_TRANSLATE_RING      Ring;
+    BACKEND                     Backend;
+    BENCH                       Bench;
+    ULONG64                     Sequence;
+    ULONG64                     Passes;
+    ULONG64                     Elapsed;
+    ULONG64                     Reports;
+    double                      Seconds;
+    int                         Option;
+
+    while ((Option = getopt_long(argc, argv, "", Options, NULL)) != -1) {
+        switch (Option) {
+        case 'e':
+            Events = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            Budget = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            BenchUsage(argv[0]);
+        }
+    }
+
+    Shared = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (Shared == NULL)
+        return 1;
+
+    memset(Shared, 0, PAGE_SIZE);
+    memset(&Translate, 0, sizeof (Translate));
+    memset(&Bench, 0, sizeof (Bench));
+
+    TranslateReset(&Translate);
+
+    memset(&Ring, 0, sizeof (Ring));
+    Ring.Shared = Shared;
+    Ring.Slots = XENKBD_IN_RING(Shared);
+    Ring.Length = XENKBD_IN_RING_LEN;
+    Ring.Snapshot = Snapshot;
+    Ring.SnapshotLength = ARRAYSIZE(Snapshot);
+
+    BackendInitialize(&Backend, Shared, Ring.Slots, Ring.Length);
+
+    Sequence = 0;
+    Passes = 0;
+    Elapsed = 0;
+
+    while (Ring.Applied < Events) {
+        union xenkbd_in_event   Event;
+        ULONG64                 Start;
+
+        while (Sequence < Events) {
+            BenchEvent(Sequence, &Event);
+            if (!BackendPut(&Backend, &Event))
+                break;
+            Sequence++;
+        }
+
+        (VOID) BackendPush(&Backend);
+
+        Start = BenchGetTimeNs();
+        (VOID) TranslateRing(&Translate,
+                             &Ring,
+                             (Budget != 0) ? Budget : ~0u,
+                             NULL,
+                             BenchCallback,
+                             NULL,
+                             &Bench);
+        Elapsed += BenchGetTimeNs() - Start;
+        Passes++;
+    }
+
+    Reports = Bench.Results[TRANSLATE_RESULT_KEYBOARD] +
+              Bench.Results[TRANSLATE_RESULT_BUTTONS] +
+              Bench.Results[TRANSLATE_RESULT_POINTER];
+    Seconds = (double)Elapsed / 1e9;
+
+    printf("events      %u\n", Ring.Applied);
+    printf("passes      %llu\n", (unsigned long long)Passes);
+    printf("reports     %llu (keyboard %llu buttons %llu pointer %llu)\n",
+           (unsigned long long)Reports,
+           (unsigned long long)Bench.Results[TRANSLATE_RESULT_KEYBOARD],
+           (unsigned long long)Bench.Results[TRANSLATE_RESULT_BUTTONS],
+           (unsigned long long)Bench.Results[TRANSLATE_RESULT_POINTER]);
+    printf("ns/event    %.2f\n", (double)Elapsed / (double)Ring.Applied);
+    printf("events/s    %.0f\n", (double)Ring.Applied / Seconds);
+    printf("reports/s   %.0f\n", (double)Reports / Seconds);
+
+    free(Shared);
+
+    return (Ring.Applied == Events) ? 0 : 1;
+}
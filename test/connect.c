@@ -0,0 +1,455 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "connect.h"
+
+static ULONG
+__ConnectReadValue(
+    IN  PFAKE_STORE Store,
+    IN  const CHAR  *Prefix,
+    IN  const CHAR  *Node,
+    IN  ULONG       Default
+    )
+{
+    CHAR            *Buffer;
+    ULONG           Value;
+
+    if (FakeStoreRead(Store, NULL, Prefix, Node, &Buffer) != 0)
+        return Default;
+
+    Value = (ULONG)strtoul(Buffer, NULL, 10);
+    FakeStoreFree(Buffer);
+
+    return Value;
+}
+
+static VOID
+__HostSetState(
+    IN  PHOST       Host,
+    IN  XenbusState State
+    )
+{
+    Host->State = State;
+    (VOID) FakeStorePrintf(Host->Store, NULL, Host->Path, "state", "%u", State);
+}
+
+// Written from the protocol: the in ring is as many slots as fit, rounded
+// down to a power of two, in 2^order - 1 pages granted as in-ring-ref<N>
+static int
+__HostMapInRing(
+    IN  PHOST                   Host,
+    OUT union xenkbd_in_event   **Slots,
+    OUT PULONG                  Length
+    )
+{
+    ULONG                       Order = 0;
+    ULONG                       Index;
+    int                         Error;
+
+    if (Host->Features & HOST_FEATURE_PAGE_ORDER_MASK)
+        Order = __ConnectReadValue(Host->Store,
+                                   Host->FrontendPath,
+                                   "ring-page-order",
+                                   0);
+
+    if (Order == 0) {
+        *Slots = XENKBD_IN_RING(Host->Page);
+        *Length = XENKBD_IN_RING_LEN;
+        return 0;
+    }
+
+    Error = EINVAL;
+    if (Order > ((Host->Features & HOST_FEATURE_PAGE_ORDER_MASK) >>
+                 HOST_FEATURE_PAGE_ORDER_SHIFT))
+        goto fail1;
+
+    Host->InPages = (1u << Order) - 1;
+
+    for (Index = 0; Index < Host->InPages; Index++) {
+        CHAR    Node[sizeof ("in-ring-ref") + 10];
+
+        snprintf(Node, sizeof (Node), "in-ring-ref%u", Index);
+        Host->InReference[Index] = __ConnectReadValue(Host->Store,
+                                                      Host->FrontendPath,
+                                                      Node,
+                                                      0);
+    }
+
+    Error = FakeGnttabMapForeignPages(Host->Gnttab,
+                                      CONNECT_HOST_DOMAIN,
+                                      Host->InPages,
+                                      Host->InReference,
+                                      &Host->InRing);
+    if (Error != 0)
+        goto fail2;
+
+    *Slots = Host->InRing;
+    *Length = (Host->InPages * FAKE_PAGE_SIZE) / XENKBD_IN_EVENT_SIZE;
+    while ((*Length & (*Length - 1)) != 0)
+        *Length &= *Length - 1;
+
+    return 0;
+
+fail2:
+    Host->InPages = 0;
+
+fail1:
+    return Error;
+}
+
+static VOID
+__HostUnmapInRing(
+    IN  PHOST   Host
+    )
+{
+    if (Host->InPages == 0)
+        return;
+
+    FakeGnttabUnmapForeignPages(Host->Gnttab,
+                                Host->InPages,
+                                Host->InReference,
+                                Host->InRing);
+    Host->InRing = NULL;
+    Host->InPages = 0;
+}
+
+static int
+__HostConnect(
+    IN  PHOST   Host
+    )
+{
+    union xenkbd_in_event   *Slots;
+    ULONG                   Length;
+    ULONG                   Port;
+    int                     Error;
+
+    Host->Reference = __ConnectReadValue(Host->Store,
+                                         Host->FrontendPath,
+                                         "page-gref",
+                                         0);
+    Port = __ConnectReadValue(Host->Store,
+                              Host->FrontendPath,
+                              "event-channel",
+                              0);
+
+    Error = FakeGnttabMapForeignPages(Host->Gnttab,
+                                      CONNECT_HOST_DOMAIN,
+                                      1,
+                                      &Host->Reference,
+                                      &Host->Page);
+    if (Error != 0)
+        goto fail1;
+
+    Error = __HostMapInRing(Host, &Slots, &Length);
+    if (Error != 0)
+        goto fail2;
+
+    Error = EINVAL;
+    Host->Channel = FakeEvtchnBindInterdomain(Port);
+    if (Host->Channel == NULL)
+        goto fail3;
+
+    BackendInitialize(&Host->Backend, Host->Page, Slots, Length);
+
+    if (Host->Features & HOST_FEATURE_EVENT_IDX)
+        Host->Backend.EventIdx = (__ConnectReadValue(Host->Store,
+                                                     Host->FrontendPath,
+                                                     "request-event-idx",
+                                                     0) != 0);
+    if (Host->Features & HOST_FEATURE_KEY_BATCH)
+        Host->Backend.KeyBatch = (__ConnectReadValue(Host->Store,
+                                                     Host->FrontendPath,
+                                                     "request-key-batch",
+                                                     0) != 0);
+    if (Host->Features & HOST_FEATURE_TIMESTAMP)
+        Host->Backend.Timestamp = (__ConnectReadValue(Host->Store,
+                                                      Host->FrontendPath,
+                                                      "request-timestamp",
+                                                      0) != 0);
+
+    return 0;
+
+fail3:
+    __HostUnmapInRing(Host);
+
+fail2:
+    FakeGnttabUnmapForeignPages(Host->Gnttab, 1, &Host->Reference, Host->Page);
+    Host->Page = NULL;
+
+fail1:
+    fprintf(stderr, "%s: connect failed (%d)\n", Host->Path, Error);
+
+    return Error;
+}
+
+static VOID
+__HostDisconnect(
+    IN  PHOST   Host
+    )
+{
+    Host->Channel = NULL;
+
+    __HostUnmapInRing(Host);
+
+    FakeGnttabUnmapForeignPages(Host->Gnttab, 1, &Host->Reference, Host->Page);
+    Host->Page = NULL;
+    Host->Reference = 0;
+}
+
+// React to the frontend's state as a backend's xenbus watch handler does
+static VOID
+__HostUpdate(
+    IN  PHOST   Host
+    )
+{
+    XenbusState State;
+
+    State = __ConnectReadValue(Host->Store,
+                               Host->FrontendPath,
+                               "state",
+                               XenbusStateUnknown);
+
+    switch (State) {
+    case XenbusStateInitialising:
+        if (Host->State == XenbusStateClosed)
+            __HostSetState(Host, XenbusStateInitWait);
+        break;
+
+    case XenbusStateInitialised:
+    case XenbusStateConnected:
+        if (Host->Connected || Host->State != XenbusStateInitWait)
+            break;
+
+        if (__HostConnect(Host) != 0) {
+            __HostSetState(Host, XenbusStateClosing);
+            break;
+        }
+
+        Host->Connected = TRUE;
+        Host->Connects++;
+        __HostSetState(Host, XenbusStateConnected);
+
+        pthread_cond_broadcast(&Host->Condition);
+        break;
+
+    case XenbusStateClosing:
+    case XenbusStateClosed:
+        if (Host->Connected) {
+            __HostDisconnect(Host);
+            Host->Connected = FALSE;
+        }
+
+        __HostSetState(Host,
+                       (State == XenbusStateClosing) ?
+                       XenbusStateClosing :
+                       XenbusStateClosed);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static PVOID
+HostThread(
+    IN  PVOID   Argument
+    )
+{
+    PHOST       Host = Argument;
+
+    for (;;) {
+        (VOID) FakeEventWait(&Host->Event, -1);
+
+        pthread_mutex_lock(&Host->Lock);
+
+        if (Host->Stopping) {
+            pthread_mutex_unlock(&Host->Lock);
+            break;
+        }
+
+        __HostUpdate(Host);
+
+        pthread_mutex_unlock(&Host->Lock);
+    }
+
+    return NULL;
+}
+
+int
+HostCreate(
+    IN  PFAKE_STORE     Store,
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  const CHAR      *Path,
+    IN  const CHAR      *FrontendPath,
+    IN  ULONG           Features,
+    OUT PHOST           *Host
+    )
+{
+    int                 Error;
+
+    *Host = calloc(1, sizeof (HOST));
+    if (*Host == NULL)
+        return ENOMEM;
+
+    (*Host)->Store = Store;
+    (*Host)->Gnttab = Gnttab;
+    snprintf((*Host)->Path, sizeof ((*Host)->Path), "%s", Path);
+    snprintf((*Host)->FrontendPath, sizeof ((*Host)->FrontendPath), "%s", FrontendPath);
+    (*Host)->Features = Features;
+
+    pthread_mutex_init(&(*Host)->Lock, NULL);
+    pthread_cond_init(&(*Host)->Condition, NULL);
+
+    Error = FakeEventInitialize(&(*Host)->Event);
+    if (Error != 0)
+        goto fail1;
+
+    // What the toolstack would write
+    (VOID) FakeStorePrintf(Store, NULL, FrontendPath, "backend", "%s", Path);
+    (VOID) FakeStorePrintf(Store, NULL, FrontendPath, "backend-id", "%u",
+                           CONNECT_HOST_DOMAIN);
+    (VOID) FakeStorePrintf(Store, NULL, Path, "frontend", "%s", FrontendPath);
+    (VOID) FakeStorePrintf(Store, NULL, Path, "online", "%u", 1);
+    (VOID) FakeStorePrintf(Store, NULL, Path, "frontend-id", "%u",
+                           CONNECT_GUEST_DOMAIN);
+
+    (VOID) FakeStorePrintf(Store, NULL, Path, "feature-abs-pointer", "%u", 1);
+    (VOID) FakeStorePrintf(Store, NULL, Path, "feature-raw-pointer", "%u", 1);
+
+    if (Features & HOST_FEATURE_EVENT_IDX)
+        (VOID) FakeStorePrintf(Store, NULL, Path, "feature-event-idx", "%u", 1);
+    if (Features & HOST_FEATURE_KEY_BATCH)
+        (VOID) FakeStorePrintf(Store, NULL, Path, "feature-key-batch", "%u", 1);
+    if (Features & HOST_FEATURE_TIMESTAMP)
+        (VOID) FakeStorePrintf(Store, NULL, Path, "feature-timestamp", "%u", 1);
+    if (Features & HOST_FEATURE_PAGE_ORDER_MASK)
+        (VOID) FakeStorePrintf(Store, NULL, Path, "max-ring-page-order", "%u",
+                               (Features & HOST_FEATURE_PAGE_ORDER_MASK) >>
+                               HOST_FEATURE_PAGE_ORDER_SHIFT);
+
+    __HostSetState(*Host, XenbusStateInitWait);
+
+    Error = FakeStoreWatchAdd(Store,
+                              FrontendPath,
+                              "state",
+                              &(*Host)->Event,
+                              &(*Host)->Watch);
+    if (Error != 0)
+        goto fail2;
+
+    Error = pthread_create(&(*Host)->Thread, NULL, HostThread, *Host);
+    if (Error != 0)
+        goto fail3;
+
+    return 0;
+
+fail3:
+    FakeStoreWatchRemove(Store, (*Host)->Watch);
+
+fail2:
+    FakeEventTeardown(&(*Host)->Event);
+
+fail1:
+    pthread_cond_destroy(&(*Host)->Condition);
+    pthread_mutex_destroy(&(*Host)->Lock);
+    free(*Host);
+    *Host = NULL;
+
+    return Error;
+}
+
+VOID
+HostDestroy(
+    IN  PHOST   Host
+    )
+{
+    pthread_mutex_lock(&Host->Lock);
+    Host->Stopping = TRUE;
+    FakeEventSet(&Host->Event);
+    pthread_mutex_unlock(&Host->Lock);
+
+    pthread_join(Host->Thread, NULL);
+
+    if (Host->Connected)
+        __HostDisconnect(Host);
+
+    FakeStoreWatchRemove(Host->Store, Host->Watch);
+    FakeEventTeardown(&Host->Event);
+    pthread_cond_destroy(&Host->Condition);
+    pthread_mutex_destroy(&Host->Lock);
+    free(Host);
+}
+
+int
+HostWaitForConnection(
+    IN  PHOST   Host,
+    IN  LONG    TimeoutMs
+    )
+{
+    struct timespec Deadline;
+    int             Error;
+
+    clock_gettime(CLOCK_REALTIME, &Deadline);
+    Deadline.tv_sec += TimeoutMs / 1000;
+    Deadline.tv_nsec += (TimeoutMs % 1000) * 1000000l;
+    if (Deadline.tv_nsec >= 1000000000l) {
+        Deadline.tv_sec++;
+        Deadline.tv_nsec -= 1000000000l;
+    }
+
+    pthread_mutex_lock(&Host->Lock);
+
+    Error = 0;
+    while (!Host->Connected && Error == 0)
+        Error = pthread_cond_timedwait(&Host->Condition, &Host->Lock, &Deadline);
+
+    pthread_mutex_unlock(&Host->Lock);
+
+    return Error;
+}
+
+VOID
+HostPush(
+    IN  PHOST   Host
+    )
+{
+    if (BackendPush(&Host->Backend))
+        FakeEvtchnSend(Host->Channel);
+}
@@ -0,0 +1,122 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_CONNECT_H
+#define _XENVKBD_TEST_CONNECT_H
+
+#include <pthread.h>
+
+#include <public/io/xenbus.h>
+
+#include "translate.h"
+#include "fake.h"
+#include "backend.h"
+
+// The backend end of the kbdif xenbus handshake, over the fakes: a
+// reference backend that runs on a thread of its own, as a backend's
+// xenbus watch would. The frontend end is the driver's own (see guest.h).
+
+#define CONNECT_PATH_LENGTH 64
+
+#define CONNECT_GUEST_DOMAIN    1
+#define CONNECT_HOST_DOMAIN     0
+
+// What the reference backend advertises
+#define HOST_FEATURE_EVENT_IDX          0x00000001
+#define HOST_FEATURE_KEY_BATCH          0x00000002
+#define HOST_FEATURE_TIMESTAMP          0x00000004
+
+// max-ring-page-order, if not zero
+#define HOST_FEATURE_PAGE_ORDER_SHIFT   8
+#define HOST_FEATURE_PAGE_ORDER_MASK    0x00000F00
+#define HOST_FEATURE_PAGE_ORDER(_Order) \
+    ((ULONG)(_Order) << HOST_FEATURE_PAGE_ORDER_SHIFT)
+
+#define HOST_MAX_IN_PAGES   15
+
+typedef struct _HOST {
+    PFAKE_STORE             Store;
+    PFAKE_GNTTAB            Gnttab;
+    CHAR                    Path[CONNECT_PATH_LENGTH];
+    CHAR                    FrontendPath[CONNECT_PATH_LENGTH];
+    ULONG                   Features;
+    FAKE_EVENT              Event;
+    PFAKE_STORE_WATCH       Watch;
+    pthread_t               Thread;
+
+    pthread_mutex_t         Lock;
+    pthread_cond_t          Condition;
+    BOOLEAN                 Stopping;
+    XenbusState             State;
+    BOOLEAN                 Connected;
+    ULONG                   Connects;
+    ULONG                   Reference;
+    PVOID                   Page;
+    ULONG                   InPages;
+    ULONG                   InReference[HOST_MAX_IN_PAGES];
+    PVOID                   InRing;
+    PFAKE_EVTCHN            Channel;
+    BACKEND                 Backend;
+} HOST, *PHOST;
+
+// Advertises the backend's features and waits for a frontend
+extern int
+HostCreate(
+    IN  PFAKE_STORE     Store,
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  const CHAR      *Path,
+    IN  const CHAR      *FrontendPath,
+    IN  ULONG           Features,
+    OUT PHOST           *Host
+    );
+
+extern VOID
+HostDestroy(
+    IN  PHOST   Host
+    );
+
+// Waits for the frontend to connect. Host->Backend may then be used, from
+// one thread, until the frontend starts to close.
+extern int
+HostWaitForConnection(
+    IN  PHOST   Host,
+    IN  LONG    TimeoutMs
+    );
+
+// Notifies the frontend if Backend needs to
+extern VOID
+HostPush(
+    IN  PHOST   Host
+    );
+
+#endif  // _XENVKBD_TEST_CONNECT_H
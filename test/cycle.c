@@ -0,0 +1,262 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+// Connect/disconnect cycles between the reference backend and the driver's
+// own frontend (see guest.h), over the in-process fakes. Each cycle also
+// times the first event through the new ring; the phases are as the
+// frontend accounts for them itself.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <linux-keycodes.h>
+
+#include "translate.h"
+#include "fake.h"
+#include "connect.h"
+#include "guest.h"
+
+typedef struct _CYCLE {
+    PGUEST      Guest;
+    FAKE_EVENT  Reported;
+} CYCLE, *PCYCLE;
+
+typedef struct _CYCLE_TIMING {
+    ULONG64 Total;
+    ULONG64 Maximum;
+} CYCLE_TIMING, *PCYCLE_TIMING;
+
+static ULONG64
+CycleGetTimeNs(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return (ULONG64)Now.tv_sec * 1000000000ull + (ULONG64)Now.tv_nsec;
+}
+
+static VOID
+CycleAccount(
+    IN  PCYCLE_TIMING   Timing,
+    IN  ULONG64         Ns
+    )
+{
+    Timing->Total += Ns;
+    if (Ns > Timing->Maximum)
+        Timing->Maximum = Ns;
+}
+
+static VOID
+CyclePrint(
+    IN  const CHAR      *Name,
+    IN  PCYCLE_TIMING   Timing,
+    IN  ULONG           Cycles
+    )
+{
+    printf("%-12s mean %8.1fus max %8.1fus\n",
+           Name,
+           (double)Timing->Total / Cycles / 1000.0,
+           (double)Timing->Maximum / 1000.0);
+}
+
+static BOOLEAN
+CycleCallback(
+    IN  PVOID       Context,
+    IN  const VOID  *Report,
+    IN  ULONG       Length
+    )
+{
+    PCYCLE          Cycle = Context;
+
+    (void)Report;
+    (void)Length;
+
+    FakeEventSet(&Cycle->Reported);
+
+    return TRUE;
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static const struct option  Options[] = {
+        { "cycles", required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    ULONG                       Cycles = 1000;
+    PFAKE_STORE                 Store;
+    PFAKE_GNTTAB                Gnttab;
+    PHOST                       Host;
+    CYCLE                       Cycle;
+    CYCLE_TIMING                Enable;
+    CYCLE_TIMING                Prepare;
+    CYCLE_TIMING                Connect;
+    CYCLE_TIMING                Event;
+    CYCLE_TIMING                Close;
+    GUEST_TIMING                Timing;
+    FAKE_STORE_STATISTICS       Statistics;
+    ULONG64                     Start;
+    ULONG64                     Elapsed;
+    ULONG                       Index;
+    int                         Option;
+    int                         Error;
+
+    while ((Option = getopt_long(argc, argv, "", Options, NULL)) != -1) {
+        switch (Option) {
+        case 'c':
+            Cycles = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--cycles N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (Cycles == 0)
+        return 2;
+
+    memset(&Cycle, 0, sizeof (Cycle));
+    memset(&Enable, 0, sizeof (Enable));
+    memset(&Prepare, 0, sizeof (Prepare));
+    memset(&Connect, 0, sizeof (Connect));
+    memset(&Event, 0, sizeof (Event));
+    memset(&Close, 0, sizeof (Close));
+
+    if (FakeEventInitialize(&Cycle.Reported) != 0 ||
+        FakeStoreCreate(&Store) != 0 ||
+        FakeGnttabCreate(64, &Gnttab) != 0)
+        return 1;
+
+    Error = HostCreate(Store, Gnttab, "backend/vkbd/0/0", "device/vkbd/0", 0, &Host);
+    if (Error != 0)
+        return 1;
+
+    Error = GuestCreate(Store, Gnttab, "0", 0, &Cycle.Guest);
+    if (Error != 0)
+        return 1;
+
+    Start = CycleGetTimeNs();
+
+    for (Index = 0; Index < Cycles; Index++) {
+        union xenkbd_in_event   Key;
+        ULONG64                 Sent;
+
+        Sent = CycleGetTimeNs();
+
+        Error = GuestEnable(Cycle.Guest, CycleCallback, &Cycle);
+        if (Error != 0)
+            break;
+
+        Error = HostWaitForConnection(Host, 5000);
+        if (Error != 0)
+            break;
+
+        CycleAccount(&Enable, CycleGetTimeNs() - Sent);
+
+        Error = GuestGetTiming(Cycle.Guest, &Timing);
+        if (Error != 0)
+            break;
+
+        CycleAccount(&Prepare, Timing.Prepare * 1000);
+        CycleAccount(&Connect, Timing.Connect * 1000);
+
+        Sent = CycleGetTimeNs();
+
+        BackendKey(&Key, KEY_A, (Index & 1) ? FALSE : TRUE);
+        (VOID) BackendPut(&Host->Backend, &Key);
+        HostPush(Host);
+
+        Error = FakeEventWait(&Cycle.Reported, 5000);
+        if (Error != 0)
+            break;
+
+        CycleAccount(&Event, CycleGetTimeNs() - Sent);
+
+        Error = GuestClose(Cycle.Guest);
+        if (Error != 0)
+            break;
+
+        Error = GuestGetTiming(Cycle.Guest, &Timing);
+        if (Error != 0)
+            break;
+
+        CycleAccount(&Close, Timing.Close * 1000);
+    }
+
+    Elapsed = CycleGetTimeNs() - Start;
+
+    if (Error != 0) {
+        fprintf(stderr, "cycle %u failed (%d)\n", Index, Error);
+        return 1;
+    }
+
+    FakeStoreGetStatistics(Store, &Statistics);
+
+    printf("cycles       %u (%u connects)\n", Cycles, Host->Connects);
+    printf("cycles/s     %.0f\n", (double)Cycles * 1e9 / (double)Elapsed);
+    CyclePrint("enable", &Enable, Cycles);
+    CyclePrint("prepare", &Prepare, Cycles);
+    CyclePrint("connect", &Connect, Cycles);
+    CyclePrint("first event", &Event, Cycles);
+    CyclePrint("close", &Close, Cycles);
+    printf("store/cycle  reads %.1f writes %.1f watches %.1f\n",
+           (double)Statistics.Reads / Cycles,
+           (double)Statistics.Writes / Cycles,
+           (double)Statistics.Watches / Cycles);
+    printf("transactions %llu (%llu conflicts)\n",
+           (unsigned long long)Statistics.Transactions,
+           (unsigned long long)Statistics.Conflicts);
+    printf("frontend     %u connects, %u store ops in %llu.%03llums (max %lluus)\n",
+           Timing.Connects,
+           Timing.StoreOps,
+           (unsigned long long)(Timing.StoreTime / 1000),
+           (unsigned long long)(Timing.StoreTime % 1000),
+           (unsigned long long)Timing.StoreMax);
+
+    GuestDestroy(Cycle.Guest);
+    HostDestroy(Host);
+    FakeGnttabDestroy(Gnttab);
+    FakeStoreDestroy(Store);
+    FakeEventTeardown(&Cycle.Reported);
+
+    return 0;
+}
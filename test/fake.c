@@ -0,0 +1,1192 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "fake.h"
+
+#define FAKE_PATH_LENGTH    256
+
+int
+FakeEventInitialize(
+    OUT PFAKE_EVENT Event
+    )
+{
+    Event->Fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    return (Event->Fd < 0) ? errno : 0;
+}
+
+VOID
+FakeEventTeardown(
+    IN  PFAKE_EVENT Event
+    )
+{
+    close(Event->Fd);
+    Event->Fd = -1;
+}
+
+VOID
+FakeEventSet(
+    IN  PFAKE_EVENT Event
+    )
+{
+    uint64_t        Value = 1;
+
+    // Only fails if the counter would overflow, i.e. it is already set
+    (void) !write(Event->Fd, &Value, sizeof (Value));
+}
+
+int
+FakeEventWait(
+    IN  PFAKE_EVENT Event,
+    IN  LONG        TimeoutMs
+    )
+{
+    struct pollfd   Poll;
+    uint64_t        Value;
+
+    for (;;) {
+        // Reading resets the event
+        if (read(Event->Fd, &Value, sizeof (Value)) == sizeof (Value))
+            return 0;
+
+        Poll.fd = Event->Fd;
+        Poll.events = POLLIN;
+        Poll.revents = 0;
+
+        switch (poll(&Poll, 1, TimeoutMs)) {
+        case 0:
+            return ETIMEDOUT;
+        case -1:
+            if (errno != EINTR)
+                return errno;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// The store is a flat list of nodes: it only ever holds a few devices'
+// worth of keys
+typedef struct _FAKE_STORE_NODE {
+    struct _FAKE_STORE_NODE *Next;
+    CHAR                    *Path;
+    CHAR                    *Value;     // NULL records a removal
+} FAKE_STORE_NODE, *PFAKE_STORE_NODE;
+
+struct _FAKE_STORE_WATCH {
+    PFAKE_STORE_WATCH   Next;
+    CHAR                *Path;
+    PFAKE_EVENT         Event;
+};
+
+struct _FAKE_STORE_TRANSACTION {
+    ULONG64             Generation;
+    PFAKE_STORE_NODE    Head;           // Writes and removals, newest first
+};
+
+struct _FAKE_STORE {
+    pthread_mutex_t         Lock;
+    PFAKE_STORE_NODE        Head;
+    PFAKE_STORE_WATCH       Watch;
+    ULONG64                 Generation;
+    FAKE_STORE_STATISTICS   Statistics;
+};
+
+static int
+__FakeStorePath(
+    IN  const CHAR  *Prefix OPTIONAL,
+    IN  const CHAR  *Node,
+    OUT CHAR        *Path
+    )
+{
+    int             Length;
+
+    if (Prefix != NULL)
+        Length = snprintf(Path, FAKE_PATH_LENGTH, "%s/%s", Prefix, Node);
+    else
+        Length = snprintf(Path, FAKE_PATH_LENGTH, "%s", Node);
+
+    return (Length < 0 || Length >= FAKE_PATH_LENGTH) ? ENAMETOOLONG : 0;
+}
+
+// TRUE if Path is Ancestor or lies below it
+static BOOLEAN
+__FakeStoreIsBelow(
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Ancestor
+    )
+{
+    size_t          Length = strlen(Ancestor);
+
+    if (strncmp(Path, Ancestor, Length) != 0)
+        return FALSE;
+
+    return (Path[Length] == '\0' || Path[Length] == '/') ? TRUE : FALSE;
+}
+
+static PFAKE_STORE_NODE
+__FakeStoreNodeCreate(
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Value OPTIONAL
+    )
+{
+    PFAKE_STORE_NODE    Node;
+
+    Node = calloc(1, sizeof (FAKE_STORE_NODE));
+    if (Node == NULL)
+        return NULL;
+
+    Node->Path = strdup(Path);
+    Node->Value = (Value != NULL) ? strdup(Value) : NULL;
+
+    if (Node->Path == NULL || (Value != NULL && Node->Value == NULL)) {
+        free(Node->Path);
+        free(Node->Value);
+        free(Node);
+        return NULL;
+    }
+
+    return Node;
+}
+
+static VOID
+__FakeStoreNodeDestroy(
+    IN  PFAKE_STORE_NODE    Node
+    )
+{
+    free(Node->Path);
+    free(Node->Value);
+    free(Node);
+}
+
+static VOID
+__FakeStoreFire(
+    IN  PFAKE_STORE     Store,
+    IN  const CHAR      *Path
+    )
+{
+    PFAKE_STORE_WATCH   Watch;
+
+    for (Watch = Store->Watch; Watch != NULL; Watch = Watch->Next) {
+        // A removal of a parent also takes the watched node with it
+        if (!__FakeStoreIsBelow(Path, Watch->Path) &&
+            !__FakeStoreIsBelow(Watch->Path, Path))
+            continue;
+
+        Store->Statistics.Watches++;
+        FakeEventSet(Watch->Event);
+    }
+}
+
+static int
+__FakeStoreWrite(
+    IN  PFAKE_STORE     Store,
+    IN  const CHAR      *Path,
+    IN  const CHAR      *Value
+    )
+{
+    PFAKE_STORE_NODE    Node;
+    CHAR                *Copy;
+
+    for (Node = Store->Head; Node != NULL; Node = Node->Next) {
+        if (strcmp(Node->Path, Path) == 0)
+            break;
+    }
+
+    if (Node != NULL) {
+        Copy = strdup(Value);
+        if (Copy == NULL)
+            return ENOMEM;
+
+        free(Node->Value);
+        Node->Value = Copy;
+    } else {
+        Node = __FakeStoreNodeCreate(Path, Value);
+        if (Node == NULL)
+            return ENOMEM;
+
+        Node->Next = Store->Head;
+        Store->Head = Node;
+    }
+
+    Store->Generation++;
+    __FakeStoreFire(Store, Path);
+
+    return 0;
+}
+
+static int
+__FakeStoreRemove(
+    IN  PFAKE_STORE     Store,
+    IN  const CHAR      *Path
+    )
+{
+    PFAKE_STORE_NODE    *Link;
+    BOOLEAN             Found;
+
+    Found = FALSE;
+
+    Link = &Store->Head;
+    while (*Link != NULL) {
+        PFAKE_STORE_NODE    Node = *Link;
+
+        if (!__FakeStoreIsBelow(Node->Path, Path)) {
+            Link = &Node->Next;
+            continue;
+        }
+
+        *Link = Node->Next;
+        __FakeStoreNodeDestroy(Node);
+        Found = TRUE;
+    }
+
+    if (!Found)
+        return ENOENT;
+
+    Store->Generation++;
+    __FakeStoreFire(Store, Path);
+
+    return 0;
+}
+
+int
+FakeStoreCreate(
+    OUT PFAKE_STORE *Store
+    )
+{
+    *Store = calloc(1, sizeof (FAKE_STORE));
+    if (*Store == NULL)
+        return ENOMEM;
+
+    pthread_mutex_init(&(*Store)->Lock, NULL);
+
+    return 0;
+}
+
+VOID
+FakeStoreDestroy(
+    IN  PFAKE_STORE Store
+    )
+{
+    while (Store->Head != NULL) {
+        PFAKE_STORE_NODE    Node = Store->Head;
+
+        Store->Head = Node->Next;
+        __FakeStoreNodeDestroy(Node);
+    }
+
+    // Every watch must have been removed by its owner
+    if (Store->Watch != NULL)
+        abort();
+
+    pthread_mutex_destroy(&Store->Lock);
+    free(Store);
+}
+
+int
+FakeStoreRead(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction OPTIONAL,
+    IN  const CHAR              *Prefix OPTIONAL,
+    IN  const CHAR              *Node,
+    OUT CHAR                    **Value
+    )
+{
+    CHAR                        Path[FAKE_PATH_LENGTH];
+    PFAKE_STORE_NODE            Entry;
+    int                         Error;
+
+    Error = __FakeStorePath(Prefix, Node, Path);
+    if (Error != 0)
+        return Error;
+
+    pthread_mutex_lock(&Store->Lock);
+
+    Store->Statistics.Reads++;
+
+    // A transaction sees its own writes first
+    Entry = NULL;
+    if (Transaction != NULL) {
+        for (Entry = Transaction->Head; Entry != NULL; Entry = Entry->Next) {
+            if (Entry->Value == NULL && __FakeStoreIsBelow(Path, Entry->Path))
+                break;
+            if (strcmp(Entry->Path, Path) == 0)
+                break;
+        }
+    }
+
+    if (Entry == NULL) {
+        for (Entry = Store->Head; Entry != NULL; Entry = Entry->Next) {
+            if (strcmp(Entry->Path, Path) == 0)
+                break;
+        }
+    }
+
+    Error = ENOENT;
+    if (Entry != NULL && Entry->Value != NULL) {
+        *Value = strdup(Entry->Value);
+        Error = (*Value != NULL) ? 0 : ENOMEM;
+    }
+
+    pthread_mutex_unlock(&Store->Lock);
+
+    return Error;
+}
+
+VOID
+FakeStoreFree(
+    IN  CHAR    *Value
+    )
+{
+    free(Value);
+}
+
+int
+FakeStorePrintf(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction OPTIONAL,
+    IN  const CHAR              *Prefix OPTIONAL,
+    IN  const CHAR              *Node,
+    IN  const CHAR              *Format,
+    ...
+    )
+{
+    CHAR                        Path[FAKE_PATH_LENGTH];
+    CHAR                        Value[FAKE_PATH_LENGTH];
+    va_list                     Arguments;
+    int                         Length;
+    int                         Error;
+
+    Error = __FakeStorePath(Prefix, Node, Path);
+    if (Error != 0)
+        return Error;
+
+    va_start(Arguments, Format);
+    Length = vsnprintf(Value, sizeof (Value), Format, Arguments);
+    va_end(Arguments);
+
+    if (Length < 0 || Length >= (int)sizeof (Value))
+        return E2BIG;
+
+    pthread_mutex_lock(&Store->Lock);
+
+    Store->Statistics.Writes++;
+
+    if (Transaction != NULL) {
+        PFAKE_STORE_NODE    Entry;
+
+        Entry = __FakeStoreNodeCreate(Path, Value);
+        if (Entry != NULL) {
+            Entry->Next = Transaction->Head;
+            Transaction->Head = Entry;
+        }
+
+        Error = (Entry != NULL) ? 0 : ENOMEM;
+    } else {
+        Error = __FakeStoreWrite(Store, Path, Value);
+    }
+
+    pthread_mutex_unlock(&Store->Lock);
+
+    return Error;
+}
+
+int
+FakeStoreRemove(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction OPTIONAL,
+    IN  const CHAR              *Prefix OPTIONAL,
+    IN  const CHAR              *Node
+    )
+{
+    CHAR                        Path[FAKE_PATH_LENGTH];
+    int                         Error;
+
+    Error = __FakeStorePath(Prefix, Node, Path);
+    if (Error != 0)
+        return Error;
+
+    pthread_mutex_lock(&Store->Lock);
+
+    Store->Statistics.Removes++;
+
+    if (Transaction != NULL) {
+        PFAKE_STORE_NODE    Entry;
+
+        Entry = __FakeStoreNodeCreate(Path, NULL);
+        if (Entry != NULL) {
+            Entry->Next = Transaction->Head;
+            Transaction->Head = Entry;
+        }
+
+        Error = (Entry != NULL) ? 0 : ENOMEM;
+    } else {
+        Error = __FakeStoreRemove(Store, Path);
+    }
+
+    pthread_mutex_unlock(&Store->Lock);
+
+    return Error;
+}
+
+int
+FakeStoreTransactionStart(
+    IN  PFAKE_STORE             Store,
+    OUT PFAKE_STORE_TRANSACTION *Transaction
+    )
+{
+    *Transaction = calloc(1, sizeof (FAKE_STORE_TRANSACTION));
+    if (*Transaction == NULL)
+        return ENOMEM;
+
+    pthread_mutex_lock(&Store->Lock);
+    Store->Statistics.Transactions++;
+    (*Transaction)->Generation = Store->Generation;
+    pthread_mutex_unlock(&Store->Lock);
+
+    return 0;
+}
+
+static VOID
+__FakeStoreApply(
+    IN  PFAKE_STORE         Store,
+    IN  PFAKE_STORE_NODE    Entry
+    )
+{
+    if (Entry == NULL)
+        return;
+
+    // Oldest first
+    __FakeStoreApply(Store, Entry->Next);
+
+    if (Entry->Value != NULL)
+        (VOID) __FakeStoreWrite(Store, Entry->Path, Entry->Value);
+    else
+        (VOID) __FakeStoreRemove(Store, Entry->Path);
+}
+
+// Conflicts are detected coarsely, as early versions of xenstored did: any
+// change to the store since the transaction started fails it
+int
+FakeStoreTransactionEnd(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction,
+    IN  BOOLEAN                 Commit
+    )
+{
+    int                         Error;
+
+    pthread_mutex_lock(&Store->Lock);
+
+    Error = 0;
+    if (Commit) {
+        if (Store->Generation != Transaction->Generation) {
+            Store->Statistics.Conflicts++;
+            Error = EAGAIN;
+        } else {
+            __FakeStoreApply(Store, Transaction->Head);
+        }
+    }
+
+    pthread_mutex_unlock(&Store->Lock);
+
+    while (Transaction->Head != NULL) {
+        PFAKE_STORE_NODE    Entry = Transaction->Head;
+
+        Transaction->Head = Entry->Next;
+        __FakeStoreNodeDestroy(Entry);
+    }
+
+    free(Transaction);
+
+    return Error;
+}
+
+int
+FakeStoreWatchAdd(
+    IN  PFAKE_STORE         Store,
+    IN  const CHAR          *Prefix OPTIONAL,
+    IN  const CHAR          *Node,
+    IN  PFAKE_EVENT         Event,
+    OUT PFAKE_STORE_WATCH   *Watch
+    )
+{
+    CHAR                    Path[FAKE_PATH_LENGTH];
+    int                     Error;
+
+    Error = __FakeStorePath(Prefix, Node, Path);
+    if (Error != 0)
+        return Error;
+
+    *Watch = calloc(1, sizeof (FAKE_STORE_WATCH));
+    if (*Watch == NULL)
+        return ENOMEM;
+
+    (*Watch)->Path = strdup(Path);
+    if ((*Watch)->Path == NULL) {
+        free(*Watch);
+        return ENOMEM;
+    }
+
+    (*Watch)->Event = Event;
+
+    pthread_mutex_lock(&Store->Lock);
+    (*Watch)->Next = Store->Watch;
+    Store->Watch = *Watch;
+    pthread_mutex_unlock(&Store->Lock);
+
+    // A new watch always fires once
+    FakeEventSet(Event);
+
+    return 0;
+}
+
+VOID
+FakeStoreWatchRemove(
+    IN  PFAKE_STORE         Store,
+    IN  PFAKE_STORE_WATCH   Watch
+    )
+{
+    PFAKE_STORE_WATCH       *Link;
+
+    pthread_mutex_lock(&Store->Lock);
+
+    for (Link = &Store->Watch; *Link != NULL; Link = &(*Link)->Next) {
+        if (*Link == Watch) {
+            *Link = Watch->Next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&Store->Lock);
+
+    free(Watch->Path);
+    free(Watch);
+}
+
+VOID
+FakeStoreGetStatistics(
+    IN  PFAKE_STORE             Store,
+    OUT PFAKE_STORE_STATISTICS  Statistics
+    )
+{
+    pthread_mutex_lock(&Store->Lock);
+    *Statistics = Store->Statistics;
+    pthread_mutex_unlock(&Store->Lock);
+}
+
+struct _FAKE_EVTCHN {
+    pthread_mutex_t         Lock;
+    ULONG                   Port;
+    FAKE_DPC_ROUTINE        Routine;
+    PVOID                   Context;
+    FAKE_EVENT              Event;
+    pthread_t               Thread;
+    BOOLEAN                 Masked;
+    BOOLEAN                 Pending;
+    BOOLEAN                 Queued;
+    BOOLEAN                 Closing;
+    FAKE_EVTCHN_STATISTICS  Statistics;
+};
+
+// Port 0 is never allocated
+#define FAKE_EVTCHN_PORTS   1024
+
+static pthread_mutex_t  FakeEvtchnLock = PTHREAD_MUTEX_INITIALIZER;
+static PFAKE_EVTCHN     FakeEvtchnPort[FAKE_EVTCHN_PORTS];
+
+static ULONG
+__FakeEvtchnAllocatePort(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    ULONG               Port;
+
+    pthread_mutex_lock(&FakeEvtchnLock);
+
+    for (Port = 1; Port < FAKE_EVTCHN_PORTS; Port++) {
+        if (FakeEvtchnPort[Port] == NULL) {
+            FakeEvtchnPort[Port] = Channel;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&FakeEvtchnLock);
+
+    return (Port < FAKE_EVTCHN_PORTS) ? Port : 0;
+}
+
+static VOID
+__FakeEvtchnFreePort(
+    IN  ULONG   Port
+    )
+{
+    pthread_mutex_lock(&FakeEvtchnLock);
+    FakeEvtchnPort[Port] = NULL;
+    pthread_mutex_unlock(&FakeEvtchnLock);
+}
+
+static VOID
+__FakeEvtchnQueueDpc(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    if (Channel->Queued)
+        return;
+
+    Channel->Queued = TRUE;
+    FakeEventSet(&Channel->Event);
+}
+
+static VOID
+__FakeEvtchnUpcall(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    // Masked on delivery, so that the DPC decides when to take more
+    Channel->Masked = TRUE;
+    Channel->Pending = FALSE;
+    Channel->Statistics.Upcalls++;
+
+    __FakeEvtchnQueueDpc(Channel);
+}
+
+static PVOID
+FakeEvtchnThread(
+    IN  PVOID       Argument
+    )
+{
+    PFAKE_EVTCHN    Channel = Argument;
+
+    for (;;) {
+        (VOID) FakeEventWait(&Channel->Event, -1);
+
+        pthread_mutex_lock(&Channel->Lock);
+
+        if (Channel->Closing) {
+            pthread_mutex_unlock(&Channel->Lock);
+            break;
+        }
+
+        if (!Channel->Queued) {
+            pthread_mutex_unlock(&Channel->Lock);
+            continue;
+        }
+
+        // Dequeued before it runs, so it may be queued again meanwhile
+        Channel->Queued = FALSE;
+        Channel->Statistics.Dpcs++;
+
+        pthread_mutex_unlock(&Channel->Lock);
+
+        Channel->Routine(Channel->Context);
+    }
+
+    return NULL;
+}
+
+int
+FakeEvtchnOpen(
+    IN  FAKE_DPC_ROUTINE    Routine,
+    IN  PVOID               Context,
+    OUT PFAKE_EVTCHN        *Channel
+    )
+{
+    int                     Error;
+
+    *Channel = calloc(1, sizeof (FAKE_EVTCHN));
+    if (*Channel == NULL)
+        return ENOMEM;
+
+    Error = FakeEventInitialize(&(*Channel)->Event);
+    if (Error != 0)
+        goto fail1;
+
+    pthread_mutex_init(&(*Channel)->Lock, NULL);
+    (*Channel)->Routine = Routine;
+    (*Channel)->Context = Context;
+    (*Channel)->Masked = TRUE;
+
+    Error = pthread_create(&(*Channel)->Thread, NULL, FakeEvtchnThread, *Channel);
+    if (Error != 0)
+        goto fail2;
+
+    Error = ENOSPC;
+    (*Channel)->Port = __FakeEvtchnAllocatePort(*Channel);
+    if ((*Channel)->Port == 0)
+        goto fail3;
+
+    return 0;
+
+fail3:
+    (*Channel)->Closing = TRUE;
+    FakeEventSet(&(*Channel)->Event);
+    pthread_join((*Channel)->Thread, NULL);
+
+fail2:
+    pthread_mutex_destroy(&(*Channel)->Lock);
+    FakeEventTeardown(&(*Channel)->Event);
+
+fail1:
+    free(*Channel);
+    *Channel = NULL;
+
+    return Error;
+}
+
+VOID
+FakeEvtchnClose(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    __FakeEvtchnFreePort(Channel->Port);
+
+    pthread_mutex_lock(&Channel->Lock);
+    Channel->Closing = TRUE;
+    FakeEventSet(&Channel->Event);
+    pthread_mutex_unlock(&Channel->Lock);
+
+    pthread_join(Channel->Thread, NULL);
+
+    pthread_mutex_destroy(&Channel->Lock);
+    FakeEventTeardown(&Channel->Event);
+    free(Channel);
+}
+
+ULONG
+FakeEvtchnGetPort(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    return Channel->Port;
+}
+
+PFAKE_EVTCHN
+FakeEvtchnBindInterdomain(
+    IN  ULONG   Port
+    )
+{
+    PFAKE_EVTCHN    Channel;
+
+    if (Port >= FAKE_EVTCHN_PORTS)
+        return NULL;
+
+    pthread_mutex_lock(&FakeEvtchnLock);
+    Channel = FakeEvtchnPort[Port];
+    pthread_mutex_unlock(&FakeEvtchnLock);
+
+    return Channel;
+}
+
+VOID
+FakeEvtchnSend(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    pthread_mutex_lock(&Channel->Lock);
+
+    Channel->Statistics.Sends++;
+
+    if (Channel->Masked)
+        Channel->Pending = TRUE;
+    else
+        __FakeEvtchnUpcall(Channel);
+
+    pthread_mutex_unlock(&Channel->Lock);
+}
+
+VOID
+FakeEvtchnUnmask(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    pthread_mutex_lock(&Channel->Lock);
+
+    Channel->Masked = FALSE;
+
+    // Anything sent while masked is delivered now
+    if (Channel->Pending)
+        __FakeEvtchnUpcall(Channel);
+
+    pthread_mutex_unlock(&Channel->Lock);
+}
+
+BOOLEAN
+FakeEvtchnQueueDpc(
+    IN  PFAKE_EVTCHN    Channel
+    )
+{
+    BOOLEAN             Queued;
+
+    pthread_mutex_lock(&Channel->Lock);
+
+    Queued = !Channel->Queued;
+    __FakeEvtchnQueueDpc(Channel);
+
+    pthread_mutex_unlock(&Channel->Lock);
+
+    return Queued;
+}
+
+VOID
+FakeEvtchnGetStatistics(
+    IN  PFAKE_EVTCHN            Channel,
+    OUT PFAKE_EVTCHN_STATISTICS Statistics
+    )
+{
+    pthread_mutex_lock(&Channel->Lock);
+    *Statistics = Channel->Statistics;
+    pthread_mutex_unlock(&Channel->Lock);
+}
+
+#define FAKE_GNTTAB_ENTRIES 256
+
+typedef struct _FAKE_GNTTAB_ENTRY {
+    BOOLEAN     InUse;
+    BOOLEAN     ReadOnly;
+    USHORT      Domain;
+    ULONG       Pfn;
+    ULONG       Mapped;
+} FAKE_GNTTAB_ENTRY, *PFAKE_GNTTAB_ENTRY;
+
+struct _FAKE_GNTTAB {
+    pthread_mutex_t     Lock;
+    int                 Fd;
+    ULONG               Pages;
+    PUCHAR              Memory;
+    PUCHAR              Allocated;  // One byte per page
+    FAKE_GNTTAB_ENTRY   Entry[FAKE_GNTTAB_ENTRIES];
+};
+
+// Reference 0 is reserved, as it is in Xen
+#define FAKE_GNTTAB_FIRST_REFERENCE 1
+
+int
+FakeGnttabCreate(
+    IN  ULONG           Pages,
+    OUT PFAKE_GNTTAB    *Gnttab
+    )
+{
+    size_t              Size = (size_t)Pages * FAKE_PAGE_SIZE;
+    int                 Error;
+
+    *Gnttab = calloc(1, sizeof (FAKE_GNTTAB));
+    if (*Gnttab == NULL)
+        return ENOMEM;
+
+    (*Gnttab)->Pages = Pages;
+
+    Error = ENOMEM;
+    (*Gnttab)->Allocated = calloc(Pages, 1);
+    if ((*Gnttab)->Allocated == NULL)
+        goto fail1;
+
+    (*Gnttab)->Fd = memfd_create("xenvkbd-guest", MFD_CLOEXEC);
+    if ((*Gnttab)->Fd < 0) {
+        Error = errno;
+        goto fail2;
+    }
+
+    if (ftruncate((*Gnttab)->Fd, (off_t)Size) < 0) {
+        Error = errno;
+        goto fail3;
+    }
+
+    (*Gnttab)->Memory = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             (*Gnttab)->Fd, 0);
+    if ((*Gnttab)->Memory == MAP_FAILED) {
+        Error = errno;
+        goto fail3;
+    }
+
+    pthread_mutex_init(&(*Gnttab)->Lock, NULL);
+
+    return 0;
+
+fail3:
+    close((*Gnttab)->Fd);
+
+fail2:
+    free((*Gnttab)->Allocated);
+
+fail1:
+    free(*Gnttab);
+    *Gnttab = NULL;
+
+    return Error;
+}
+
+VOID
+FakeGnttabDestroy(
+    IN  PFAKE_GNTTAB    Gnttab
+    )
+{
+    ULONG               Index;
+
+    // Every grant must have been revoked
+    for (Index = 0; Index < FAKE_GNTTAB_ENTRIES; Index++) {
+        if (Gnttab->Entry[Index].InUse)
+            abort();
+    }
+
+    pthread_mutex_destroy(&Gnttab->Lock);
+    munmap(Gnttab->Memory, (size_t)Gnttab->Pages * FAKE_PAGE_SIZE);
+    close(Gnttab->Fd);
+    free(Gnttab->Allocated);
+    free(Gnttab);
+}
+
+int
+FakeGnttabAllocatePages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Count,
+    OUT PULONG          Pfn
+    )
+{
+    ULONG               Start;
+    ULONG               Index;
+    int                 Error;
+
+    pthread_mutex_lock(&Gnttab->Lock);
+
+    Error = ENOMEM;
+    for (Start = 0; Start + Count <= Gnttab->Pages; Start++) {
+        for (Index = 0; Index < Count; Index++) {
+            if (Gnttab->Allocated[Start + Index])
+                break;
+        }
+
+        if (Index != Count)
+            continue;
+
+        memset(Gnttab->Allocated + Start, 1, Count);
+        memset(Gnttab->Memory + (size_t)Start * FAKE_PAGE_SIZE,
+               0,
+               (size_t)Count * FAKE_PAGE_SIZE);
+
+        *Pfn = Start;
+        Error = 0;
+        break;
+    }
+
+    pthread_mutex_unlock(&Gnttab->Lock);
+
+    return Error;
+}
+
+VOID
+FakeGnttabFreePages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Pfn,
+    IN  ULONG           Count
+    )
+{
+    pthread_mutex_lock(&Gnttab->Lock);
+    memset(Gnttab->Allocated + Pfn, 0, Count);
+    pthread_mutex_unlock(&Gnttab->Lock);
+}
+
+PVOID
+FakeGnttabGetPage(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Pfn
+    )
+{
+    return Gnttab->Memory + (size_t)Pfn * FAKE_PAGE_SIZE;
+}
+
+int
+FakeGnttabPermitForeignAccess(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  USHORT          Domain,
+    IN  ULONG           Pfn,
+    IN  BOOLEAN         ReadOnly,
+    OUT PULONG          Reference
+    )
+{
+    ULONG               Index;
+    int                 Error;
+
+    if (Pfn >= Gnttab->Pages)
+        return EINVAL;
+
+    pthread_mutex_lock(&Gnttab->Lock);
+
+    Error = ENOSPC;
+    for (Index = FAKE_GNTTAB_FIRST_REFERENCE; Index < FAKE_GNTTAB_ENTRIES; Index++) {
+        PFAKE_GNTTAB_ENTRY  Entry = &Gnttab->Entry[Index];
+
+        if (Entry->InUse)
+            continue;
+
+        Entry->InUse = TRUE;
+        Entry->ReadOnly = ReadOnly;
+        Entry->Domain = Domain;
+        Entry->Pfn = Pfn;
+        Entry->Mapped = 0;
+
+        *Reference = Index;
+        Error = 0;
+        break;
+    }
+
+    pthread_mutex_unlock(&Gnttab->Lock);
+
+    return Error;
+}
+
+int
+FakeGnttabRevokeForeignAccess(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Reference
+    )
+{
+    PFAKE_GNTTAB_ENTRY  Entry;
+    int                 Error;
+
+    if (Reference >= FAKE_GNTTAB_ENTRIES)
+        return EINVAL;
+
+    pthread_mutex_lock(&Gnttab->Lock);
+
+    Entry = &Gnttab->Entry[Reference];
+
+    if (!Entry->InUse)
+        Error = EINVAL;
+    else if (Entry->Mapped != 0)
+        Error = EBUSY;
+    else
+        Error = 0;
+
+    if (Error == 0)
+        memset(Entry, 0, sizeof (FAKE_GNTTAB_ENTRY));
+
+    pthread_mutex_unlock(&Gnttab->Lock);
+
+    return Error;
+}
+
+int
+FakeGnttabMapForeignPages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  USHORT          Domain,
+    IN  ULONG           Count,
+    IN  const ULONG     *Reference,
+    OUT PVOID           *Address
+    )
+{
+    PUCHAR              Base;
+    ULONG               Index;
+    int                 Error;
+
+    // Reserve the range, then map each page into it
+    Base = mmap(NULL, (size_t)Count * FAKE_PAGE_SIZE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Base == MAP_FAILED)
+        return errno;
+
+    pthread_mutex_lock(&Gnttab->Lock);
+
+    for (Index = 0; Index < Count; Index++) {
+        PFAKE_GNTTAB_ENTRY  Entry;
+        PVOID               Page;
+
+        Error = EINVAL;
+        if (Reference[Index] >= FAKE_GNTTAB_ENTRIES)
+            goto fail1;
+
+        Entry = &Gnttab->Entry[Reference[Index]];
+
+        if (!Entry->InUse || Entry->Domain != Domain)
+            goto fail1;
+
+        Page = mmap(Base + (size_t)Index * FAKE_PAGE_SIZE,
+                    FAKE_PAGE_SIZE,
+                    PROT_READ | ((Entry->ReadOnly) ? 0 : PROT_WRITE),
+                    MAP_SHARED | MAP_FIXED,
+                    Gnttab->Fd,
+                    (off_t)Entry->Pfn * FAKE_PAGE_SIZE);
+        if (Page == MAP_FAILED) {
+            Error = errno;
+            goto fail1;
+        }
+    }
+
+    for (Index = 0; Index < Count; Index++)
+        Gnttab->Entry[Reference[Index]].Mapped++;
+
+    pthread_mutex_unlock(&Gnttab->Lock);
+
+    *Address = Base;
+    return 0;
+
+fail1:
+    pthread_mutex_unlock(&Gnttab->Lock);
+
+    munmap(Base, (size_t)Count * FAKE_PAGE_SIZE);
+
+    return Error;
+}
+
+VOID
+FakeGnttabUnmapForeignPages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Count,
+    IN  const ULONG     *Reference,
+    IN  PVOID           Address
+    )
+{
+    ULONG               Index;
+
+    munmap(Address, (size_t)Count * FAKE_PAGE_SIZE);
+
+    pthread_mutex_lock(&Gnttab->Lock);
+
+    for (Index = 0; Index < Count; Index++)
+        Gnttab->Entry[Reference[Index]].Mapped--;
+
+    pthread_mutex_unlock(&Gnttab->Lock);
+}
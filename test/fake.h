@@ -0,0 +1,307 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_FAKE_H
+#define _XENVKBD_TEST_FAKE_H
+
+#include "translate.h"
+
+// In-process stand-ins for the XENBUS store, event channel and grant table
+// interfaces, so that both ends of a frontend/backend connection can be run
+// in one Linux process. They follow the semantics the driver relies upon
+// rather than the XENBUS interface structures themselves. Errors are
+// reported as errno values, as xenstored does.
+
+#define FAKE_PAGE_SIZE  4096
+
+// An auto-reset event (cf. a SynchronizationEvent KEVENT), backed by an
+// eventfd so that it can also be polled
+typedef struct _FAKE_EVENT {
+    int Fd;
+} FAKE_EVENT, *PFAKE_EVENT;
+
+extern int
+FakeEventInitialize(
+    OUT PFAKE_EVENT Event
+    );
+
+extern VOID
+FakeEventTeardown(
+    IN  PFAKE_EVENT Event
+    );
+
+extern VOID
+FakeEventSet(
+    IN  PFAKE_EVENT Event
+    );
+
+// Returns 0 if the event was signalled or ETIMEDOUT. A negative TimeoutMs
+// waits forever.
+extern int
+FakeEventWait(
+    IN  PFAKE_EVENT Event,
+    IN  LONG        TimeoutMs
+    );
+
+typedef struct _FAKE_STORE              FAKE_STORE, *PFAKE_STORE;
+typedef struct _FAKE_STORE_TRANSACTION  FAKE_STORE_TRANSACTION, *PFAKE_STORE_TRANSACTION;
+typedef struct _FAKE_STORE_WATCH        FAKE_STORE_WATCH, *PFAKE_STORE_WATCH;
+
+typedef struct _FAKE_STORE_STATISTICS {
+    ULONG64 Reads;
+    ULONG64 Writes;
+    ULONG64 Removes;
+    ULONG64 Transactions;
+    ULONG64 Conflicts;
+    ULONG64 Watches;    // Watch events fired
+} FAKE_STORE_STATISTICS, *PFAKE_STORE_STATISTICS;
+
+extern int
+FakeStoreCreate(
+    OUT PFAKE_STORE *Store
+    );
+
+extern VOID
+FakeStoreDestroy(
+    IN  PFAKE_STORE Store
+    );
+
+// *Value is allocated and must be released with FakeStoreFree()
+extern int
+FakeStoreRead(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction OPTIONAL,
+    IN  const CHAR              *Prefix OPTIONAL,
+    IN  const CHAR              *Node,
+    OUT CHAR                    **Value
+    );
+
+extern VOID
+FakeStoreFree(
+    IN  CHAR    *Value
+    );
+
+extern int
+FakeStorePrintf(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction OPTIONAL,
+    IN  const CHAR              *Prefix OPTIONAL,
+    IN  const CHAR              *Node,
+    IN  const CHAR              *Format,
+    ...
+    ) __attribute__((format(printf, 5, 6)));
+
+// Removes Node and everything below it
+extern int
+FakeStoreRemove(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction OPTIONAL,
+    IN  const CHAR              *Prefix OPTIONAL,
+    IN  const CHAR              *Node
+    );
+
+extern int
+FakeStoreTransactionStart(
+    IN  PFAKE_STORE             Store,
+    OUT PFAKE_STORE_TRANSACTION *Transaction
+    );
+
+// Returns EAGAIN, and discards the transaction, if anything it read or
+// wrote was changed by someone else in the meantime
+extern int
+FakeStoreTransactionEnd(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction,
+    IN  BOOLEAN                 Commit
+    );
+
+// Event is set on registration and whenever Node, or anything below it,
+// is written or removed
+extern int
+FakeStoreWatchAdd(
+    IN  PFAKE_STORE         Store,
+    IN  const CHAR          *Prefix OPTIONAL,
+    IN  const CHAR          *Node,
+    IN  PFAKE_EVENT         Event,
+    OUT PFAKE_STORE_WATCH   *Watch
+    );
+
+extern VOID
+FakeStoreWatchRemove(
+    IN  PFAKE_STORE         Store,
+    IN  PFAKE_STORE_WATCH   Watch
+    );
+
+extern VOID
+FakeStoreGetStatistics(
+    IN  PFAKE_STORE             Store,
+    OUT PFAKE_STORE_STATISTICS  Statistics
+    );
+
+// An event channel whose upcall queues a DPC, as RingEvtchnCallback()
+// does. The DPC runs on a thread of its own, one invocation at a time, and
+// the channel is masked on delivery until the consumer unmasks it.
+typedef struct _FAKE_EVTCHN FAKE_EVTCHN, *PFAKE_EVTCHN;
+
+typedef VOID
+(*FAKE_DPC_ROUTINE)(
+    IN  PVOID   Context
+    );
+
+typedef struct _FAKE_EVTCHN_STATISTICS {
+    ULONG64 Sends;
+    ULONG64 Upcalls;    // Sends that found the channel unmasked
+    ULONG64 Dpcs;       // DPC invocations
+} FAKE_EVTCHN_STATISTICS, *PFAKE_EVTCHN_STATISTICS;
+
+// The channel starts masked
+extern int
+FakeEvtchnOpen(
+    IN  FAKE_DPC_ROUTINE    Routine,
+    IN  PVOID               Context,
+    OUT PFAKE_EVTCHN        *Channel
+    );
+
+extern VOID
+FakeEvtchnClose(
+    IN  PFAKE_EVTCHN    Channel
+    );
+
+extern ULONG
+FakeEvtchnGetPort(
+    IN  PFAKE_EVTCHN    Channel
+    );
+
+// The remote end's handle on an open channel, or NULL. It is valid until
+// the channel is closed.
+extern PFAKE_EVTCHN
+FakeEvtchnBindInterdomain(
+    IN  ULONG   Port
+    );
+
+// The remote end's notify
+extern VOID
+FakeEvtchnSend(
+    IN  PFAKE_EVTCHN    Channel
+    );
+
+extern VOID
+FakeEvtchnUnmask(
+    IN  PFAKE_EVTCHN    Channel
+    );
+
+// cf. KeInsertQueueDpc(): FALSE if the DPC was already queued
+extern BOOLEAN
+FakeEvtchnQueueDpc(
+    IN  PFAKE_EVTCHN    Channel
+    );
+
+extern VOID
+FakeEvtchnGetStatistics(
+    IN  PFAKE_EVTCHN            Channel,
+    OUT PFAKE_EVTCHN_STATISTICS Statistics
+    );
+
+// Guest memory is a memfd; the guest sees it through one mapping and a
+// foreign mapping of a grant is a separate mmap() of the same pages, so
+// that nothing can rely on the two ends sharing an address.
+typedef struct _FAKE_GNTTAB FAKE_GNTTAB, *PFAKE_GNTTAB;
+
+extern int
+FakeGnttabCreate(
+    IN  ULONG           Pages,
+    OUT PFAKE_GNTTAB    *Gnttab
+    );
+
+extern VOID
+FakeGnttabDestroy(
+    IN  PFAKE_GNTTAB    Gnttab
+    );
+
+// Returns Count contiguous, zeroed guest pages
+extern int
+FakeGnttabAllocatePages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Count,
+    OUT PULONG          Pfn
+    );
+
+extern VOID
+FakeGnttabFreePages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Pfn,
+    IN  ULONG           Count
+    );
+
+extern PVOID
+FakeGnttabGetPage(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Pfn
+    );
+
+extern int
+FakeGnttabPermitForeignAccess(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  USHORT          Domain,
+    IN  ULONG           Pfn,
+    IN  BOOLEAN         ReadOnly,
+    OUT PULONG          Reference
+    );
+
+// Returns EBUSY while the grant is mapped
+extern int
+FakeGnttabRevokeForeignAccess(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Reference
+    );
+
+// Maps Count grants contiguously, as a backend mapping a multi-page ring
+// would
+extern int
+FakeGnttabMapForeignPages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  USHORT          Domain,
+    IN  ULONG           Count,
+    IN  const ULONG     *Reference,
+    OUT PVOID           *Address
+    );
+
+extern VOID
+FakeGnttabUnmapForeignPages(
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  ULONG           Count,
+    IN  const ULONG     *Reference,
+    IN  PVOID           Address
+    );
+
+#endif  // _XENVKBD_TEST_FAKE_H
@@ -0,0 +1,490 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <linux-keycodes.h>
+
+#include "translate.h"
+#include "fake.h"
+#include "connect.h"
+#include "guest.h"
+
+static ULONG    Failures;
+
+#define CHECK(_E)                                               \
+    do {                                                        \
+        if (!(_E)) {                                            \
+            fprintf(stderr, "%s:%u: CHECK(%s) failed\n",        \
+                    __FILE__, __LINE__, #_E);                   \
+            Failures++;                                         \
+        }                                                       \
+    } while (FALSE)
+
+static BOOLEAN
+TestRead(
+    IN  PFAKE_STORE             Store,
+    IN  PFAKE_STORE_TRANSACTION Transaction OPTIONAL,
+    IN  const CHAR              *Path,
+    IN  const CHAR              *Expected OPTIONAL
+    )
+{
+    CHAR                        *Value;
+    BOOLEAN                     Match;
+
+    if (FakeStoreRead(Store, Transaction, NULL, Path, &Value) != 0)
+        return (Expected == NULL) ? TRUE : FALSE;
+
+    Match = (Expected != NULL && strcmp(Value, Expected) == 0) ? TRUE : FALSE;
+    FakeStoreFree(Value);
+
+    return Match;
+}
+
+static VOID
+TestStore(
+    VOID
+    )
+{
+    PFAKE_STORE             Store;
+    PFAKE_STORE_TRANSACTION Transaction;
+    PFAKE_STORE_TRANSACTION Other;
+    PFAKE_STORE_WATCH       Watch;
+    FAKE_EVENT              Event;
+    FAKE_STORE_STATISTICS   Statistics;
+
+    CHECK(FakeStoreCreate(&Store) == 0);
+    CHECK(FakeEventInitialize(&Event) == 0);
+
+    CHECK(FakeStorePrintf(Store, NULL, "device/vkbd/0", "state", "%u", 1) == 0);
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/state", "1"));
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/missing", NULL));
+
+    // Watches fire on registration, then for the node and anything below it
+    CHECK(FakeStoreWatchAdd(Store, NULL, "device/vkbd/0", &Event, &Watch) == 0);
+    CHECK(FakeEventWait(&Event, 0) == 0);
+    CHECK(FakeEventWait(&Event, 0) == ETIMEDOUT);
+
+    CHECK(FakeStorePrintf(Store, NULL, "device/vkbd/0", "page-gref", "%u", 8) == 0);
+    CHECK(FakeEventWait(&Event, 0) == 0);
+
+    CHECK(FakeStorePrintf(Store, NULL, "device/vkbd/00", "state", "%u", 1) == 0);
+    CHECK(FakeEventWait(&Event, 0) == ETIMEDOUT);
+
+    // Transactions see their own writes, which nobody else sees until commit
+    CHECK(FakeStoreTransactionStart(Store, &Transaction) == 0);
+    CHECK(FakeStorePrintf(Store, Transaction, "device/vkbd/0", "state", "%u", 3) == 0);
+    CHECK(FakeStoreRemove(Store, Transaction, "device/vkbd/0", "page-gref") == 0);
+    CHECK(TestRead(Store, Transaction, "device/vkbd/0/state", "3"));
+    CHECK(TestRead(Store, Transaction, "device/vkbd/0/page-gref", NULL));
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/state", "1"));
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/page-gref", "8"));
+    CHECK(FakeEventWait(&Event, 0) == ETIMEDOUT);
+    CHECK(FakeStoreTransactionEnd(Store, Transaction, TRUE) == 0);
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/state", "3"));
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/page-gref", NULL));
+    CHECK(FakeEventWait(&Event, 0) == 0);
+
+    // A change made meanwhile fails the commit
+    CHECK(FakeStoreTransactionStart(Store, &Transaction) == 0);
+    CHECK(FakeStoreTransactionStart(Store, &Other) == 0);
+    CHECK(FakeStorePrintf(Store, Other, "device/vkbd/0", "state", "%u", 4) == 0);
+    CHECK(FakeStoreTransactionEnd(Store, Other, TRUE) == 0);
+    CHECK(FakeStorePrintf(Store, Transaction, "device/vkbd/0", "state", "%u", 5) == 0);
+    CHECK(FakeStoreTransactionEnd(Store, Transaction, TRUE) == EAGAIN);
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/state", "4"));
+
+    // Removing a parent takes the watched node with it
+    CHECK(FakeEventWait(&Event, 0) == 0);
+    CHECK(FakeStoreRemove(Store, NULL, NULL, "device/vkbd") == 0);
+    CHECK(FakeEventWait(&Event, 0) == 0);
+    CHECK(TestRead(Store, NULL, "device/vkbd/0/state", NULL));
+    CHECK(TestRead(Store, NULL, "device/vkbd/00/state", NULL));
+    CHECK(FakeStoreRemove(Store, NULL, NULL, "device/vkbd") == ENOENT);
+
+    FakeStoreGetStatistics(Store, &Statistics);
+    CHECK(Statistics.Transactions == 3);
+    CHECK(Statistics.Conflicts == 1);
+
+    FakeStoreWatchRemove(Store, Watch);
+    FakeEventTeardown(&Event);
+    FakeStoreDestroy(Store);
+}
+
+typedef struct _TEST_DPC {
+    FAKE_EVENT  Started;
+    FAKE_EVENT  Release;
+    ULONG       Count;
+} TEST_DPC, *PTEST_DPC;
+
+static VOID
+TestDpc(
+    IN  PVOID   Context
+    )
+{
+    PTEST_DPC   Dpc = Context;
+
+    __atomic_add_fetch(&Dpc->Count, 1, __ATOMIC_SEQ_CST);
+
+    FakeEventSet(&Dpc->Started);
+    (VOID) FakeEventWait(&Dpc->Release, -1);
+}
+
+static VOID
+TestEvtchn(
+    VOID
+    )
+{
+    TEST_DPC                Dpc;
+    PFAKE_EVTCHN            Channel;
+    FAKE_EVTCHN_STATISTICS  Statistics;
+
+    memset(&Dpc, 0, sizeof (Dpc));
+    CHECK(FakeEventInitialize(&Dpc.Started) == 0);
+    CHECK(FakeEventInitialize(&Dpc.Release) == 0);
+
+    CHECK(FakeEvtchnOpen(TestDpc, &Dpc, &Channel) == 0);
+    CHECK(FakeEvtchnBindInterdomain(FakeEvtchnGetPort(Channel)) == Channel);
+
+    // Masked to begin with, so a send is only latched
+    FakeEvtchnSend(Channel);
+    FakeEvtchnGetStatistics(Channel, &Statistics);
+    CHECK(Statistics.Sends == 1);
+    CHECK(Statistics.Upcalls == 0);
+    CHECK(FakeEventWait(&Dpc.Started, 50) == ETIMEDOUT);
+
+    // ...and delivered on unmask, which masks it again
+    FakeEvtchnUnmask(Channel);
+    CHECK(FakeEventWait(&Dpc.Started, 5000) == 0);
+
+    FakeEvtchnSend(Channel);
+    FakeEvtchnGetStatistics(Channel, &Statistics);
+    CHECK(Statistics.Upcalls == 1);
+
+    // The running DPC has been dequeued, so it can be queued once more
+    CHECK(FakeEvtchnQueueDpc(Channel));
+    CHECK(!FakeEvtchnQueueDpc(Channel));
+
+    FakeEventSet(&Dpc.Release);
+    CHECK(FakeEventWait(&Dpc.Started, 5000) == 0);
+    FakeEventSet(&Dpc.Release);
+
+    // The send made while masked is delivered now
+    FakeEvtchnUnmask(Channel);
+    CHECK(FakeEventWait(&Dpc.Started, 5000) == 0);
+    FakeEventSet(&Dpc.Release);
+
+    FakeEvtchnClose(Channel);
+
+    CHECK(Dpc.Count == 3);
+
+    FakeEventTeardown(&Dpc.Release);
+    FakeEventTeardown(&Dpc.Started);
+}
+
+static VOID
+TestGnttab(
+    VOID
+    )
+{
+    PFAKE_GNTTAB    Gnttab;
+    ULONG           Pfn;
+    ULONG           Reference[3];
+    PUCHAR          Guest;
+    PUCHAR          Mapping;
+    ULONG           Index;
+
+    CHECK(FakeGnttabCreate(8, &Gnttab) == 0);
+    CHECK(FakeGnttabAllocatePages(Gnttab, 3, &Pfn) == 0);
+
+    for (Index = 0; Index < 3; Index++) {
+        Guest = FakeGnttabGetPage(Gnttab, Pfn + Index);
+        Guest[0] = (UCHAR)(0xA0 + Index);
+
+        CHECK(FakeGnttabPermitForeignAccess(Gnttab,
+                                            CONNECT_HOST_DOMAIN,
+                                            Pfn + Index,
+                                            FALSE,
+                                            &Reference[Index]) == 0);
+        CHECK(Reference[Index] != 0);
+    }
+
+    // Only the domain granted access may map
+    CHECK(FakeGnttabMapForeignPages(Gnttab, 7, 1, Reference, (PVOID *)&Mapping) == EINVAL);
+
+    // Mapped in reverse: the mapping is contiguous in the order given
+    Index = Reference[0];
+    Reference[0] = Reference[2];
+    Reference[2] = Index;
+
+    CHECK(FakeGnttabMapForeignPages(Gnttab,
+                                    CONNECT_HOST_DOMAIN,
+                                    3,
+                                    Reference,
+                                    (PVOID *)&Mapping) == 0);
+
+    Guest = FakeGnttabGetPage(Gnttab, Pfn);
+    CHECK(Mapping != Guest);
+    CHECK(Mapping[0] == 0xA2);
+    CHECK(Mapping[FAKE_PAGE_SIZE] == 0xA1);
+    CHECK(Mapping[2 * FAKE_PAGE_SIZE] == 0xA0);
+
+    Mapping[2 * FAKE_PAGE_SIZE + 1] = 0x55;
+    CHECK(Guest[1] == 0x55);
+
+    CHECK(FakeGnttabRevokeForeignAccess(Gnttab, Reference[0]) == EBUSY);
+
+    FakeGnttabUnmapForeignPages(Gnttab, 3, Reference, Mapping);
+
+    for (Index = 0; Index < 3; Index++)
+        CHECK(FakeGnttabRevokeForeignAccess(Gnttab, Reference[Index]) == 0);
+
+    CHECK(FakeGnttabRevokeForeignAccess(Gnttab, Reference[0]) == EINVAL);
+
+    FakeGnttabFreePages(Gnttab, Pfn, 3);
+    FakeGnttabDestroy(Gnttab);
+}
+
+typedef struct _TEST_RING {
+    ULONG                   Reports;
+    XENVKBD_HID_KEYBOARD    Keyboard;
+    XENVKBD_HID_ABSMOUSE    AbsMouse;
+    FAKE_EVENT              Reported;
+} TEST_RING, *PTEST_RING;
+
+static BOOLEAN
+TestRingCallback(
+    IN  PVOID       Context,
+    IN  const VOID  *Report,
+    IN  ULONG       Length
+    )
+{
+    PTEST_RING      Test = Context;
+    const UCHAR     *Id = Report;
+
+    if (*Id == 1 && Length == sizeof (XENVKBD_HID_KEYBOARD))
+        memcpy(&Test->Keyboard, Report, Length);
+    else if (*Id == 2 && Length == sizeof (XENVKBD_HID_ABSMOUSE))
+        memcpy(&Test->AbsMouse, Report, Length);
+
+    Test->Reports++;
+    FakeEventSet(&Test->Reported);
+
+    return TRUE;
+}
+
+// The DPC counts what it processed only once it has sent the reports
+static int
+TestWaitForProcessed(
+    IN  PGUEST          Guest,
+    IN  ULONG           Processed,
+    OUT PGUEST_COUNTERS Counters
+    )
+{
+    ULONG               Count;
+    int                 Error;
+
+    for (Count = 0; Count < 5000; Count++) {
+        struct timespec Delay = { 0, 1000000 };
+
+        Error = GuestGetCounters(Guest, Counters);
+        if (Error != 0)
+            return Error;
+
+        if (Counters->Processed == Processed)
+            return 0;
+
+        nanosleep(&Delay, NULL);
+    }
+
+    return ETIMEDOUT;
+}
+
+// Two full connect/disconnect cycles of the driver's frontend, with a key
+// through the ring each time
+static VOID
+TestConnect(
+    VOID
+    )
+{
+    PFAKE_STORE     Store;
+    PFAKE_GNTTAB    Gnttab;
+    PHOST           Host;
+    PGUEST          Guest;
+    TEST_RING       Test;
+    GUEST_COUNTERS  Counters;
+    GUEST_TIMING    Timing;
+    ULONG           Cycle;
+
+    memset(&Test, 0, sizeof (Test));
+    CHECK(FakeEventInitialize(&Test.Reported) == 0);
+
+    CHECK(FakeStoreCreate(&Store) == 0);
+    CHECK(FakeGnttabCreate(64, &Gnttab) == 0);
+
+    CHECK(HostCreate(Store, Gnttab, "backend/vkbd/1/0", "device/vkbd/0", 0, &Host) == 0);
+    CHECK(GuestCreate(Store, Gnttab, "0", 0, &Guest) == 0);
+
+    for (Cycle = 0; Cycle < 2; Cycle++) {
+        union xenkbd_in_event   Event;
+
+        CHECK(GuestEnable(Guest, TestRingCallback, &Test) == 0);
+        CHECK(HostWaitForConnection(Host, 5000) == 0);
+
+        BackendKey(&Event, KEY_A, TRUE);
+        CHECK(BackendPut(&Host->Backend, &Event));
+        HostPush(Host);
+
+        CHECK(FakeEventWait(&Test.Reported, 5000) == 0);
+        CHECK(Test.Keyboard.Keys[0] == 0x04);
+
+        BackendKey(&Event, KEY_A, FALSE);
+        CHECK(BackendPut(&Host->Backend, &Event));
+        HostPush(Host);
+
+        CHECK(FakeEventWait(&Test.Reported, 5000) == 0);
+        CHECK(Test.Keyboard.Keys[0] == 0);
+
+        // Kept until teardown, so they add up across connections
+        CHECK(TestWaitForProcessed(Guest, 2 * (Cycle + 1), &Counters) == 0);
+        CHECK(Counters.Reports == 2 * (Cycle + 1));
+
+        CHECK(GuestClose(Guest) == 0);
+        CHECK(!Host->Connected);
+    }
+
+    CHECK(Host->Connects == 2);
+    CHECK(Test.Reports == 4);
+    CHECK(!GuestIsEjectRequested(Guest));
+
+    CHECK(GuestGetTiming(Guest, &Timing) == 0);
+    CHECK(Timing.Connects == 2);
+    CHECK(Timing.StoreOps != 0);
+
+    GuestDestroy(Guest);
+    HostDestroy(Host);
+
+    FakeGnttabDestroy(Gnttab);
+    FakeStoreDestroy(Store);
+    FakeEventTeardown(&Test.Reported);
+}
+
+// A backend offering a larger ring gets one of 2^order - 1 extra pages,
+// and both ends agree on its length
+static VOID
+TestConnectMultiPage(
+    VOID
+    )
+{
+    PFAKE_STORE     Store;
+    PFAKE_GNTTAB    Gnttab;
+    PHOST           Host;
+    PGUEST          Guest;
+    TEST_RING       Test;
+    GUEST_COUNTERS  Counters;
+    CHAR            *Buffer;
+    ULONG           Index;
+
+    memset(&Test, 0, sizeof (Test));
+    CHECK(FakeEventInitialize(&Test.Reported) == 0);
+
+    CHECK(FakeStoreCreate(&Store) == 0);
+    CHECK(FakeGnttabCreate(64, &Gnttab) == 0);
+
+    // More than the frontend will use
+    CHECK(HostCreate(Store, Gnttab, "backend/vkbd/1/0", "device/vkbd/0",
+                     HOST_FEATURE_PAGE_ORDER(3), &Host) == 0);
+    CHECK(GuestCreate(Store, Gnttab, "0", 0, &Guest) == 0);
+
+    CHECK(GuestEnable(Guest, TestRingCallback, &Test) == 0);
+    CHECK(HostWaitForConnection(Host, 5000) == 0);
+
+    CHECK(FakeStoreRead(Store, NULL, "device/vkbd/0", "ring-page-order", &Buffer) == 0);
+    CHECK(strcmp(Buffer, "2") == 0);
+    FakeStoreFree(Buffer);
+
+    CHECK(Host->InPages == 3);
+    CHECK(Host->Backend.Length == 256);
+
+    // More than a single page ring holds, in one go
+    for (Index = 0; Index < 200; Index++) {
+        union xenkbd_in_event   Event;
+
+        BackendMotion(&Event, 1, 1, 0);
+        CHECK(BackendPut(&Host->Backend, &Event));
+    }
+    HostPush(Host);
+
+    while (Test.AbsMouse.X != 200) {
+        if (FakeEventWait(&Test.Reported, 5000) != 0)
+            break;
+    }
+
+    CHECK(Test.AbsMouse.X == 200);
+    CHECK(Host->Backend.Full == 0);
+
+    CHECK(TestWaitForProcessed(Guest, 200, &Counters) == 0);
+
+    CHECK(GuestClose(Guest) == 0);
+    CHECK(Host->InPages == 0);
+
+    GuestDestroy(Guest);
+    HostDestroy(Host);
+
+    FakeGnttabDestroy(Gnttab);
+    FakeStoreDestroy(Store);
+    FakeEventTeardown(&Test.Reported);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestStore();
+    TestEvtchn();
+    TestGnttab();
+    TestConnect();
+    TestConnectMultiPage();
+
+    if (Failures != 0) {
+        fprintf(stderr, "%u failures\n", Failures);
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
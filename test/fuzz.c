@@ -0,0 +1,565 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+// Fuzzes the ring consumer (TranslateRing() and everything below it) with
+// the input a hostile backend controls: the slots, in_prod, in_cons and
+// the timing of its updates. See fuzz.h for the input format.
+//
+// Built for libFuzzer where the compiler supports it; otherwise main()
+// below runs the inputs named on the command line (files or directories,
+// such as test/corpus) and then mutates them at random.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "translate.h"
+#include "fuzz.h"
+
+#define FUZZ_CHECK(_E)                                              \
+    do {                                                            \
+        if (!(_E)) {                                                \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_E); \
+            abort();                                                \
+        }                                                           \
+    } while (0)
+
+#define FUZZ_MAXIMUM_LENGTH 256
+#define FUZZ_PAGES          4
+
+static const ULONG  FuzzLength[] = { XENKBD_IN_RING_LEN, 64, 128, 256 };
+
+typedef struct _FUZZ {
+    const UCHAR             *Data;
+    size_t                  Size;
+
+    XENVKBD_TRANSLATE       Translate;
+    PUCHAR                  Page;
+    struct xenkbd_page      *Shared;
+    union xenkbd_in_event   *Slots;
+    ULONG                   Length;
+    BOOLEAN                 EventIdx;
+    BOOLEAN                 Backpressure;
+    union xenkbd_in_event   Snapshot[FUZZ_MAXIMUM_LENGTH];
+
+    // Of the current run
+    UCHAR                   HoldPattern;
+    ULONG                   Holds;
+    ULONG                   Race;
+    ULONG                   Passes;
+    ULONG64                 Callbacks;
+    BOOLEAN                 First;
+    ULONG                   LastIndex;
+} FUZZ, *PFUZZ;
+
+static ULONG
+FuzzRead(
+    IN  PFUZZ   Fuzz,
+    OUT PVOID   Buffer,
+    IN  size_t  Length
+    )
+{
+    size_t      Copy = __min(Length, Fuzz->Size);
+
+    memcpy(Buffer, Fuzz->Data, Copy);
+    memset((PUCHAR)Buffer + Copy, 0, Length - Copy);
+
+    Fuzz->Data += Copy;
+    Fuzz->Size -= Copy;
+
+    return (ULONG)Copy;
+}
+
+static ULONG
+FuzzReadUlong(
+    IN  PFUZZ   Fuzz,
+    IN  ULONG   Bytes
+    )
+{
+    UCHAR       Buffer[4];
+    ULONG       Value = 0;
+    ULONG       Index;
+
+    FuzzRead(Fuzz, Buffer, Bytes);
+
+    for (Index = 0; Index < Bytes; Index++)
+        Value |= (ULONG)Buffer[Index] << (8 * Index);
+
+    return Value;
+}
+
+static VOID
+FuzzProduce(
+    IN  PFUZZ                       Fuzz,
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    ULONG                           in_prod = Fuzz->Shared->in_prod;
+
+    Fuzz->Slots[in_prod % Fuzz->Length] = *Event;
+    Fuzz->Shared->in_prod = in_prod + 1;
+}
+
+// The reports must be well formed whatever the backend sent
+static VOID
+FuzzCheckReports(
+    IN  PFUZZ                   Fuzz
+    )
+{
+    XENVKBD_HID_KEYBOARD        *Keyboard = &Fuzz->Translate.Keyboard;
+    XENVKBD_HID_ABSMOUSE        *AbsMouse = &Fuzz->Translate.AbsMouse;
+    ULONG                       Index;
+    ULONG                       Other;
+
+    FUZZ_CHECK(Keyboard->ReportId == 1);
+    FUZZ_CHECK(AbsMouse->ReportId == 2);
+    FUZZ_CHECK(AbsMouse->Buttons <= 0x1F);
+    FUZZ_CHECK(AbsMouse->X <= 32767);
+    FUZZ_CHECK(AbsMouse->Y <= 32767);
+    FUZZ_CHECK(AbsMouse->dZ >= -127);
+
+    // Pressed keys are packed at the front, once each, and are never
+    // modifiers
+    for (Index = 0; Index < ARRAYSIZE(Keyboard->Keys); Index++) {
+        if (Keyboard->Keys[Index] == 0) {
+            for (Other = Index + 1; Other < ARRAYSIZE(Keyboard->Keys); Other++)
+                FUZZ_CHECK(Keyboard->Keys[Other] == 0);
+            break;
+        }
+
+        FUZZ_CHECK(Keyboard->Keys[Index] < 0xE0 || Keyboard->Keys[Index] > 0xE7);
+
+        for (Other = Index + 1; Other < ARRAYSIZE(Keyboard->Keys); Other++)
+            FUZZ_CHECK(Keyboard->Keys[Other] != Keyboard->Keys[Index]);
+    }
+}
+
+static VOID
+FuzzCallback(
+    IN  PVOID                       Context,
+    IN  ULONG                       Index,
+    IN  const union xenkbd_in_event *Event,
+    IN  XENVKBD_TRANSLATE_RESULT    Result
+    )
+{
+    PFUZZ                           Fuzz = Context;
+
+    (void)Event;
+
+    FUZZ_CHECK(Result <= TRANSLATE_RESULT_POINTER);
+
+    // Slots are applied in ring order
+    if (!Fuzz->First)
+        FUZZ_CHECK((LONG)(Index - Fuzz->LastIndex) >= 0);
+
+    Fuzz->First = FALSE;
+    Fuzz->LastIndex = Index;
+    Fuzz->Callbacks++;
+
+    FuzzCheckReports(Fuzz);
+}
+
+static BOOLEAN
+FuzzHold(
+    IN  PVOID                       Context,
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    PFUZZ                           Fuzz = Context;
+
+    (void)Event;
+
+    return (Fuzz->HoldPattern >> (Fuzz->Holds++ % 8)) & 1;
+}
+
+// The backend keeps producing while the frontend consumes
+static VOID
+FuzzPass(
+    IN  PVOID               Context,
+    IN  ULONG               Cons,
+    IN  ULONG               Prod,
+    IN  BOOLEAN             Overrun
+    )
+{
+    PFUZZ                   Fuzz = Context;
+    union xenkbd_in_event   Event;
+
+    FUZZ_CHECK(Prod - Cons <= Fuzz->Length);
+    FUZZ_CHECK(!Overrun || Prod - Cons == Fuzz->Length);
+
+    Fuzz->Passes++;
+
+    if (Fuzz->Race != 0) {
+        Fuzz->Race--;
+
+        memset(&Event, 0, sizeof (Event));
+        Event.key.type = XENKBD_TYPE_KEY;
+        Event.key.pressed = (uint8_t)(Fuzz->Race & 1);
+        Event.key.keycode = 30 + (Fuzz->Race % 26);
+        FuzzProduce(Fuzz, &Event);
+    }
+}
+
+static VOID
+FuzzRun(
+    IN  PFUZZ               Fuzz,
+    IN  ULONG               Budget
+    )
+{
+    XENVKBD_TRANSLATE_RING  Ring;
+    XENVKBD_TRANSLATE_STOP  Stop;
+    ULONG                   Race = Fuzz->Race;
+
+    Ring.Shared = Fuzz->Shared;
+    Ring.Slots = Fuzz->Slots;
+    Ring.Length = Fuzz->Length;
+    Ring.EventIdx = Fuzz->EventIdx;
+    Ring.Backpressure = Fuzz->Backpressure;
+    Ring.Snapshot = Fuzz->Snapshot;
+    Ring.SnapshotLength = ARRAYSIZE(Fuzz->Snapshot);
+    Ring.Applied = 0;
+    Ring.Rechecks = 0;
+
+    Fuzz->Holds = 0;
+    Fuzz->Passes = 0;
+    Fuzz->Callbacks = 0;
+    Fuzz->First = TRUE;
+
+    Stop = TranslateRing(&Fuzz->Translate,
+                         &Ring,
+                         Budget,
+                         FuzzPass,
+                         FuzzCallback,
+                         FuzzHold,
+                         Fuzz);
+
+    FUZZ_CHECK(Stop <= TRANSLATE_STOP_BUDGET);
+
+    // Work is bounded by the budget, not by anything the backend wrote
+    FUZZ_CHECK(Ring.Applied <= Budget);
+    // (A slot produced during the last pass costs one more, empty, pass)
+    FUZZ_CHECK(Fuzz->Passes <= Ring.Applied + 2);
+    FUZZ_CHECK(Ring.Rechecks <= Race);
+    FUZZ_CHECK(Fuzz->Callbacks <= ((ULONG64)Ring.Applied + 1) * XENKBD_KEY_BATCH_MAX);
+
+    if (Stop == TRANSLATE_STOP_HELD)
+        FUZZ_CHECK(Fuzz->Backpressure);
+    if (Stop == TRANSLATE_STOP_BUDGET)
+        FUZZ_CHECK(Ring.Applied == Budget);
+    if (Stop == TRANSLATE_STOP_EMPTY)
+        FUZZ_CHECK(Fuzz->Shared->in_cons == Fuzz->Shared->in_prod);
+
+    if (Fuzz->EventIdx && Stop == TRANSLATE_STOP_EMPTY)
+        FUZZ_CHECK(XENKBD_IN_EVENT_IDX(Fuzz->Shared) == Fuzz->Shared->in_cons + 1);
+
+    FuzzCheckReports(Fuzz);
+}
+
+int
+LLVMFuzzerTestOneInput(
+    const uint8_t   *Data,
+    size_t          Size
+    );
+
+int
+LLVMFuzzerTestOneInput(
+    const uint8_t   *Data,
+    size_t          Size
+    )
+{
+    static PUCHAR   Page;
+    FUZZ            Fuzz;
+    UCHAR           Flags;
+
+    if (Page == NULL) {
+        Page = aligned_alloc(4096, FUZZ_PAGES * 4096);
+        FUZZ_CHECK(Page != NULL);
+    }
+
+    memset(Page, 0, FUZZ_PAGES * 4096);
+    memset(&Fuzz, 0, sizeof (Fuzz));
+
+    Fuzz.Data = Data;
+    Fuzz.Size = Size;
+    Fuzz.Page = Page;
+    Fuzz.Shared = (struct xenkbd_page *)Page;
+
+    FuzzRead(&Fuzz, &Flags, 1);
+
+    Fuzz.Length = FuzzLength[(Flags & FUZZ_LENGTH_MASK) >> FUZZ_LENGTH_SHIFT];
+    Fuzz.Slots = (Fuzz.Length == XENKBD_IN_RING_LEN) ?
+                 (union xenkbd_in_event *)XENKBD_IN_RING(Fuzz.Shared) :
+                 (union xenkbd_in_event *)(Page + 4096);
+    Fuzz.EventIdx = (Flags & FUZZ_FLAG_EVENT_IDX) ? TRUE : FALSE;
+    Fuzz.Backpressure = (Flags & FUZZ_FLAG_BACKPRESSURE) ? TRUE : FALSE;
+
+    TranslateReset(&Fuzz.Translate);
+    Fuzz.Translate.KeyBatch = (Flags & FUZZ_FLAG_KEY_BATCH) ? TRUE : FALSE;
+    Fuzz.Translate.Timestamp = (Flags & FUZZ_FLAG_TIMESTAMP) ? TRUE : FALSE;
+
+    while (Fuzz.Size != 0) {
+        union xenkbd_in_event   Event;
+        UCHAR                   Op;
+
+        FuzzRead(&Fuzz, &Op, 1);
+
+        switch (Op % FUZZ_OP_COUNT) {
+        case FUZZ_OP_PUT:
+            FuzzRead(&Fuzz, &Event, sizeof (Event));
+            FuzzProduce(&Fuzz, &Event);
+            break;
+
+        case FUZZ_OP_KEY:
+            memset(&Event, 0, sizeof (Event));
+            Event.key.type = XENKBD_TYPE_KEY;
+            Event.key.keycode = FuzzReadUlong(&Fuzz, 2);
+            Event.key.pressed = (uint8_t)FuzzReadUlong(&Fuzz, 1);
+            FuzzProduce(&Fuzz, &Event);
+            break;
+
+        case FUZZ_OP_JUMP:
+            Fuzz.Shared->in_prod += FuzzReadUlong(&Fuzz, 4);
+            break;
+
+        case FUZZ_OP_CONS:
+            Fuzz.Shared->in_cons = FuzzReadUlong(&Fuzz, 4);
+            break;
+
+        case FUZZ_OP_RUN: {
+            ULONG   Budget = FuzzReadUlong(&Fuzz, 1);
+
+            Fuzz.HoldPattern = (UCHAR)FuzzReadUlong(&Fuzz, 1);
+            FuzzRun(&Fuzz, (Budget != 0) ? Budget : ~0u);
+            Fuzz.Race = 0;
+            break;
+        }
+        case FUZZ_OP_RACE:
+            Fuzz.Race = FuzzReadUlong(&Fuzz, 1);
+            break;
+        }
+    }
+
+    // Whatever is left must drain once nothing is held
+    Fuzz.HoldPattern = 0;
+    FuzzRun(&Fuzz, ~0u);
+    FUZZ_CHECK(Fuzz.Shared->in_cons == Fuzz.Shared->in_prod);
+
+    return 0;
+}
+
+#ifndef XENVKBD_LIBFUZZER
+
+#include <getopt.h>
+
+typedef struct _FUZZ_CORPUS {
+    PUCHAR  *Input;
+    size_t  *Size;
+    ULONG   Count;
+} FUZZ_CORPUS, *PFUZZ_CORPUS;
+
+static VOID
+FuzzLoad(
+    IN  PFUZZ_CORPUS    Corpus,
+    IN  const CHAR      *Path
+    )
+{
+    struct stat         Stat;
+    FILE                *File;
+    PUCHAR              Input;
+
+    if (stat(Path, &Stat) != 0) {
+        perror(Path);
+        exit(1);
+    }
+
+    if (S_ISDIR(Stat.st_mode)) {
+        DIR             *Directory = opendir(Path);
+        struct dirent   *Entry;
+
+        FUZZ_CHECK(Directory != NULL);
+
+        while ((Entry = readdir(Directory)) != NULL) {
+            CHAR    Name[4096];
+
+            if (Entry->d_name[0] == '.')
+                continue;
+
+            snprintf(Name, sizeof (Name), "%s/%s", Path, Entry->d_name);
+            FuzzLoad(Corpus, Name);
+        }
+
+        closedir(Directory);
+        return;
+    }
+
+    Input = malloc((size_t)Stat.st_size + 1);
+    File = fopen(Path, "rb");
+    FUZZ_CHECK(Input != NULL && File != NULL);
+    FUZZ_CHECK(fread(Input, 1, (size_t)Stat.st_size, File) == (size_t)Stat.st_size);
+    fclose(File);
+
+    Corpus->Input = realloc(Corpus->Input, (Corpus->Count + 1) * sizeof (PUCHAR));
+    Corpus->Size = realloc(Corpus->Size, (Corpus->Count + 1) * sizeof (size_t));
+    FUZZ_CHECK(Corpus->Input != NULL && Corpus->Size != NULL);
+
+    Corpus->Input[Corpus->Count] = Input;
+    Corpus->Size[Corpus->Count] = (size_t)Stat.st_size;
+    Corpus->Count++;
+}
+
+// A crude stand-in for libFuzzer's mutators: flip, overwrite, insert and
+// delete bytes of a corpus entry, or make up an input from nothing
+static size_t
+FuzzMutate(
+    IN  const UCHAR *Input,
+    IN  size_t      Size,
+    OUT PUCHAR      Output,
+    IN  size_t      Maximum
+    )
+{
+    ULONG           Count = 1 + (ULONG)(random() % 8);
+
+    if (Input == NULL) {
+        Size = (size_t)random() % Maximum;
+        for (Count = 0; Count < Size; Count++)
+            Output[Count] = (UCHAR)random();
+
+        return Size;
+    }
+
+    Size = __min(Size, Maximum);
+    memcpy(Output, Input, Size);
+
+    while (Count-- != 0) {
+        size_t  Offset = (Size != 0) ? (size_t)random() % Size : 0;
+
+        switch (random() % 4) {
+        case 0:
+            if (Size != 0)
+                Output[Offset] ^= (UCHAR)(1 << (random() % 8));
+            break;
+        case 1:
+            if (Size != 0)
+                Output[Offset] = (UCHAR)random();
+            break;
+        case 2:
+            if (Size < Maximum) {
+                memmove(&Output[Offset + 1], &Output[Offset], Size - Offset);
+                Output[Offset] = (UCHAR)random();
+                Size++;
+            }
+            break;
+        default:
+            if (Size != 0) {
+                memmove(&Output[Offset], &Output[Offset + 1], Size - Offset - 1);
+                Size--;
+            }
+            break;
+        }
+    }
+
+    return Size;
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static const struct option  Options[] = {
+        { "runs", required_argument, NULL, 'r' },
+        { "seed", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    FUZZ_CORPUS                 Corpus;
+    ULONG64                     Runs = 0;
+    ULONG64                     Run;
+    ULONG                       Index;
+    static UCHAR                Output[65536];
+    int                         Option;
+
+    memset(&Corpus, 0, sizeof (Corpus));
+    srandom(1);
+
+    while ((Option = getopt_long(argc, argv, "", Options, NULL)) != -1) {
+        switch (Option) {
+        case 'r':
+            Runs = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            srandom((unsigned int)strtoul(optarg, NULL, 0));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [--runs N] [--seed N] [INPUT|DIRECTORY]...\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    for (; optind < argc; optind++)
+        FuzzLoad(&Corpus, argv[optind]);
+
+    for (Index = 0; Index < Corpus.Count; Index++)
+        LLVMFuzzerTestOneInput(Corpus.Input[Index], Corpus.Size[Index]);
+
+    for (Run = 0; Run < Runs; Run++) {
+        size_t  Size;
+
+        if (Corpus.Count != 0 && (random() % 8) != 0) {
+            Index = (ULONG)random() % Corpus.Count;
+            Size = FuzzMutate(Corpus.Input[Index], Corpus.Size[Index],
+                              Output, sizeof (Output));
+        } else {
+            Size = FuzzMutate(NULL, 0, Output, 256);
+        }
+
+        LLVMFuzzerTestOneInput(Output, Size);
+    }
+
+    printf("%u inputs, %llu mutations\n",
+           Corpus.Count, (unsigned long long)Runs);
+
+    for (Index = 0; Index < Corpus.Count; Index++)
+        free(Corpus.Input[Index]);
+    free(Corpus.Input);
+    free(Corpus.Size);
+
+    return 0;
+}
+
+#endif  // XENVKBD_LIBFUZZER
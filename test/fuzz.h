@@ -0,0 +1,63 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_FUZZ_H
+#define _XENVKBD_TEST_FUZZ_H
+
+// The input format of fuzz.c, which replay --seed writes from a capture.
+//
+// The first byte selects the ring: FUZZ_FLAG_* and, in FUZZ_LENGTH_MASK,
+// a single page (XENKBD_IN_RING_LEN slots) or one of the power-of-two
+// multi-page lengths. The rest is a sequence of operations by a hostile
+// backend, each an opcode followed by its operands; an operand cut short
+// by the end of the input reads as zero.
+
+#define FUZZ_FLAG_KEY_BATCH     0x01
+#define FUZZ_FLAG_TIMESTAMP     0x02
+#define FUZZ_FLAG_EVENT_IDX     0x04
+#define FUZZ_FLAG_BACKPRESSURE  0x08
+
+#define FUZZ_LENGTH_SHIFT       4
+#define FUZZ_LENGTH_MASK        0x30
+
+typedef enum _FUZZ_OP {
+    FUZZ_OP_PUT = 0,    // 40 bytes: an event into the next slot
+    FUZZ_OP_KEY,        // 3 bytes: keycode (LE16) and pressed, ditto
+    FUZZ_OP_JUMP,       // 4 bytes (LE32): added to in_prod
+    FUZZ_OP_CONS,       // 4 bytes (LE32): stored over in_cons
+    FUZZ_OP_RUN,        // 2 bytes: budget (0 for none) and hold pattern
+    FUZZ_OP_RACE,       // 1 byte: slots produced during the next run
+    FUZZ_OP_COUNT
+} FUZZ_OP;
+
+#endif  // _XENVKBD_TEST_FUZZ_H
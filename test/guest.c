@@ -0,0 +1,526 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <ntddk.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <hid_interface.h>
+
+#include "driver.h"
+#include "frontend.h"
+#include "hid.h"
+#include "vkbd.h"
+#include "kernel.h"
+#include "xenbus.h"
+#include "guest.h"
+
+C_ASSERT(sizeof (GUEST_TUNING) == sizeof (XENVKBD_HID_TUNING));
+C_ASSERT(sizeof (GUEST_COUNTERS) == sizeof (XENVKBD_HID_COUNTERS));
+C_ASSERT(GUEST_TUNING_COALESCE == XENVKBD_HID_TUNING_COALESCE);
+C_ASSERT(GUEST_TUNING_DEDUP == XENVKBD_HID_TUNING_DEDUP);
+C_ASSERT(GUEST_TUNING_BACKPRESSURE == XENVKBD_HID_TUNING_BACKPRESSURE);
+
+#define GUEST_NAME_LENGTH   16
+
+#define GUEST_CAPTURE_TAG   'tpaC'  // capture.c
+
+struct _XENVKBD_FDO {
+    PXENBUS     Xenbus;
+};
+
+struct _XENVKBD_PDO {
+    CHAR                    Name[GUEST_NAME_LENGTH];
+    PXENVKBD_FDO            Fdo;
+    PXENVKBD_FRONTEND       Frontend;
+    PXENVKBD_HID_CONTEXT    HidContext;
+    BOOLEAN                 EjectRequested;
+};
+
+struct _GUEST {
+    XENVKBD_FDO             Fdo;
+    XENVKBD_PDO             Pdo;
+    XENHID_HID_INTERFACE    HidInterface;
+    BOOLEAN                 Enabled;
+    GUEST_REPORT_CALLBACK   Callback;
+    PVOID                   Context;
+    PXENVKBD_CAPTURE        Capture;
+};
+
+// The driver's parameters (cf. DriverGetConfig()). Only CaptureRecords is
+// read by the frontend, when it is initialized.
+static XENVKBD_CONFIG   GuestConfig;
+
+const XENVKBD_CONFIG *
+DriverGetConfig(
+    VOID
+    )
+{
+    return &GuestConfig;
+}
+
+VOID
+DriverPutConfig(
+    IN  const XENVKBD_CONFIG    *Config
+    )
+{
+    UNREFERENCED_PARAMETER(Config);
+}
+
+PCHAR
+FdoGetVendorName(
+    IN  PXENVKBD_FDO    Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return "XS";
+}
+
+#define DEFINE_FDO_GET_INTERFACE(_Interface, _Type)         \
+VOID                                                        \
+FdoGet ## _Interface ## Interface(                          \
+    IN  PXENVKBD_FDO Fdo,                                   \
+    OUT _Type       _Interface ## Interface                 \
+    )                                                       \
+{                                                           \
+    XenbusGet ## _Interface ## Interface(Fdo->Xenbus,       \
+                                         _Interface ## Interface); \
+}
+
+DEFINE_FDO_GET_INTERFACE(Debug, PXENBUS_DEBUG_INTERFACE)
+DEFINE_FDO_GET_INTERFACE(Suspend, PXENBUS_SUSPEND_INTERFACE)
+DEFINE_FDO_GET_INTERFACE(Evtchn, PXENBUS_EVTCHN_INTERFACE)
+DEFINE_FDO_GET_INTERFACE(Store, PXENBUS_STORE_INTERFACE)
+DEFINE_FDO_GET_INTERFACE(Gnttab, PXENBUS_GNTTAB_INTERFACE)
+
+#undef DEFINE_FDO_GET_INTERFACE
+
+PCHAR
+PdoGetName(
+    IN  PXENVKBD_PDO    Pdo
+    )
+{
+    return Pdo->Name;
+}
+
+PXENVKBD_FDO
+PdoGetFdo(
+    IN  PXENVKBD_PDO    Pdo
+    )
+{
+    return Pdo->Fdo;
+}
+
+ULONG
+PdoGetFootprint(
+    IN  PXENVKBD_PDO    Pdo
+    )
+{
+    UNREFERENCED_PARAMETER(Pdo);
+
+    return sizeof (XENVKBD_PDO);
+}
+
+PXENVKBD_FRONTEND
+PdoGetFrontend(
+    IN  PXENVKBD_PDO    Pdo
+    )
+{
+    return Pdo->Frontend;
+}
+
+PXENVKBD_HID_CONTEXT
+PdoGetHidContext(
+    IN  PXENVKBD_PDO    Pdo
+    )
+{
+    return Pdo->HidContext;
+}
+
+VOID
+PdoRequestEject(
+    IN  PXENVKBD_PDO    Pdo
+    )
+{
+    Pdo->EjectRequested = TRUE;
+}
+
+static int
+__GuestError(
+    IN  NTSTATUS    status
+    )
+{
+    if (NT_SUCCESS(status))
+        return 0;
+
+    switch (status) {
+    case STATUS_NO_MEMORY:
+        return ENOMEM;
+
+    case STATUS_OBJECT_NAME_NOT_FOUND:
+        return ENOENT;
+
+    case STATUS_DEVICE_NOT_READY:
+        return ENODEV;
+
+    case STATUS_INVALID_PARAMETER:
+    case STATUS_BUFFER_TOO_SMALL:
+        return EINVAL;
+
+    case STATUS_NOT_SUPPORTED:
+        return ENOTSUP;
+
+    default:
+        return EIO;
+    }
+}
+
+static BOOLEAN
+GuestHidCallback(
+    IN  PVOID   Argument,
+    IN  PVOID   Buffer,
+    IN  ULONG   Length
+    )
+{
+    PGUEST      Guest = Argument;
+
+    return Guest->Callback(Guest->Context, Buffer, Length);
+}
+
+int
+GuestEnable(
+    IN  PGUEST                  Guest,
+    IN  GUEST_REPORT_CALLBACK   Callback,
+    IN  PVOID                   Context
+    )
+{
+    NTSTATUS                    status;
+
+    if (Guest->Enabled)
+        return EBUSY;
+
+    Guest->Callback = Callback;
+    Guest->Context = Context;
+
+    status = XENHID_HID(Enable,
+                        &Guest->HidInterface,
+                        GuestHidCallback,
+                        Guest);
+    if (!NT_SUCCESS(status))
+        return __GuestError(status);
+
+    Guest->Enabled = TRUE;
+
+    XENHID_HID(ReadReport, &Guest->HidInterface);
+
+    return 0;
+}
+
+VOID
+GuestDisable(
+    IN  PGUEST  Guest
+    )
+{
+    if (!Guest->Enabled)
+        return;
+
+    XENHID_HID(Disable, &Guest->HidInterface);
+
+    Guest->Enabled = FALSE;
+    Guest->Callback = NULL;
+    Guest->Context = NULL;
+}
+
+int
+GuestClose(
+    IN  PGUEST  Guest
+    )
+{
+    GuestDisable(Guest);
+
+    FrontendSetState(Guest->Pdo.Frontend, FRONTEND_CLOSED);
+
+    return __GuestError(FrontendWaitForState(Guest->Pdo.Frontend));
+}
+
+VOID
+GuestReadReport(
+    IN  PGUEST  Guest
+    )
+{
+    XENHID_HID(ReadReport, &Guest->HidInterface);
+}
+
+int
+GuestSetTuning(
+    IN  PGUEST              Guest,
+    IN  const GUEST_TUNING  *Tuning
+    )
+{
+    GUEST_TUNING            Buffer = *Tuning;
+
+    Buffer.ReportId = 3;
+
+    return __GuestError(XENHID_HID(SetFeature,
+                                   &Guest->HidInterface,
+                                   3,
+                                   &Buffer,
+                                   sizeof (Buffer)));
+}
+
+int
+GuestGetCounters(
+    IN  PGUEST          Guest,
+    OUT PGUEST_COUNTERS Counters
+    )
+{
+    ULONG               Returned;
+    NTSTATUS            status;
+
+    status = XENHID_HID(GetFeature,
+                        &Guest->HidInterface,
+                        4,
+                        Counters,
+                        sizeof (GUEST_COUNTERS),
+                        &Returned);
+    if (!NT_SUCCESS(status))
+        return __GuestError(status);
+
+    return (Returned == sizeof (GUEST_COUNTERS)) ? 0 : EIO;
+}
+
+const XENVKBD_CAPTURE *
+GuestGetCapture(
+    IN  PGUEST  Guest
+    )
+{
+    return Guest->Capture;
+}
+
+VOID
+GuestDebug(
+    IN  PGUEST  Guest,
+    IN  FILE    *Stream
+    )
+{
+    XenbusDebug(Guest->Fdo.Xenbus, Stream);
+}
+
+// Picks the frontend's figures out of its debug output, as someone
+// reading a debugger log would
+int
+GuestGetTiming(
+    IN  PGUEST          Guest,
+    OUT PGUEST_TIMING   Timing
+    )
+{
+    FILE                *Stream;
+    CHAR                *Buffer = NULL;
+    SIZE_T              Length = 0;
+    CHAR                *Line;
+    ULONG               Found;
+    ULONG64             Cpu;
+
+    RtlZeroMemory(Timing, sizeof (GUEST_TIMING));
+
+    Stream = open_memstream(&Buffer, &Length);
+    if (Stream == NULL)
+        return errno;
+
+    GuestDebug(Guest, Stream);
+    fclose(Stream);
+
+    Found = 0;
+
+    Line = strstr(Buffer, "CLOSE: ");
+    if (Line != NULL &&
+        sscanf(Line, "CLOSE: %" SCNu64 "us PREPARE: %" SCNu64 "us CONNECT: %" SCNu64 "us",
+               &Timing->Close, &Timing->Prepare, &Timing->Connect) == 3)
+        Found++;
+
+    Line = strstr(Buffer, "GNTTAB_CACHE: ");
+    if (Line != NULL &&
+        sscanf(Line, "GNTTAB_CACHE: %" SCNu64 "us GRANT: %" SCNu64 "us "
+               "EVTCHN: %" SCNu64 "us FEATURES: %" SCNu64 "us "
+               "STORE_WRITE: %" SCNu64 "us",
+               &Timing->GnttabCache, &Timing->Grant, &Timing->Evtchn,
+               &Timing->Features, &Timing->StoreWrite) == 5)
+        Found++;
+
+    Line = strstr(Buffer, "CONNECTS: ");
+    if (Line != NULL &&
+        sscanf(Line, "CONNECTS: %u (LAST %" SCNu64 "us CPU %" SCNu64 "us) "
+               "STORE: %u ops %" SCNu64 "us (max %" SCNu64 "us)",
+               &Timing->Connects, &Timing->LastConnect, &Cpu,
+               &Timing->StoreOps, &Timing->StoreTime, &Timing->StoreMax) == 6)
+        Found++;
+
+    free(Buffer);
+
+    return (Found == 3) ? 0 : EPROTO;
+}
+
+int
+GuestSuspend(
+    IN  PGUEST                  Guest
+    )
+{
+    XENBUS_SUSPEND_INTERFACE    SuspendInterface;
+
+    XenbusGetSuspendInterface(Guest->Fdo.Xenbus, &SuspendInterface);
+
+    return __GuestError(XENBUS_SUSPEND(Trigger, &SuspendInterface));
+}
+
+BOOLEAN
+GuestIsEjectRequested(
+    IN  PGUEST  Guest
+    )
+{
+    return Guest->Pdo.EjectRequested;
+}
+
+int
+GuestCreate(
+    IN  PFAKE_STORE     Store,
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  const CHAR      *Name,
+    IN  ULONG           CaptureRecords,
+    OUT PGUEST          *Guest
+    )
+{
+    NTSTATUS            status;
+
+    *Guest = calloc(1, sizeof (GUEST));
+
+    status = STATUS_NO_MEMORY;
+    if (*Guest == NULL)
+        goto fail1;
+
+    (VOID) snprintf((*Guest)->Pdo.Name, sizeof ((*Guest)->Pdo.Name), "%s", Name);
+    (*Guest)->Pdo.Fdo = &(*Guest)->Fdo;
+
+    status = KernelInitialize(Gnttab);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XenbusCreate(Store, Gnttab, &(*Guest)->Fdo.Xenbus);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    // As PdoCreate()
+    status = HidInitialize(&(*Guest)->Pdo, &(*Guest)->Pdo.HidContext);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    GuestConfig.CaptureRecords = CaptureRecords;
+
+    status = FrontendInitialize(&(*Guest)->Pdo, &(*Guest)->Pdo.Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    // The ring's, since guests are created one at a time
+    if (CaptureRecords != 0)
+        (*Guest)->Capture = KernelFindPool(GUEST_CAPTURE_TAG, NULL);
+
+    // As PdoResume() and PdoD3ToD0()
+    status = FrontendResume((*Guest)->Pdo.Frontend);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
+    // As XENHID querying for the interface and starting
+    (*Guest)->HidInterface.Interface.Version = 1;
+
+    status = HidGetInterface((*Guest)->Pdo.HidContext,
+                             1,
+                             (PINTERFACE)&(*Guest)->HidInterface,
+                             sizeof ((*Guest)->HidInterface));
+    if (!NT_SUCCESS(status))
+        goto fail7;
+
+    status = XENHID_HID(Acquire, &(*Guest)->HidInterface);
+    if (!NT_SUCCESS(status))
+        goto fail8;
+
+    return 0;
+
+fail8:
+fail7:
+    FrontendSuspend((*Guest)->Pdo.Frontend);
+
+fail6:
+    FrontendTeardown((*Guest)->Pdo.Frontend);
+
+fail5:
+    HidTeardown((*Guest)->Pdo.HidContext);
+
+fail4:
+    XenbusDestroy((*Guest)->Fdo.Xenbus);
+
+fail3:
+    KernelTeardown();
+
+fail2:
+    free(*Guest);
+    *Guest = NULL;
+
+fail1:
+    return __GuestError(status);
+}
+
+VOID
+GuestDestroy(
+    IN  PGUEST  Guest
+    )
+{
+    (VOID) GuestClose(Guest);
+
+    XENHID_HID(Release, &Guest->HidInterface);
+
+    // As PdoSuspend() and PdoDestroy()
+    FrontendSuspend(Guest->Pdo.Frontend);
+    FrontendTeardown(Guest->Pdo.Frontend);
+    HidTeardown(Guest->Pdo.HidContext);
+
+    XenbusDestroy(Guest->Fdo.Xenbus);
+    KernelTeardown();
+
+    free(Guest);
+}
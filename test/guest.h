@@ -0,0 +1,198 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_GUEST_H
+#define _XENVKBD_TEST_GUEST_H
+
+#include <stdio.h>
+
+#include "translate.h"
+#include "capture.h"
+#include "fake.h"
+
+// The driver's own frontend.c, ring.c and hid.c, built against the kernel
+// shim (see kernel.h) and run over the fakes. A GUEST stands in for the
+// PDO, the FDO it hangs off and the XENHID driver above it, so that the
+// tools can drive the frontend through the HID interface as XENHID does.
+// Errors are reported as errno values, as by the fakes.
+
+typedef struct _GUEST   GUEST, *PGUEST;
+
+// A read completing (cf. XENHID_HID_CALLBACK), at DISPATCH_LEVEL from the
+// ring's DPC. Returning FALSE means that there was no read to complete: the
+// report is left pending until GuestReadReport() posts one.
+typedef BOOLEAN
+(*GUEST_REPORT_CALLBACK)(
+    IN  PVOID       Context,
+    IN  const VOID  *Report,
+    IN  ULONG       Length
+    );
+
+// The feature reports (cf. vkbd.h), which the tools cannot include
+#define GUEST_TUNING_COALESCE       0x01
+#define GUEST_TUNING_DEDUP          0x02
+#define GUEST_TUNING_BACKPRESSURE   0x04
+
+#pragma pack(push, 1)
+
+typedef struct _GUEST_TUNING {
+    UCHAR   ReportId;   // = 3
+    UCHAR   Flags;
+    USHORT  Reserved;
+    ULONG   FlushRate;
+    ULONG   DpcBudget;
+} GUEST_TUNING, *PGUEST_TUNING;
+
+typedef struct _GUEST_COUNTERS {
+    UCHAR   ReportId;   // = 4
+    UCHAR   Reserved[3];
+    ULONG   Events;
+    ULONG   Dpcs;
+    ULONG   Processed;
+    ULONG   Reports;
+    ULONG   Pending;
+    ULONG   Coalesced;
+    ULONG   Deduplicated;
+    ULONG   Deferred;
+} GUEST_COUNTERS, *PGUEST_COUNTERS;
+
+#pragma pack(pop)
+
+// What the frontend's debug callback reports, all in microseconds. The
+// phases are those of the last transition through them.
+typedef struct _GUEST_TIMING {
+    ULONG64 Close;
+    ULONG64 Prepare;
+    ULONG64 Connect;
+    ULONG64 GnttabCache;
+    ULONG64 Grant;
+    ULONG64 Evtchn;
+    ULONG64 Features;
+    ULONG64 StoreWrite;
+    ULONG   Connects;
+    ULONG64 LastConnect;
+    ULONG   StoreOps;
+    ULONG64 StoreTime;
+    ULONG64 StoreMax;
+} GUEST_TIMING, *PGUEST_TIMING;
+
+// Creates the frontend for device/vkbd/<Name> and resumes it, leaving it
+// closed. The backend's path is read from the frontend's area, so the host
+// must have been created first. CaptureRecords is the driver's
+// CaptureRecords parameter. Guests must be created one at a time.
+extern int
+GuestCreate(
+    IN  PFAKE_STORE     Store,
+    IN  PFAKE_GNTTAB    Gnttab,
+    IN  const CHAR      *Name,
+    IN  ULONG           CaptureRecords,
+    OUT PGUEST          *Guest
+    );
+
+extern VOID
+GuestDestroy(
+    IN  PGUEST  Guest
+    );
+
+// As XENHID starting: connects the ring and enables reports, then posts
+// the first read
+extern int
+GuestEnable(
+    IN  PGUEST                  Guest,
+    IN  GUEST_REPORT_CALLBACK   Callback,
+    IN  PVOID                   Context
+    );
+
+// Disconnects the ring, leaving the frontend connected to the backend
+extern VOID
+GuestDisable(
+    IN  PGUEST  Guest
+    );
+
+// As the PDO going to D3
+extern int
+GuestClose(
+    IN  PGUEST  Guest
+    );
+
+extern VOID
+GuestReadReport(
+    IN  PGUEST  Guest
+    );
+
+// Only while enabled. Tuning persists until the guest is destroyed, but
+// the capture only records it when the ring next connects.
+extern int
+GuestSetTuning(
+    IN  PGUEST              Guest,
+    IN  const GUEST_TUNING  *Tuning
+    );
+
+extern int
+GuestGetCounters(
+    IN  PGUEST          Guest,
+    OUT PGUEST_COUNTERS Counters
+    );
+
+// The driver's capture buffer, or NULL if CaptureRecords was 0
+extern const XENVKBD_CAPTURE *
+GuestGetCapture(
+    IN  PGUEST  Guest
+    );
+
+extern int
+GuestGetTiming(
+    IN  PGUEST          Guest,
+    OUT PGUEST_TIMING   Timing
+    );
+
+// Runs the driver's debug callbacks, with their output going to Stream
+extern VOID
+GuestDebug(
+    IN  PGUEST  Guest,
+    IN  FILE    *Stream
+    );
+
+// A suspend and resume in the same domain
+extern int
+GuestSuspend(
+    IN  PGUEST  Guest
+    );
+
+// Whether the frontend has asked for the device to be ejected
+extern BOOLEAN
+GuestIsEjectRequested(
+    IN  PGUEST  Guest
+    );
+
+#endif  // _XENVKBD_TEST_GUEST_H
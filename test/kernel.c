@@ -0,0 +1,1094 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <ntddk.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "kernel.h"
+#include "thread.h"
+#include "pool.h"
+
+// Bug check codes used by the shim itself
+#define IRQL_NOT_LESS_OR_EQUAL          0x0000000A
+#define IRQL_NOT_GREATER_OR_EQUAL       0x00000009
+#define BAD_POOL_CALLER                 0x000000C2
+#define ASSERTION_FAILURE               0x0000DEAD
+
+#define KERNEL_SYSTEM_TIME_BIAS 116444736000000000ll    // 1601 to 1970
+
+static __thread KIRQL   CurrentIrql;
+
+typedef struct _KERNEL_POOL_HEADER {
+    struct _KERNEL_POOL_HEADER  *Prev;
+    struct _KERNEL_POOL_HEADER  *Next;
+    ULONG                       Tag;
+    SIZE_T                      Length;
+} __attribute__((aligned(64))) KERNEL_POOL_HEADER, *PKERNEL_POOL_HEADER;
+
+typedef struct _KERNEL {
+    pthread_mutex_t     Lock;
+    LONG                References;
+    PFAKE_GNTTAB        Gnttab;
+    BOOLEAN             Stopping;
+
+    // Events: one condition for all of them, broadcast on every set
+    pthread_mutex_t     EventLock;
+    pthread_cond_t      EventCondition;
+
+    pthread_mutex_t     DpcLock;
+    pthread_cond_t      DpcCondition;
+    pthread_cond_t      DpcDone;
+    PKDPC               DpcHead;
+    PKDPC               DpcTail;
+    ULONG64             DpcQueued;
+    ULONG64             DpcCompleted;
+    pthread_t           DpcThread;
+
+    pthread_mutex_t     TimerLock;
+    pthread_cond_t      TimerCondition;
+    PKTIMER             TimerList;
+    pthread_t           TimerThread;
+
+    pthread_mutex_t     PoolLock;
+    KERNEL_POOL_HEADER  PoolList;
+    ULONG               PoolCount;
+
+    BOOLEAN             Verbose;
+} KERNEL, *PKERNEL;
+
+static KERNEL   Kernel = {
+    .Lock = PTHREAD_MUTEX_INITIALIZER,
+    .EventLock = PTHREAD_MUTEX_INITIALIZER,
+    .DpcLock = PTHREAD_MUTEX_INITIALIZER,
+    .TimerLock = PTHREAD_MUTEX_INITIALIZER,
+    .PoolLock = PTHREAD_MUTEX_INITIALIZER,
+    .PoolList = { &Kernel.PoolList, &Kernel.PoolList, 0, 0 },
+};
+
+static ULONG64
+__KernelGetTimeNs(
+    IN  clockid_t   Clock
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(Clock, &Now);
+
+    return (ULONG64)Now.tv_sec * 1000000000ull + (ULONG64)Now.tv_nsec;
+}
+
+static VOID
+__KernelDeadline(
+    IN  ULONG64         Ns,
+    OUT struct timespec *Deadline
+    )
+{
+    Deadline->tv_sec = (time_t)(Ns / 1000000000ull);
+    Deadline->tv_nsec = (long)(Ns % 1000000000ull);
+}
+
+static VOID
+__KernelInitializeCondition(
+    OUT pthread_cond_t  *Condition
+    )
+{
+    pthread_condattr_t  Attributes;
+
+    pthread_condattr_init(&Attributes);
+    pthread_condattr_setclock(&Attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(Condition, &Attributes);
+    pthread_condattr_destroy(&Attributes);
+}
+
+VOID
+KeBugCheckEx(
+    IN  ULONG       BugCheckCode,
+    IN  ULONG_PTR   BugCheckParameter1,
+    IN  ULONG_PTR   BugCheckParameter2,
+    IN  ULONG_PTR   BugCheckParameter3,
+    IN  ULONG_PTR   BugCheckParameter4
+    )
+{
+    if (BugCheckCode == ASSERTION_FAILURE && BugCheckParameter1 != 0)
+        fprintf(stderr, "*** ASSERTION FAILURE: %s (%s:%lu)\n",
+                (const CHAR *)BugCheckParameter1,
+                (const CHAR *)BugCheckParameter2,
+                (unsigned long)BugCheckParameter3);
+    else
+        fprintf(stderr, "*** STOP: 0x%08x (0x%lx, 0x%lx, 0x%lx, 0x%lx)\n",
+                BugCheckCode,
+                (unsigned long)BugCheckParameter1,
+                (unsigned long)BugCheckParameter2,
+                (unsigned long)BugCheckParameter3,
+                (unsigned long)BugCheckParameter4);
+
+    abort();
+}
+
+KIRQL
+KeGetCurrentIrql(
+    VOID
+    )
+{
+    return CurrentIrql;
+}
+
+VOID
+KeRaiseIrql(
+    IN  KIRQL   NewIrql,
+    OUT PKIRQL  OldIrql
+    )
+{
+    if (NewIrql < CurrentIrql)
+        KeBugCheckEx(IRQL_NOT_GREATER_OR_EQUAL, NewIrql, CurrentIrql, 0, 0);
+
+    *OldIrql = CurrentIrql;
+    CurrentIrql = NewIrql;
+}
+
+VOID
+KeLowerIrql(
+    IN  KIRQL   NewIrql
+    )
+{
+    if (NewIrql > CurrentIrql)
+        KeBugCheckEx(IRQL_NOT_LESS_OR_EQUAL, NewIrql, CurrentIrql, 0, 0);
+
+    CurrentIrql = NewIrql;
+}
+
+// Only ever compared, never dereferenced
+PKTHREAD
+KeGetCurrentThread(
+    VOID
+    )
+{
+    return (PKTHREAD)&CurrentIrql;
+}
+
+VOID
+KeInitializeSpinLock(
+    OUT PKSPIN_LOCK Lock
+    )
+{
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+VOID
+KeAcquireSpinLockAtDpcLevel(
+    IN  PKSPIN_LOCK Lock
+    )
+{
+    if (CurrentIrql < DISPATCH_LEVEL)
+        KeBugCheckEx(IRQL_NOT_GREATER_OR_EQUAL, (ULONG_PTR)Lock, CurrentIrql, 0, 0);
+
+    // The holder may be pre-empted, which a real spin lock rules out, so
+    // give way rather than burn its time slice
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(Lock, __ATOMIC_RELAXED) != 0)
+            sched_yield();
+    }
+}
+
+VOID
+KeReleaseSpinLockFromDpcLevel(
+    IN  PKSPIN_LOCK Lock
+    )
+{
+    if (__atomic_load_n(Lock, __ATOMIC_RELAXED) == 0)
+        KeBugCheckEx(IRQL_NOT_GREATER_OR_EQUAL, (ULONG_PTR)Lock, CurrentIrql, 1, 0);
+
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+VOID
+KeInitializeEvent(
+    OUT PKEVENT     Event,
+    IN  EVENT_TYPE  Type,
+    IN  BOOLEAN     State
+    )
+{
+    Event->Type = Type;
+    __atomic_store_n(&Event->State, (State) ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+LONG
+KeSetEvent(
+    IN  PKEVENT Event,
+    IN  LONG    Increment,
+    IN  BOOLEAN Wait
+    )
+{
+    LONG        State;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    pthread_mutex_lock(&Kernel.EventLock);
+    State = Event->State;
+    Event->State = 1;
+    pthread_cond_broadcast(&Kernel.EventCondition);
+    pthread_mutex_unlock(&Kernel.EventLock);
+
+    return State;
+}
+
+VOID
+KeClearEvent(
+    IN  PKEVENT Event
+    )
+{
+    pthread_mutex_lock(&Kernel.EventLock);
+    Event->State = 0;
+    pthread_mutex_unlock(&Kernel.EventLock);
+}
+
+LONG
+KeReadStateEvent(
+    IN  PKEVENT Event
+    )
+{
+    return __atomic_load_n(&Event->State, __ATOMIC_ACQUIRE);
+}
+
+NTSTATUS
+KeWaitForSingleObject(
+    IN  PVOID           Object,
+    IN  KWAIT_REASON    WaitReason,
+    IN  KPROCESSOR_MODE WaitMode,
+    IN  BOOLEAN         Alertable,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    )
+{
+    PKEVENT             Event = Object;
+    struct timespec     Deadline;
+    BOOLEAN             Poll;
+    NTSTATUS            status;
+
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    Poll = (Timeout != NULL && Timeout->QuadPart == 0) ? TRUE : FALSE;
+
+    if (!Poll && CurrentIrql > APC_LEVEL)
+        KeBugCheckEx(IRQL_NOT_LESS_OR_EQUAL, (ULONG_PTR)Object, CurrentIrql, 0, 0);
+
+    if (Timeout != NULL && Timeout->QuadPart > 0)
+        KeBugCheckEx(BAD_POOL_CALLER, (ULONG_PTR)Object, 0, 0, 0);
+
+    if (Timeout != NULL)
+        __KernelDeadline(__KernelGetTimeNs(CLOCK_MONOTONIC) +
+                         (ULONG64)(-Timeout->QuadPart) * 100ull,
+                         &Deadline);
+
+    pthread_mutex_lock(&Kernel.EventLock);
+
+    for (;;) {
+        if (Event->State != 0) {
+            if (Event->Type == SynchronizationEvent)
+                Event->State = 0;
+
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        status = STATUS_TIMEOUT;
+        if (Poll)
+            break;
+
+        if (Timeout == NULL) {
+            pthread_cond_wait(&Kernel.EventCondition, &Kernel.EventLock);
+        } else if (pthread_cond_timedwait(&Kernel.EventCondition,
+                                          &Kernel.EventLock,
+                                          &Deadline) == ETIMEDOUT) {
+            if (Event->State == 0)
+                break;
+        }
+    }
+
+    pthread_mutex_unlock(&Kernel.EventLock);
+
+    return status;
+}
+
+VOID
+KeInitializeDpc(
+    OUT PKDPC               Dpc,
+    IN  PKDEFERRED_ROUTINE  DeferredRoutine,
+    IN  PVOID               DeferredContext OPTIONAL
+    )
+{
+    RtlZeroMemory(Dpc, sizeof (KDPC));
+
+    Dpc->DeferredRoutine = DeferredRoutine;
+    Dpc->DeferredContext = DeferredContext;
+}
+
+BOOLEAN
+KeInsertQueueDpc(
+    IN  PKDPC   Dpc,
+    IN  PVOID   SystemArgument1 OPTIONAL,
+    IN  PVOID   SystemArgument2 OPTIONAL
+    )
+{
+    pthread_mutex_lock(&Kernel.DpcLock);
+
+    if (Dpc->Inserted) {
+        pthread_mutex_unlock(&Kernel.DpcLock);
+        return FALSE;
+    }
+
+    Dpc->Inserted = TRUE;
+    Dpc->SystemArgument1 = SystemArgument1;
+    Dpc->SystemArgument2 = SystemArgument2;
+    Dpc->Next = NULL;
+
+    if (Kernel.DpcTail != NULL)
+        Kernel.DpcTail->Next = Dpc;
+    else
+        Kernel.DpcHead = Dpc;
+    Kernel.DpcTail = Dpc;
+
+    Kernel.DpcQueued++;
+
+    pthread_cond_signal(&Kernel.DpcCondition);
+    pthread_mutex_unlock(&Kernel.DpcLock);
+
+    return TRUE;
+}
+
+// Waits for everything queued so far to have run
+VOID
+KeFlushQueuedDpcs(
+    VOID
+    )
+{
+    ULONG64     Queued;
+
+    if (CurrentIrql != PASSIVE_LEVEL)
+        KeBugCheckEx(IRQL_NOT_LESS_OR_EQUAL, 0, CurrentIrql, 0, 0);
+
+    pthread_mutex_lock(&Kernel.DpcLock);
+
+    Queued = Kernel.DpcQueued;
+    while (Kernel.DpcCompleted < Queued)
+        pthread_cond_wait(&Kernel.DpcDone, &Kernel.DpcLock);
+
+    pthread_mutex_unlock(&Kernel.DpcLock);
+}
+
+static PVOID
+KernelDpcThread(
+    IN  PVOID   Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    CurrentIrql = DISPATCH_LEVEL;
+
+    pthread_mutex_lock(&Kernel.DpcLock);
+
+    for (;;) {
+        PKDPC   Dpc;
+
+        while (Kernel.DpcHead == NULL && !Kernel.Stopping)
+            pthread_cond_wait(&Kernel.DpcCondition, &Kernel.DpcLock);
+
+        Dpc = Kernel.DpcHead;
+        if (Dpc == NULL)
+            break;
+
+        Kernel.DpcHead = Dpc->Next;
+        if (Kernel.DpcHead == NULL)
+            Kernel.DpcTail = NULL;
+
+        // It may be queued again from here on
+        Dpc->Next = NULL;
+        Dpc->Inserted = FALSE;
+
+        pthread_mutex_unlock(&Kernel.DpcLock);
+
+        Dpc->DeferredRoutine(Dpc,
+                             Dpc->DeferredContext,
+                             Dpc->SystemArgument1,
+                             Dpc->SystemArgument2);
+
+        if (CurrentIrql != DISPATCH_LEVEL)
+            KeBugCheckEx(IRQL_NOT_GREATER_OR_EQUAL, (ULONG_PTR)Dpc, CurrentIrql, 0, 0);
+
+        pthread_mutex_lock(&Kernel.DpcLock);
+
+        Kernel.DpcCompleted++;
+        pthread_cond_broadcast(&Kernel.DpcDone);
+    }
+
+    pthread_mutex_unlock(&Kernel.DpcLock);
+
+    return NULL;
+}
+
+VOID
+KeInitializeTimer(
+    OUT PKTIMER Timer
+    )
+{
+    RtlZeroMemory(Timer, sizeof (KTIMER));
+}
+
+static BOOLEAN
+__KernelRemoveTimer(
+    IN  PKTIMER Timer
+    )
+{
+    PKTIMER     *Link;
+
+    if (!Timer->Inserted)
+        return FALSE;
+
+    for (Link = &Kernel.TimerList; *Link != NULL; Link = &(*Link)->Next) {
+        if (*Link == Timer) {
+            *Link = Timer->Next;
+            break;
+        }
+    }
+
+    Timer->Next = NULL;
+    Timer->Inserted = FALSE;
+
+    return TRUE;
+}
+
+BOOLEAN
+KeSetTimer(
+    IN  PKTIMER         Timer,
+    IN  LARGE_INTEGER   DueTime,
+    IN  PKDPC           Dpc OPTIONAL
+    )
+{
+    BOOLEAN             Inserted;
+
+    if (DueTime.QuadPart > 0)
+        KeBugCheckEx(BAD_POOL_CALLER, (ULONG_PTR)Timer, 1, 0, 0);
+
+    pthread_mutex_lock(&Kernel.TimerLock);
+
+    Inserted = __KernelRemoveTimer(Timer);
+
+    Timer->DueTime = __KernelGetTimeNs(CLOCK_MONOTONIC) +
+                     (ULONG64)(-DueTime.QuadPart) * 100ull;
+    Timer->Dpc = Dpc;
+    Timer->Inserted = TRUE;
+    Timer->Next = Kernel.TimerList;
+    Kernel.TimerList = Timer;
+
+    pthread_cond_signal(&Kernel.TimerCondition);
+    pthread_mutex_unlock(&Kernel.TimerLock);
+
+    return Inserted;
+}
+
+BOOLEAN
+KeCancelTimer(
+    IN  PKTIMER Timer
+    )
+{
+    BOOLEAN     Inserted;
+
+    pthread_mutex_lock(&Kernel.TimerLock);
+    Inserted = __KernelRemoveTimer(Timer);
+    pthread_mutex_unlock(&Kernel.TimerLock);
+
+    return Inserted;
+}
+
+static PVOID
+KernelTimerThread(
+    IN  PVOID   Argument
+    )
+{
+    UNREFERENCED_PARAMETER(Argument);
+
+    pthread_mutex_lock(&Kernel.TimerLock);
+
+    while (!Kernel.Stopping) {
+        PKTIMER         Timer;
+        PKTIMER         Next;
+        ULONG64         Now;
+        ULONG64         Due;
+        struct timespec Deadline;
+
+        Now = __KernelGetTimeNs(CLOCK_MONOTONIC);
+        Due = ~0ull;
+
+        for (Timer = Kernel.TimerList; Timer != NULL; Timer = Next) {
+            Next = Timer->Next;
+
+            if (Timer->DueTime > Now) {
+                Due = __min(Due, Timer->DueTime);
+                continue;
+            }
+
+            (VOID) __KernelRemoveTimer(Timer);
+
+            if (Timer->Dpc != NULL)
+                (VOID) KeInsertQueueDpc(Timer->Dpc, NULL, NULL);
+        }
+
+        if (Due == ~0ull) {
+            pthread_cond_wait(&Kernel.TimerCondition, &Kernel.TimerLock);
+        } else {
+            __KernelDeadline(Due, &Deadline);
+            (VOID) pthread_cond_timedwait(&Kernel.TimerCondition,
+                                          &Kernel.TimerLock,
+                                          &Deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&Kernel.TimerLock);
+
+    return NULL;
+}
+
+VOID
+KeQuerySystemTime(
+    OUT PLARGE_INTEGER  CurrentTime
+    )
+{
+    CurrentTime->QuadPart = (LONGLONG)(__KernelGetTimeNs(CLOCK_REALTIME) / 100ull) +
+                            KERNEL_SYSTEM_TIME_BIAS;
+}
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    OUT PLARGE_INTEGER  PerformanceFrequency OPTIONAL
+    )
+{
+    LARGE_INTEGER       Counter;
+
+    if (PerformanceFrequency != NULL)
+        PerformanceFrequency->QuadPart = 1000000000ll;
+
+    Counter.QuadPart = (LONGLONG)__KernelGetTimeNs(CLOCK_MONOTONIC);
+
+    return Counter;
+}
+
+VOID
+KeStallExecutionProcessor(
+    IN  ULONG   MicroSeconds
+    )
+{
+    ULONG64     Until;
+
+    Until = __KernelGetTimeNs(CLOCK_MONOTONIC) + (ULONG64)MicroSeconds * 1000ull;
+
+    while (__KernelGetTimeNs(CLOCK_MONOTONIC) < Until)
+        sched_yield();
+}
+
+PVOID
+ExAllocatePoolWithTag(
+    IN  POOL_TYPE   PoolType,
+    IN  SIZE_T      NumberOfBytes,
+    IN  ULONG       Tag
+    )
+{
+    PKERNEL_POOL_HEADER Header;
+
+    UNREFERENCED_PARAMETER(PoolType);
+
+    // Cache aligned, as the ring's DECLSPEC_CACHEALIGN members need
+    if (posix_memalign((void **)&Header,
+                       __alignof__(KERNEL_POOL_HEADER),
+                       sizeof (KERNEL_POOL_HEADER) + NumberOfBytes) != 0)
+        return NULL;
+
+    // Not zeroed by the real thing either, so make use of it show up
+
+    memset(Header + 1, 0xA5, NumberOfBytes);
+
+    Header->Tag = Tag;
+    Header->Length = NumberOfBytes;
+
+    pthread_mutex_lock(&Kernel.PoolLock);
+    Header->Next = &Kernel.PoolList;
+    Header->Prev = Kernel.PoolList.Prev;
+    Kernel.PoolList.Prev->Next = Header;
+    Kernel.PoolList.Prev = Header;
+    Kernel.PoolCount++;
+    pthread_mutex_unlock(&Kernel.PoolLock);
+
+    return Header + 1;
+}
+
+VOID
+ExFreePoolWithTag(
+    IN  PVOID   Buffer,
+    IN  ULONG   Tag
+    )
+{
+    PKERNEL_POOL_HEADER Header = (PKERNEL_POOL_HEADER)Buffer - 1;
+
+    if (Tag != 0 && Tag != Header->Tag)
+        KeBugCheckEx(BAD_POOL_CALLER, (ULONG_PTR)Buffer, Tag, Header->Tag, 0);
+
+    pthread_mutex_lock(&Kernel.PoolLock);
+    Header->Prev->Next = Header->Next;
+    Header->Next->Prev = Header->Prev;
+    Kernel.PoolCount--;
+    pthread_mutex_unlock(&Kernel.PoolLock);
+
+    free(Header);
+}
+
+PVOID
+KernelFindPool(
+    IN  ULONG   Tag,
+    OUT PSIZE_T Length OPTIONAL
+    )
+{
+    PKERNEL_POOL_HEADER Header;
+    PVOID               Buffer = NULL;
+
+    pthread_mutex_lock(&Kernel.PoolLock);
+
+    for (Header = Kernel.PoolList.Prev;
+         Header != &Kernel.PoolList;
+         Header = Header->Prev) {
+        if (Header->Tag != Tag)
+            continue;
+
+        Buffer = Header + 1;
+        if (Length != NULL)
+            *Length = Header->Length;
+        break;
+    }
+
+    pthread_mutex_unlock(&Kernel.PoolLock);
+
+    return Buffer;
+}
+
+ULONG
+KernelGetPoolCount(
+    VOID
+    )
+{
+    ULONG   Count;
+
+    pthread_mutex_lock(&Kernel.PoolLock);
+    Count = Kernel.PoolCount;
+    pthread_mutex_unlock(&Kernel.PoolLock);
+
+    return Count;
+}
+
+// cf. pool.c, without the lookaside lists and accounting
+PVOID
+PoolAllocate(
+    IN  ULONG   Tag,
+    IN  ULONG   Length
+    )
+{
+    PVOID       Buffer;
+
+    Buffer = ExAllocatePoolWithTag(NonPagedPool, Length, Tag);
+    if (Buffer != NULL)
+        RtlZeroMemory(Buffer, Length);
+
+    return Buffer;
+}
+
+PVOID
+PoolAllocateObject(
+    IN  ULONG   Tag,
+    IN  ULONG   Length
+    )
+{
+    return PoolAllocate(Tag, Length);
+}
+
+VOID
+PoolFree(
+    IN  PVOID   Buffer,
+    IN  ULONG   Tag
+    )
+{
+    ExFreePoolWithTag(Buffer, Tag);
+}
+
+#define KERNEL_MDL_TAG  'ldM'
+
+PMDL
+MmAllocatePagesForMdlEx(
+    IN  PHYSICAL_ADDRESS    LowAddress,
+    IN  PHYSICAL_ADDRESS    HighAddress,
+    IN  PHYSICAL_ADDRESS    SkipBytes,
+    IN  SIZE_T              TotalBytes,
+    IN  MEMORY_CACHING_TYPE CacheType,
+    IN  ULONG               Flags
+    )
+{
+    ULONG                   Count;
+    ULONG                   Pfn;
+    ULONG                   Index;
+    PMDL                    Mdl;
+
+    UNREFERENCED_PARAMETER(LowAddress);
+    UNREFERENCED_PARAMETER(HighAddress);
+    UNREFERENCED_PARAMETER(SkipBytes);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(Flags);
+
+    Count = ADDRESS_AND_SIZE_TO_SPAN_PAGES(0, TotalBytes);
+
+    Mdl = ExAllocatePoolWithTag(NonPagedPool,
+                                MmSizeOfMdl(0, TotalBytes),
+                                KERNEL_MDL_TAG);
+    if (Mdl == NULL)
+        goto fail1;
+
+    if (FakeGnttabAllocatePages(Kernel.Gnttab, Count, &Pfn) != 0)
+        goto fail2;
+
+    RtlZeroMemory(Mdl, sizeof (MDL));
+    Mdl->Size = (SHORT)MmSizeOfMdl(0, TotalBytes);
+    Mdl->MdlFlags = MDL_PAGES_LOCKED;
+    Mdl->ByteCount = (ULONG)((SIZE_T)Count * PAGE_SIZE);
+
+    for (Index = 0; Index < Count; Index++)
+        MmGetMdlPfnArray(Mdl)[Index] = Pfn + Index;
+
+    return Mdl;
+
+fail2:
+    ExFreePoolWithTag(Mdl, KERNEL_MDL_TAG);
+
+fail1:
+    return NULL;
+}
+
+// The pages are contiguous in the fake grant table's memory
+PVOID
+MmMapLockedPagesSpecifyCache(
+    IN  PMDL                Mdl,
+    IN  KPROCESSOR_MODE     AccessMode,
+    IN  MEMORY_CACHING_TYPE CacheType,
+    IN  PVOID               RequestedAddress OPTIONAL,
+    IN  ULONG               BugCheckOnFailure,
+    IN  ULONG               Priority
+    )
+{
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(RequestedAddress);
+    UNREFERENCED_PARAMETER(BugCheckOnFailure);
+    UNREFERENCED_PARAMETER(Priority);
+
+    Mdl->MappedSystemVa = FakeGnttabGetPage(Kernel.Gnttab,
+                                            (ULONG)MmGetMdlPfnArray(Mdl)[0]);
+    Mdl->MdlFlags |= MDL_MAPPED_TO_SYSTEM_VA;
+
+    return Mdl->MappedSystemVa;
+}
+
+VOID
+MmUnmapLockedPages(
+    IN  PVOID   BaseAddress,
+    IN  PMDL    Mdl
+    )
+{
+    if (BaseAddress != Mdl->MappedSystemVa)
+        KeBugCheckEx(BAD_POOL_CALLER, (ULONG_PTR)BaseAddress, (ULONG_PTR)Mdl, 0, 0);
+
+    Mdl->MappedSystemVa = NULL;
+    Mdl->MdlFlags &= ~MDL_MAPPED_TO_SYSTEM_VA;
+}
+
+VOID
+MmFreePagesFromMdl(
+    IN  PMDL    Mdl
+    )
+{
+    ULONG       Count = Mdl->ByteCount / PAGE_SIZE;
+
+    FakeGnttabFreePages(Kernel.Gnttab, (ULONG)MmGetMdlPfnArray(Mdl)[0], Count);
+    Mdl->ByteCount = 0;
+}
+
+ULONG
+vDbgPrintExWithPrefix(
+    IN  const CHAR  *Prefix,
+    IN  ULONG       ComponentId,
+    IN  ULONG       Level,
+    IN  const CHAR  *Format,
+    IN  va_list     Arguments
+    )
+{
+    CHAR            Buffer[512];
+
+    UNREFERENCED_PARAMETER(ComponentId);
+
+    if (Level > DPFLTR_WARNING_LEVEL && !Kernel.Verbose)
+        return 0;
+
+    // One write per line, so that lines from different threads stay whole
+    (VOID) vsnprintf(Buffer, sizeof (Buffer), Format, Arguments);
+    fprintf(stderr, "%s%s", Prefix, Buffer);
+
+    return 0;
+}
+
+// The driver's work items (thread.c), each on a thread of its own
+struct _XENVKBD_WORK {
+    XENVKBD_WORK_FUNCTION   Function;
+    PVOID                   Context;
+    KEVENT                  Event;
+    BOOLEAN                 Alerted;
+    pthread_t               Thread;
+};
+
+#define KERNEL_WORK_TAG 'kroW'
+
+static PVOID
+KernelWorkThread(
+    IN  PVOID       Argument
+    )
+{
+    PXENVKBD_WORK   Work = Argument;
+
+    for (;;) {
+        (VOID) KeWaitForSingleObject(&Work->Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+
+        // Clear before the call so that a wake during the call is not lost
+        KeClearEvent(&Work->Event);
+
+        if (__atomic_load_n(&Work->Alerted, __ATOMIC_ACQUIRE))
+            break;
+
+        Work->Function(Work, Work->Context);
+
+        if (CurrentIrql != PASSIVE_LEVEL)
+            KeBugCheckEx(IRQL_NOT_LESS_OR_EQUAL, (ULONG_PTR)Work, CurrentIrql, 0, 0);
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+WorkCreate(
+    IN  XENVKBD_WORK_FUNCTION   Function,
+    IN  PVOID                   Context,
+    IN  XENVKBD_WORK_CLASS      Class,
+    OUT PXENVKBD_WORK           *Work
+    )
+{
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Class);
+
+    *Work = PoolAllocate(KERNEL_WORK_TAG, sizeof (XENVKBD_WORK));
+
+    status = STATUS_NO_MEMORY;
+    if (*Work == NULL)
+        goto fail1;
+
+    (*Work)->Function = Function;
+    (*Work)->Context = Context;
+    KeInitializeEvent(&(*Work)->Event, NotificationEvent, FALSE);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (pthread_create(&(*Work)->Thread, NULL, KernelWorkThread, *Work) != 0)
+        goto fail2;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    PoolFree(*Work, KERNEL_WORK_TAG);
+    *Work = NULL;
+
+fail1:
+    return status;
+}
+
+PKEVENT
+WorkGetEvent(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    return &Work->Event;
+}
+
+BOOLEAN
+WorkIsAlerted(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    return __atomic_load_n(&Work->Alerted, __ATOMIC_ACQUIRE);
+}
+
+VOID
+WorkWake(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    KeSetEvent(&Work->Event, IO_NO_INCREMENT, FALSE);
+}
+
+VOID
+WorkAlert(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    __atomic_store_n(&Work->Alerted, TRUE, __ATOMIC_RELEASE);
+    KeSetEvent(&Work->Event, IO_NO_INCREMENT, FALSE);
+}
+
+VOID
+WorkJoin(
+    IN  PXENVKBD_WORK   Work
+    )
+{
+    if (CurrentIrql != PASSIVE_LEVEL || !Work->Alerted)
+        KeBugCheckEx(ASSERTION_FAILURE, 0, (ULONG_PTR)Work, CurrentIrql, 0);
+
+    pthread_join(Work->Thread, NULL);
+    PoolFree(Work, KERNEL_WORK_TAG);
+}
+
+NTSTATUS
+KernelInitialize(
+    IN  PFAKE_GNTTAB    Gnttab
+    )
+{
+    NTSTATUS            status;
+
+    pthread_mutex_lock(&Kernel.Lock);
+
+    if (Kernel.References++ != 0) {
+        status = (Kernel.Gnttab == Gnttab) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+        if (!NT_SUCCESS(status))
+            --Kernel.References;
+
+        pthread_mutex_unlock(&Kernel.Lock);
+        return status;
+    }
+
+    Kernel.Gnttab = Gnttab;
+    Kernel.Stopping = FALSE;
+    Kernel.Verbose = (getenv("XENVKBD_VERBOSE") != NULL) ? TRUE : FALSE;
+
+    __KernelInitializeCondition(&Kernel.EventCondition);
+    __KernelInitializeCondition(&Kernel.DpcCondition);
+    __KernelInitializeCondition(&Kernel.DpcDone);
+    __KernelInitializeCondition(&Kernel.TimerCondition);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (pthread_create(&Kernel.DpcThread, NULL, KernelDpcThread, NULL) != 0)
+        goto fail1;
+
+    if (pthread_create(&Kernel.TimerThread, NULL, KernelTimerThread, NULL) != 0)
+        goto fail2;
+
+    pthread_mutex_unlock(&Kernel.Lock);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    pthread_mutex_lock(&Kernel.DpcLock);
+    Kernel.Stopping = TRUE;
+    pthread_cond_signal(&Kernel.DpcCondition);
+    pthread_mutex_unlock(&Kernel.DpcLock);
+
+    pthread_join(Kernel.DpcThread, NULL);
+
+fail1:
+    Kernel.Gnttab = NULL;
+    --Kernel.References;
+
+    pthread_mutex_unlock(&Kernel.Lock);
+
+    return status;
+}
+
+VOID
+KernelTeardown(
+    VOID
+    )
+{
+    pthread_mutex_lock(&Kernel.Lock);
+
+    if (--Kernel.References != 0) {
+        pthread_mutex_unlock(&Kernel.Lock);
+        return;
+    }
+
+    // Anything still queued refers to something that has been freed
+    if (Kernel.DpcHead != NULL || Kernel.TimerList != NULL)
+        KeBugCheckEx(ASSERTION_FAILURE, 0, (ULONG_PTR)Kernel.DpcHead,
+                     (ULONG_PTR)Kernel.TimerList, 0);
+
+    pthread_mutex_lock(&Kernel.DpcLock);
+    Kernel.Stopping = TRUE;
+    pthread_cond_signal(&Kernel.DpcCondition);
+    pthread_mutex_unlock(&Kernel.DpcLock);
+
+    pthread_mutex_lock(&Kernel.TimerLock);
+    pthread_cond_signal(&Kernel.TimerCondition);
+    pthread_mutex_unlock(&Kernel.TimerLock);
+
+    pthread_join(Kernel.DpcThread, NULL);
+    pthread_join(Kernel.TimerThread, NULL);
+
+    pthread_cond_destroy(&Kernel.TimerCondition);
+    pthread_cond_destroy(&Kernel.DpcDone);
+    pthread_cond_destroy(&Kernel.DpcCondition);
+    pthread_cond_destroy(&Kernel.EventCondition);
+
+    Kernel.Gnttab = NULL;
+
+    pthread_mutex_unlock(&Kernel.Lock);
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_KERNEL_H
+#define _XENVKBD_TEST_KERNEL_H
+
+#include <ntddk.h>
+
+#include "fake.h"
+
+// The run-time half of the kernel shim (see kernel/ntddk.h): IRQL, spin
+// locks, events, DPCs, timers, pool, pages and the driver's work items, on
+// top of pthreads. Pages come from the fake grant table, so that they can
+// be granted to a backend in the same process.
+
+// The first call starts the DPC and timer threads; every call must name
+// the same grant table
+extern NTSTATUS
+KernelInitialize(
+    IN  PFAKE_GNTTAB    Gnttab
+    );
+
+extern VOID
+KernelTeardown(
+    VOID
+    );
+
+// The most recent live allocation made with Tag, as a debugger's pool
+// search would find it, or NULL
+extern PVOID
+KernelFindPool(
+    IN  ULONG   Tag,
+    OUT PSIZE_T Length OPTIONAL
+    );
+
+// Live allocations, of any tag
+extern ULONG
+KernelGetPoolCount(
+    VOID
+    );
+
+#endif  // _XENVKBD_TEST_KERNEL_H
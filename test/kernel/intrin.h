@@ -0,0 +1,66 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_INTRIN_H
+#define _XENVKBD_TEST_INTRIN_H
+
+#include <ntddk.h>
+
+static FORCEINLINE BOOLEAN
+_BitScanReverse(
+    OUT PULONG  Index,
+    IN  ULONG   Mask
+    )
+{
+    if (Mask == 0)
+        return FALSE;
+
+    *Index = 31 - __builtin_clz(Mask);
+    return TRUE;
+}
+
+static FORCEINLINE VOID
+__cpuid(
+    OUT int     Info[4],
+    IN  int     Leaf
+    )
+{
+    __asm__ __volatile__("cpuid"
+                         : "=a" (Info[0]), "=b" (Info[1]),
+                           "=c" (Info[2]), "=d" (Info[3])
+                         : "a" (Leaf), "c" (0));
+}
+
+#define _mm_pause() __builtin_ia32_pause()
+
+#endif  // _XENVKBD_TEST_INTRIN_H
@@ -0,0 +1,711 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+// Just enough of the WDK for the frontend, ring and HID code to build on
+// Linux against the XENBUS fakes (see ../kernel.c and ../xenbus.c). The
+// integer types agree with the user-space definitions in translate.h so
+// that code built either way can be linked together.
+
+#ifndef _XENVKBD_TEST_NTDDK_H
+#define _XENVKBD_TEST_NTDDK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <wchar.h>
+
+// util.h has its own (static) __strtok_r()
+#define __strtok_r  __xenvkbd_strtok_r
+
+typedef void            VOID, *PVOID;
+typedef char            CHAR, *PCHAR;
+typedef uint8_t         UCHAR, *PUCHAR;
+typedef int16_t         SHORT, *PSHORT;
+typedef uint16_t        USHORT, *PUSHORT;
+typedef int32_t         LONG, *PLONG;
+typedef uint32_t        ULONG, *PULONG;
+typedef int64_t         LONG64, LONGLONG, *PLONGLONG;
+typedef uint64_t        ULONG64, ULONGLONG, *PULONGLONG;
+typedef uint8_t         BOOLEAN, *PBOOLEAN;
+typedef wchar_t         WCHAR, *PWCHAR;
+typedef intptr_t        LONG_PTR;
+typedef uintptr_t       ULONG_PTR;
+typedef size_t          SIZE_T, *PSIZE_T;
+typedef LONG            NTSTATUS;
+typedef UCHAR           KIRQL, *PKIRQL;
+typedef ULONG_PTR       PFN_NUMBER, *PPFN_NUMBER;
+typedef PVOID           HANDLE, *PHANDLE;
+typedef ULONG           ACCESS_MASK;
+
+#define TRUE            1
+#define FALSE           0
+
+#define MAXUCHAR        0xff
+#define MAXUSHORT       0xffff
+#define MAXULONG        0xffffffff
+
+#define IN
+#define OUT
+#define OPTIONAL
+
+#define FORCEINLINE         inline
+#define DECLSPEC_NOINLINE   __attribute__((noinline))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+
+// Annotations
+#define __checkReturn
+#define __analysis_assume(_Expression)
+#define __annotation(...)   ((VOID)0)
+#define __drv_maxIRQL(_Irql)
+#define __drv_minIRQL(_Irql)
+#define __drv_requiresIRQL(_Irql)
+#define __drv_raisesIRQL(_Irql)
+#define __drv_setsIRQL(_Irql)
+#define __drv_savesIRQL
+#define __drv_restoresIRQL
+#define __drv_sameIRQL
+#define __drv_dispatchType(_Type)
+#define __drv_functionClass(_Class)
+#define _IRQL_requires_(_Irql)
+#define _IRQL_requires_max_(_Irql)
+#define _Function_class_(_Class)
+#define _Use_decl_annotations_
+
+// MSVC's __FUNCTION__ is a string literal that the logging macros in
+// dbg_print.h paste into their prefix; GCC's is not
+#undef  __FUNCTION__
+#define __FUNCTION__    ""
+
+#define UNREFERENCED_PARAMETER(_Parameter)  ((VOID)(_Parameter))
+
+#define ARRAYSIZE(_A)           (sizeof (_A) / sizeof ((_A)[0]))
+#define FIELD_OFFSET(_T, _F)    offsetof(_T, _F)
+#define RTL_FIELD_SIZE(_T, _F)  (sizeof (((_T *)0)->_F))
+#define CONTAINING_RECORD(_Address, _T, _F) \
+        ((_T *)((PUCHAR)(_Address) - FIELD_OFFSET(_T, _F)))
+#define C_ASSERT(_E)            _Static_assert((_E), #_E)
+
+#define __min(_A, _B)   (((_A) < (_B)) ? (_A) : (_B))
+#define __max(_A, _B)   (((_A) > (_B)) ? (_A) : (_B))
+
+#define RtlZeroMemory(_D, _L)       memset((PVOID)(_D), 0, (_L))
+#define RtlFillMemory(_D, _L, _F)   memset((_D), (_F), (_L))
+#define RtlCopyMemory(_D, _S, _L)   memcpy((_D), (_S), (_L))
+#define RtlMoveMemory(_D, _S, _L)   memmove((_D), (_S), (_L))
+#define RtlEqualMemory(_A, _B, _L)  (memcmp((_A), (_B), (_L)) == 0)
+
+#define KeMemoryBarrier()   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define NT_SUCCESS(_Status) ((NTSTATUS)(_Status) >= 0)
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                  ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                  ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_MEMORY                ((NTSTATUS)0xC0000017L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034L)
+#define STATUS_DEVICE_NOT_READY         ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_RETRY                    ((NTSTATUS)0xC000022DL)
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG   LowPart;
+        LONG    HighPart;
+    };
+    LONGLONG    QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+
+typedef struct _ANSI_STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PCHAR   Buffer;
+} ANSI_STRING, *PANSI_STRING;
+
+typedef struct _UNICODE_STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PWCHAR  Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY  *Flink;
+    struct _LIST_ENTRY  *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _GUID {
+    ULONG   Data1;
+    USHORT  Data2;
+    USHORT  Data3;
+    UCHAR   Data4[8];
+} GUID;
+
+#define DEFINE_GUID(_Name, _L, _W1, _W2, _B1, _B2, _B3, _B4, _B5, _B6, _B7, _B8) \
+        static const GUID _Name __attribute__((unused)) =                         \
+            { _L, _W1, _W2, { _B1, _B2, _B3, _B4, _B5, _B6, _B7, _B8 } }
+
+typedef VOID (*PINTERFACE_REFERENCE)(PVOID);
+typedef VOID (*PINTERFACE_DEREFERENCE)(PVOID);
+
+typedef struct _INTERFACE {
+    USHORT                  Size;
+    USHORT                  Version;
+    PVOID                   Context;
+    PINTERFACE_REFERENCE    InterfaceReference;
+    PINTERFACE_DEREFERENCE  InterfaceDereference;
+} INTERFACE, *PINTERFACE;
+
+// Objects that are only ever handled by pointer
+typedef struct _DEVICE_OBJECT       DEVICE_OBJECT, *PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT       DRIVER_OBJECT, *PDRIVER_OBJECT;
+typedef struct _IRP                 IRP, *PIRP;
+typedef struct _DMA_ADAPTER         DMA_ADAPTER, *PDMA_ADAPTER;
+typedef struct _DEVICE_DESCRIPTION  DEVICE_DESCRIPTION, *PDEVICE_DESCRIPTION;
+typedef struct _KINTERRUPT          KINTERRUPT, *PKINTERRUPT;
+typedef struct _KTHREAD             KTHREAD, *PKTHREAD;
+
+typedef BOOLEAN
+KSERVICE_ROUTINE(
+    IN  PKINTERRUPT Interrupt,
+    IN  PVOID       ServiceContext
+    );
+
+typedef KSERVICE_ROUTINE    *PKSERVICE_ROUTINE;
+
+// Only for the names in names.h
+typedef enum _POWER_ACTION {
+    PowerActionNone = 0,
+    PowerActionReserved,
+    PowerActionSleep,
+    PowerActionHibernate,
+    PowerActionShutdown,
+    PowerActionShutdownReset,
+    PowerActionShutdownOff,
+    PowerActionWarmEject
+} POWER_ACTION;
+
+#define IRP_MN_WAIT_WAKE                    0x00
+#define IRP_MN_POWER_SEQUENCE               0x01
+#define IRP_MN_SET_POWER                    0x02
+#define IRP_MN_QUERY_POWER                  0x03
+
+#define IRP_MN_START_DEVICE                 0x00
+#define IRP_MN_QUERY_REMOVE_DEVICE          0x01
+#define IRP_MN_REMOVE_DEVICE                0x02
+#define IRP_MN_CANCEL_REMOVE_DEVICE         0x03
+#define IRP_MN_STOP_DEVICE                  0x04
+#define IRP_MN_QUERY_STOP_DEVICE            0x05
+#define IRP_MN_CANCEL_STOP_DEVICE           0x06
+#define IRP_MN_QUERY_DEVICE_RELATIONS       0x07
+#define IRP_MN_QUERY_INTERFACE              0x08
+#define IRP_MN_QUERY_CAPABILITIES           0x09
+#define IRP_MN_QUERY_RESOURCES              0x0A
+#define IRP_MN_QUERY_RESOURCE_REQUIREMENTS  0x0B
+#define IRP_MN_QUERY_DEVICE_TEXT            0x0C
+#define IRP_MN_FILTER_RESOURCE_REQUIREMENTS 0x0D
+#define IRP_MN_READ_CONFIG                  0x0F
+#define IRP_MN_WRITE_CONFIG                 0x10
+#define IRP_MN_EJECT                        0x11
+#define IRP_MN_SET_LOCK                     0x12
+#define IRP_MN_QUERY_ID                     0x13
+#define IRP_MN_QUERY_PNP_DEVICE_STATE       0x14
+#define IRP_MN_QUERY_BUS_INFORMATION        0x15
+#define IRP_MN_DEVICE_USAGE_NOTIFICATION    0x16
+#define IRP_MN_SURPRISE_REMOVAL             0x17
+#define IRP_MN_QUERY_LEGACY_BUS_INFORMATION 0x18
+
+#define CmResourceTypeNull              0
+#define CmResourceTypePort              1
+#define CmResourceTypeInterrupt         2
+#define CmResourceTypeMemory            3
+#define CmResourceTypeDma               4
+#define CmResourceTypeDeviceSpecific    5
+#define CmResourceTypeBusNumber         6
+#define CmResourceTypeMemoryLarge       7
+#define CmResourceTypeConfigData        128
+#define CmResourceTypeDevicePrivate     129
+
+typedef enum _DEVICE_USAGE_NOTIFICATION_TYPE {
+    DeviceUsageTypeUndefined,
+    DeviceUsageTypePaging,
+    DeviceUsageTypeHibernation,
+    DeviceUsageTypeDumpFile
+} DEVICE_USAGE_NOTIFICATION_TYPE;
+
+typedef enum _INTERFACE_TYPE {
+    InterfaceTypeUndefined = -1,
+    Internal,
+    Isa,
+    Eisa,
+    MicroChannel,
+    TurboChannel,
+    PCIBus,
+    VMEBus,
+    NuBus,
+    PCMCIABus,
+    CBus,
+    MPIBus,
+    MPSABus,
+    ProcessorInternal,
+    InternalPowerBus,
+    PNPISABus,
+    PNPBus,
+    Vmcs,
+    ACPIBus,
+    MaximumInterfaceType
+} INTERFACE_TYPE;
+
+typedef enum _DMA_WIDTH {
+    Width8Bits,
+    Width16Bits,
+    Width32Bits,
+    Width64Bits,
+    WidthNoWrap,
+    MaximumDmaWidth
+} DMA_WIDTH;
+
+typedef enum _DMA_SPEED {
+    Compatible,
+    TypeA,
+    TypeB,
+    TypeC,
+    TypeF,
+    MaximumDmaSpeed
+} DMA_SPEED;
+
+typedef enum _POWER_STATE_TYPE {
+    SystemPowerState = 0,
+    DevicePowerState
+} POWER_STATE_TYPE;
+
+typedef enum _SYSTEM_POWER_STATE {
+    PowerSystemUnspecified = 0,
+    PowerSystemWorking,
+    PowerSystemSleeping1,
+    PowerSystemSleeping2,
+    PowerSystemSleeping3,
+    PowerSystemHibernate,
+    PowerSystemShutdown,
+    PowerSystemMaximum
+} SYSTEM_POWER_STATE;
+
+typedef enum _DEVICE_POWER_STATE {
+    PowerDeviceUnspecified = 0,
+    PowerDeviceD0,
+    PowerDeviceD1,
+    PowerDeviceD2,
+    PowerDeviceD3,
+    PowerDeviceMaximum
+} DEVICE_POWER_STATE;
+
+// IRQL. Each thread has its own; raising it to DISPATCH_LEVEL only serves
+// to check the assertions the code makes about where it is called from.
+#define PASSIVE_LEVEL   0
+#define APC_LEVEL       1
+#define DISPATCH_LEVEL  2
+#define HIGH_LEVEL      15
+
+extern KIRQL
+KeGetCurrentIrql(
+    VOID
+    );
+
+extern VOID
+KeRaiseIrql(
+    IN  KIRQL   NewIrql,
+    OUT PKIRQL  OldIrql
+    );
+
+extern VOID
+KeLowerIrql(
+    IN  KIRQL   NewIrql
+    );
+
+extern PKTHREAD
+KeGetCurrentThread(
+    VOID
+    );
+
+typedef volatile ULONG_PTR  KSPIN_LOCK, *PKSPIN_LOCK;
+
+extern VOID
+KeInitializeSpinLock(
+    OUT PKSPIN_LOCK Lock
+    );
+
+extern VOID
+KeAcquireSpinLockAtDpcLevel(
+    IN  PKSPIN_LOCK Lock
+    );
+
+extern VOID
+KeReleaseSpinLockFromDpcLevel(
+    IN  PKSPIN_LOCK Lock
+    );
+
+#define KeAcquireSpinLock(_Lock, _OldIrql)          \
+        do {                                        \
+            KeRaiseIrql(DISPATCH_LEVEL, (_OldIrql)); \
+            KeAcquireSpinLockAtDpcLevel(_Lock);     \
+        } while (FALSE)
+
+#define KeReleaseSpinLock(_Lock, _NewIrql)          \
+        do {                                        \
+            KeReleaseSpinLockFromDpcLevel(_Lock);   \
+            KeLowerIrql(_NewIrql);                  \
+        } while (FALSE)
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef struct _KEVENT {
+    EVENT_TYPE      Type;
+    volatile LONG   State;
+} KEVENT, *PKEVENT;
+
+#define IO_NO_INCREMENT 0
+
+typedef enum _KWAIT_REASON {
+    Executive
+} KWAIT_REASON;
+
+typedef enum _KPROCESSOR_MODE {
+    KernelMode
+} KPROCESSOR_MODE;
+
+extern VOID
+KeInitializeEvent(
+    OUT PKEVENT     Event,
+    IN  EVENT_TYPE  Type,
+    IN  BOOLEAN     State
+    );
+
+extern LONG
+KeSetEvent(
+    IN  PKEVENT Event,
+    IN  LONG    Increment,
+    IN  BOOLEAN Wait
+    );
+
+extern VOID
+KeClearEvent(
+    IN  PKEVENT Event
+    );
+
+extern LONG
+KeReadStateEvent(
+    IN  PKEVENT Event
+    );
+
+// Only events can be waited upon. A zero timeout polls, which is all that
+// is allowed at DISPATCH_LEVEL.
+extern NTSTATUS
+KeWaitForSingleObject(
+    IN  PVOID           Object,
+    IN  KWAIT_REASON    WaitReason,
+    IN  KPROCESSOR_MODE WaitMode,
+    IN  BOOLEAN         Alertable,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    );
+
+typedef struct _KDPC KDPC, *PKDPC;
+
+typedef VOID
+KDEFERRED_ROUTINE(
+    IN  PKDPC   Dpc,
+    IN  PVOID   DeferredContext OPTIONAL,
+    IN  PVOID   SystemArgument1 OPTIONAL,
+    IN  PVOID   SystemArgument2 OPTIONAL
+    );
+
+typedef KDEFERRED_ROUTINE   *PKDEFERRED_ROUTINE;
+
+// DPCs are run in the order they were queued by a single thread at
+// DISPATCH_LEVEL (i.e. a uniprocessor guest)
+struct _KDPC {
+    PKDEFERRED_ROUTINE  DeferredRoutine;
+    PVOID               DeferredContext;
+    PVOID               SystemArgument1;
+    PVOID               SystemArgument2;
+    BOOLEAN             Inserted;
+    PKDPC               Next;
+};
+
+extern VOID
+KeInitializeDpc(
+    OUT PKDPC               Dpc,
+    IN  PKDEFERRED_ROUTINE  DeferredRoutine,
+    IN  PVOID               DeferredContext OPTIONAL
+    );
+
+extern BOOLEAN
+KeInsertQueueDpc(
+    IN  PKDPC   Dpc,
+    IN  PVOID   SystemArgument1 OPTIONAL,
+    IN  PVOID   SystemArgument2 OPTIONAL
+    );
+
+extern VOID
+KeFlushQueuedDpcs(
+    VOID
+    );
+
+typedef struct _KTIMER KTIMER, *PKTIMER;
+
+struct _KTIMER {
+    ULONGLONG   DueTime;    // CLOCK_MONOTONIC, in ns
+    PKDPC       Dpc;
+    BOOLEAN     Inserted;
+    PKTIMER     Next;
+};
+
+extern VOID
+KeInitializeTimer(
+    OUT PKTIMER Timer
+    );
+
+// Only relative due times (i.e. negative values) are supported
+extern BOOLEAN
+KeSetTimer(
+    IN  PKTIMER         Timer,
+    IN  LARGE_INTEGER   DueTime,
+    IN  PKDPC           Dpc OPTIONAL
+    );
+
+extern BOOLEAN
+KeCancelTimer(
+    IN  PKTIMER Timer
+    );
+
+extern VOID
+KeQuerySystemTime(
+    OUT PLARGE_INTEGER  CurrentTime
+    );
+
+extern LARGE_INTEGER
+KeQueryPerformanceCounter(
+    OUT PLARGE_INTEGER  PerformanceFrequency OPTIONAL
+    );
+
+extern VOID
+KeStallExecutionProcessor(
+    IN  ULONG   MicroSeconds
+    );
+
+extern VOID
+KeBugCheckEx(
+    IN  ULONG       BugCheckCode,
+    IN  ULONG_PTR   BugCheckParameter1,
+    IN  ULONG_PTR   BugCheckParameter2,
+    IN  ULONG_PTR   BugCheckParameter3,
+    IN  ULONG_PTR   BugCheckParameter4
+    ) __attribute__((noreturn));
+
+#define DbgRaiseAssertionFailure()  KeBugCheckEx(0, 0, 0, 0, 0)
+
+static FORCEINLINE LONG
+InterlockedIncrement(
+    IN  volatile LONG   *Addend
+    )
+{
+    return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONG
+InterlockedDecrement(
+    IN  volatile LONG   *Addend
+    )
+{
+    return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONG
+InterlockedExchange(
+    IN  volatile LONG   *Target,
+    IN  LONG            Value
+    )
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONG
+InterlockedCompareExchange(
+    IN  volatile LONG   *Destination,
+    IN  LONG            Exchange,
+    IN  LONG            Comperand
+    )
+{
+    (VOID) __atomic_compare_exchange_n(Destination, &Comperand, Exchange,
+                                       FALSE, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+static FORCEINLINE LONG64
+InterlockedCompareExchange64(
+    IN  volatile LONG64 *Destination,
+    IN  LONG64          Exchange,
+    IN  LONG64          Comperand
+    )
+{
+    (VOID) __atomic_compare_exchange_n(Destination, &Comperand, Exchange,
+                                       FALSE, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+// Pool
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool
+} POOL_TYPE;
+
+extern PVOID
+ExAllocatePoolWithTag(
+    IN  POOL_TYPE   PoolType,
+    IN  SIZE_T      NumberOfBytes,
+    IN  ULONG       Tag
+    );
+
+extern VOID
+ExFreePoolWithTag(
+    IN  PVOID   Buffer,
+    IN  ULONG   Tag
+    );
+
+#define ExFreePool(_Buffer) ExFreePoolWithTag((_Buffer), 0)
+
+// Pages. The PFNs are those of the fake grant table's memory (see
+// FakeGnttabAllocatePages()), so that they can be granted to the backend.
+#define PAGE_SHIFT  12
+#define PAGE_SIZE   (1ul << PAGE_SHIFT)
+
+#define PAGE_ALIGN(_Va) ((PVOID)((ULONG_PTR)(_Va) & ~(PAGE_SIZE - 1)))
+
+#define ADDRESS_AND_SIZE_TO_SPAN_PAGES(_Va, _Size)                      \
+        ((ULONG)((((ULONG_PTR)(_Va) & (PAGE_SIZE - 1)) + (_Size) +      \
+                  (PAGE_SIZE - 1)) >> PAGE_SHIFT))
+
+typedef struct _MDL {
+    struct _MDL *Next;
+    SHORT       Size;
+    SHORT       MdlFlags;
+    PVOID       MappedSystemVa;
+    PVOID       StartVa;
+    ULONG       ByteCount;
+    ULONG       ByteOffset;
+} MDL, *PMDL;
+
+#define MDL_MAPPED_TO_SYSTEM_VA     0x0001
+#define MDL_PAGES_LOCKED            0x0002
+#define MDL_SOURCE_IS_NONPAGED_POOL 0x0004
+#define MDL_PARTIAL                 0x0010
+#define MDL_PARTIAL_HAS_BEEN_MAPPED 0x0020
+#define MDL_PARENT_MAPPED_SYSTEM_VA 0x0100
+#define MDL_IO_SPACE                0x0800
+
+#define MmGetMdlPfnArray(_Mdl)  ((PPFN_NUMBER)((_Mdl) + 1))
+
+#define MmSizeOfMdl(_Base, _Length)                                         \
+        ((SIZE_T)(sizeof (MDL) +                                            \
+                  (ADDRESS_AND_SIZE_TO_SPAN_PAGES((_Base), (_Length)) *     \
+                   sizeof (PFN_NUMBER))))
+
+typedef enum _MEMORY_CACHING_TYPE {
+    MmNonCached,
+    MmCached
+} MEMORY_CACHING_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MM_ALLOCATE_FULLY_REQUIRED  0x00000004
+
+extern PMDL
+MmAllocatePagesForMdlEx(
+    IN  PHYSICAL_ADDRESS    LowAddress,
+    IN  PHYSICAL_ADDRESS    HighAddress,
+    IN  PHYSICAL_ADDRESS    SkipBytes,
+    IN  SIZE_T              TotalBytes,
+    IN  MEMORY_CACHING_TYPE CacheType,
+    IN  ULONG               Flags
+    );
+
+extern PVOID
+MmMapLockedPagesSpecifyCache(
+    IN  PMDL                Mdl,
+    IN  KPROCESSOR_MODE     AccessMode,
+    IN  MEMORY_CACHING_TYPE CacheType,
+    IN  PVOID               RequestedAddress OPTIONAL,
+    IN  ULONG               BugCheckOnFailure,
+    IN  ULONG               Priority
+    );
+
+extern VOID
+MmUnmapLockedPages(
+    IN  PVOID   BaseAddress,
+    IN  PMDL    Mdl
+    );
+
+extern VOID
+MmFreePagesFromMdl(
+    IN  PMDL    Mdl
+    );
+
+// Debug output
+#define DPFLTR_IHVDRIVER_ID 77
+
+#define DPFLTR_ERROR_LEVEL      0
+#define DPFLTR_WARNING_LEVEL    1
+#define DPFLTR_TRACE_LEVEL      2
+#define DPFLTR_INFO_LEVEL       3
+
+extern ULONG
+vDbgPrintExWithPrefix(
+    IN  const CHAR  *Prefix,
+    IN  ULONG       ComponentId,
+    IN  ULONG       Level,
+    IN  const CHAR  *Format,
+    IN  va_list     Arguments
+    );
+
+#endif  // _XENVKBD_TEST_NTDDK_H
@@ -0,0 +1,80 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_NTSTRSAFE_H
+#define _XENVKBD_TEST_NTSTRSAFE_H
+
+#include <ntddk.h>
+#include <stdio.h>
+
+static FORCEINLINE NTSTATUS
+RtlStringCbVPrintfA(
+    OUT PCHAR       Destination,
+    IN  SIZE_T      Size,
+    IN  const CHAR  *Format,
+    IN  va_list     Arguments
+    )
+{
+    int             Length;
+
+    if (Size == 0)
+        return STATUS_INVALID_PARAMETER;
+
+    Length = vsnprintf(Destination, Size, Format, Arguments);
+    if (Length < 0) {
+        Destination[0] = '\0';
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return ((SIZE_T)Length < Size) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+static FORCEINLINE NTSTATUS
+RtlStringCbPrintfA(
+    OUT PCHAR       Destination,
+    IN  SIZE_T      Size,
+    IN  const CHAR  *Format,
+    ...
+    )
+{
+    va_list         Arguments;
+    NTSTATUS        status;
+
+    va_start(Arguments, Format);
+    status = RtlStringCbVPrintfA(Destination, Size, Format, Arguments);
+    va_end(Arguments);
+
+    return status;
+}
+
+#endif  // _XENVKBD_TEST_NTSTRSAFE_H
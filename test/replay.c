@@ -0,0 +1,673 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+// Replays a capture (see src/xenvkbd/capture.h) through the translation
+// engine and checks that the HID reports the driver sent can all be
+// reproduced, in order. The input may be a raw capture buffer or anything
+// containing one, such as a crash dump: the first valid header found is
+// used.
+//
+// The driver may merge pointer reports (COALESCE) or drop repeats (DEDUP),
+// so each captured report need only match some later replayed report.
+//
+// With --seed the replayed passes are also written out as an input for
+// the fuzzer (fuzz.c), which is how test/corpus was made.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "translate.h"
+#include "capture.h"
+#include "fuzz.h"
+
+// Largest capture accepted; the driver keeps at most
+// XENVKBD_CAPTURE_MAXIMUM records but the tools may keep more
+#define REPLAY_MAXIMUM_RECORDS  (1u << 24)
+
+// A report reduced to its fields, so that padding never compares
+typedef struct _REPLAY_REPORT {
+    UCHAR   Data[8];
+    ULONG   Index;
+} REPLAY_REPORT, *PREPLAY_REPORT;
+
+typedef struct _REPLAY_REPORTS {
+    PREPLAY_REPORT  Report;
+    ULONG64         Count;
+    ULONG64         Size;
+} REPLAY_REPORTS, *PREPLAY_REPORTS;
+
+typedef struct _REPLAY {
+    BOOLEAN                 Realtime;
+    BOOLEAN                 Verbose;
+    FILE                    *Seed;      // Input for fuzz.c
+
+    PXENVKBD_CAPTURE        Capture;
+    XENVKBD_TRANSLATE       Translate;
+    struct xenkbd_page      Shared;
+    union xenkbd_in_event   *Slots;
+    union xenkbd_in_event   *Snapshot;
+    ULONG                   Length;
+    BOOLEAN                 Started;    // Cons is known
+    ULONG                   Cons;       // Next slot to replay
+
+    // The pass being assembled
+    BOOLEAN                 Pass;
+    ULONG                   PassCons;
+    ULONG                   PassProd;
+    ULONG64                 PassTimeUs;
+
+    REPLAY_REPORTS          Captured;
+    REPLAY_REPORTS          Replayed;
+
+    ULONG64                 Connects;
+    ULONG64                 Passes;
+    ULONG64                 Events;
+    ULONG64                 Overruns;
+    ULONG64                 Skipped;
+    ULONG64                 Torn;
+} REPLAY, *PREPLAY;
+
+static ULONG64
+ReplayGetTimeUs(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return ((ULONG64)Now.tv_sec * 1000000ull) +
+           ((ULONG64)Now.tv_nsec / 1000ull);
+}
+
+static VOID
+ReplayAddReport(
+    IN  PREPLAY_REPORTS Reports,
+    IN  const VOID      *Report,
+    IN  ULONG           Index
+    )
+{
+    PREPLAY_REPORT      Entry;
+    UCHAR               Id = *(const UCHAR *)Report;
+
+    if (Reports->Count == Reports->Size) {
+        Reports->Size = __max(Reports->Size * 2, 1024);
+        Reports->Report = realloc(Reports->Report,
+                                  Reports->Size * sizeof (REPLAY_REPORT));
+        if (Reports->Report == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    Entry = &Reports->Report[Reports->Count++];
+    memset(Entry, 0, sizeof (*Entry));
+    Entry->Index = Index;
+
+    if (Id == 2) {
+        XENVKBD_HID_ABSMOUSE    AbsMouse;
+
+        memcpy(&AbsMouse, Report, sizeof (AbsMouse));
+
+        Entry->Data[0] = AbsMouse.ReportId;
+        Entry->Data[1] = AbsMouse.Buttons;
+        memcpy(&Entry->Data[2], &AbsMouse.X, sizeof (USHORT));
+        memcpy(&Entry->Data[4], &AbsMouse.Y, sizeof (USHORT));
+        Entry->Data[6] = (UCHAR)AbsMouse.dZ;
+    } else {
+        memcpy(Entry->Data, Report, sizeof (XENVKBD_HID_KEYBOARD));
+    }
+}
+
+static VOID
+ReplayCallback(
+    IN  PVOID                       Context,
+    IN  ULONG                       Index,
+    IN  const union xenkbd_in_event *Event,
+    IN  XENVKBD_TRANSLATE_RESULT    Result
+    )
+{
+    PREPLAY                         Replay = Context;
+
+    (void)Event;
+
+    switch (Result) {
+    case TRANSLATE_RESULT_KEYBOARD:
+        ReplayAddReport(&Replay->Replayed, &Replay->Translate.Keyboard, Index);
+        break;
+    case TRANSLATE_RESULT_BUTTONS:
+    case TRANSLATE_RESULT_POINTER:
+        ReplayAddReport(&Replay->Replayed, &Replay->Translate.AbsMouse, Index);
+        break;
+    default:
+        break;
+    }
+}
+
+static VOID
+ReplaySleepUntilUs(
+    IN  ULONG64     Us
+    )
+{
+    struct timespec Due;
+
+    Due.tv_sec = (time_t)(Us / 1000000ull);
+    Due.tv_nsec = (long)((Us % 1000000ull) * 1000ull);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Due, NULL) == EINTR)
+        ;
+}
+
+// Writes the pass as a hostile backend would have produced it: the slots,
+// then a run
+static VOID
+ReplaySeedPass(
+    IN  PREPLAY Replay
+    )
+{
+    ULONG       Index;
+
+    for (Index = Replay->Cons; Index != Replay->PassProd; Index++) {
+        fputc(FUZZ_OP_PUT, Replay->Seed);
+        fwrite(&Replay->Slots[Index % Replay->Length],
+               sizeof (union xenkbd_in_event), 1, Replay->Seed);
+    }
+
+    fputc(FUZZ_OP_RUN, Replay->Seed);
+    fputc(0, Replay->Seed);
+    fputc(0, Replay->Seed);
+}
+
+static VOID
+ReplaySeedConnect(
+    IN  PREPLAY                 Replay,
+    IN  PXENVKBD_CAPTURE_CONNECT Connect
+    )
+{
+    UCHAR                       Flags = 0;
+
+    // fuzz.c only knows a single ring per input
+    if (Replay->Connects != 1)
+        return;
+
+    if (Connect->Flags & XENVKBD_CAPTURE_KEY_BATCH)
+        Flags |= FUZZ_FLAG_KEY_BATCH;
+    if (Connect->Flags & XENVKBD_CAPTURE_TIMESTAMP)
+        Flags |= FUZZ_FLAG_TIMESTAMP;
+    if (Connect->Flags & XENVKBD_CAPTURE_EVENT_IDX)
+        Flags |= FUZZ_FLAG_EVENT_IDX;
+
+    switch (Replay->Length) {
+    case 64:
+        Flags |= 1 << FUZZ_LENGTH_SHIFT;
+        break;
+    case 128:
+        Flags |= 2 << FUZZ_LENGTH_SHIFT;
+        break;
+    case 256:
+        Flags |= 3 << FUZZ_LENGTH_SHIFT;
+        break;
+    default:
+        break;
+    }
+
+    fputc(Flags, Replay->Seed);
+}
+
+// Runs the assembled pass through the engine, as the DPC did
+static VOID
+ReplayPass(
+    IN  PREPLAY             Replay,
+    IN  ULONG64             StartUs
+    )
+{
+    XENVKBD_TRANSLATE_RING  Ring;
+
+    if (!Replay->Pass)
+        return;
+
+    Replay->Pass = FALSE;
+    Replay->Passes++;
+
+    if (Replay->Realtime)
+        ReplaySleepUntilUs(StartUs + Replay->PassTimeUs);
+
+    if (!Replay->Started) {
+        Replay->Started = TRUE;
+        Replay->Cons = Replay->PassCons;
+    } else if ((LONG)(Replay->PassCons - Replay->Cons) > 0) {
+        // The driver skipped to the newest slots and released everything
+        Replay->Overruns++;
+        TranslateRelease(&Replay->Translate);
+        ReplayAddReport(&Replay->Replayed, &Replay->Translate.Keyboard, Replay->PassCons);
+        ReplayAddReport(&Replay->Replayed, &Replay->Translate.AbsMouse, Replay->PassCons);
+        Replay->Cons = Replay->PassCons;
+    }
+
+    // Slots re-read after a hold have already been replayed
+    if ((LONG)(Replay->PassProd - Replay->Cons) <= 0)
+        return;
+
+    if (Replay->Seed != NULL)
+        ReplaySeedPass(Replay);
+
+    Replay->Shared.in_cons = Replay->Cons;
+    Replay->Shared.in_prod = Replay->PassProd;
+
+    Ring.Shared = &Replay->Shared;
+    Ring.Slots = Replay->Slots;
+    Ring.Length = Replay->Length;
+    Ring.EventIdx = FALSE;
+    Ring.Backpressure = FALSE;
+    Ring.Snapshot = Replay->Snapshot;
+    Ring.SnapshotLength = Replay->Length;
+    Ring.Applied = 0;
+    Ring.Rechecks = 0;
+
+    (VOID) TranslateRing(&Replay->Translate,
+                         &Ring,
+                         ~0u,
+                         NULL,
+                         ReplayCallback,
+                         NULL,
+                         Replay);
+
+    Replay->Cons += Ring.Applied;
+}
+
+static int
+ReplayConnect(
+    IN  PREPLAY                     Replay,
+    IN  PXENVKBD_CAPTURE_RECORD     Record
+    )
+{
+    XENVKBD_CAPTURE_CONNECT         Connect;
+
+    memcpy(&Connect, Record->Data, sizeof (Connect));
+
+    if (Record->Index == 0 || Record->Index > REPLAY_MAXIMUM_RECORDS) {
+        fprintf(stderr, "%u: bad ring length %u\n", Record->Sequence, Record->Index);
+        return EINVAL;
+    }
+
+    if (Record->Index != Replay->Length) {
+        free(Replay->Slots);
+        free(Replay->Snapshot);
+
+        Replay->Length = Record->Index;
+        Replay->Slots = calloc(Replay->Length, sizeof (union xenkbd_in_event));
+        Replay->Snapshot = calloc(Replay->Length, sizeof (union xenkbd_in_event));
+        if (Replay->Slots == NULL || Replay->Snapshot == NULL)
+            return ENOMEM;
+    }
+
+    TranslateReset(&Replay->Translate);
+    Replay->Translate.KeyBatch = (Connect.Flags & XENVKBD_CAPTURE_KEY_BATCH) ? TRUE : FALSE;
+    Replay->Translate.Timestamp = (Connect.Flags & XENVKBD_CAPTURE_TIMESTAMP) ? TRUE : FALSE;
+
+    Replay->Started = FALSE;
+    Replay->Connects++;
+
+    if (Replay->Seed != NULL)
+        ReplaySeedConnect(Replay, &Connect);
+
+    if (Replay->Verbose)
+        printf("%u: CONNECT %u slots flags %08x\n",
+               Record->Sequence, Record->Index, Connect.Flags);
+
+    return 0;
+}
+
+static int
+ReplayRun(
+    IN  PREPLAY                 Replay
+    )
+{
+    PXENVKBD_CAPTURE            Capture = Replay->Capture;
+    ULONG                       Sequence;
+    ULONG                       Count;
+    ULONG64                     StartUs;
+    int                         Error;
+
+    Count = __min(Capture->Sequence, Capture->Count);
+    Sequence = Capture->Sequence - Count;
+
+    StartUs = ReplayGetTimeUs();
+
+    for (; Count != 0; --Count, Sequence++) {
+        PXENVKBD_CAPTURE_RECORD Record;
+
+        Record = &Capture->Record[Sequence & (Capture->Count - 1)];
+
+        // The record at the write position may be torn
+        if (Record->Sequence != Sequence) {
+            Replay->Torn++;
+            continue;
+        }
+
+        switch (Record->Type) {
+        case CAPTURE_TYPE_CONNECT:
+            ReplayPass(Replay, StartUs);
+
+            Error = ReplayConnect(Replay, Record);
+            if (Error != 0)
+                return Error;
+            break;
+
+        case CAPTURE_TYPE_PASS:
+            ReplayPass(Replay, StartUs);
+
+            if (Replay->Length == 0) {
+                XENVKBD_CAPTURE_RECORD  Connect;
+
+                // No CONNECT in the capture, so assume a single page and
+                // no extensions
+                memset(&Connect, 0, sizeof (Connect));
+                Connect.Sequence = Record->Sequence;
+                Connect.Type = CAPTURE_TYPE_CONNECT;
+                Connect.Index = XENKBD_IN_RING_LEN;
+
+                Error = ReplayConnect(Replay, &Connect);
+                if (Error != 0)
+                    return Error;
+
+                fprintf(stderr, "no CONNECT record: state before the capture is unknown\n");
+            }
+
+            Replay->Pass = TRUE;
+            Replay->PassCons = Record->Index;
+            Replay->PassProd = Replay->PassCons;
+            Replay->PassTimeUs = Record->TimeUs;
+            break;
+
+        case CAPTURE_TYPE_EVENT:
+            if (!Replay->Pass ||
+                Record->Index - Replay->PassCons >= Replay->Length) {
+                Replay->Skipped++;
+                break;
+            }
+
+            memcpy(&Replay->Slots[Record->Index % Replay->Length],
+                   Record->Data,
+                   sizeof (union xenkbd_in_event));
+
+            if ((LONG)(Record->Index + 1 - Replay->PassProd) > 0)
+                Replay->PassProd = Record->Index + 1;
+
+            Replay->Events++;
+            break;
+
+        case CAPTURE_TYPE_REPORT:
+            ReplayAddReport(&Replay->Captured, Record->Data, Record->Index);
+            break;
+
+        default:
+            Replay->Skipped++;
+            break;
+        }
+    }
+
+    ReplayPass(Replay, StartUs);
+
+    return 0;
+}
+
+// Every captured report, with repeats of a report the driver had to resend
+// collapsed, must appear in order among the replayed reports
+static int
+ReplayCompare(
+    IN  PREPLAY     Replay
+    )
+{
+    PREPLAY_REPORTS Captured = &Replay->Captured;
+    PREPLAY_REPORTS Replayed = &Replay->Replayed;
+    ULONG64         Index;
+    ULONG64         Next;
+
+    Next = 0;
+
+    for (Index = 0; Index < Captured->Count; Index++) {
+        PREPLAY_REPORT  Report = &Captured->Report[Index];
+
+        if (Index != 0 &&
+            memcmp(Report->Data, Captured->Report[Index - 1].Data,
+                   sizeof (Report->Data)) == 0)
+            continue;
+
+        while (Next < Replayed->Count &&
+               memcmp(Report->Data, Replayed->Report[Next].Data,
+                      sizeof (Report->Data)) != 0)
+            Next++;
+
+        if (Next == Replayed->Count) {
+            ULONG   Byte;
+
+            fprintf(stderr, "captured report %llu (slot %u) was not reproduced:",
+                    (unsigned long long)Index, Report->Index);
+            for (Byte = 0; Byte < sizeof (Report->Data); Byte++)
+                fprintf(stderr, " %02x", Report->Data[Byte]);
+            fprintf(stderr, "\n");
+
+            return EPROTO;
+        }
+
+        Next++;
+    }
+
+    return 0;
+}
+
+static PXENVKBD_CAPTURE
+ReplayFind(
+    IN  PUCHAR  Buffer,
+    IN  size_t  Size
+    )
+{
+    size_t      Offset;
+
+    for (Offset = 0;
+         Offset + FIELD_OFFSET(XENVKBD_CAPTURE, Record) <= Size;
+         Offset += sizeof (ULONG)) {
+        PXENVKBD_CAPTURE    Capture = (PXENVKBD_CAPTURE)(Buffer + Offset);
+
+        if (Capture->Magic != XENVKBD_CAPTURE_MAGIC)
+            continue;
+
+        if (Capture->Version < 1 ||
+            Capture->Version > XENVKBD_CAPTURE_VERSION ||
+            Capture->RecordSize != sizeof (XENVKBD_CAPTURE_RECORD) ||
+            Capture->Count == 0 ||
+            Capture->Count > REPLAY_MAXIMUM_RECORDS ||
+            (Capture->Count & (Capture->Count - 1)) != 0 ||
+            XENVKBD_CAPTURE_SIZE((size_t)Capture->Count) > Size - Offset)
+            continue;
+
+        return Capture;
+    }
+
+    return NULL;
+}
+
+static PUCHAR
+ReplayLoad(
+    IN  const CHAR  *Path,
+    OUT size_t      *Size
+    )
+{
+    FILE            *File;
+    PUCHAR          Buffer;
+    long            Length;
+
+    File = fopen(Path, "rb");
+    if (File == NULL)
+        goto fail1;
+
+    if (fseek(File, 0, SEEK_END) != 0 ||
+        (Length = ftell(File)) < 0 ||
+        fseek(File, 0, SEEK_SET) != 0)
+        goto fail2;
+
+    // Aligned for the header and records
+    Buffer = aligned_alloc(sizeof (ULONG64),
+                           ((size_t)Length + sizeof (ULONG64)) & ~(sizeof (ULONG64) - 1));
+    if (Buffer == NULL)
+        goto fail3;
+
+    if (fread(Buffer, 1, (size_t)Length, File) != (size_t)Length)
+        goto fail4;
+
+    fclose(File);
+
+    *Size = (size_t)Length;
+    return Buffer;
+
+fail4:
+    free(Buffer);
+
+fail3:
+fail2:
+    fclose(File);
+
+fail1:
+    perror(Path);
+
+    return NULL;
+}
+
+static VOID
+ReplayUsage(
+    IN  const CHAR  *Name
+    )
+{
+    fprintf(stderr, "usage: %s [--realtime] [--verbose] [--seed FUZZ-INPUT] CAPTURE\n",
+            Name);
+    exit(2);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static const struct option  Options[] = {
+        { "realtime", no_argument, NULL, 'r' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "seed", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    REPLAY                      Replay;
+    PUCHAR                      Buffer;
+    size_t                      Size;
+    ULONG64                     Start;
+    ULONG64                     Elapsed;
+    int                         Option;
+    int                         Error;
+
+    memset(&Replay, 0, sizeof (Replay));
+
+    while ((Option = getopt_long(argc, argv, "", Options, NULL)) != -1) {
+        switch (Option) {
+        case 'r':
+            Replay.Realtime = TRUE;
+            break;
+        case 'v':
+            Replay.Verbose = TRUE;
+            break;
+        case 's':
+            Replay.Seed = fopen(optarg, "wb");
+            if (Replay.Seed == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            ReplayUsage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        ReplayUsage(argv[0]);
+
+    Buffer = ReplayLoad(argv[optind], &Size);
+    if (Buffer == NULL)
+        return 1;
+
+    Replay.Capture = ReplayFind(Buffer, Size);
+    if (Replay.Capture == NULL) {
+        fprintf(stderr, "%s: no capture found\n", argv[optind]);
+        return 1;
+    }
+
+    Start = ReplayGetTimeUs();
+    Error = ReplayRun(&Replay);
+    Elapsed = ReplayGetTimeUs() - Start;
+
+    if (Error == 0)
+        Error = ReplayCompare(&Replay);
+
+    printf("capture         version %u, %u of %u records\n",
+           Replay.Capture->Version,
+           __min(Replay.Capture->Sequence, Replay.Capture->Count),
+           Replay.Capture->Count);
+    printf("replayed        %llu connects, %llu passes, %llu events in %.3fms\n",
+           (unsigned long long)Replay.Connects,
+           (unsigned long long)Replay.Passes,
+           (unsigned long long)Replay.Events,
+           (double)Elapsed / 1e3);
+    printf("overruns        %llu\n", (unsigned long long)Replay.Overruns);
+    printf("skipped         %llu (torn %llu)\n",
+           (unsigned long long)Replay.Skipped,
+           (unsigned long long)Replay.Torn);
+    printf("reports         %llu captured, %llu replayed\n",
+           (unsigned long long)Replay.Captured.Count,
+           (unsigned long long)Replay.Replayed.Count);
+    printf("result          %s\n", (Error == 0) ? "match" : "MISMATCH");
+
+    if (Replay.Seed != NULL)
+        fclose(Replay.Seed);
+
+    free(Replay.Captured.Report);
+    free(Replay.Replayed.Report);
+    free(Replay.Slots);
+    free(Replay.Snapshot);
+    free(Buffer);
+
+    return (Error == 0) ? 0 : 1;
+}
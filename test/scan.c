@@ -0,0 +1,459 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+
+// Cost of one FdoScan() reconciliation: the device/vkbd listing is built
+// into a device set, the UnsupportedDevices list is filtered out of it,
+// every PDO is matched against it and the rest are counted as new, then
+// the set is compared with the previous scan's snapshot. The nested loops
+// FdoScan() used before the set are timed alongside, and both must agree.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "devset.h"
+
+typedef struct _SCAN {
+    ULONG   Devices;
+    PCHAR   Listing;        // This scan's device/vkbd, double NUL terminated
+    PCHAR   Previous;       // The last scan's
+    PCHAR   *Pdo;           // Names of the existing PDOs
+    ULONG   Pdos;
+    PCHAR   *Unsupported;
+    ULONG   Unsupporteds;
+} SCAN, *PSCAN;
+
+typedef struct _SCAN_RESULT {
+    ULONG   Claimed;
+    ULONG   Created;
+    ULONG   Added;
+    ULONG   Removed;
+} SCAN_RESULT, *PSCAN_RESULT;
+
+static ULONG64
+ScanGetTimeNs(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return (ULONG64)Now.tv_sec * 1000000000ull + (ULONG64)Now.tv_nsec;
+}
+
+static PCHAR
+ScanName(
+    IN  ULONG   Id
+    )
+{
+    CHAR        Name[16];
+    PCHAR       Copy;
+
+    snprintf(Name, sizeof (Name), "%u", Id);
+
+    Copy = strdup(Name);
+    if (Copy == NULL)
+        abort();
+
+    return Copy;
+}
+
+// The listing for devices First to First + Count - 1
+static PCHAR
+ScanListing(
+    IN  ULONG   First,
+    IN  ULONG   Count
+    )
+{
+    PCHAR       Listing;
+    PCHAR       Cursor;
+    ULONG       Index;
+
+    Listing = malloc((size_t)Count * 12 + 2);
+    if (Listing == NULL)
+        abort();
+
+    Cursor = Listing;
+    for (Index = 0; Index < Count; Index++)
+        Cursor += sprintf(Cursor, "%u", First + Index) + 1;
+
+    // An empty listing is still double NUL terminated
+    if (Count == 0)
+        *Cursor++ = '\0';
+    *Cursor = '\0';
+
+    return Listing;
+}
+
+// A sixteenth of the devices have gone since the last scan and as many
+// have appeared; the PDOs are those of the last scan, and one device in
+// eight is on the UnsupportedDevices list
+static VOID
+ScanCreate(
+    IN  ULONG   Devices,
+    OUT PSCAN   Scan
+    )
+{
+    ULONG       Churn = Devices / 16;
+    ULONG       Index;
+
+    Scan->Devices = Devices;
+    Scan->Listing = ScanListing(Churn, Devices);
+    Scan->Previous = ScanListing(0, Devices);
+
+    Scan->Pdos = Devices;
+    Scan->Pdo = calloc(Devices + 1, sizeof (PCHAR));
+    if (Scan->Pdo == NULL)
+        abort();
+
+    for (Index = 0; Index < Devices; Index++)
+        Scan->Pdo[Index] = ScanName(Index);
+
+    Scan->Unsupporteds = (Devices + 7) / 8;
+    Scan->Unsupported = calloc(Scan->Unsupporteds + 1, sizeof (PCHAR));
+    if (Scan->Unsupported == NULL)
+        abort();
+
+    for (Index = 0; Index < Scan->Unsupporteds; Index++)
+        Scan->Unsupported[Index] = ScanName(Index * 8 + 3);
+}
+
+static VOID
+ScanDestroy(
+    IN  PSCAN   Scan
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < Scan->Pdos; Index++)
+        free(Scan->Pdo[Index]);
+    for (Index = 0; Index < Scan->Unsupporteds; Index++)
+        free(Scan->Unsupported[Index]);
+
+    free(Scan->Pdo);
+    free(Scan->Unsupported);
+    free(Scan->Listing);
+    free(Scan->Previous);
+}
+
+static PXENVKBD_DEVICE_SET
+ScanCreateSet(
+    IN  PCHAR   Listing
+    )
+{
+    PVOID       Memory;
+
+    Memory = malloc(DeviceSetGetFootprint(Listing));
+    if (Memory == NULL)
+        abort();
+
+    return DeviceSetInitialize(Memory, Listing);
+}
+
+static VOID
+ScanHashed(
+    IN  PSCAN               Scan,
+    IN  PXENVKBD_DEVICE_SET Snapshot,
+    OUT PSCAN_RESULT        Result
+    )
+{
+    PXENVKBD_DEVICE_SET     Devices;
+    ULONG                   Index;
+
+    memset(Result, 0, sizeof (SCAN_RESULT));
+
+    Devices = ScanCreateSet(Scan->Listing);
+
+    Result->Added = DeviceSetCountMissing(Devices, Snapshot);
+    Result->Removed = DeviceSetCountMissing(Snapshot, Devices);
+
+    for (Index = 0; Index < Scan->Unsupporteds; Index++) {
+        PANSI_STRING    Device;
+
+        Device = DeviceSetFind(Devices, Scan->Unsupported[Index]);
+        if (Device != NULL)
+            Device->Length = 0;
+    }
+
+    for (Index = 0; Index < Scan->Pdos; Index++) {
+        PANSI_STRING    Device;
+
+        Device = DeviceSetFind(Devices, Scan->Pdo[Index]);
+        if (Device != NULL) {
+            Device->Length = 0;
+            Result->Claimed++;
+        }
+    }
+
+    for (Index = 0; Index < Devices->Count; Index++)
+        if (Devices->Device[Index].Length != 0)
+            Result->Created++;
+
+    DeviceSetReset(Devices);
+    free(Devices);
+}
+
+// The listing as an array of names, a zero length one having been claimed
+static ULONG
+ScanSplit(
+    IN  PCHAR   Listing,
+    OUT PCHAR   **Name,
+    OUT PULONG  *Length
+    )
+{
+    ULONG       Count;
+    ULONG       Index;
+    PCHAR       Cursor;
+
+    Count = 0;
+    for (Cursor = Listing; *Cursor != '\0'; Cursor += strlen(Cursor) + 1)
+        Count++;
+
+    *Name = calloc(Count + 1, sizeof (PCHAR));
+    *Length = calloc(Count + 1, sizeof (ULONG));
+    if (*Name == NULL || *Length == NULL)
+        abort();
+
+    Index = 0;
+    for (Cursor = Listing; *Cursor != '\0'; Cursor += strlen(Cursor) + 1) {
+        (*Name)[Index] = Cursor;
+        (*Length)[Index] = (ULONG)strlen(Cursor);
+        Index++;
+    }
+
+    return Count;
+}
+
+static ULONG
+ScanCountMissingLinear(
+    IN  PCHAR   *From,
+    IN  ULONG   FromCount,
+    IN  PCHAR   *In,
+    IN  ULONG   InCount
+    )
+{
+    ULONG       Count;
+    ULONG       Index;
+
+    Count = 0;
+    for (Index = 0; Index < FromCount; Index++) {
+        ULONG   Other;
+
+        for (Other = 0; Other < InCount; Other++)
+            if (strcasecmp(From[Index], In[Other]) == 0)
+                break;
+
+        if (Other == InCount)
+            Count++;
+    }
+
+    return Count;
+}
+
+static VOID
+ScanLinear(
+    IN  PSCAN           Scan,
+    OUT PSCAN_RESULT    Result
+    )
+{
+    PCHAR               *Device;
+    PULONG              Length;
+    ULONG               Count;
+    PCHAR               *Previous;
+    PULONG              PreviousLength;
+    ULONG               PreviousCount;
+    ULONG               Index;
+
+    memset(Result, 0, sizeof (SCAN_RESULT));
+
+    Count = ScanSplit(Scan->Listing, &Device, &Length);
+    PreviousCount = ScanSplit(Scan->Previous, &Previous, &PreviousLength);
+
+    Result->Added = ScanCountMissingLinear(Device, Count,
+                                           Previous, PreviousCount);
+    Result->Removed = ScanCountMissingLinear(Previous, PreviousCount,
+                                             Device, Count);
+
+    for (Index = 0; Index < Scan->Unsupporteds; Index++) {
+        ULONG   Other;
+
+        for (Other = 0; Other < Count; Other++)
+            if (Length[Other] != 0 &&
+                strcasecmp(Scan->Unsupported[Index], Device[Other]) == 0)
+                Length[Other] = 0;
+    }
+
+    for (Index = 0; Index < Scan->Pdos; Index++) {
+        ULONG   Other;
+
+        for (Other = 0; Other < Count; Other++) {
+            if (Length[Other] != 0 &&
+                strcasecmp(Scan->Pdo[Index], Device[Other]) == 0) {
+                Length[Other] = 0;
+                Result->Claimed++;
+                break;
+            }
+        }
+    }
+
+    for (Index = 0; Index < Count; Index++)
+        if (Length[Index] != 0)
+            Result->Created++;
+
+    free(Device);
+    free(Length);
+    free(Previous);
+    free(PreviousLength);
+}
+
+static int
+ScanRun(
+    IN  ULONG           Devices,
+    IN  ULONG           Scans
+    )
+{
+    SCAN                Scan;
+    PXENVKBD_DEVICE_SET Snapshot;
+    SCAN_RESULT         Hashed;
+    SCAN_RESULT         Linear;
+    ULONG64             HashedNs;
+    ULONG64             LinearNs;
+    ULONG64             Start;
+    ULONG               Index;
+    int                 Error;
+
+    ScanCreate(Devices, &Scan);
+    Snapshot = ScanCreateSet(Scan.Previous);
+
+    memset(&Hashed, 0, sizeof (SCAN_RESULT));
+    HashedNs = 0;
+    LinearNs = 0;
+    Error = 0;
+
+    for (Index = 0; Index < Scans; Index++) {
+        Start = ScanGetTimeNs();
+        ScanHashed(&Scan, Snapshot, &Hashed);
+        HashedNs += ScanGetTimeNs() - Start;
+
+        Start = ScanGetTimeNs();
+        ScanLinear(&Scan, &Linear);
+        LinearNs += ScanGetTimeNs() - Start;
+
+        if (memcmp(&Hashed, &Linear, sizeof (SCAN_RESULT)) != 0) {
+            fprintf(stderr, "%u devices: hashed +%u -%u claimed %u created %u, "
+                    "linear +%u -%u claimed %u created %u\n",
+                    Devices,
+                    Hashed.Added, Hashed.Removed,
+                    Hashed.Claimed, Hashed.Created,
+                    Linear.Added, Linear.Removed,
+                    Linear.Claimed, Linear.Created);
+            Error = 1;
+            break;
+        }
+    }
+
+    if (Error == 0)
+        printf("%8u %10.1f %12.1f %8.1fx   +%u -%u claimed %u created %u\n",
+               Devices,
+               (double)HashedNs / (double)Scans / 1e3,
+               (double)LinearNs / (double)Scans / 1e3,
+               (double)LinearNs / (double)__max(HashedNs, 1),
+               Hashed.Added, Hashed.Removed,
+               Hashed.Claimed, Hashed.Created);
+
+    free(Snapshot);
+    ScanDestroy(&Scan);
+
+    return Error;
+}
+
+static VOID
+ScanUsage(
+    IN  const CHAR  *Name
+    )
+{
+    fprintf(stderr, "usage: %s [--devices N] [--scans N]\n", Name);
+    exit(2);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static const struct option  Options[] = {
+        { "devices", required_argument, NULL, 'd' },
+        { "scans", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    static const ULONG          Sweep[] = { 0, 1, 4, 16, 64, 256, 1024 };
+    ULONG                       Devices = 0;
+    ULONG                       Scans = 100;
+    ULONG                       Index;
+    int                         Option;
+    int                         Error;
+
+    while ((Option = getopt_long(argc, argv, "", Options, NULL)) != -1) {
+        switch (Option) {
+        case 'd':
+            Devices = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            Scans = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            ScanUsage(argv[0]);
+        }
+    }
+
+    if (Scans == 0)
+        ScanUsage(argv[0]);
+
+    printf("%8s %10s %12s %9s\n", "devices", "hashed us", "linear us", "speedup");
+
+    Error = 0;
+    if (Devices != 0) {
+        Error = ScanRun(Devices, Scans);
+    } else {
+        for (Index = 0; Index < ARRAYSIZE(Sweep) && Error == 0; Index++)
+            Error = ScanRun(Sweep[Index], Scans);
+    }
+
+    return Error;
+}
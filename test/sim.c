@@ -0,0 +1,797 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+// A kbdif backend simulator. The reference backend produces input at the
+// rate and in the pattern of a load profile into a ring shared, via the
+// fakes, with the driver's own frontend (see guest.h), which consumes it
+// from its event channel DPC and hands reports up as it would to XENHID.
+// When the ring is full the producer waits (or, with --drop, drops input)
+// as a real backend has to.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <linux-keycodes.h>
+
+#include "translate.h"
+#include "capture.h"
+#include "fake.h"
+#include "connect.h"
+#include "guest.h"
+
+// Linux BTN_LEFT, which TranslateEvent() maps to pointer button 0
+#define SIM_BUTTON_LEFT 0x110
+
+// How long a full ring is left before the producer looks again
+#define SIM_FULL_WAIT_NS    20000
+
+typedef enum _SIM_PROFILE {
+    SIM_PROFILE_TYPING = 0,
+    SIM_PROFILE_PASTE,
+    SIM_PROFILE_DRAG,
+    SIM_PROFILE_SCROLL,
+    SIM_PROFILE_MULTITOUCH,
+    SIM_PROFILE_COUNT
+} SIM_PROFILE;
+
+typedef struct _SIM_PROFILE_INFO {
+    const CHAR  *Name;
+    ULONG       Rate;       // Default events per second; 0 is flat out
+    ULONG64     Events;     // Default number of events
+} SIM_PROFILE_INFO;
+
+static const SIM_PROFILE_INFO   SimProfileInfo[SIM_PROFILE_COUNT] = {
+    [SIM_PROFILE_TYPING] = { "typing", 20, 200 },
+    [SIM_PROFILE_PASTE] = { "paste", 0, 40000 },
+    [SIM_PROFILE_DRAG] = { "drag", 1000, 2000 },
+    [SIM_PROFILE_SCROLL] = { "scroll", 120, 240 },
+    [SIM_PROFILE_MULTITOUCH] = { "multitouch", 500, 1000 },
+};
+
+// One generated input: a key transition, which a batching backend may pack
+// with others, or any other event
+typedef struct _SIM_ITEM {
+    BOOLEAN                 Key;
+    ULONG                   KeyCode;
+    BOOLEAN                 Pressed;
+    union xenkbd_in_event   Event;
+} SIM_ITEM, *PSIM_ITEM;
+
+typedef struct _SIM {
+    SIM_PROFILE             Profile;
+    ULONG                   Rate;
+    ULONG64                 Events;
+    ULONG                   Burst;      // Characters per paste
+    ULONG                   GapMs;      // Between pastes
+    ULONG                   Push;       // Events per publication
+    ULONG                   ConsumerNs; // Extra cost per report read
+    ULONG                   Budget;
+    BOOLEAN                 Drop;
+    BOOLEAN                 Debug;
+    const CHAR              *CapturePath;
+
+    PFAKE_STORE             Store;
+    PFAKE_GNTTAB            Gnttab;
+    PHOST                   Host;
+    PGUEST                  Guest;
+
+    // Generator state
+    ULONG64                 Sequence;
+    SIM_ITEM                Queue[4];
+    ULONG                   Queued;
+    ULONG                   Next;
+    ULONG                   Character;
+
+    // Producer
+    ULONG64                 Produced;
+    ULONG64                 Dropped;
+    ULONG64                 Stalls;
+    ULONG64                 WaitNs;
+    ULONG64                 MaxWaitNs;
+
+    // Consumer (from the DPC)
+    ULONG64                 Reports;
+    XENVKBD_HID_KEYBOARD    Keyboard;
+    XENVKBD_HID_ABSMOUSE    AbsMouse;
+} SIM, *PSIM;
+
+static ULONG64
+SimGetTimeNs(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return (ULONG64)Now.tv_sec * 1000000000ull + (ULONG64)Now.tv_nsec;
+}
+
+static VOID
+SimSleepUntil(
+    IN  ULONG64     Ns
+    )
+{
+    struct timespec Due;
+
+    Due.tv_sec = (time_t)(Ns / 1000000000ull);
+    Due.tv_nsec = (long)(Ns % 1000000000ull);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Due, NULL) == EINTR)
+        ;
+}
+
+static const CHAR   SimText[] =
+    "The quick brown fox jumps over the lazy dog, 1234567890 times.\n";
+
+static const ULONG  SimLetter[26] = {
+    KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
+    KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
+    KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z
+};
+
+static const ULONG  SimDigit[10] = {
+    KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9
+};
+
+static ULONG
+SimKeyCode(
+    IN  CHAR        Character,
+    OUT BOOLEAN     *Shift
+    )
+{
+    *Shift = FALSE;
+
+    if (Character >= 'a' && Character <= 'z')
+        return SimLetter[Character - 'a'];
+
+    if (Character >= 'A' && Character <= 'Z') {
+        *Shift = TRUE;
+        return SimLetter[Character - 'A'];
+    }
+
+    if (Character >= '0' && Character <= '9')
+        return SimDigit[Character - '0'];
+
+    switch (Character) {
+    case ',':
+        return KEY_COMMA;
+    case '.':
+        return KEY_DOT;
+    case '\n':
+        return KEY_ENTER;
+    default:
+        return KEY_SPACE;
+    }
+}
+
+static VOID
+SimQueueKey(
+    IN  PSIM    Sim,
+    IN  ULONG   KeyCode,
+    IN  BOOLEAN Pressed
+    )
+{
+    PSIM_ITEM   Item = &Sim->Queue[Sim->Queued++];
+
+    Item->Key = TRUE;
+    Item->KeyCode = KeyCode;
+    Item->Pressed = Pressed;
+    BackendKey(&Item->Event, KeyCode, Pressed);
+}
+
+static VOID
+SimQueueEvent(
+    IN  PSIM                        Sim,
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    PSIM_ITEM                       Item = &Sim->Queue[Sim->Queued++];
+
+    Item->Key = FALSE;
+    Item->Event = *Event;
+}
+
+// Queues the press and release of the next character, with Shift around
+// it if need be
+static VOID
+SimQueueCharacter(
+    IN  PSIM    Sim
+    )
+{
+    CHAR        Character;
+    ULONG       KeyCode;
+    BOOLEAN     Shift;
+
+    Character = SimText[Sim->Character++ % (sizeof (SimText) - 1)];
+    KeyCode = SimKeyCode(Character, &Shift);
+
+    if (Shift)
+        SimQueueKey(Sim, KEY_LEFTSHIFT, TRUE);
+    SimQueueKey(Sim, KeyCode, TRUE);
+    SimQueueKey(Sim, KeyCode, FALSE);
+    if (Shift)
+        SimQueueKey(Sim, KEY_LEFTSHIFT, FALSE);
+}
+
+static VOID
+SimQueuePointer(
+    IN  PSIM                Sim,
+    IN  ULONG64             Index,
+    IN  ULONG64             Count
+    )
+{
+    union xenkbd_in_event   Event;
+
+    switch (Sim->Profile) {
+    case SIM_PROFILE_DRAG:
+        // Press, a straight drag, release
+        if (Index == 0) {
+            SimQueueKey(Sim, SIM_BUTTON_LEFT, TRUE);
+        } else if (Index == Count - 1) {
+            SimQueueKey(Sim, SIM_BUTTON_LEFT, FALSE);
+        } else {
+            BackendPosition(&Event,
+                            (LONG)(1000 + (Index * 7) % 30000),
+                            (LONG)(1000 + (Index * 3) % 30000),
+                            0);
+            SimQueueEvent(Sim, &Event);
+        }
+        break;
+
+    case SIM_PROFILE_SCROLL:
+        BackendMotion(&Event, 0, 0, ((Index / 30) & 1) ? -1 : 1);
+        SimQueueEvent(Sim, &Event);
+        break;
+
+    case SIM_PROFILE_MULTITOUCH: {
+        // Two contacts moving together, down and up every 100 events
+        ULONG   Contact = (ULONG)(Index & 1);
+        ULONG64 Step = (Index / 2) % 50;
+
+        memset(&Event, 0, sizeof (Event));
+        Event.mtouch.type = XENKBD_TYPE_MTOUCH;
+        Event.mtouch.contact_id = (uint8_t)Contact;
+        Event.mtouch.event_type = (Step == 0) ? XENKBD_MT_EV_DOWN :
+                                  (Step == 49) ? XENKBD_MT_EV_UP :
+                                  XENKBD_MT_EV_MOTION;
+        Event.mtouch.u.pos.abs_x = (int32_t)(100 + Step * 10 + Contact * 200);
+        Event.mtouch.u.pos.abs_y = (int32_t)(100 + Step * 5);
+        SimQueueEvent(Sim, &Event);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Returns the next item and when, relative to the start, it is due
+static BOOLEAN
+SimNext(
+    IN  PSIM        Sim,
+    OUT PSIM_ITEM   *Item,
+    OUT ULONG64     *DueNs
+    )
+{
+    ULONG64         Index;
+
+    if (Sim->Sequence >= Sim->Events)
+        return FALSE;
+
+    if (Sim->Next == Sim->Queued) {
+        Sim->Next = 0;
+        Sim->Queued = 0;
+
+        if (Sim->Profile == SIM_PROFILE_TYPING ||
+            Sim->Profile == SIM_PROFILE_PASTE)
+            SimQueueCharacter(Sim);
+        else
+            SimQueuePointer(Sim, Sim->Sequence, Sim->Events);
+    }
+
+    Index = Sim->Sequence++;
+    *Item = &Sim->Queue[Sim->Next++];
+
+    if (Sim->Profile == SIM_PROFILE_PASTE) {
+        ULONG64 Burst = Index / ((ULONG64)Sim->Burst * 2);
+
+        // A burst of Burst characters every GapMs
+        *DueNs = Burst * Sim->GapMs * 1000000ull;
+    } else if (Sim->Rate != 0) {
+        *DueNs = Index * 1000000000ull / Sim->Rate;
+    } else {
+        *DueNs = 0;
+    }
+
+    return TRUE;
+}
+
+// As XENHID completing a read, which it always has posted
+static BOOLEAN
+SimCallback(
+    IN  PVOID       Context,
+    IN  const VOID  *Report,
+    IN  ULONG       Length
+    )
+{
+    PSIM            Sim = Context;
+    const UCHAR     *Id = Report;
+
+    if (*Id == 1 && Length == sizeof (XENVKBD_HID_KEYBOARD))
+        memcpy(&Sim->Keyboard, Report, Length);
+    else if (*Id == 2 && Length == sizeof (XENVKBD_HID_ABSMOUSE))
+        memcpy(&Sim->AbsMouse, Report, Length);
+
+    if (Sim->ConsumerNs != 0) {
+        ULONG64 Until = SimGetTimeNs() + Sim->ConsumerNs;
+
+        while (SimGetTimeNs() < Until)
+            ;
+    }
+
+    Sim->Reports++;
+
+    return TRUE;
+}
+
+static int
+SimCaptureWrite(
+    IN  PSIM        Sim
+    )
+{
+    const XENVKBD_CAPTURE   *Capture = GuestGetCapture(Sim->Guest);
+    FILE                    *File;
+    size_t                  Size;
+    int                     Error;
+
+    if (Capture == NULL) {
+        fprintf(stderr, "the frontend is not capturing\n");
+        return ENOENT;
+    }
+
+    File = fopen(Sim->CapturePath, "wb");
+    if (File == NULL)
+        goto fail1;
+
+    Size = XENVKBD_CAPTURE_SIZE((size_t)Capture->Count);
+    if (fwrite(Capture, 1, Size, File) != Size)
+        goto fail2;
+
+    if (fclose(File) != 0)
+        goto fail1;
+
+    return 0;
+
+fail2:
+    fclose(File);
+
+fail1:
+    Error = errno;
+    perror(Sim->CapturePath);
+
+    return Error;
+}
+
+static BOOLEAN
+SimPutItem(
+    IN  PBACKEND    Backend,
+    IN  PSIM_ITEM   Item
+    )
+{
+    if (Item->Key)
+        return BackendPutKey(Backend, Item->KeyCode, Item->Pressed);
+
+    return BackendPut(Backend, &Item->Event);
+}
+
+static VOID
+SimPut(
+    IN  PSIM        Sim,
+    IN  PSIM_ITEM   Item
+    )
+{
+    PBACKEND        Backend = &Sim->Host->Backend;
+    ULONG64         Start;
+    ULONG64         Waited;
+
+    if (SimPutItem(Backend, Item)) {
+        Sim->Produced++;
+        return;
+    }
+
+    Sim->Stalls++;
+
+    // Let the frontend see everything before waiting for it
+    HostPush(Sim->Host);
+
+    if (Sim->Drop) {
+        Sim->Dropped++;
+        return;
+    }
+
+    Start = SimGetTimeNs();
+
+    do {
+        SimSleepUntil(SimGetTimeNs() + SIM_FULL_WAIT_NS);
+    } while (!SimPutItem(Backend, Item));
+
+    Waited = SimGetTimeNs() - Start;
+
+    Sim->WaitNs += Waited;
+    if (Waited > Sim->MaxWaitNs)
+        Sim->MaxWaitNs = Waited;
+
+    Sim->Produced++;
+}
+
+static int
+SimRun(
+    IN  PSIM    Sim
+    )
+{
+    PSIM_ITEM   Item;
+    ULONG64     Start;
+    ULONG64     DueNs;
+    ULONG64     Elapsed;
+    ULONG64     Deadline;
+    ULONG       Pending;
+    GUEST_COUNTERS          Counters;
+    FAKE_EVTCHN_STATISTICS  Channel;
+    int                     Error;
+
+    Pending = 0;
+    Start = SimGetTimeNs();
+
+    while (SimNext(Sim, &Item, &DueNs)) {
+        if (Start + DueNs > SimGetTimeNs()) {
+            // Idle until then, so publish what there is
+            HostPush(Sim->Host);
+            Pending = 0;
+
+            SimSleepUntil(Start + DueNs);
+        }
+
+        SimPut(Sim, Item);
+
+        // Let a batch fill while input keeps coming
+        if (++Pending >= Sim->Push &&
+            !BackendBatching(&Sim->Host->Backend)) {
+            HostPush(Sim->Host);
+            Pending = 0;
+        }
+    }
+
+    HostPush(Sim->Host);
+
+    // Let the frontend drain the ring. It hands slots back before sending
+    // the reports, so wait for the DPC to account for them.
+    Deadline = SimGetTimeNs() + 5000000000ull;
+    for (;;) {
+        Error = GuestGetCounters(Sim->Guest, &Counters);
+        if (Error != 0)
+            return Error;
+
+        if (Counters.Processed == (ULONG)Sim->Host->Backend.Produced)
+            break;
+
+        if (SimGetTimeNs() > Deadline) {
+            fprintf(stderr, "frontend stopped consuming\n");
+            return ETIMEDOUT;
+        }
+
+        SimSleepUntil(SimGetTimeNs() + 100000);
+    }
+
+    Elapsed = SimGetTimeNs() - Start;
+
+    FakeEvtchnGetStatistics(Sim->Host->Channel, &Channel);
+
+    printf("profile         %s\n", SimProfileInfo[Sim->Profile].Name);
+    printf("ring            %u slots (%u pages besides the shared one)\n",
+           Sim->Host->Backend.Length,
+           Sim->Host->InPages);
+    printf("produced        %llu in %llu slots (dropped %llu)\n",
+           (unsigned long long)Sim->Produced,
+           (unsigned long long)Sim->Host->Backend.Produced,
+           (unsigned long long)Sim->Dropped);
+    printf("consumed        %u slots, %u DPCs (%.1f slots per DPC, %u deferred)\n",
+           Counters.Processed,
+           Counters.Dpcs,
+           (double)Counters.Processed / (double)__max(Counters.Dpcs, 1),
+           Counters.Deferred);
+    printf("reports         %llu read (%u sent, %u pending)\n",
+           (unsigned long long)Sim->Reports,
+           Counters.Reports,
+           Counters.Pending);
+    printf("rate            %.0f events/s\n",
+           (double)Sim->Produced * 1e9 / (double)__max(Elapsed, 1));
+    printf("stalls          %llu (ring full)\n", (unsigned long long)Sim->Stalls);
+    printf("producer wait   %.3fms (max %.3fms)\n",
+           (double)Sim->WaitNs / 1e6,
+           (double)Sim->MaxWaitNs / 1e6);
+    printf("notifications   %llu sent, %llu suppressed, %llu upcalls\n",
+           (unsigned long long)Channel.Sends,
+           (unsigned long long)Sim->Host->Backend.Suppressed,
+           (unsigned long long)Channel.Upcalls);
+    printf("event-idx       %s\n",
+           (Sim->Host->Backend.EventIdx) ? "on" : "off");
+    printf("key-batch       %s\n",
+           (Sim->Host->Backend.KeyBatch) ? "on" : "off");
+    printf("timestamp       %s\n",
+           (Sim->Host->Backend.Timestamp) ? "on" : "off");
+
+    // Including the frontend's latency histograms
+    if (Sim->Debug)
+        GuestDebug(Sim->Guest, stdout);
+
+    return 0;
+}
+
+// Nothing may be left held down once a profile has run its course, as the
+// last reports read show it
+static int
+SimCheck(
+    IN  PSIM            Sim
+    )
+{
+    ULONG               Index;
+    int                 Error = 0;
+
+    if (Sim->Dropped != 0)
+        return 0;
+
+    for (Index = 0; Index < ARRAYSIZE(Sim->Keyboard.Keys); Index++) {
+        if (Sim->Keyboard.Keys[Index] != 0)
+            Error = EPROTO;
+    }
+
+    if (Sim->Keyboard.Modifiers != 0 || Sim->AbsMouse.Buttons != 0)
+        Error = EPROTO;
+
+    if (Error != 0)
+        fprintf(stderr, "inconsistent frontend state at the end of the run: "
+                "%llu produced, %llu reports, modifiers %02x, buttons %02x, key %02x\n",
+                (unsigned long long)Sim->Produced,
+                (unsigned long long)Sim->Reports,
+                Sim->Keyboard.Modifiers,
+                Sim->AbsMouse.Buttons,
+                Sim->Keyboard.Keys[0]);
+
+    return Error;
+}
+
+// Tuning can only be set once the frontend is enabled, and the capture
+// records it when the ring connects, so connect twice. The caller closes
+// the guest on failure.
+static int
+SimConnect(
+    IN  PSIM        Sim
+    )
+{
+    GUEST_TUNING    Tuning;
+    int             Error;
+
+    Error = GuestEnable(Sim->Guest, SimCallback, Sim);
+    if (Error != 0)
+        goto fail1;
+
+    Error = HostWaitForConnection(Sim->Host, 5000);
+    if (Error != 0)
+        goto fail1;
+
+    if (Sim->Budget == 0)
+        return 0;
+
+    memset(&Tuning, 0, sizeof (Tuning));
+    Tuning.DpcBudget = Sim->Budget;
+
+    Error = GuestSetTuning(Sim->Guest, &Tuning);
+    if (Error != 0)
+        goto fail1;
+
+    Error = GuestClose(Sim->Guest);
+    if (Error != 0)
+        goto fail1;
+
+    Error = GuestEnable(Sim->Guest, SimCallback, Sim);
+    if (Error != 0)
+        goto fail1;
+
+    Error = HostWaitForConnection(Sim->Host, 5000);
+    if (Error != 0)
+        goto fail1;
+
+    return 0;
+
+fail1:
+    fprintf(stderr, "failed to connect: %s\n", strerror(Error));
+
+    return Error;
+}
+
+static VOID
+SimUsage(
+    IN  const CHAR  *Name
+    )
+{
+    fprintf(stderr,
+            "usage: %s [--profile typing|paste|drag|scroll|multitouch]\n"
+            "          [--rate EVENTS/S] [--events N] [--burst CHARACTERS]\n"
+            "          [--gap MS] [--push N] [--budget N] [--consumer-ns NS]\n"
+            "          [--drop] [--capture FILE] [--event-idx]\n"
+            "          [--page-order N] [--key-batch] [--timestamp]\n"
+            "          [--debug]\n",
+            Name);
+    exit(2);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static const struct option  Options[] = {
+        { "profile", required_argument, NULL, 'p' },
+        { "rate", required_argument, NULL, 'r' },
+        { "events", required_argument, NULL, 'e' },
+        { "burst", required_argument, NULL, 'b' },
+        { "gap", required_argument, NULL, 'g' },
+        { "push", required_argument, NULL, 'P' },
+        { "budget", required_argument, NULL, 'B' },
+        { "consumer-ns", required_argument, NULL, 'c' },
+        { "drop", no_argument, NULL, 'd' },
+        { "capture", required_argument, NULL, 'C' },
+        { "event-idx", no_argument, NULL, 'E' },
+        { "page-order", required_argument, NULL, 'O' },
+        { "key-batch", no_argument, NULL, 'K' },
+        { "timestamp", no_argument, NULL, 'T' },
+        { "debug", no_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+    SIM                         Sim;
+    LONG                        Rate = -1;
+    ULONG                       Records = 0;
+    ULONG                       Features = 0;
+    int                         Option;
+    int                         Error;
+
+    memset(&Sim, 0, sizeof (Sim));
+    Sim.Burst = 1000;
+    Sim.GapMs = 100;
+    Sim.Push = 1;
+
+    while ((Option = getopt_long(argc, argv, "", Options, NULL)) != -1) {
+        switch (Option) {
+        case 'p':
+            for (Sim.Profile = 0; Sim.Profile < SIM_PROFILE_COUNT; Sim.Profile++) {
+                if (strcmp(optarg, SimProfileInfo[Sim.Profile].Name) == 0)
+                    break;
+            }
+            if (Sim.Profile == SIM_PROFILE_COUNT)
+                SimUsage(argv[0]);
+            break;
+        case 'r':
+            Rate = (LONG)strtol(optarg, NULL, 0);
+            break;
+        case 'e':
+            Sim.Events = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            Sim.Burst = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            Sim.GapMs = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            Sim.Push = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'B':
+            Sim.Budget = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            Sim.ConsumerNs = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            Sim.Drop = TRUE;
+            break;
+        case 'C':
+            Sim.CapturePath = optarg;
+            break;
+        case 'E':
+            Features |= HOST_FEATURE_EVENT_IDX;
+            break;
+        case 'K':
+            Features |= HOST_FEATURE_KEY_BATCH;
+            break;
+        case 'T':
+            Features |= HOST_FEATURE_TIMESTAMP;
+            break;
+        case 'D':
+            Sim.Debug = TRUE;
+            break;
+        case 'O':
+            Features &= ~HOST_FEATURE_PAGE_ORDER_MASK;
+            Features |= HOST_FEATURE_PAGE_ORDER(strtoul(optarg, NULL, 0) & 0xF);
+            break;
+        default:
+            SimUsage(argv[0]);
+        }
+    }
+
+    Sim.Rate = (Rate >= 0) ? (ULONG)Rate : SimProfileInfo[Sim.Profile].Rate;
+    if (Sim.Events == 0)
+        Sim.Events = SimProfileInfo[Sim.Profile].Events;
+    if (Sim.Burst == 0 || Sim.Push == 0)
+        SimUsage(argv[0]);
+
+    // The driver's buffer is bounded, so a long run keeps only its tail
+    if (Sim.CapturePath != NULL)
+        Records = XENVKBD_CAPTURE_MAXIMUM;
+
+    if (FakeStoreCreate(&Sim.Store) != 0 ||
+        FakeGnttabCreate(64, &Sim.Gnttab) != 0)
+        return 1;
+
+    Error = HostCreate(Sim.Store, Sim.Gnttab, "backend/vkbd/0/0", "device/vkbd/0",
+                       Features, &Sim.Host);
+    if (Error != 0)
+        return 1;
+
+    Error = GuestCreate(Sim.Store, Sim.Gnttab, "0", Records, &Sim.Guest);
+    if (Error != 0)
+        return 1;
+
+    Error = SimConnect(&Sim);
+    if (Error == 0)
+        Error = SimRun(&Sim);
+    if (Error == 0)
+        Error = SimCheck(&Sim);
+    if (Error == 0 && Sim.CapturePath != NULL)
+        Error = SimCaptureWrite(&Sim);
+
+    (VOID) GuestClose(Sim.Guest);
+
+    GuestDestroy(Sim.Guest);
+    HostDestroy(Sim.Host);
+    FakeGnttabDestroy(Sim.Gnttab);
+    FakeStoreDestroy(Sim.Store);
+
+    return (Error == 0) ? 0 : 1;
+}
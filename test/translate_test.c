@@ -0,0 +1,553 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux-keycodes.h>
+
+#include "translate.h"
+#include "backend.h"
+
+#define PAGE_SIZE   4096
+
+static ULONG    Failures;
+
+#define CHECK(_E)                                               \
+    do {                                                        \
+        if (!(_E)) {                                            \
+            fprintf(stderr, "%s:%u: CHECK(%s) failed\n",        \
+                    __FILE__, __LINE__, #_E);                   \
+            Failures++;                                         \
+        }                                                       \
+    } while (FALSE)
+
+#define TEST_RESULTS    256
+
+typedef struct _TEST {
+    struct xenkbd_page      *Shared;
+    union xenkbd_in_event   Snapshot[XENKBD_IN_RING_LEN];
+    XENVKBD_TRANSLATE       Translate;
+    XENVKBD_TRANSLATE_RING  Ring;
+    BACKEND                 Backend;
+
+    ULONG                   Passes;
+    ULONG                   Overruns;
+    ULONG                   PassCons;
+    ULONG                   Count;
+    ULONG                   Index[TEST_RESULTS];
+    XENVKBD_TRANSLATE_RESULT Result[TEST_RESULTS];
+    XENVKBD_HID_KEYBOARD    Keyboard[TEST_RESULTS];
+
+    // Hold everything once this many keyboard reports have been seen
+    ULONG                   HoldAfter;
+    ULONG                   Keyboards;
+} TEST, *PTEST;
+
+static VOID
+TestCallback(
+    IN  PVOID                       Context,
+    IN  ULONG                       Index,
+    IN  const union xenkbd_in_event *Event,
+    IN  XENVKBD_TRANSLATE_RESULT    Result
+    )
+{
+    PTEST                           Test = Context;
+
+    (void)Event;
+
+    if (Result == TRANSLATE_RESULT_KEYBOARD)
+        Test->Keyboards++;
+
+    if (Test->Count == TEST_RESULTS)
+        return;
+
+    Test->Index[Test->Count] = Index;
+    Test->Result[Test->Count] = Result;
+    Test->Keyboard[Test->Count] = Test->Translate.Keyboard;
+    Test->Count++;
+}
+
+static BOOLEAN
+TestHold(
+    IN  PVOID                       Context,
+    IN  const union xenkbd_in_event *Event
+    )
+{
+    PTEST                           Test = Context;
+
+    (void)Event;
+
+    return (Test->HoldAfter != 0 && Test->Keyboards >= Test->HoldAfter) ? TRUE : FALSE;
+}
+
+static VOID
+TestPass(
+    IN  PVOID       Context,
+    IN  ULONG       Cons,
+    IN  ULONG       Prod,
+    IN  BOOLEAN     Overrun
+    )
+{
+    PTEST           Test = Context;
+
+    (void)Prod;
+
+    Test->Passes++;
+    Test->PassCons = Cons;
+    if (Overrun)
+        Test->Overruns++;
+}
+
+static PTEST
+TestCreate(
+    VOID
+    )
+{
+    PTEST   Test;
+
+    Test = calloc(1, sizeof (TEST));
+    if (Test == NULL)
+        abort();
+
+    Test->Shared = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (Test->Shared == NULL)
+        abort();
+
+    memset(Test->Shared, 0, PAGE_SIZE);
+
+    TranslateReset(&Test->Translate);
+
+    Test->Ring.Shared = Test->Shared;
+    Test->Ring.Slots = XENKBD_IN_RING(Test->Shared);
+    Test->Ring.Length = XENKBD_IN_RING_LEN;
+    Test->Ring.Snapshot = Test->Snapshot;
+    Test->Ring.SnapshotLength = ARRAYSIZE(Test->Snapshot);
+
+    BackendInitialize(&Test->Backend,
+                      Test->Shared,
+                      Test->Ring.Slots,
+                      Test->Ring.Length);
+
+    return Test;
+}
+
+static VOID
+TestDestroy(
+    IN  PTEST   Test
+    )
+{
+    free(Test->Shared);
+    free(Test);
+}
+
+static VOID
+TestKey(
+    IN  PTEST   Test,
+    IN  ULONG   KeyCode,
+    IN  BOOLEAN Pressed
+    )
+{
+    union xenkbd_in_event   Event;
+
+    BackendKey(&Event, KeyCode, Pressed);
+    CHECK(BackendPut(&Test->Backend, &Event));
+}
+
+static VOID
+TestMotion(
+    IN  PTEST   Test,
+    IN  LONG    dX,
+    IN  LONG    dY
+    )
+{
+    union xenkbd_in_event   Event;
+
+    BackendMotion(&Event, dX, dY, 0);
+    CHECK(BackendPut(&Test->Backend, &Event));
+}
+
+static XENVKBD_TRANSLATE_STOP
+TestConsume(
+    IN  PTEST   Test,
+    IN  ULONG   Budget
+    )
+{
+    return TranslateRing(&Test->Translate,
+                         &Test->Ring,
+                         (Budget != 0) ? Budget : ~0u,
+                         TestPass,
+                         TestCallback,
+                         TestHold,
+                         Test);
+}
+
+static VOID
+TestRingBasic(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+
+    TestKey(Test, KEY_A, TRUE);
+    TestKey(Test, KEY_A, FALSE);
+    TestMotion(Test, 10, 20);
+    (VOID) BackendPush(&Test->Backend);
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 3);
+    CHECK(Test->Shared->in_cons == 3);
+    CHECK(Test->Passes == 1);
+    CHECK(Test->Count == 3);
+    CHECK(Test->Result[0] == TRANSLATE_RESULT_KEYBOARD);
+    CHECK(Test->Keyboard[0].Keys[0] == 0x04);
+    CHECK(Test->Result[1] == TRANSLATE_RESULT_KEYBOARD);
+    CHECK(Test->Keyboard[1].Keys[0] == 0);
+    CHECK(Test->Result[2] == TRANSLATE_RESULT_POINTER);
+    CHECK(Test->Translate.AbsMouse.X == 10);
+    CHECK(Test->Translate.AbsMouse.Y == 20);
+
+    // Nothing more to do
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 3);
+
+    TestDestroy(Test);
+}
+
+// Indices run on across the end of the ring and the snapshot is taken in
+// two pieces
+static VOID
+TestRingWrap(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+    ULONG   Index;
+
+    for (Index = 0; Index < 40; Index++)
+        TestMotion(Test, 1, 0);
+    (VOID) BackendPush(&Test->Backend);
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+
+    for (Index = 0; Index < 40; Index++)
+        TestMotion(Test, 0, 1);
+    (VOID) BackendPush(&Test->Backend);
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 80);
+    CHECK(Test->Shared->in_cons == 80);
+    CHECK(Test->Translate.AbsMouse.X == 40);
+    CHECK(Test->Translate.AbsMouse.Y == 40);
+
+    for (Index = 0; Index < 80; Index++)
+        CHECK(Test->Index[Index] == Index);
+
+    TestDestroy(Test);
+}
+
+static VOID
+TestRingBudget(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+    ULONG   Index;
+
+    for (Index = 0; Index < 20; Index++)
+        TestMotion(Test, 1, 1);
+    (VOID) BackendPush(&Test->Backend);
+
+    CHECK(TestConsume(Test, 5) == TRANSLATE_STOP_BUDGET);
+    CHECK(Test->Ring.Applied == 5);
+    CHECK(Test->Shared->in_cons == 5);
+
+    CHECK(TestConsume(Test, 15) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 20);
+    CHECK(Test->Shared->in_cons == 20);
+
+    TestDestroy(Test);
+}
+
+// A producer more than a ring ahead loses the oldest slots; the consumer
+// must skip them and release everything
+static VOID
+TestRingOverrun(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+    ULONG   Index;
+
+    TestKey(Test, KEY_LEFTSHIFT, TRUE);
+    (VOID) BackendPush(&Test->Backend);
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Translate.Keyboard.Modifiers == 0x02);
+
+    // Write straight into the slots, as a misbehaving backend would
+    for (Index = 0; Index < XENKBD_IN_RING_LEN + 10; Index++) {
+        union xenkbd_in_event   *Event;
+
+        Event = &Test->Ring.Slots[(1 + Index) % XENKBD_IN_RING_LEN];
+        BackendMotion(Event, 1, 0, 0);
+    }
+    Test->Shared->in_prod = 1 + XENKBD_IN_RING_LEN + 10;
+
+    Test->Passes = 0;
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Overruns == 1);
+    CHECK(Test->PassCons == 11);
+    CHECK(Test->Translate.Keyboard.Modifiers == 0);
+    CHECK(Test->Shared->in_cons == Test->Shared->in_prod);
+    CHECK(Test->Ring.Applied == 1 + XENKBD_IN_RING_LEN);
+
+    TestDestroy(Test);
+}
+
+// With backpressure only the applied slots are handed back; without it
+// everything snapshotted is
+static VOID
+TestRingHold(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+
+    TestKey(Test, KEY_A, TRUE);
+    TestKey(Test, KEY_A, FALSE);
+    TestKey(Test, KEY_B, TRUE);
+    (VOID) BackendPush(&Test->Backend);
+
+    Test->Ring.Backpressure = TRUE;
+    Test->HoldAfter = 1;
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_HELD);
+    CHECK(Test->Ring.Applied == 1);
+    CHECK(Test->Shared->in_cons == 1);
+
+    Test->HoldAfter = 0;
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 3);
+    CHECK(Test->Shared->in_cons == 3);
+    CHECK(Test->Translate.Keyboard.Keys[0] == 0x05);
+
+    TestDestroy(Test);
+}
+
+// With event-idx the backend notifies only when in_prod passes in_event,
+// which the consumer re-arms to in_cons + 1 each time it finds the ring
+// empty
+static VOID
+TestRingEventIdx(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+
+    Test->Ring.EventIdx = TRUE;
+    Test->Backend.EventIdx = TRUE;
+    XENKBD_IN_EVENT_IDX(Test->Shared) = 1;
+
+    TestKey(Test, KEY_A, TRUE);
+    CHECK(BackendPush(&Test->Backend));
+
+    // Not yet consumed, so the frontend is already on its way
+    TestKey(Test, KEY_A, FALSE);
+    CHECK(!BackendPush(&Test->Backend));
+    CHECK(Test->Backend.Suppressed == 1);
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 2);
+    CHECK(XENKBD_IN_EVENT_IDX(Test->Shared) == 3);
+
+    // A batch of events published together is a single notification
+    TestMotion(Test, 1, 0);
+    TestMotion(Test, 1, 0);
+    CHECK(BackendPush(&Test->Backend));
+    CHECK(Test->Backend.Notifications == 2);
+
+    // A consumer that stops on its budget has not re-armed in_event
+    TestMotion(Test, 1, 0);
+    CHECK(!BackendPush(&Test->Backend));
+    CHECK(TestConsume(Test, 1) == TRANSLATE_STOP_BUDGET);
+    CHECK(XENKBD_IN_EVENT_IDX(Test->Shared) == 3);
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(XENKBD_IN_EVENT_IDX(Test->Shared) == 6);
+    CHECK(Test->Ring.Rechecks == 0);
+
+    TestDestroy(Test);
+}
+
+// A key batch packs up to 19 transitions into a slot, or 15 with room for
+// the timestamp, and each of them is a keyboard report
+static VOID
+TestRingKeyBatch(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+    ULONG   Index;
+
+    Test->Translate.KeyBatch = TRUE;
+    Test->Backend.KeyBatch = TRUE;
+
+    for (Index = 0; Index < XENKBD_KEY_BATCH_MAX + 1; Index++)
+        CHECK(BackendPutKey(&Test->Backend, KEY_A, (Index & 1) ? FALSE : TRUE));
+    (VOID) BackendPush(&Test->Backend);
+
+    CHECK(Test->Backend.Produced == 2);
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 2);
+    CHECK(Test->Keyboards == XENKBD_KEY_BATCH_MAX + 1);
+    CHECK(Test->Index[XENKBD_KEY_BATCH_MAX - 1] == 0);
+    CHECK(Test->Index[XENKBD_KEY_BATCH_MAX] == 1);
+    CHECK(Test->Keyboard[XENKBD_KEY_BATCH_MAX - 1].Keys[0] == 0x04);
+    CHECK(Test->Translate.Keyboard.Keys[0] == 0);
+
+    // A batch appended to after it was published would race the frontend
+    CHECK(BackendPutKey(&Test->Backend, KEY_A, TRUE));
+    (VOID) BackendPush(&Test->Backend);
+    CHECK(!BackendBatching(&Test->Backend));
+
+    Test->Translate.Timestamp = TRUE;
+    Test->Backend.Timestamp = TRUE;
+
+    for (Index = 0; Index < XENKBD_KEY_BATCH_MAX_STAMPED + 1; Index++)
+        CHECK(BackendPutKey(&Test->Backend, KEY_B, (Index & 1) ? TRUE : FALSE));
+    (VOID) BackendPush(&Test->Backend);
+
+    CHECK(Test->Backend.Produced == 5);
+    CHECK(TranslateGetTimestamp(&Test->Ring.Slots[3]) != 0);
+    CHECK(TranslateGetTimestamp(&Test->Ring.Slots[4]) >=
+          TranslateGetTimestamp(&Test->Ring.Slots[3]));
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Ring.Applied == 5);
+    CHECK(Test->Keyboards == XENKBD_KEY_BATCH_MAX + XENKBD_KEY_BATCH_MAX_STAMPED + 3);
+    CHECK(Test->Translate.Keyboard.Keys[0] == 0x04);
+    CHECK(Test->Translate.Keyboard.Keys[1] == 0x05);
+
+    TestDestroy(Test);
+}
+
+// With backpressure each key of a batch waits for the report before it to
+// be read, and a batch held part way through resumes from the key it
+// stopped at
+static VOID
+TestRingKeyBatchHold(
+    VOID
+    )
+{
+    PTEST   Test = TestCreate();
+
+    Test->Translate.KeyBatch = TRUE;
+    Test->Backend.KeyBatch = TRUE;
+    Test->Ring.Backpressure = TRUE;
+
+    CHECK(BackendPutKey(&Test->Backend, KEY_A, TRUE));
+    CHECK(BackendPutKey(&Test->Backend, KEY_A, FALSE));
+    CHECK(BackendPutKey(&Test->Backend, KEY_B, TRUE));
+    (VOID) BackendPush(&Test->Backend);
+    TestKey(Test, KEY_C, TRUE);
+    (VOID) BackendPush(&Test->Backend);
+
+    Test->HoldAfter = 1;
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_HELD);
+    CHECK(Test->Keyboards == 1);
+    CHECK(Test->Ring.Applied == 0);
+    CHECK(Test->Shared->in_cons == 0);
+    CHECK(Test->Translate.BatchIndex == 1);
+    CHECK(Test->Translate.Keyboard.Keys[0] == 0x04);
+
+    // The press of A has been read, so its release may follow
+    Test->HoldAfter = 2;
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_HELD);
+    CHECK(Test->Keyboards == 2);
+    CHECK(Test->Translate.BatchIndex == 2);
+    CHECK(Test->Keyboard[1].Keys[0] == 0);
+    CHECK(Test->Index[1] == 0);
+
+    Test->HoldAfter = 0;
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_EMPTY);
+    CHECK(Test->Keyboards == 4);
+    CHECK(Test->Ring.Applied == 2);
+    CHECK(Test->Shared->in_cons == 2);
+    CHECK(Test->Translate.BatchIndex == 0);
+    CHECK(Test->Keyboard[2].Keys[0] == 0x05);
+    CHECK(Test->Index[3] == 1);
+    CHECK(Test->Translate.Keyboard.Keys[1] == 0x06);
+
+    // An overrun abandons the rest of a held batch
+    CHECK(BackendPutKey(&Test->Backend, KEY_D, TRUE));
+    CHECK(BackendPutKey(&Test->Backend, KEY_D, FALSE));
+    (VOID) BackendPush(&Test->Backend);
+
+    Test->HoldAfter = 5;
+
+    CHECK(TestConsume(Test, 0) == TRANSLATE_STOP_HELD);
+    CHECK(Test->Translate.BatchIndex == 1);
+
+    TranslateRelease(&Test->Translate);
+    CHECK(Test->Translate.BatchIndex == 0);
+
+    TestDestroy(Test);
+}
+
+int
+main(
+    VOID
+    )
+{
+    TestRingBasic();
+    TestRingWrap();
+    TestRingBudget();
+    TestRingOverrun();
+    TestRingHold();
+    TestRingEventIdx();
+    TestRingKeyBatch();
+    TestRingKeyBatchHold();
+
+    if (Failures != 0) {
+        fprintf(stderr, "%u failures\n", Failures);
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
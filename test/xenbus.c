@@ -0,0 +1,1119 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <ntddk.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "xenbus.h"
+
+#define XENBUS_CACHE_NAME_LENGTH    64
+#define XENBUS_STORE_PAYLOAD_MAX    4096    // XENSTORE_PAYLOAD_MAX
+
+struct _XENBUS_DEBUG_CALLBACK {
+    XENBUS_DEBUG_CALLBACK   *Next;
+    CHAR                    *Prefix;
+    XENBUS_DEBUG_FUNCTION   Function;
+    PVOID                   Argument;
+};
+
+struct _XENBUS_SUSPEND_CALLBACK {
+    XENBUS_SUSPEND_CALLBACK         *Next;
+    XENBUS_SUSPEND_CALLBACK_TYPE    Type;
+    XENBUS_SUSPEND_FUNCTION         Function;
+    PVOID                           Argument;
+};
+
+// Each watch has a thread that passes the fake store's events on to the
+// driver's KEVENT
+struct _XENBUS_STORE_WATCH {
+    PXENBUS             Xenbus;
+    PFAKE_STORE_WATCH   Watch;
+    FAKE_EVENT          Event;
+    PKEVENT             Target;
+    pthread_mutex_t     Lock;
+    BOOLEAN             Removed;
+    pthread_t           Thread;
+};
+
+struct _XENBUS_EVTCHN_CHANNEL {
+    PFAKE_EVTCHN        Channel;
+    PKSERVICE_ROUTINE   Function;
+    PVOID               Argument;
+};
+
+struct _XENBUS_GNTTAB_CACHE {
+    CHAR                        Name[XENBUS_CACHE_NAME_LENGTH];
+    XENBUS_CACHE_ACQUIRE_LOCK   AcquireLock;
+    XENBUS_CACHE_RELEASE_LOCK   ReleaseLock;
+    PVOID                       Argument;
+    LONG                        Entries;
+};
+
+struct _XENBUS_GNTTAB_ENTRY {
+    ULONG   Reference;
+};
+
+struct _XENBUS {
+    PFAKE_STORE             Store;
+    PFAKE_GNTTAB            Gnttab;
+
+    pthread_mutex_t         Lock;
+    XENBUS_DEBUG_CALLBACK   *DebugList;
+    FILE                    *DebugStream;
+    const CHAR              *DebugPrefix;
+    XENBUS_SUSPEND_CALLBACK *SuspendList;
+    ULONG                   SuspendCount;
+};
+
+#define XENBUS_BUGCHECK(_Xenbus, _Code)    \
+        KeBugCheckEx(0xDEAD, (ULONG_PTR)(_Code), (ULONG_PTR)__FILE__, __LINE__, (ULONG_PTR)(_Xenbus))
+
+static NTSTATUS
+__XenbusStatus(
+    IN  int Error
+    )
+{
+    switch (Error) {
+    case 0:
+        return STATUS_SUCCESS;
+
+    case ENOENT:
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    case EAGAIN:
+        return STATUS_RETRY;
+
+    case ENOMEM:
+        return STATUS_NO_MEMORY;
+
+    default:
+        return STATUS_UNSUCCESSFUL;
+    }
+}
+
+static FORCEINLINE PXENBUS
+__XenbusFromInterface(
+    IN  PINTERFACE  Interface
+    )
+{
+    return Interface->Context;
+}
+
+static NTSTATUS
+XenbusAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+XenbusRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+}
+
+// DEBUG
+
+static NTSTATUS
+XenbusDebugRegister(
+    IN  PINTERFACE              Interface,
+    IN  PCHAR                   Prefix,
+    IN  XENBUS_DEBUG_FUNCTION   Function,
+    IN  PVOID                   Argument OPTIONAL,
+    OUT PXENBUS_DEBUG_CALLBACK  *Callback
+    )
+{
+    PXENBUS                     Xenbus = __XenbusFromInterface(Interface);
+
+    *Callback = calloc(1, sizeof (XENBUS_DEBUG_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Prefix = strdup(Prefix);
+    if ((*Callback)->Prefix == NULL) {
+        free(*Callback);
+        *Callback = NULL;
+        return STATUS_NO_MEMORY;
+    }
+
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    pthread_mutex_lock(&Xenbus->Lock);
+    (*Callback)->Next = Xenbus->DebugList;
+    Xenbus->DebugList = *Callback;
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+XenbusDebugPrintf(
+    IN  PINTERFACE  Interface,
+    IN  const CHAR  *Format,
+    ...
+    )
+{
+    PXENBUS         Xenbus = __XenbusFromInterface(Interface);
+    FILE            *Stream;
+    va_list         Arguments;
+
+    // Only valid from a callback, which holds the lock
+    Stream = (Xenbus->DebugStream != NULL) ? Xenbus->DebugStream : stderr;
+
+    fprintf(Stream, "%s: ", Xenbus->DebugPrefix);
+
+    va_start(Arguments, Format);
+    vfprintf(Stream, Format, Arguments);
+    va_end(Arguments);
+}
+
+static VOID
+__XenbusDebugCall(
+    IN  PXENBUS                 Xenbus,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback
+    )
+{
+    KIRQL                       Irql;
+
+    Xenbus->DebugPrefix = Callback->Prefix;
+
+    KeRaiseIrql(HIGH_LEVEL, &Irql);
+    Callback->Function(Callback->Argument, FALSE);
+    KeLowerIrql(Irql);
+
+    Xenbus->DebugPrefix = NULL;
+}
+
+static VOID
+XenbusDebugTrigger(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback OPTIONAL
+    )
+{
+    PXENBUS                     Xenbus = __XenbusFromInterface(Interface);
+    PXENBUS_DEBUG_CALLBACK      Next;
+
+    pthread_mutex_lock(&Xenbus->Lock);
+
+    if (Callback != NULL) {
+        __XenbusDebugCall(Xenbus, Callback);
+    } else {
+        for (Next = Xenbus->DebugList; Next != NULL; Next = Next->Next)
+            __XenbusDebugCall(Xenbus, Next);
+    }
+
+    pthread_mutex_unlock(&Xenbus->Lock);
+}
+
+static VOID
+XenbusDebugDeregister(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback
+    )
+{
+    PXENBUS                     Xenbus = __XenbusFromInterface(Interface);
+    PXENBUS_DEBUG_CALLBACK      *Link;
+
+    pthread_mutex_lock(&Xenbus->Lock);
+
+    for (Link = &Xenbus->DebugList; *Link != NULL; Link = &(*Link)->Next) {
+        if (*Link == Callback) {
+            *Link = Callback->Next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    free(Callback->Prefix);
+    free(Callback);
+}
+
+// SUSPEND
+
+static NTSTATUS
+XenbusSuspendRegister(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_SUSPEND_CALLBACK_TYPE    Type,
+    IN  XENBUS_SUSPEND_FUNCTION         Function,
+    IN  PVOID                           Argument OPTIONAL,
+    OUT PXENBUS_SUSPEND_CALLBACK        *Callback
+    )
+{
+    PXENBUS                             Xenbus = __XenbusFromInterface(Interface);
+
+    *Callback = calloc(1, sizeof (XENBUS_SUSPEND_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Type = Type;
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    pthread_mutex_lock(&Xenbus->Lock);
+    (*Callback)->Next = Xenbus->SuspendList;
+    Xenbus->SuspendList = *Callback;
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+XenbusSuspendDeregister(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_SUSPEND_CALLBACK    Callback
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+    PXENBUS_SUSPEND_CALLBACK        *Link;
+
+    pthread_mutex_lock(&Xenbus->Lock);
+
+    for (Link = &Xenbus->SuspendList; *Link != NULL; Link = &(*Link)->Next) {
+        if (*Link == Callback) {
+            *Link = Callback->Next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    free(Callback);
+}
+
+static VOID
+__XenbusSuspendCall(
+    IN  PXENBUS                         Xenbus,
+    IN  XENBUS_SUSPEND_CALLBACK_TYPE    Type,
+    IN  KIRQL                           Level
+    )
+{
+    PXENBUS_SUSPEND_CALLBACK            Callback;
+    KIRQL                               Irql;
+
+    for (Callback = Xenbus->SuspendList;
+         Callback != NULL;
+         Callback = Callback->Next) {
+        if (Callback->Type != Type)
+            continue;
+
+        KeRaiseIrql(Level, &Irql);
+        Callback->Function(Callback->Argument);
+        KeLowerIrql(Irql);
+    }
+}
+
+// A resume in the same domain: the backend and store are untouched, so
+// the callbacks find everything as it was
+static NTSTATUS
+XenbusSuspendTrigger(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS         Xenbus = __XenbusFromInterface(Interface);
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+        XENBUS_BUGCHECK(Xenbus, "SuspendTrigger");
+
+    pthread_mutex_lock(&Xenbus->Lock);
+
+    Xenbus->SuspendCount++;
+
+    __XenbusSuspendCall(Xenbus, SUSPEND_CALLBACK_EARLY, HIGH_LEVEL);
+    __XenbusSuspendCall(Xenbus, SUSPEND_CALLBACK_LATE, DISPATCH_LEVEL);
+
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+static ULONG
+XenbusSuspendGetCount(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS         Xenbus = __XenbusFromInterface(Interface);
+    ULONG           Count;
+
+    pthread_mutex_lock(&Xenbus->Lock);
+    Count = Xenbus->SuspendCount;
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    return Count;
+}
+
+// EVTCHN
+
+static VOID
+XenbusEvtchnUpcall(
+    IN  PVOID               Context
+    )
+{
+    PXENBUS_EVTCHN_CHANNEL  Channel = Context;
+    KIRQL                   Irql;
+
+    KeRaiseIrql(HIGH_LEVEL, &Irql);
+    (VOID) Channel->Function(NULL, Channel->Argument);
+    KeLowerIrql(Irql);
+}
+
+static PXENBUS_EVTCHN_CHANNEL
+XenbusEvtchnOpen(
+    IN  PINTERFACE          Interface,
+    IN  XENBUS_EVTCHN_TYPE  Type,
+    IN  PKSERVICE_ROUTINE   Function,
+    IN  PVOID               Argument OPTIONAL,
+    ...
+    )
+{
+    PXENBUS_EVTCHN_CHANNEL  Channel;
+    va_list                 Arguments;
+    USHORT                  Domain;
+    BOOLEAN                 Mask;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    // Only what a frontend opens
+    if (Type != XENBUS_EVTCHN_TYPE_UNBOUND)
+        return NULL;
+
+    va_start(Arguments, Argument);
+    Domain = (USHORT)va_arg(Arguments, int);
+    Mask = (BOOLEAN)va_arg(Arguments, int);
+    va_end(Arguments);
+
+    UNREFERENCED_PARAMETER(Domain);
+    UNREFERENCED_PARAMETER(Mask);
+
+    Channel = calloc(1, sizeof (XENBUS_EVTCHN_CHANNEL));
+    if (Channel == NULL)
+        return NULL;
+
+    Channel->Function = Function;
+    Channel->Argument = Argument;
+
+    if (FakeEvtchnOpen(XenbusEvtchnUpcall, Channel, &Channel->Channel) != 0) {
+        free(Channel);
+        return NULL;
+    }
+
+    return Channel;
+}
+
+static NTSTATUS
+XenbusEvtchnBind(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  USHORT                  Group,
+    IN  UCHAR                   Number
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Channel);
+    UNREFERENCED_PARAMETER(Group);
+    UNREFERENCED_PARAMETER(Number);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+static BOOLEAN
+XenbusEvtchnUnmask(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  BOOLEAN                 InCallback,
+    IN  BOOLEAN                 Force
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(InCallback);
+    UNREFERENCED_PARAMETER(Force);
+
+    // Anything pending is delivered by the unmask itself
+    FakeEvtchnUnmask(Channel->Channel);
+
+    return FALSE;
+}
+
+// Only the backend is notified this way, and the fake backend polls
+static VOID
+XenbusEvtchnSend(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Channel);
+}
+
+static VOID
+XenbusEvtchnTrigger(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    (VOID) FakeEvtchnQueueDpc(Channel->Channel);
+}
+
+static ULONG
+XenbusEvtchnGetCount(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    FAKE_EVTCHN_STATISTICS      Statistics;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    FakeEvtchnGetStatistics(Channel->Channel, &Statistics);
+
+    return (ULONG)Statistics.Upcalls;
+}
+
+static NTSTATUS
+XenbusEvtchnWait(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Count,
+    IN  PLARGE_INTEGER          Timeout OPTIONAL
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Channel);
+    UNREFERENCED_PARAMETER(Count);
+    UNREFERENCED_PARAMETER(Timeout);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+static ULONG
+XenbusEvtchnGetPort(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return FakeEvtchnGetPort(Channel->Channel);
+}
+
+static VOID
+XenbusEvtchnClose(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    FakeEvtchnClose(Channel->Channel);
+    free(Channel);
+}
+
+// STORE
+
+static VOID
+XenbusStoreFree(
+    IN  PINTERFACE  Interface,
+    IN  PCHAR       Buffer
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    FakeStoreFree(Buffer);
+}
+
+static NTSTATUS
+XenbusStoreRead(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    OUT PCHAR                       *Buffer
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+
+    return __XenbusStatus(FakeStoreRead(Xenbus->Store,
+                                        (PFAKE_STORE_TRANSACTION)Transaction,
+                                        Prefix,
+                                        Node,
+                                        Buffer));
+}
+
+static NTSTATUS
+XenbusStorePrintf(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  const CHAR                  *Format,
+    ...
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+    CHAR                            Buffer[XENBUS_STORE_PAYLOAD_MAX];
+    va_list                         Arguments;
+
+    va_start(Arguments, Format);
+    (VOID) vsnprintf(Buffer, sizeof (Buffer), Format, Arguments);
+    va_end(Arguments);
+
+    return __XenbusStatus(FakeStorePrintf(Xenbus->Store,
+                                          (PFAKE_STORE_TRANSACTION)Transaction,
+                                          Prefix,
+                                          Node,
+                                          "%s",
+                                          Buffer));
+}
+
+static NTSTATUS
+XenbusStorePermissionsSet(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    IN  PXENBUS_STORE_PERMISSION    Permissions,
+    IN  ULONG                       NumberPermissions
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Transaction);
+    UNREFERENCED_PARAMETER(Prefix);
+    UNREFERENCED_PARAMETER(Node);
+    UNREFERENCED_PARAMETER(Permissions);
+    UNREFERENCED_PARAMETER(NumberPermissions);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+XenbusStoreRemove(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+
+    return __XenbusStatus(FakeStoreRemove(Xenbus->Store,
+                                          (PFAKE_STORE_TRANSACTION)Transaction,
+                                          Prefix,
+                                          Node));
+}
+
+static NTSTATUS
+XenbusStoreDirectory(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Prefix OPTIONAL,
+    IN  PCHAR                       Node,
+    OUT PCHAR                       *Buffer
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Transaction);
+    UNREFERENCED_PARAMETER(Prefix);
+    UNREFERENCED_PARAMETER(Node);
+
+    *Buffer = NULL;
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS
+XenbusStoreTransactionStart(
+    IN  PINTERFACE                  Interface,
+    OUT PXENBUS_STORE_TRANSACTION   *Transaction
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+
+    return __XenbusStatus(FakeStoreTransactionStart(Xenbus->Store,
+                                                    (PFAKE_STORE_TRANSACTION *)Transaction));
+}
+
+static NTSTATUS
+XenbusStoreTransactionEnd(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction,
+    IN  BOOLEAN                     Commit
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+
+    return __XenbusStatus(FakeStoreTransactionEnd(Xenbus->Store,
+                                                  (PFAKE_STORE_TRANSACTION)Transaction,
+                                                  Commit));
+}
+
+static PVOID
+XenbusStoreWatchThread(
+    IN  PVOID           Argument
+    )
+{
+    PXENBUS_STORE_WATCH Watch = Argument;
+
+    for (;;) {
+        (VOID) FakeEventWait(&Watch->Event, -1);
+
+        pthread_mutex_lock(&Watch->Lock);
+
+        if (Watch->Removed) {
+            pthread_mutex_unlock(&Watch->Lock);
+            break;
+        }
+
+        (VOID) KeSetEvent(Watch->Target, IO_NO_INCREMENT, FALSE);
+
+        pthread_mutex_unlock(&Watch->Lock);
+    }
+
+    return NULL;
+}
+
+static NTSTATUS
+XenbusStoreWatchAdd(
+    IN  PINTERFACE          Interface,
+    IN  PCHAR               Prefix OPTIONAL,
+    IN  PCHAR               Node,
+    IN  PKEVENT             Event,
+    OUT PXENBUS_STORE_WATCH *Watch
+    )
+{
+    PXENBUS                 Xenbus = __XenbusFromInterface(Interface);
+    int                     Error;
+
+    *Watch = calloc(1, sizeof (XENBUS_STORE_WATCH));
+
+    Error = ENOMEM;
+    if (*Watch == NULL)
+        goto fail1;
+
+    (*Watch)->Xenbus = Xenbus;
+    (*Watch)->Target = Event;
+    pthread_mutex_init(&(*Watch)->Lock, NULL);
+
+    Error = FakeEventInitialize(&(*Watch)->Event);
+    if (Error != 0)
+        goto fail2;
+
+    Error = pthread_create(&(*Watch)->Thread, NULL, XenbusStoreWatchThread, *Watch);
+    if (Error != 0)
+        goto fail3;
+
+    Error = FakeStoreWatchAdd(Xenbus->Store,
+                              Prefix,
+                              Node,
+                              &(*Watch)->Event,
+                              &(*Watch)->Watch);
+    if (Error != 0)
+        goto fail4;
+
+    return STATUS_SUCCESS;
+
+fail4:
+    pthread_mutex_lock(&(*Watch)->Lock);
+    (*Watch)->Removed = TRUE;
+    FakeEventSet(&(*Watch)->Event);
+    pthread_mutex_unlock(&(*Watch)->Lock);
+
+    pthread_join((*Watch)->Thread, NULL);
+
+fail3:
+    FakeEventTeardown(&(*Watch)->Event);
+
+fail2:
+    pthread_mutex_destroy(&(*Watch)->Lock);
+    free(*Watch);
+    *Watch = NULL;
+
+fail1:
+    return __XenbusStatus(Error);
+}
+
+// The driver's event is not set once this returns
+static NTSTATUS
+XenbusStoreWatchRemove(
+    IN  PINTERFACE          Interface,
+    IN  PXENBUS_STORE_WATCH Watch
+    )
+{
+    PXENBUS                 Xenbus = __XenbusFromInterface(Interface);
+
+    FakeStoreWatchRemove(Xenbus->Store, Watch->Watch);
+
+    pthread_mutex_lock(&Watch->Lock);
+    Watch->Removed = TRUE;
+    FakeEventSet(&Watch->Event);
+    pthread_mutex_unlock(&Watch->Lock);
+
+    pthread_join(Watch->Thread, NULL);
+
+    FakeEventTeardown(&Watch->Event);
+    pthread_mutex_destroy(&Watch->Lock);
+    free(Watch);
+
+    return STATUS_SUCCESS;
+}
+
+// Watches fire on threads of their own, so there is nothing to poll
+static VOID
+XenbusStorePoll(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+}
+
+// GNTTAB
+
+static NTSTATUS
+XenbusGnttabCreateCache(
+    IN  PINTERFACE                  Interface,
+    IN  const CHAR                  *Name,
+    IN  ULONG                       Reservation,
+    IN  ULONG                       Cap,
+    IN  XENBUS_CACHE_ACQUIRE_LOCK   AcquireLock,
+    IN  XENBUS_CACHE_RELEASE_LOCK   ReleaseLock,
+    IN  PVOID                       Argument OPTIONAL,
+    OUT PXENBUS_GNTTAB_CACHE        *Cache
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Reservation);
+    UNREFERENCED_PARAMETER(Cap);
+
+    *Cache = calloc(1, sizeof (XENBUS_GNTTAB_CACHE));
+    if (*Cache == NULL)
+        return STATUS_NO_MEMORY;
+
+    (VOID) snprintf((*Cache)->Name, sizeof ((*Cache)->Name), "%s", Name);
+    (*Cache)->AcquireLock = AcquireLock;
+    (*Cache)->ReleaseLock = ReleaseLock;
+    (*Cache)->Argument = Argument;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+XenbusGnttabPermitForeignAccess(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  USHORT                      Domain,
+    IN  PFN_NUMBER                  Pfn,
+    IN  BOOLEAN                     ReadOnly,
+    OUT PXENBUS_GNTTAB_ENTRY        *Entry
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+    int                             Error;
+
+    *Entry = calloc(1, sizeof (XENBUS_GNTTAB_ENTRY));
+    if (*Entry == NULL)
+        return STATUS_NO_MEMORY;
+
+    // The cache lock protects the cache's own free list; take it the
+    // same way, so that a caller holding it already is caught out
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    Error = FakeGnttabPermitForeignAccess(Xenbus->Gnttab,
+                                          Domain,
+                                          (ULONG)Pfn,
+                                          ReadOnly,
+                                          &(*Entry)->Reference);
+    if (Error == 0)
+        Cache->Entries++;
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    if (Error != 0) {
+        free(*Entry);
+        *Entry = NULL;
+    }
+
+    return __XenbusStatus(Error);
+}
+
+static NTSTATUS
+XenbusGnttabRevokeForeignAccess(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  PXENBUS_GNTTAB_ENTRY        Entry
+    )
+{
+    PXENBUS                         Xenbus = __XenbusFromInterface(Interface);
+    int                             Error;
+
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    Error = FakeGnttabRevokeForeignAccess(Xenbus->Gnttab, Entry->Reference);
+    Cache->Entries--;
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    free(Entry);
+
+    return __XenbusStatus(Error);
+}
+
+static ULONG
+XenbusGnttabGetReference(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_GNTTAB_ENTRY        Entry
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return Entry->Reference;
+}
+
+static NTSTATUS
+XenbusGnttabQueryReference(
+    IN  PINTERFACE  Interface,
+    IN  ULONG       Reference,
+    OUT PPFN_NUMBER Pfn OPTIONAL,
+    OUT PBOOLEAN    ReadOnly OPTIONAL
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Reference);
+    UNREFERENCED_PARAMETER(Pfn);
+    UNREFERENCED_PARAMETER(ReadOnly);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+static VOID
+XenbusGnttabDestroyCache(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_GNTTAB_CACHE    Cache
+    )
+{
+    PXENBUS                     Xenbus = __XenbusFromInterface(Interface);
+
+    if (Cache->Entries != 0)
+        XENBUS_BUGCHECK(Xenbus, Cache->Name);
+
+    free(Cache);
+}
+
+static NTSTATUS
+XenbusGnttabMapForeignPages(
+    IN  PINTERFACE              Interface,
+    IN  USHORT                  Domain,
+    IN  ULONG                   NumberPages,
+    IN  PULONG                  References,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PHYSICAL_ADDRESS        *Address
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Domain);
+    UNREFERENCED_PARAMETER(NumberPages);
+    UNREFERENCED_PARAMETER(References);
+    UNREFERENCED_PARAMETER(ReadOnly);
+    UNREFERENCED_PARAMETER(Address);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS
+XenbusGnttabUnmapForeignPages(
+    IN  PINTERFACE              Interface,
+    IN  PHYSICAL_ADDRESS        Address
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Address);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+static XENBUS_DEBUG_INTERFACE   XenbusDebugInterface = {
+    { sizeof (XENBUS_DEBUG_INTERFACE), 1, NULL, NULL, NULL },
+    XenbusAcquire,
+    XenbusRelease,
+    XenbusDebugRegister,
+    XenbusDebugPrintf,
+    XenbusDebugTrigger,
+    XenbusDebugDeregister
+};
+
+static XENBUS_SUSPEND_INTERFACE XenbusSuspendInterface = {
+    { sizeof (XENBUS_SUSPEND_INTERFACE), 1, NULL, NULL, NULL },
+    XenbusAcquire,
+    XenbusRelease,
+    XenbusSuspendRegister,
+    XenbusSuspendDeregister,
+    XenbusSuspendTrigger,
+    XenbusSuspendGetCount
+};
+
+static XENBUS_EVTCHN_INTERFACE  XenbusEvtchnInterface = {
+    { sizeof (XENBUS_EVTCHN_INTERFACE), 9, NULL, NULL, NULL },
+    XenbusAcquire,
+    XenbusRelease,
+    XenbusEvtchnOpen,
+    XenbusEvtchnBind,
+    XenbusEvtchnUnmask,
+    XenbusEvtchnSend,
+    XenbusEvtchnTrigger,
+    XenbusEvtchnGetCount,
+    XenbusEvtchnWait,
+    XenbusEvtchnGetPort,
+    XenbusEvtchnClose
+};
+
+static XENBUS_STORE_INTERFACE   XenbusStoreInterface = {
+    { sizeof (XENBUS_STORE_INTERFACE), 2, NULL, NULL, NULL },
+    XenbusAcquire,
+    XenbusRelease,
+    XenbusStoreFree,
+    XenbusStoreRead,
+    XenbusStorePrintf,
+    XenbusStorePermissionsSet,
+    XenbusStoreRemove,
+    XenbusStoreDirectory,
+    XenbusStoreTransactionStart,
+    XenbusStoreTransactionEnd,
+    XenbusStoreWatchAdd,
+    XenbusStoreWatchRemove,
+    XenbusStorePoll
+};
+
+static XENBUS_GNTTAB_INTERFACE  XenbusGnttabInterface = {
+    { sizeof (XENBUS_GNTTAB_INTERFACE), 4, NULL, NULL, NULL },
+    XenbusAcquire,
+    XenbusRelease,
+    XenbusGnttabCreateCache,
+    XenbusGnttabPermitForeignAccess,
+    XenbusGnttabRevokeForeignAccess,
+    XenbusGnttabGetReference,
+    XenbusGnttabQueryReference,
+    XenbusGnttabDestroyCache,
+    XenbusGnttabMapForeignPages,
+    XenbusGnttabUnmapForeignPages
+};
+
+#define DEFINE_XENBUS_GET_INTERFACE(_Name, _Type)                   \
+VOID                                                                \
+XenbusGet ## _Name ## Interface(                                    \
+    IN  PXENBUS     Xenbus,                                         \
+    OUT _Type       Interface                                       \
+    )                                                               \
+{                                                                   \
+    *Interface = Xenbus ## _Name ## Interface;                      \
+    Interface->Interface.Context = Xenbus;                          \
+}
+
+DEFINE_XENBUS_GET_INTERFACE(Debug, PXENBUS_DEBUG_INTERFACE)
+DEFINE_XENBUS_GET_INTERFACE(Suspend, PXENBUS_SUSPEND_INTERFACE)
+DEFINE_XENBUS_GET_INTERFACE(Evtchn, PXENBUS_EVTCHN_INTERFACE)
+DEFINE_XENBUS_GET_INTERFACE(Store, PXENBUS_STORE_INTERFACE)
+DEFINE_XENBUS_GET_INTERFACE(Gnttab, PXENBUS_GNTTAB_INTERFACE)
+
+#undef DEFINE_XENBUS_GET_INTERFACE
+
+VOID
+XenbusDebug(
+    IN  PXENBUS Xenbus,
+    IN  FILE    *Stream
+    )
+{
+    XENBUS_DEBUG_INTERFACE  Interface;
+
+    XenbusGetDebugInterface(Xenbus, &Interface);
+
+    pthread_mutex_lock(&Xenbus->Lock);
+    Xenbus->DebugStream = Stream;
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    XenbusDebugTrigger(&Interface.Interface, NULL);
+
+    pthread_mutex_lock(&Xenbus->Lock);
+    Xenbus->DebugStream = NULL;
+    pthread_mutex_unlock(&Xenbus->Lock);
+
+    fflush(Stream);
+}
+
+NTSTATUS
+XenbusCreate(
+    IN  PFAKE_STORE     Store,
+    IN  PFAKE_GNTTAB    Gnttab,
+    OUT PXENBUS         *Xenbus
+    )
+{
+    *Xenbus = calloc(1, sizeof (XENBUS));
+    if (*Xenbus == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Xenbus)->Store = Store;
+    (*Xenbus)->Gnttab = Gnttab;
+    pthread_mutex_init(&(*Xenbus)->Lock, NULL);
+
+    return STATUS_SUCCESS;
+}
+
+// Everything registered must have been deregistered
+VOID
+XenbusDestroy(
+    IN  PXENBUS Xenbus
+    )
+{
+    if (Xenbus->DebugList != NULL || Xenbus->SuspendList != NULL)
+        XENBUS_BUGCHECK(Xenbus, "XenbusDestroy");
+
+    pthread_mutex_destroy(&Xenbus->Lock);
+    free(Xenbus);
+}
@@ -0,0 +1,105 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENVKBD_TEST_XENBUS_H
+#define _XENVKBD_TEST_XENBUS_H
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#include <debug_interface.h>
+#include <suspend_interface.h>
+#include <evtchn_interface.h>
+#include <store_interface.h>
+#include <gnttab_interface.h>
+
+#include "fake.h"
+
+// The XENBUS interfaces the frontend and ring acquire from the FDO, as
+// method tables over the fake store, event channels and grant table.
+// Debug output goes to whatever XenbusDebug() is given, and a suspend
+// runs the registered callbacks at the IRQLs XENBUS would.
+
+typedef struct _XENBUS  XENBUS, *PXENBUS;
+
+extern NTSTATUS
+XenbusCreate(
+    IN  PFAKE_STORE     Store,
+    IN  PFAKE_GNTTAB    Gnttab,
+    OUT PXENBUS         *Xenbus
+    );
+
+extern VOID
+XenbusDestroy(
+    IN  PXENBUS Xenbus
+    );
+
+extern VOID
+XenbusGetDebugInterface(
+    IN  PXENBUS                 Xenbus,
+    OUT PXENBUS_DEBUG_INTERFACE Interface
+    );
+
+extern VOID
+XenbusGetSuspendInterface(
+    IN  PXENBUS                     Xenbus,
+    OUT PXENBUS_SUSPEND_INTERFACE   Interface
+    );
+
+extern VOID
+XenbusGetEvtchnInterface(
+    IN  PXENBUS                     Xenbus,
+    OUT PXENBUS_EVTCHN_INTERFACE    Interface
+    );
+
+extern VOID
+XenbusGetStoreInterface(
+    IN  PXENBUS                 Xenbus,
+    OUT PXENBUS_STORE_INTERFACE Interface
+    );
+
+extern VOID
+XenbusGetGnttabInterface(
+    IN  PXENBUS                     Xenbus,
+    OUT PXENBUS_GNTTAB_INTERFACE    Interface
+    );
+
+// Runs every debug callback, as a debugger's !xenbus would, with
+// Printf() output going to Stream
+extern VOID
+XenbusDebug(
+    IN  PXENBUS Xenbus,
+    IN  FILE    *Stream
+    );
+
+#endif  // _XENVKBD_TEST_XENBUS_H